@@ -0,0 +1 @@
+#define BUILD_ID "92fbd45aa80e8db78f44162d88650828"
@@ -0,0 +1,106 @@
+// Generated by tools/gen_lookup.c - do not edit
+
+#ifndef LOOKUP_TABLES_H
+#define LOOKUP_TABLES_H
+
+#define MNEMONIC_HASH_SEED 0x000002D3u
+#define MNEMONIC_HASH_MASK 0xFFu
+
+static const lookup_slot_t mnemonic_slots[256] = {
+    [17] = {"sltiu", 5, INST_SLTIU, 0x221E6811u},
+    [18] = {"lhu", 3, INST_LHU, 0x105B8012u},
+    [24] = {"xori", 4, INST_XORI, 0x03217918u},
+    [25] = {"ori", 3, INST_ORI, 0x957EDE19u},
+    [31] = {"lw", 2, INST_LW, 0x5EB2881Fu},
+    [34] = {"add", 3, INST_ADD, 0xB9729C22u},
+    [40] = {"nop", 3, INST_NOP, 0x35C38528u},
+    [42] = {"j", 1, INST_J, 0xBC0E682Au},
+    [49] = {"sub", 3, INST_SUB, 0x40720E31u},
+    [51] = {"divu", 4, INST_DIVU, 0x4C273933u},
+    [54] = {"lbu", 3, INST_LBU, 0x0C6ABC36u},
+    [65] = {"li", 2, INST_LI, 0x4CB28041u},
+    [72] = {"and", 3, INST_AND, 0xB58A8648u},
+    [76] = {"sh", 2, INST_SH, 0x6D7C044Cu},
+    [79] = {"sltu", 4, INST_SLTU, 0xEC6D614Fu},
+    [82] = {"nor", 3, INST_NOR, 0x37C39E52u},
+    [95] = {"jr", 2, INST_JR, 0x51B63D5Fu},
+    [96] = {"lb", 2, INST_LB, 0x51B28260u},
+    [97] = {"mthi", 4, INST_MTHI, 0xF4C37361u},
+    [106] = {"sllv", 4, INST_SLLV, 0xFB31516Au},
+    [107] = {"mflo", 4, INST_MFLO, 0xFE425D6Bu},
+    [119] = {"or", 2, INST_OR, 0x5BAEE877u},
+    [124] = {"jalr", 4, INST_JALR, 0xACC7F77Cu},
+    [130] = {"b", 1, INST_B, 0xB40E6B82u},
+    [131] = {"mfhi", 4, INST_MFHI, 0x244C9083u},
+    [133] = {"break", 5, INST_BREAK, 0x8FE56E85u},
+    [134] = {"div", 3, INST_DIV, 0xB672DA86u},
+    [142] = {"andi", 4, INST_ANDI, 0x01466E8Eu},
+    [147] = {"slti", 4, INST_SLTI, 0xE86D6393u},
+    [154] = {"beqz", 4, INST_BEQZ, 0x5ECBFB9Au},
+    [155] = {"multu", 5, INST_MULTU, 0xBB11119Bu},
+    [157] = {"srav", 4, INST_SRAV, 0x5BD0319Du},
+    [166] = {"jal", 3, INST_JAL, 0xE29E2AA6u},
+    [171] = {"move", 4, INST_MOVE, 0x0EB40FABu},
+    [172] = {"mult", 4, INST_MULT, 0x8B716CACu},
+    [177] = {"mtlo", 4, INST_MTLO, 0x12B9EAB1u},
+    [179] = {"bne", 3, INST_BNE, 0x92EC73B3u},
+    [183] = {"slt", 3, INST_SLT, 0x2C886CB7u},
+    [188] = {"mul", 3, INST_MUL, 0x8FE723BCu},
+    [195] = {"beq", 3, INST_BEQ, 0x8EFF84C3u},
+    [197] = {"addi", 4, INST_ADDI, 0x9D8183C5u},
+    [198] = {"lui", 3, INST_LUI, 0x008F63C6u},
+    [207] = {"sll", 3, INST_SLL, 0x148826CFu},
+    [208] = {"sra", 3, INST_SRA, 0x337950D0u},
+    [210] = {"syscall", 7, INST_SYSCALL, 0xBAF9DFD2u},
+    [213] = {"bnez", 4, INST_BNEZ, 0x5E9EC2D5u},
+    [215] = {"divi", 4, INST_DIVI, 0x40270ED7u},
+    [217] = {"la", 2, INST_LA, 0x54B28CD9u},
+    [222] = {"sb", 2, INST_SB, 0x737C0EDEu},
+    [225] = {"sw", 2, INST_SW, 0x5E7C7BE1u},
+    [230] = {"addiu", 5, INST_ADDIU, 0xA2A3FBE6u},
+    [239] = {"srlv", 4, INST_SRLV, 0x5DDDEEEFu},
+    [243] = {"srl", 3, INST_SRL, 0x38794EF3u},
+    [246] = {"lh", 2, INST_LH, 0x4BB280F6u},
+    [249] = {"remi", 4, INST_REMI, 0x1B5C33F9u},
+    [255] = {"xor", 3, INST_XOR, 0x07F40CFFu},
+};
+
+#define REGISTER_HASH_SEED 0x0000076Bu
+#define REGISTER_HASH_MASK 0x3Fu
+
+static const lookup_slot_t register_slots[64] = {
+    [3] = {"t9", 2, 25, 0x113B6143u},
+    [4] = {"a1", 2, 5, 0x952116C4u},
+    [5] = {"v0", 2, 2, 0x0C36A645u},
+    [6] = {"s6", 2, 22, 0x8443BC86u},
+    [10] = {"s2", 2, 18, 0x8843AACAu},
+    [11] = {"zero", 4, 0, 0x0753DC8Bu},
+    [12] = {"t0", 2, 8, 0x183B7E4Cu},
+    [17] = {"t3", 2, 11, 0x173B62D1u},
+    [19] = {"s5", 2, 21, 0x8543BF13u},
+    [20] = {"t8", 2, 24, 0x103B61D4u},
+    [22] = {"v1", 2, 3, 0x0D36A5D6u},
+    [23] = {"a0", 2, 4, 0x96211257u},
+    [24] = {"t4", 2, 12, 0x143B6F98u},
+    [32] = {"gp", 2, 28, 0x52106CA0u},
+    [34] = {"t2", 2, 10, 0x163B6762u},
+    [36] = {"k1", 2, 27, 0x19074664u},
+    [37] = {"fp", 2, 30, 0x4C0E1865u},
+    [39] = {"s1", 2, 17, 0x8943A967u},
+    [42] = {"a3", 2, 7, 0x972111EAu},
+    [44] = {"s4", 2, 20, 0x8643BBACu},
+    [45] = {"t7", 2, 15, 0x133B602Du},
+    [47] = {"ra", 2, 31, 0x554081EFu},
+    [48] = {"s0", 2, 16, 0x8A43A9F0u},
+    [49] = {"sp", 2, 29, 0x4A42CC31u},
+    [51] = {"k0", 2, 26, 0x1A0741F3u},
+    [52] = {"at", 2, 1, 0x521F7734u},
+    [53] = {"s7", 2, 23, 0x8343B4F5u},
+    [55] = {"t5", 2, 13, 0x153B63F7u},
+    [57] = {"s3", 2, 19, 0x8743B639u},
+    [59] = {"t1", 2, 9, 0x193B7DBBu},
+    [61] = {"a2", 2, 6, 0x9821717Du},
+    [62] = {"t6", 2, 14, 0x123B60BEu},
+};
+
+#endif // LOOKUP_TABLES_H
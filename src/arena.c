@@ -0,0 +1,112 @@
+#include "arena.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct arena_block {
+  arena_block_t *next;
+  size_t used;
+  size_t capacity;
+  // Block data follows the header
+};
+
+// Round up to the strictest fundamental alignment
+#define ARENA_ALIGN(n) (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+#define ARENA_HEADER_SIZE ARENA_ALIGN(sizeof(arena_block_t))
+
+// Initialize an empty arena
+void arena_init(arena_t *arena, size_t block_size) {
+  arena->head = NULL;
+  arena->spare = NULL;
+  arena->block_size = block_size ? block_size : ARENA_BLOCK_SIZE;
+}
+
+// Take a spare block with room for capacity bytes, or allocate a new one
+static arena_block_t *arena_new_block(arena_t *arena, size_t capacity) {
+  for (arena_block_t **link = &arena->spare; *link; link = &(*link)->next) {
+    arena_block_t *block = *link;
+    if (block->capacity >= capacity) {
+      *link = block->next;
+      return block;
+    }
+  }
+
+  arena_block_t *block = malloc(ARENA_HEADER_SIZE + capacity);
+  if (block)
+    block->capacity = capacity;
+  return block;
+}
+
+// Allocate size bytes from the arena
+void *arena_alloc(arena_t *arena, size_t size) {
+  arena_block_t *block = arena->head;
+  size = ARENA_ALIGN(size);
+
+  if (!block || block->capacity - block->used < size) {
+    // Oversized requests get a block of their own, linked behind the current
+    // block so it keeps serving small allocations
+    size_t capacity = size > arena->block_size ? size : arena->block_size;
+    arena_block_t *fresh = arena_new_block(arena, capacity);
+    if (!fresh)
+      return NULL;
+
+    fresh->used = 0;
+    if (block && size > arena->block_size) {
+      fresh->next = block->next;
+      block->next = fresh;
+    } else {
+      fresh->next = block;
+      arena->head = fresh;
+    }
+    block = fresh;
+  }
+
+  void *ptr = (uint8_t *)block + ARENA_HEADER_SIZE + block->used;
+  block->used += size;
+  return ptr;
+}
+
+// Copy len bytes of str into the arena as a NUL-terminated string
+char *arena_strndup(arena_t *arena, const char *str, size_t len) {
+  char *copy = arena_alloc(arena, len + 1);
+  if (!copy)
+    return NULL;
+
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+// Forget every allocation but keep the blocks, so refilling the arena to the
+// same size does not allocate again
+void arena_reset(arena_t *arena) {
+  while (arena->head) {
+    arena_block_t *block = arena->head;
+    arena->head = block->next;
+    block->next = arena->spare;
+    arena->spare = block;
+  }
+}
+
+// Release every block owned by the arena
+void arena_free(arena_t *arena) {
+  arena_reset(arena);
+
+  arena_block_t *block = arena->spare;
+  while (block) {
+    arena_block_t *next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->spare = NULL;
+}
+
+// Heap held by the arena, spare blocks included
+size_t arena_footprint(const arena_t *arena) {
+  size_t total = 0;
+  for (const arena_block_t *block = arena->head; block; block = block->next)
+    total += ARENA_HEADER_SIZE + block->capacity;
+  for (const arena_block_t *block = arena->spare; block; block = block->next)
+    total += ARENA_HEADER_SIZE + block->capacity;
+  return total;
+}
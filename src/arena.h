@@ -0,0 +1,27 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Default size of a single arena block
+#define ARENA_BLOCK_SIZE 65536
+
+typedef struct arena_block arena_block_t;
+
+// Bump-pointer allocator. Memory is handed out from large blocks and is only
+// released all at once, so pointers stay valid for the lifetime of the arena.
+// A reset arena keeps its blocks for reuse.
+typedef struct {
+  arena_block_t *head;
+  arena_block_t *spare; // Blocks released by arena_reset(), ready for reuse
+  size_t block_size;
+} arena_t;
+
+void arena_init(arena_t *arena, size_t block_size);
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+size_t arena_footprint(const arena_t *arena);
+
+#endif // ARENA_H
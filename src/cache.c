@@ -0,0 +1,340 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "cache.h"
+#include "xxhash.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC 0x3143534Du // "MSC1"
+
+// Bumped whenever the entry layout changes; part of every key
+#define CACHE_FORMAT 1u
+
+// Entry file names are the key in hex
+#define CACHE_NAME_LEN 32
+
+// Temporary files of a store that did not finish are removed after this
+#define CACHE_STALE_SECONDS 3600
+
+// Stores evict down to this share of the size limit, so that a full cache
+// does not have to evict again on the next store
+#define CACHE_LOW_WATER(max) ((max) / 10 * 9)
+
+// File in the cache directory holding a running estimate of its size in
+// bytes, so that stores only scan the directory once the limit may have
+// been crossed
+#define CACHE_SIZE_NAME ".size"
+
+// Entry file header, followed by the verbose output, the diagnostics and
+// the image
+typedef struct {
+  uint32_t magic;
+  uint32_t status;
+  uint64_t out_len;
+  uint64_t err_len;
+  uint64_t image_len;
+} cache_header_t;
+
+// Entry seen while scanning the directory for eviction
+typedef struct {
+  char name[CACHE_NAME_LEN + 1];
+  uint64_t size;
+  struct timespec mtime;
+} cache_file_t;
+
+// Create dir and any missing parents
+static int make_dirs(const char *dir) {
+  char *path = strdup(dir);
+  if (!path)
+    return 0;
+
+  for (char *p = path + 1;; p++) {
+    if (*p != '/' && *p != '\0')
+      continue;
+
+    char saved = *p;
+    *p = '\0';
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+      free(path);
+      return 0;
+    }
+    *p = saved;
+    if (saved == '\0')
+      break;
+  }
+  free(path);
+  return 1;
+}
+
+// Open (creating it if needed) the cache directory dir
+int cache_init(cache_t *cache, const char *dir, uint64_t max_size) {
+  cache->dir = strdup(dir);
+  cache->max_size = max_size;
+  if (!cache->dir || !make_dirs(dir)) {
+    free(cache->dir);
+    cache->dir = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+void cache_free(cache_t *cache) {
+  free(cache->dir);
+  cache->dir = NULL;
+}
+
+// Key a source by its bytes, the options that change the result and the
+// build of the assembler (BUILD_ID), so that builds sharing a directory never
+// replay each other's results
+cache_key_t cache_key(const char *build, uint32_t options,
+                      const void *source, size_t len) {
+  uint64_t seed = xxh64(build, strlen(build),
+                        ((uint64_t)CACHE_FORMAT << 32) | options);
+  cache_key_t key;
+  key.lo = xxh64(source, len, seed);
+  key.hi = xxh64(source, len, ~seed);
+  return key;
+}
+
+// Path of the entry for key; returns a malloc()ed string
+static char *entry_path(const cache_t *cache, cache_key_t key) {
+  size_t size = strlen(cache->dir) + CACHE_NAME_LEN + 2;
+  char *path = malloc(size);
+  if (path) {
+    snprintf(path, size, "%s/%016llx%016llx", cache->dir,
+             (unsigned long long)key.hi, (unsigned long long)key.lo);
+  }
+  return path;
+}
+
+// Read `len` bytes of an entry into a new buffer
+static int read_part(FILE *file, uint64_t len, void **part) {
+  *part = malloc(len ? (size_t)len : 1);
+  return *part && fread(*part, 1, (size_t)len, file) == len;
+}
+
+// Look up key. On a hit, fills entry, marks the entry as recently used and
+// returns 1.
+int cache_lookup(const cache_t *cache, cache_key_t key, cache_entry_t *entry) {
+  char *path = entry_path(cache, key);
+  FILE *file = path ? fopen(path, "rb") : NULL;
+  cache_header_t header;
+  struct stat st;
+
+  free(path);
+  memset(entry, 0, sizeof(*entry));
+  if (!file)
+    return 0;
+
+  // Reject anything that is not a complete entry
+  int ok = fstat(fileno(file), &st) == 0 &&
+           fread(&header, sizeof(header), 1, file) == 1 &&
+           header.magic == CACHE_MAGIC && header.out_len < SIZE_MAX &&
+           header.err_len < SIZE_MAX && header.image_len < SIZE_MAX &&
+           (uint64_t)st.st_size == sizeof(header) + header.out_len +
+                                       header.err_len + header.image_len;
+  ok = ok && read_part(file, header.out_len, (void **)&entry->out) &&
+       read_part(file, header.err_len, (void **)&entry->err) &&
+       read_part(file, header.image_len, (void **)&entry->image);
+
+  if (ok) {
+    entry->status = (int)header.status;
+    entry->out_len = (size_t)header.out_len;
+    entry->err_len = (size_t)header.err_len;
+    entry->image_len = (size_t)header.image_len;
+    futimens(fileno(file), NULL);
+  } else {
+    cache_entry_free(entry);
+  }
+  fclose(file);
+  return ok;
+}
+
+static int compare_mtime(const void *a, const void *b) {
+  const cache_file_t *fa = a;
+  const cache_file_t *fb = b;
+  if (fa->mtime.tv_sec != fb->mtime.tv_sec)
+    return fa->mtime.tv_sec < fb->mtime.tv_sec ? -1 : 1;
+  if (fa->mtime.tv_nsec != fb->mtime.tv_nsec)
+    return fa->mtime.tv_nsec < fb->mtime.tv_nsec ? -1 : 1;
+  return strcmp(fa->name, fb->name);
+}
+
+// fcntl() locks are held per process, so threads of one process take this
+// mutex as well
+static pthread_mutex_t size_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Remove least recently used entries until the directory is below the low
+// water mark, and temporary files left behind by interrupted stores.
+// Entries another process removes first are simply skipped. Returns the
+// size of the entries left, or UINT64_MAX if the directory was not read.
+static uint64_t cache_evict(const cache_t *cache) {
+  DIR *dir = opendir(cache->dir);
+  if (!dir)
+    return UINT64_MAX;
+
+  size_t path_size = strlen(cache->dir) + 258; // d_name is at most 255
+  char *path = malloc(path_size);
+  cache_file_t *files = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  uint64_t total = 0;
+  time_t now = time(NULL);
+  struct dirent *de;
+
+  while (path && (de = readdir(dir)) != NULL) {
+    int temporary = strncmp(de->d_name, ".tmp-", 5) == 0;
+    int is_entry = strlen(de->d_name) == CACHE_NAME_LEN &&
+                   strspn(de->d_name, "0123456789abcdef") == CACHE_NAME_LEN;
+    if (!temporary && !is_entry)
+      continue;
+
+    struct stat st;
+    snprintf(path, path_size, "%s/%s", cache->dir, de->d_name);
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+
+    if (temporary) {
+      if (now - st.st_mtime > CACHE_STALE_SECONDS)
+        unlink(path);
+      continue;
+    }
+
+    if (count == capacity) {
+      size_t grown = capacity ? capacity * 2 : 256;
+      cache_file_t *resized = realloc(files, grown * sizeof(*files));
+      if (!resized)
+        break;
+      files = resized;
+      capacity = grown;
+    }
+    memcpy(files[count].name, de->d_name, CACHE_NAME_LEN + 1);
+    files[count].size = (uint64_t)st.st_size;
+    files[count].mtime = st.st_mtim;
+    total += files[count].size;
+    count++;
+  }
+  closedir(dir);
+
+  if (total > cache->max_size) {
+    qsort(files, count, sizeof(*files), compare_mtime);
+    for (size_t i = 0;
+         i < count && total > CACHE_LOW_WATER(cache->max_size); i++) {
+      snprintf(path, path_size, "%s/%s", cache->dir, files[i].name);
+      unlink(path);
+      total -= files[i].size;
+    }
+  }
+
+  free(files);
+  free(path);
+  return total;
+}
+
+// Add a stored entry of `size` bytes to the running size estimate, and scan
+// the directory only when the estimate exceeds the limit; the scan then
+// replaces the estimate with the real total. The estimate is locked while
+// it is updated, so concurrent stores lose no update and scan one at a
+// time. It can only run high (an entry replacing another is counted twice,
+// entries removed by hand are still counted), which costs an early scan.
+// A missing or damaged estimate file, as in a cache written by an older
+// version, forces a scan.
+static void cache_account(const cache_t *cache, uint64_t size) {
+  size_t path_size = strlen(cache->dir) + sizeof("/" CACHE_SIZE_NAME);
+  char *path = malloc(path_size);
+  int fd = -1;
+
+  pthread_mutex_lock(&size_mutex);
+  if (path) {
+    snprintf(path, path_size, "%s/" CACHE_SIZE_NAME, cache->dir);
+    fd = open(path, O_RDWR | O_CREAT, 0666);
+  }
+  free(path);
+
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  if (fd < 0 || fcntl(fd, F_SETLKW, &lock) != 0) {
+    // Without a shared estimate, fall back to scanning on every store
+    if (fd >= 0)
+      close(fd);
+    cache_evict(cache);
+    pthread_mutex_unlock(&size_mutex);
+    return;
+  }
+
+  uint64_t estimate;
+  if (pread(fd, &estimate, sizeof(estimate), 0) != sizeof(estimate) ||
+      estimate > UINT64_MAX - size)
+    estimate = UINT64_MAX;
+  else
+    estimate += size;
+  if (estimate > cache->max_size)
+    estimate = cache_evict(cache);
+  if (pwrite(fd, &estimate, sizeof(estimate), 0) != sizeof(estimate))
+    ftruncate(fd, 0); // Scan again on the next store
+  close(fd); // Releases the lock
+  pthread_mutex_unlock(&size_mutex);
+}
+
+// Store an entry under key. The entry is written to a temporary file and
+// renamed into place, so readers never see a partial entry. Returns 1 on
+// success.
+int cache_store(const cache_t *cache, cache_key_t key,
+                const cache_entry_t *entry) {
+  size_t size = strlen(cache->dir) + sizeof("/.tmp-XXXXXX");
+  char *temp = malloc(size);
+  char *path = entry_path(cache, key);
+  FILE *file = NULL;
+  int fd = -1;
+
+  if (temp && path) {
+    snprintf(temp, size, "%s/.tmp-XXXXXX", cache->dir);
+    fd = mkstemp(temp);
+  }
+  if (fd >= 0)
+    fchmod(fd, 0644); // mkstemp() creates 0600; let other users read it
+  if (fd >= 0) {
+    file = fdopen(fd, "wb");
+    if (!file)
+      close(fd);
+  }
+
+  cache_header_t header = {CACHE_MAGIC, (uint32_t)entry->status,
+                           entry->out_len, entry->err_len, entry->image_len};
+  int ok = file && fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(entry->out, 1, entry->out_len, file) == entry->out_len &&
+           fwrite(entry->err, 1, entry->err_len, file) == entry->err_len &&
+           fwrite(entry->image, 1, entry->image_len, file) == entry->image_len;
+  if (file && fclose(file) != 0)
+    ok = 0;
+
+  if (fd >= 0 && (!ok || rename(temp, path) != 0)) {
+    unlink(temp);
+    ok = 0;
+  }
+  free(temp);
+  free(path);
+
+  if (ok)
+    cache_account(cache, sizeof(header) + entry->out_len + entry->err_len +
+                             entry->image_len);
+  return ok;
+}
+
+// Release the buffers of an entry
+void cache_entry_free(cache_entry_t *entry) {
+  free(entry->out);
+  free(entry->err);
+  free(entry->image);
+  memset(entry, 0, sizeof(*entry));
+}
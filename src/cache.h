@@ -0,0 +1,46 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Default size limit of a cache directory
+#define CACHE_DEFAULT_SIZE (256ull * 1024 * 1024)
+
+// Content-addressed result cache. Every entry is one file named after the
+// key, written to a temporary file and renamed into place, so processes can
+// share a directory. Lookups refresh the entry's mtime; stores keep a
+// running size estimate in the directory and, once it exceeds max_size,
+// scan it and evict the least recently used entries.
+typedef struct {
+  char *dir;
+  uint64_t max_size;
+} cache_t;
+
+// 128-bit key: source bytes, options and the build of the assembler
+typedef struct {
+  uint64_t hi;
+  uint64_t lo;
+} cache_key_t;
+
+// Cached result of one assembly; every buffer is malloc()ed
+typedef struct {
+  int status; // 1 when the image was assembled
+  char *out;  // Verbose output
+  size_t out_len;
+  char *err; // Diagnostics
+  size_t err_len;
+  uint8_t *image;
+  size_t image_len;
+} cache_entry_t;
+
+int cache_init(cache_t *cache, const char *dir, uint64_t max_size);
+void cache_free(cache_t *cache);
+cache_key_t cache_key(const char *build, uint32_t options,
+                      const void *source, size_t len);
+int cache_lookup(const cache_t *cache, cache_key_t key, cache_entry_t *entry);
+int cache_store(const cache_t *cache, cache_key_t key,
+                const cache_entry_t *entry);
+void cache_entry_free(cache_entry_t *entry);
+
+#endif // CACHE_H
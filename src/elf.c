@@ -0,0 +1,481 @@
+#define _XOPEN_SOURCE 700
+
+#include "elf.h"
+#include "arena.h"
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define EHDR_SIZE 52
+#define SHDR_SIZE 40
+#define SYM_SIZE 16
+#define REL_SIZE 8
+
+#define ET_REL 1
+#define EM_MIPS 8
+#define EF_MIPS_NOREORDER 0x00000001
+#define EF_MIPS_ABI_O32 0x00001000 // MIPS I, 32-bit ABI
+
+#define SHT_PROGBITS 1
+#define SHT_SYMTAB 2
+#define SHT_STRTAB 3
+#define SHT_NOBITS 8
+#define SHT_RELA 4
+#define SHT_REL 9
+#define SHF_WRITE 0x1
+#define SHF_ALLOC 0x2
+#define SHF_EXECINSTR 0x4
+#define SHF_INFO_LINK 0x40
+#define SHN_UNDEF 0
+#define SHN_ABS 0xFFF1
+
+#define STB_LOCAL 0
+#define STB_GLOBAL 1
+#define STT_NOTYPE 0
+#define STT_SECTION 3
+
+// Section header table: null, then each allocated section followed by its
+// relocations, then the symbol and string tables
+enum {
+  SH_NULL,
+  SH_TEXT,
+  SH_REL_TEXT,
+  SH_DATA,
+  SH_REL_DATA,
+  SH_BSS,
+  SH_SYMTAB,
+  SH_STRTAB,
+  SH_SHSTRTAB,
+  SH_COUNT
+};
+
+static const struct {
+  const char *name;
+  uint32_t type;
+  uint32_t flags;
+} allocated[ELF_SECTION_COUNT] = {
+    [ELF_TEXT] = {".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR},
+    [ELF_DATA] = {".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE},
+    [ELF_BSS] = {".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE},
+};
+
+// Header index of each allocated section and of its relocations
+static const int section_index[ELF_SECTION_COUNT] = {SH_TEXT, SH_DATA, SH_BSS};
+static const int rel_index[ELF_SECTION_COUNT] = {SH_REL_TEXT, SH_REL_DATA, 0};
+
+static const char shstrtab[] =
+    "\0.text\0.rel.text\0.data\0.rel.data\0.bss\0.symtab\0.strtab\0.shstrtab";
+
+static const uint8_t zeros[4];
+
+static void put_be16(uint8_t *out, uint16_t value) {
+  out[0] = (value >> 8) & 0xFF;
+  out[1] = value & 0xFF;
+}
+
+static void put_be32(uint8_t *out, uint32_t value) {
+  out[0] = (value >> 24) & 0xFF;
+  out[1] = (value >> 16) & 0xFF;
+  out[2] = (value >> 8) & 0xFF;
+  out[3] = value & 0xFF;
+}
+
+// Offset of a section name in shstrtab
+static uint32_t shstr(const char *name) {
+  const char *p = shstrtab + 1;
+  while (strcmp(p, name) != 0)
+    p += strlen(p) + 1;
+  return (uint32_t)(p - shstrtab);
+}
+
+static void put_sym(uint8_t *out, uint32_t name, uint32_t value, int bind,
+                    int type, uint16_t shndx) {
+  put_be32(out, name);
+  put_be32(out + 4, value);
+  put_be32(out + 8, 0);
+  out[12] = (uint8_t)((bind << 4) | type);
+  out[13] = 0;
+  put_be16(out + 14, shndx);
+}
+
+static void put_shdr(uint8_t *out, const char *name, uint32_t type,
+                     uint32_t flags, uint32_t addr, uint32_t offset,
+                     uint32_t size, uint32_t link, uint32_t info,
+                     uint32_t align, uint32_t entsize) {
+  put_be32(out, name ? shstr(name) : 0);
+  put_be32(out + 4, type);
+  put_be32(out + 8, flags);
+  put_be32(out + 12, addr);
+  put_be32(out + 16, offset);
+  put_be32(out + 20, size);
+  put_be32(out + 24, link);
+  put_be32(out + 28, info);
+  put_be32(out + 32, align);
+  put_be32(out + 36, entsize);
+}
+
+// Write every buffer, in as few writev() calls as IOV_MAX allows
+static int write_all(int fd, struct iovec *iov, size_t count) {
+  while (count > 0) {
+    int batch = count > IOV_MAX ? IOV_MAX : (int)count;
+    ssize_t written = writev(fd, iov, batch);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+
+    // Skip what was written, resuming a partly written buffer
+    while (count > 0 && (size_t)written >= iov->iov_len) {
+      written -= (ssize_t)iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + written;
+      iov->iov_len -= (size_t)written;
+    }
+  }
+  return 1;
+}
+
+// Bytes of zero padding after offset up to a multiple of 4
+static size_t padding(size_t offset) { return (0u - offset) & 3; }
+
+// Write object to fd as an ELF32 big-endian MIPS relocatable object. The
+// headers and tables are built in an arena; section bodies go from the
+// caller's runs straight to a single writev().
+//
+// Each allocated section's sh_addr is its address in the source (.text at
+// 0x00400000 unless .org moved it). The ELF ABI leaves sh_addr of a
+// relocatable object to be 0, and other tools ignore it there; only
+// `mipsasm --link` reads it back, as the default link base when no
+// --text-base or --data-base is given. Relocated fields never depend on it:
+// they hold addends relative to their section. sh_addralign is the largest
+// .align in the section, and at least 4.
+int elf_write(int fd, const elf_object_t *object) {
+  arena_t arena;
+  size_t symbols = ELF_FIRST_SYMBOL + object->symbol_count;
+  size_t run_count = 0;
+  size_t strtab_size = 1;
+
+  for (int s = 0; s < ELF_SECTION_COUNT; s++)
+    run_count += object->sections[s].run_count;
+  for (size_t i = 0; i < object->symbol_count; i++)
+    strtab_size += strlen(object->symbols[i].name) + 1;
+
+  arena_init(&arena, 0);
+  uint8_t *ehdr = arena_alloc(&arena, EHDR_SIZE);
+  uint8_t *symtab = arena_alloc(&arena, symbols * SYM_SIZE);
+  char *strtab = arena_alloc(&arena, strtab_size);
+  uint8_t *shdrs = arena_alloc(&arena, SH_COUNT * SHDR_SIZE);
+  uint8_t *rels[ELF_SECTION_COUNT] = {NULL};
+  struct iovec *iov =
+      arena_alloc(&arena, (run_count + 16) * sizeof(struct iovec));
+  int ok = ehdr && symtab && strtab && shdrs && iov;
+  for (int s = 0; ok && s < ELF_SECTION_COUNT; s++) {
+    size_t count = object->sections[s].reloc_count;
+    rels[s] = arena_alloc(&arena, count * REL_SIZE + 1);
+    ok = rels[s] != NULL;
+  }
+  if (!ok) {
+    arena_free(&arena);
+    return 0;
+  }
+
+  // Symbol table: null symbol, section symbols, then the caller's symbols
+  memset(symtab, 0, SYM_SIZE);
+  for (int s = 0; s < ELF_SECTION_COUNT; s++) {
+    put_sym(symtab + ELF_SECTION_SYMBOL(s) * SYM_SIZE, 0, 0, STB_LOCAL,
+            STT_SECTION, (uint16_t)section_index[s]);
+  }
+  size_t name = 1;
+  strtab[0] = '\0';
+  for (size_t i = 0; i < object->symbol_count; i++) {
+    const elf_symbol_t *symbol = &object->symbols[i];
+    size_t len = strlen(symbol->name);
+    uint16_t shndx = (symbol->section == ELF_UNDEF)
+                         ? 0
+                         : (uint16_t)section_index[symbol->section];
+    put_sym(symtab + (ELF_FIRST_SYMBOL + i) * SYM_SIZE, (uint32_t)name,
+            symbol->value, symbol->global ? STB_GLOBAL : STB_LOCAL,
+            STT_NOTYPE, shndx);
+    memcpy(strtab + name, symbol->name, len + 1);
+    name += len + 1;
+  }
+
+  for (int s = 0; s < ELF_SECTION_COUNT; s++) {
+    const elf_section_desc_t *section = &object->sections[s];
+    for (size_t i = 0; i < section->reloc_count; i++) {
+      const elf_reloc_t *reloc = &section->relocs[i];
+      put_be32(rels[s] + i * REL_SIZE, reloc->offset);
+      put_be32(rels[s] + i * REL_SIZE + 4, reloc->symbol << 8 | reloc->type);
+    }
+  }
+
+  // Lay the file out: header, section bodies, tables, section headers
+  size_t n = 0;
+  size_t offset = EHDR_SIZE;
+  uint32_t body_offset[ELF_SECTION_COUNT];
+  iov[n++] = (struct iovec){ehdr, EHDR_SIZE};
+  for (int s = 0; s < ELF_SECTION_COUNT; s++) {
+    const elf_section_desc_t *section = &object->sections[s];
+    iov[n++] = (struct iovec){(void *)zeros, padding(offset)};
+    offset += padding(offset);
+    body_offset[s] = (uint32_t)offset;
+    if (allocated[s].type == SHT_NOBITS)
+      continue;
+    for (size_t r = 0; r < section->run_count; r++)
+      iov[n++] = section->runs[r];
+    offset += section->size;
+  }
+
+  iov[n++] = (struct iovec){(void *)zeros, padding(offset)};
+  offset += padding(offset);
+  uint32_t symtab_offset = (uint32_t)offset;
+  iov[n++] = (struct iovec){symtab, symbols * SYM_SIZE};
+  offset += symbols * SYM_SIZE;
+
+  uint32_t rel_offset[ELF_SECTION_COUNT];
+  for (int s = 0; s < ELF_SECTION_COUNT; s++) {
+    size_t size = object->sections[s].reloc_count * REL_SIZE;
+    rel_offset[s] = (uint32_t)offset;
+    iov[n++] = (struct iovec){rels[s], size};
+    offset += size;
+  }
+
+  uint32_t strtab_offset = (uint32_t)offset;
+  iov[n++] = (struct iovec){strtab, strtab_size};
+  offset += strtab_size;
+  uint32_t shstrtab_offset = (uint32_t)offset;
+  iov[n++] = (struct iovec){(void *)shstrtab, sizeof(shstrtab)};
+  offset += sizeof(shstrtab);
+
+  iov[n++] = (struct iovec){(void *)zeros, padding(offset)};
+  offset += padding(offset);
+  uint32_t shdr_offset = (uint32_t)offset;
+  iov[n++] = (struct iovec){shdrs, SH_COUNT * SHDR_SIZE};
+
+  // Section headers
+  memset(shdrs, 0, SHDR_SIZE);
+  for (int s = 0; s < ELF_SECTION_COUNT; s++) {
+    const elf_section_desc_t *section = &object->sections[s];
+    put_shdr(shdrs + section_index[s] * SHDR_SIZE, allocated[s].name,
+             allocated[s].type, allocated[s].flags, section->address,
+             body_offset[s], section->size, 0, 0,
+             section->align > 4 ? section->align : 4, 0);
+    if (rel_index[s]) {
+      char rel_name[16] = ".rel";
+      strcat(rel_name, allocated[s].name);
+      put_shdr(shdrs + rel_index[s] * SHDR_SIZE, rel_name, SHT_REL,
+               SHF_INFO_LINK, 0, rel_offset[s],
+               (uint32_t)(section->reloc_count * REL_SIZE), SH_SYMTAB,
+               (uint32_t)section_index[s], 4, REL_SIZE);
+    }
+  }
+  put_shdr(shdrs + SH_SYMTAB * SHDR_SIZE, ".symtab", SHT_SYMTAB, 0, 0,
+           symtab_offset, (uint32_t)(symbols * SYM_SIZE), SH_STRTAB,
+           (uint32_t)(ELF_FIRST_SYMBOL + object->local_count), 4, SYM_SIZE);
+  put_shdr(shdrs + SH_STRTAB * SHDR_SIZE, ".strtab", SHT_STRTAB, 0, 0,
+           strtab_offset, (uint32_t)strtab_size, 0, 0, 1, 0);
+  put_shdr(shdrs + SH_SHSTRTAB * SHDR_SIZE, ".shstrtab", SHT_STRTAB, 0, 0,
+           shstrtab_offset, sizeof(shstrtab), 0, 0, 1, 0);
+
+  // ELF header
+  static const uint8_t ident[16] = {0x7F, 'E', 'L', 'F', 1 /* 32-bit */,
+                                    2 /* big endian */, 1 /* version */};
+  memcpy(ehdr, ident, sizeof(ident));
+  put_be16(ehdr + 16, ET_REL);
+  put_be16(ehdr + 18, EM_MIPS);
+  put_be32(ehdr + 20, 1);
+  put_be32(ehdr + 24, 0); // Entry point
+  put_be32(ehdr + 28, 0); // Program headers
+  put_be32(ehdr + 32, shdr_offset);
+  put_be32(ehdr + 36, EF_MIPS_NOREORDER | EF_MIPS_ABI_O32);
+  put_be16(ehdr + 40, EHDR_SIZE);
+  put_be16(ehdr + 42, 0);
+  put_be16(ehdr + 44, 0);
+  put_be16(ehdr + 46, SHDR_SIZE);
+  put_be16(ehdr + 48, SH_COUNT);
+  put_be16(ehdr + 50, SH_SHSTRTAB);
+
+  ok = write_all(fd, iov, n);
+  arena_free(&arena);
+  return ok;
+}
+
+static uint16_t get_be16(const uint8_t *in) {
+  return (uint16_t)(in[0] << 8 | in[1]);
+}
+
+static uint32_t get_be32(const uint8_t *in) {
+  return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 |
+         (uint32_t)in[2] << 8 | in[3];
+}
+
+// Allocated section a section header describes, by name and type
+static int allocated_section(const char *name, uint32_t type) {
+  for (int s = 0; s < ELF_SECTION_COUNT; s++) {
+    if (strcmp(name, allocated[s].name) == 0 && type == allocated[s].type)
+      return s;
+  }
+  return ELF_OTHER;
+}
+
+// Read the ELF32 big-endian MIPS relocatable object in the size bytes at
+// data. Section bodies and symbol names point into data, which must outlive
+// object; the tables are allocated from arena. Relocations of sections
+// other than .text and .data are ignored. sh_addr is kept as the section
+// address, which is only meaningful in objects written by elf_write().
+// Returns NULL, or what is wrong with the file.
+const char *elf_read(const uint8_t *data, size_t size, arena_t *arena,
+                     elf_object_t *object) {
+  memset(object, 0, sizeof(*object));
+  if (size < EHDR_SIZE || data[0] != 0x7F || memcmp(data + 1, "ELF", 3) != 0)
+    return "not an ELF file";
+  if (data[4] != 1 || data[5] != 2)
+    return "not a 32-bit big-endian ELF file";
+  if (get_be16(data + 16) != ET_REL || get_be16(data + 18) != EM_MIPS)
+    return "not a MIPS relocatable object";
+
+  uint32_t shoff = get_be32(data + 32);
+  uint16_t shentsize = get_be16(data + 46);
+  uint16_t shnum = get_be16(data + 48);
+  uint16_t shstrndx = get_be16(data + 50);
+  if (shentsize != SHDR_SIZE || shstrndx >= shnum || shoff > size ||
+      (size - shoff) / SHDR_SIZE < shnum)
+    return "bad section header table";
+
+  // Every section but .bss must lie within the file
+  const uint8_t *shdrs = data + shoff;
+  for (int i = 0; i < shnum; i++) {
+    const uint8_t *shdr = shdrs + i * SHDR_SIZE;
+    uint32_t offset = get_be32(shdr + 16);
+    uint32_t length = get_be32(shdr + 20);
+    if (get_be32(shdr + 4) != SHT_NOBITS &&
+        (offset > size || length > size - offset))
+      return "section extends past the end of the file";
+  }
+
+  const uint8_t *shstr_hdr = shdrs + shstrndx * SHDR_SIZE;
+  const char *names = (const char *)data + get_be32(shstr_hdr + 16);
+  uint32_t names_size = get_be32(shstr_hdr + 20);
+  if (names_size == 0 || names[names_size - 1] != '\0')
+    return "bad section name table";
+
+  // Map header indices to allocated sections, and find the symbol table
+  uint8_t *section_of = arena_alloc(arena, shnum);
+  struct iovec *runs =
+      arena_alloc(arena, ELF_SECTION_COUNT * sizeof(struct iovec));
+  if (!section_of || !runs)
+    return "out of memory";
+  int symtab = -1;
+  for (int i = 0; i < shnum; i++) {
+    const uint8_t *shdr = shdrs + i * SHDR_SIZE;
+    uint32_t name = get_be32(shdr);
+    uint32_t type = get_be32(shdr + 4);
+    if (name >= names_size)
+      return "bad section name";
+    if (type == SHT_SYMTAB)
+      symtab = i;
+
+    section_of[i] = (uint8_t)allocated_section(names + name, type);
+    if (i == 0 || section_of[i] == ELF_OTHER)
+      continue;
+
+    elf_section_desc_t *section = &object->sections[section_of[i]];
+    section->address = get_be32(shdr + 12);
+    section->size = get_be32(shdr + 20);
+    section->align = get_be32(shdr + 32);
+    if (section->align & (section->align - 1))
+      return "bad section alignment";
+    if (type != SHT_NOBITS && section->size > 0) {
+      runs[section_of[i]] = (struct iovec){
+          (void *)(data + get_be32(shdr + 16)), section->size};
+      section->runs = &runs[section_of[i]];
+      section->run_count = 1;
+    }
+  }
+  if (symtab < 0)
+    return "no symbol table";
+
+  const uint8_t *sym_hdr = shdrs + symtab * SHDR_SIZE;
+  uint32_t strtab = get_be32(sym_hdr + 24);
+  if (get_be32(sym_hdr + 36) != SYM_SIZE || strtab >= shnum)
+    return "bad symbol table";
+  const uint8_t *str_hdr = shdrs + strtab * SHDR_SIZE;
+  const char *strings = (const char *)data + get_be32(str_hdr + 16);
+  uint32_t strings_size = get_be32(str_hdr + 20);
+  if (strings_size == 0 || strings[strings_size - 1] != '\0')
+    return "bad string table";
+
+  // Symbols
+  const uint8_t *syms = data + get_be32(sym_hdr + 16);
+  size_t count = get_be32(sym_hdr + 20) / SYM_SIZE;
+  elf_symbol_t *symbols = arena_alloc(arena, count * sizeof(elf_symbol_t));
+  if (count > 0 && !symbols)
+    return "out of memory";
+  for (size_t i = 0; i < count; i++) {
+    const uint8_t *sym = syms + i * SYM_SIZE;
+    uint32_t name = get_be32(sym);
+    uint16_t shndx = get_be16(sym + 14);
+    if (name >= strings_size)
+      return "bad symbol name";
+
+    symbols[i].name = strings + name;
+    symbols[i].value = get_be32(sym + 4);
+    symbols[i].global = (sym[12] >> 4) != STB_LOCAL;
+    if (shndx == SHN_UNDEF)
+      symbols[i].section = ELF_UNDEF;
+    else if (shndx == SHN_ABS)
+      symbols[i].section = ELF_ABS;
+    else if (shndx < shnum)
+      symbols[i].section = section_of[shndx];
+    else
+      symbols[i].section = ELF_OTHER;
+  }
+  object->symbols = symbols;
+  object->symbol_count = count;
+  object->local_count = get_be32(sym_hdr + 28);
+
+  // Relocations of .text and .data
+  for (int i = 0; i < shnum; i++) {
+    const uint8_t *shdr = shdrs + i * SHDR_SIZE;
+    uint32_t type = get_be32(shdr + 4);
+    uint32_t target = get_be32(shdr + 28);
+    if ((type != SHT_REL && type != SHT_RELA) || target >= shnum ||
+        section_of[target] == ELF_OTHER || section_of[target] == ELF_BSS)
+      continue;
+    if (type == SHT_RELA)
+      return "RELA relocations are not supported";
+    if (get_be32(shdr + 36) != REL_SIZE ||
+        get_be32(shdr + 24) != (uint32_t)symtab)
+      return "bad relocation section";
+
+    elf_section_desc_t *section = &object->sections[section_of[target]];
+    const uint8_t *rels = data + get_be32(shdr + 16);
+    size_t reloc_count = get_be32(shdr + 20) / REL_SIZE;
+    elf_reloc_t *relocs = arena_alloc(arena, reloc_count * sizeof(*relocs));
+    if (reloc_count > 0 && !relocs)
+      return "out of memory";
+    for (size_t r = 0; r < reloc_count; r++) {
+      uint32_t info = get_be32(rels + r * REL_SIZE + 4);
+      relocs[r].offset = get_be32(rels + r * REL_SIZE);
+      relocs[r].symbol = info >> 8;
+      relocs[r].type = (uint8_t)(info & 0xFF);
+      if (relocs[r].symbol >= count)
+        return "relocation against a bad symbol";
+      if (relocs[r].offset > section->size ||
+          section->size - relocs[r].offset < 4)
+        return "relocation outside its section";
+    }
+    section->relocs = relocs;
+    section->reloc_count = reloc_count;
+  }
+  return NULL;
+}
@@ -0,0 +1,72 @@
+#ifndef ELF_H
+#define ELF_H
+
+#include "arena.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// MIPS relocation types used by the assembler (System V MIPS ABI)
+#define R_MIPS_NONE 0
+#define R_MIPS_32 2
+#define R_MIPS_26 4
+#define R_MIPS_HI16 5
+#define R_MIPS_LO16 6
+#define R_MIPS_PC16 10
+
+// Allocated sections of an object, in section header order
+typedef enum { ELF_TEXT, ELF_DATA, ELF_BSS, ELF_SECTION_COUNT } elf_section_t;
+
+// Sections of symbols outside the allocated sections. Only objects that
+// were read have absolute symbols or symbols in other sections.
+#define ELF_UNDEF 0xFF
+#define ELF_ABS 0xFE
+#define ELF_OTHER 0xFD
+
+// Symbol table index of a section's symbol, and of the first symbol of
+// elf_object_t.symbols (after the null symbol and the section symbols)
+#define ELF_SECTION_SYMBOL(section) (1 + (uint32_t)(section))
+#define ELF_FIRST_SYMBOL (1 + ELF_SECTION_COUNT)
+
+// A relocation: the field at offset in its section refers to symbol, and
+// holds the addend (REL entries have no explicit addend)
+typedef struct {
+  uint32_t offset;
+  uint32_t symbol; // Symbol table index
+  uint8_t type;    // R_MIPS_*
+} elf_reloc_t;
+
+typedef struct {
+  const char *name;
+  uint32_t value;  // Offset in the section
+  uint8_t section; // elf_section_t, ELF_UNDEF, ELF_ABS or ELF_OTHER
+  uint8_t global;
+} elf_symbol_t;
+
+// Contents of an allocated section. The body is gathered from runs in
+// place, so it is never copied before it reaches the file.
+typedef struct {
+  uint32_t address; // Load address (sh_addr, nonstandard in ET_REL)
+  uint32_t size;
+  uint32_t align;   // sh_addralign: largest .align in bytes, 0 or 1 for none
+  const struct iovec *runs; // Body, in order (none for .bss)
+  size_t run_count;
+  const elf_reloc_t *relocs;
+  size_t reloc_count;
+} elf_section_desc_t;
+
+// A relocatable object. Local symbols come first. In an object to write,
+// symbols starts at ELF_FIRST_SYMBOL; in one that was read it is the whole
+// symbol table, indexed the way relocations index it.
+typedef struct {
+  elf_section_desc_t sections[ELF_SECTION_COUNT];
+  const elf_symbol_t *symbols;
+  size_t symbol_count;
+  size_t local_count;
+} elf_object_t;
+
+int elf_write(int fd, const elf_object_t *object);
+const char *elf_read(const uint8_t *data, size_t size, arena_t *arena,
+                     elf_object_t *object);
+
+#endif // ELF_H
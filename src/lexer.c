@@ -0,0 +1,114 @@
+#include "lexer.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__AVX2__) || defined(__SSE2__))
+#include <immintrin.h>
+#define LEXER_SIMD 1
+#endif
+
+// Characters the line scanner has to stop at
+static const uint8_t special_chars[256] = {
+    ['\n'] = 1, ['"'] = 1, ['#'] = 1, ['/'] = 1, [':'] = 1};
+
+// Return the first special character in [p, end), or end
+static const char *find_special(const char *p, const char *end) {
+#ifdef LEXER_SIMD
+#ifdef __AVX2__
+  const __m256i newline32 = _mm256_set1_epi8('\n');
+  const __m256i quote32 = _mm256_set1_epi8('"');
+  const __m256i hash32 = _mm256_set1_epi8('#');
+  const __m256i slash32 = _mm256_set1_epi8('/');
+  const __m256i colon32 = _mm256_set1_epi8(':');
+
+  while (end - p >= 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hits = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, newline32),
+                        _mm256_cmpeq_epi8(chunk, quote32)),
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, hash32),
+                                        _mm256_cmpeq_epi8(chunk, slash32)),
+                        _mm256_cmpeq_epi8(chunk, colon32)));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(hits);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+#endif
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i hash = _mm_set1_epi8('#');
+  const __m128i slash = _mm_set1_epi8('/');
+  const __m128i colon = _mm_set1_epi8(':');
+
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    __m128i hits = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, newline),
+                     _mm_cmpeq_epi8(chunk, quote)),
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, hash),
+                                  _mm_cmpeq_epi8(chunk, slash)),
+                     _mm_cmpeq_epi8(chunk, colon)));
+    unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+
+  // Portable fallback, also used for the tail of the buffer
+  while (p < end && !special_chars[(uint8_t)*p])
+    p++;
+  return p;
+}
+
+// Start lexing a source buffer
+void lexer_init(lexer_t *lexer, const char *source, size_t len) {
+  lexer->cur = source;
+  lexer->end = source + len;
+}
+
+// Split off the next line. Each byte is examined once: the scanner jumps
+// between newlines, quotes, comment starts and colons, and after a comment
+// only looks for the newline. Returns 0 at the end of the buffer.
+int lexer_next_line(lexer_t *lexer, lex_line_t *line) {
+  const char *p = lexer->cur;
+  const char *end = lexer->end;
+  int in_string = 0;
+  int seen_quote = 0;
+
+  if (p >= end)
+    return 0;
+
+  line->start = p;
+  line->code_end = NULL;
+  line->colon = NULL;
+
+  for (;;) {
+    p = find_special(p, end);
+    if (p == end || *p == '\n')
+      break;
+
+    if (*p == '"') {
+      in_string = !in_string;
+      seen_quote = 1;
+    } else if (!in_string &&
+               (*p == '#' || (*p == '/' && p + 1 < end && p[1] == '/'))) {
+      // Comment: the rest of the line is not code
+      line->code_end = p;
+      p = memchr(p, '\n', end - p);
+      if (!p)
+        p = end;
+      break;
+    } else if (*p == ':' && !seen_quote && !line->colon) {
+      line->colon = p;
+    }
+    p++;
+  }
+
+  line->end = p;
+  if (!line->code_end)
+    line->code_end = p;
+  lexer->cur = (p < end) ? p + 1 : end;
+  return 1;
+}
@@ -0,0 +1,26 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <stddef.h>
+
+// Line lexer over an in-memory source buffer. Lines are handed out as
+// pointers into the buffer; nothing is copied and there is no line length
+// limit.
+typedef struct {
+  const char *cur;
+  const char *end;
+} lexer_t;
+
+// One source line, without its terminating newline
+typedef struct {
+  const char *start;
+  const char *code_end; // End of the code part: start of a '#' or '//'
+                        // comment outside string literals, or `end`
+  const char *end;
+  const char *colon; // First ':' before any '"' in the code part, or NULL
+} lex_line_t;
+
+void lexer_init(lexer_t *lexer, const char *source, size_t len);
+int lexer_next_line(lexer_t *lexer, lex_line_t *line);
+
+#endif // LEXER_H
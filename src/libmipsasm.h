@@ -0,0 +1,154 @@
+#ifndef LIBMIPSASM_H
+#define LIBMIPSASM_H
+
+// Public interface of libmipsasm.
+//
+// Every entry point works on caller-owned state only, so separate contexts
+// can be used from separate threads at the same time. A context keeps its
+// buffers between runs: once it has assembled a source of a given size,
+// assembling sources up to that size again does not touch the heap.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(__GNUC__)
+#define MIPSASM_API __attribute__((visibility("default")))
+#else
+#define MIPSASM_API
+#endif
+
+// Return codes of mips_assembler_assemble()
+#define MIPS_ASM_OK 1
+#define MIPS_ASM_ERROR 0
+#define MIPS_ASM_NOSPACE (-1)
+
+// Kinds of message passed to a mips_diag_fn_t
+typedef enum {
+  MIPS_DIAG_ERROR, // Assembly error
+  MIPS_DIAG_INFO   // Verbose progress output
+} mips_diag_kind_t;
+
+// Diagnostic callback. message is one line without its trailing newline and
+// is only valid during the call.
+typedef void (*mips_diag_fn_t)(void *arg, mips_diag_kind_t kind,
+                               const char *message);
+
+// Categories of verbose events (mips_options_t.trace). Pass summaries are
+// printed in verbose mode regardless.
+#define MIPS_TRACE_LABELS 0x01     // Label definitions
+#define MIPS_TRACE_SECTIONS 0x02   // Section switches and .org
+#define MIPS_TRACE_DIRECTIVES 0x04 // Every directive processed
+#define MIPS_TRACE_SYMBOLS 0x08    // Label addresses resolved in pass 2
+#define MIPS_TRACE_ALL 0x0F
+
+// Output formats (mips_options_t.format)
+#define MIPS_FORMAT_BINARY 0 // Flat image, sections in source order
+#define MIPS_FORMAT_ELF 1    // Image for mips_assembler_write_elf()
+
+// Rules of the peephole pass (mips_options_t.optimize), indices of
+// mips_stats_t.peephole
+#define MIPS_PEEPHOLE_LI 0     // li in one word where lui+ori was used
+#define MIPS_PEEPHOLE_LA 1     // la of a data label in one word
+#define MIPS_PEEPHOLE_LA_MEM 2 // la folded into the load/store after it
+#define MIPS_PEEPHOLE_MOVE 3   // Redundant move dropped
+#define MIPS_PEEPHOLE_RULES 4
+
+// Upper bound on the number of mnemonics in the instruction set
+#define MIPS_STATS_MNEMONICS 64
+
+// Statements assembled for one mnemonic
+typedef struct {
+  const char *mnemonic;
+  uint64_t count;
+} mips_mnemonic_count_t;
+
+// Phase times and counters of the last run, filled in when
+// mips_options_t.stats is set. Collecting them costs a walk over the parsed
+// statements; nothing is counted when stats is NULL.
+typedef struct {
+  double pass1_ms;            // Parsing, sizing and label collection
+  double pass2_ms;            // Encoding
+  uint64_t lines;             // Source lines
+  uint64_t statements;        // Statements parsed (instructions and data)
+  uint64_t instructions;      // Instructions, pseudo-instructions included
+  uint64_t pseudo_expansions; // Pseudo-instructions expanded
+  uint64_t pseudo_words;      // Machine words they expanded into
+  uint64_t labels;            // Labels defined
+  uint64_t label_lookups;     // Symbol table lookups
+  uint64_t hash_probes;       // Hash slots visited by those lookups
+  uint64_t text_bytes;        // Size of the text section
+  uint64_t data_bytes;        // Size of the data section
+  uint64_t memory_bytes;      // Heap held by the assembler context
+  uint64_t peephole[MIPS_PEEPHOLE_RULES]; // Hits of each peephole rule
+  uint64_t delay_slots;       // Delay slots added under .set reorder
+  uint64_t slots_filled;      // Of those, filled with an earlier instruction
+  uint64_t stalls_before;     // Estimated pipeline stalls of the blocks the
+  uint64_t stalls_after;      // scheduler saw, before and after it ran
+  uint64_t interlocks;        // nops it inserted for load and HI/LO hazards
+  uint64_t branches_relaxed;  // Branches out of range made into jumps
+  // Mnemonics that occur in the source, in instruction set order
+  int mnemonic_count;
+  mips_mnemonic_count_t mnemonics[MIPS_STATS_MNEMONICS];
+} mips_stats_t;
+
+// Assembly options; NULL selects the defaults
+typedef struct {
+  int verbose;
+  unsigned trace;      // Verbose event categories, MIPS_TRACE_ALL when 0
+  int jobs;            // Threads for a large source; 0 picks the CPU count
+  int format;          // MIPS_FORMAT_*; sessions always use the binary one
+  int optimize;        // Run the peephole pass (not in sessions or
+                       // mips_assemble_stream())
+  int schedule;        // Run the instruction scheduler (likewise)
+  FILE *out;           // Verbose output, stdout when NULL
+  FILE *err;           // Diagnostics, stderr when NULL
+  mips_diag_fn_t diag; // Receives all messages instead of out/err when set
+  void *diag_arg;      // Passed to diag
+  mips_stats_t *stats; // Filled in by every successful run when set (not
+                       // by sessions or mips_assemble_stream())
+} mips_options_t;
+
+// Reusable assembler context
+typedef struct mips_assembler mips_assembler_t;
+
+MIPSASM_API mips_assembler_t *
+mips_assembler_create(const mips_options_t *options);
+MIPSASM_API void mips_assembler_reset(mips_assembler_t *as);
+MIPSASM_API int mips_assembler_assemble(mips_assembler_t *as,
+                                        const char *source, size_t source_len,
+                                        uint8_t *output, size_t capacity,
+                                        size_t *output_size);
+MIPSASM_API int mips_assembler_encode(mips_assembler_t *as, uint8_t *output,
+                                      size_t capacity, size_t *output_size);
+MIPSASM_API void mips_assembler_destroy(mips_assembler_t *as);
+
+// Write the source last assembled by an assembler created with
+// MIPS_FORMAT_ELF as an ELF32 big-endian relocatable object: .text, .data
+// and .bss at the layout the source set up, every label in .symtab and REL
+// relocations for each field that refers to a label. image is the buffer
+// that mips_assembler_assemble() or mips_assembler_encode() filled in.
+MIPSASM_API int mips_assembler_write_elf(mips_assembler_t *as,
+                                         const uint8_t *image, int fd);
+
+// Incremental assembler for a source that is edited and assembled again and
+// again. Each update only parses the lines whose code changed and encodes
+// the statements they produced or that refer to moved labels.
+typedef struct mips_session mips_session_t;
+
+MIPSASM_API mips_session_t *mips_session_create(const mips_options_t *options);
+MIPSASM_API int mips_session_update(mips_session_t *session,
+                                    const char *source, size_t source_len,
+                                    const uint8_t **output,
+                                    size_t *output_size);
+MIPSASM_API void mips_session_destroy(mips_session_t *session);
+
+// One-shot helpers; the image is returned in a malloc()ed buffer
+MIPSASM_API int mips_assemble(const char *source, size_t source_len,
+                              uint8_t **output, size_t *output_size,
+                              const mips_options_t *options);
+MIPSASM_API int mips_assemble_stream(FILE *input, uint8_t **output,
+                                     size_t *output_size,
+                                     const mips_options_t *options);
+
+#endif // LIBMIPSASM_H
@@ -0,0 +1,360 @@
+#define _XOPEN_SOURCE 700
+
+#include "link.h"
+#include "elf.h"
+#include "mipsasm.h"
+#include "symtab.h"
+#include "threadpool.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Least alignment of each object's sections in the output
+#define LINK_ALIGN 4
+
+// Symbol value of a symbol that has no address in the output
+#define LINK_NO_VALUE (-1)
+
+// One input object. Each is loaded and relocated by its own task, so every
+// task reports at most one error into its own buffer.
+typedef struct {
+  const char *path;
+  uint8_t *data; // Mapped file
+  size_t size;
+  arena_t arena;
+  elf_object_t object;
+  uint32_t address[ELF_SECTION_COUNT]; // Final address of each section
+  size_t offset[ELF_SECTION_COUNT];    // Image offset of .text and .data
+  int64_t *values; // Final symbol values, or LINK_NO_VALUE
+  char error[256];
+} link_module_t;
+
+typedef struct {
+  link_module_t *modules;
+  uint8_t *image;
+} link_job_t;
+
+static uint32_t get_be32(const uint8_t *in) {
+  return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 |
+         (uint32_t)in[2] << 8 | in[3];
+}
+
+static void put_be32(uint8_t *out, uint32_t value) {
+  out[0] = (value >> 24) & 0xFF;
+  out[1] = (value >> 16) & 0xFF;
+  out[2] = (value >> 8) & 0xFF;
+  out[3] = value & 0xFF;
+}
+
+// First address from `address` on where section can go. .align pads
+// absolute addresses, so the section keeps the offset its sh_addr had from
+// a multiple of its sh_addralign; for the usual aligned sh_addr that is
+// plain alignment.
+static uint32_t place_section(uint32_t address,
+                              const elf_section_desc_t *section) {
+  uint32_t align = section->align > LINK_ALIGN ? section->align : LINK_ALIGN;
+  return address + ((section->address - address) & (align - 1));
+}
+
+// Map and parse one object
+static void load_module(void *arg, int index) {
+  link_job_t *job = arg;
+  link_module_t *module = &job->modules[index];
+
+  int fd = open(module->path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0) {
+    snprintf(module->error, sizeof(module->error), "cannot read");
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+
+  module->size = (size_t)st.st_size;
+  module->data = mmap(NULL, module->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (module->data == MAP_FAILED) {
+    module->data = NULL;
+    snprintf(module->error, sizeof(module->error), "cannot map");
+    return;
+  }
+
+  const char *problem =
+      elf_read(module->data, module->size, &module->arena, &module->object);
+  if (problem)
+    snprintf(module->error, sizeof(module->error), "%s", problem);
+}
+
+// Apply one relocation to the word at field, at address pc. A HI16 takes
+// its addend's low half from the LO16 right after it against the same
+// symbol; the original body is read for that, since the LO16 is relocated
+// independently.
+static const char *apply_reloc(const link_module_t *module,
+                               const elf_section_desc_t *section, size_t i,
+                               const uint8_t *body, uint8_t *field,
+                               uint32_t pc) {
+  const elf_reloc_t *reloc = &section->relocs[i];
+  const elf_symbol_t *symbol = &module->object.symbols[reloc->symbol];
+  int64_t value = module->values[reloc->symbol];
+  uint32_t word = get_be32(field);
+
+  if (reloc->type == R_MIPS_NONE)
+    return NULL;
+  if (value == LINK_NO_VALUE && reloc->symbol != 0) {
+    return symbol->section == ELF_UNDEF ? "undefined reference to '%s'"
+                                        : "'%s' is in a section that is "
+                                          "not linked";
+  }
+  uint32_t s = (uint32_t)(reloc->symbol != 0 ? value : 0);
+
+  switch (reloc->type) {
+  case R_MIPS_32:
+    put_be32(field, word + s);
+    return NULL;
+
+  case R_MIPS_26: {
+    uint32_t target = ((word & 0x03FFFFFF) << 2) + s;
+    if ((target & 0xF0000000) != ((pc + 4) & 0xF0000000))
+      return "jump to '%s' out of range";
+    put_be32(field, (word & 0xFC000000) | ((target >> 2) & 0x03FFFFFF));
+    return NULL;
+  }
+
+  case R_MIPS_HI16: {
+    uint32_t ahl = word << 16;
+    const elf_reloc_t *lo = reloc + 1;
+    int paired = i + 1 < section->reloc_count && lo->type == R_MIPS_LO16 &&
+                 lo->symbol == reloc->symbol;
+    if (paired)
+      ahl += (uint32_t)(int16_t)(get_be32(body + lo->offset) & 0xFFFF);
+    // A paired low half is sign-extended, so the high half is rounded
+    uint32_t hi = paired ? (ahl + s + 0x8000) >> 16 : (ahl + s) >> 16;
+    put_be32(field, (word & 0xFFFF0000) | (hi & 0xFFFF));
+    return NULL;
+  }
+
+  case R_MIPS_LO16:
+    put_be32(field, (word & 0xFFFF0000) | ((word + s) & 0xFFFF));
+    return NULL;
+
+  case R_MIPS_PC16: {
+    int32_t offset = (int32_t)(int16_t)(word & 0xFFFF) * 4;
+    int32_t delta = (int32_t)(offset + s - pc);
+    if (delta / 4 < INT16_MIN || delta / 4 > INT16_MAX)
+      return "branch to '%s' out of range";
+    put_be32(field, (word & 0xFFFF0000) | ((uint32_t)(delta / 4) & 0xFFFF));
+    return NULL;
+  }
+
+  default:
+    return "unsupported relocation against '%s'";
+  }
+}
+
+// Copy one object's .text and .data into the image and relocate them. The
+// objects own disjoint parts of the image, so they are relocated in
+// parallel.
+static void relocate_module(void *arg, int index) {
+  link_job_t *job = arg;
+  link_module_t *module = &job->modules[index];
+
+  for (int s = ELF_TEXT; s <= ELF_DATA; s++) {
+    const elf_section_desc_t *section = &module->object.sections[s];
+    uint8_t *body = job->image + module->offset[s];
+    if (section->run_count > 0)
+      memcpy(body, section->runs[0].iov_base, section->size);
+
+    for (size_t i = 0; i < section->reloc_count; i++) {
+      const elf_reloc_t *reloc = &section->relocs[i];
+      const char *problem =
+          apply_reloc(module, section, i, section->runs[0].iov_base,
+                      body + reloc->offset, module->address[s] + reloc->offset);
+      if (problem) {
+        const char *name = module->object.symbols[reloc->symbol].name;
+        snprintf(module->error, sizeof(module->error), problem, name);
+        return;
+      }
+    }
+  }
+}
+
+// Give every symbol of a module its final value. Globals are looked up in
+// the table of global definitions.
+static int resolve_symbols(link_module_t *module, symtab_t *globals) {
+  const elf_object_t *object = &module->object;
+  module->values =
+      arena_alloc(&module->arena, object->symbol_count * sizeof(int64_t));
+  if (object->symbol_count > 0 && !module->values)
+    return 0;
+
+  for (size_t i = 0; i < object->symbol_count; i++) {
+    const elf_symbol_t *symbol = &object->symbols[i];
+    int64_t value = LINK_NO_VALUE;
+    if (symbol->section < ELF_SECTION_COUNT) {
+      value = module->address[symbol->section] + symbol->value;
+    } else if (symbol->section == ELF_ABS) {
+      value = symbol->value;
+    } else if (symbol->section == ELF_UNDEF && symbol->name[0] != '\0') {
+      int index = symtab_find(globals, symbol->name, strlen(symbol->name));
+      if (index >= 0 && globals->entries[index].resolved)
+        value = globals->entries[index].address;
+    }
+    module->values[i] = value;
+  }
+  return 1;
+}
+
+// Collect the global definitions of every module, in order
+static int define_globals(link_module_t *modules, int count,
+                          symtab_t *globals, FILE *err) {
+  int ok = 1;
+  for (int m = 0; m < count; m++) {
+    const elf_object_t *object = &modules[m].object;
+    for (size_t i = object->local_count; i < object->symbol_count; i++) {
+      const elf_symbol_t *symbol = &object->symbols[i];
+      uint32_t value = symbol->value;
+      if (!symbol->global || symbol->section == ELF_UNDEF ||
+          symbol->section == ELF_OTHER)
+        continue;
+      if (symbol->section != ELF_ABS)
+        value += modules[m].address[symbol->section];
+
+      int index =
+          symtab_add(globals, symbol->name, strlen(symbol->name), value);
+      if (index == SYMTAB_DUPLICATE) {
+        fprintf(err, "Error: %s: multiple definition of '%s'\n",
+                modules[m].path, symbol->name);
+        ok = 0;
+      } else if (index < 0) {
+        fprintf(err, "Error: Out of memory\n");
+        return 0;
+      }
+    }
+  }
+  return ok;
+}
+
+// Report the first error of each module, in input order
+static int report_errors(const link_module_t *modules, int count, FILE *err) {
+  int ok = 1;
+  for (int m = 0; m < count; m++) {
+    if (modules[m].error[0]) {
+      fprintf(err, "Error: %s: %s\n", modules[m].path, modules[m].error);
+      ok = 0;
+    }
+  }
+  return ok;
+}
+
+int link_objects(const char *const *inputs, int count,
+                 const char *output_file, int64_t text_base,
+                 int64_t data_base, const mips_options_t *options) {
+  link_module_t *modules = calloc((size_t)count, sizeof(link_module_t));
+  int threads = options->jobs > 0 ? options->jobs
+                                  : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  threadpool_t *pool = threadpool_create(threads > 0 ? threads : 1);
+  symtab_t globals;
+  uint8_t *image = NULL;
+  int status = 1;
+
+  symtab_init(&globals);
+  if (!modules || !pool) {
+    fprintf(options->err, "Error: Out of memory\n");
+    goto done;
+  }
+  for (int m = 0; m < count; m++) {
+    modules[m].path = inputs[m];
+    arena_init(&modules[m].arena, 0);
+  }
+
+  link_job_t job = {modules, NULL};
+  threadpool_run(pool, load_module, &job, count);
+  if (!report_errors(modules, count, options->err))
+    goto done;
+
+  // Lay the sections out in input order: all .text, then all .data, each
+  // aligned by place_section(). Every relocated field holds a
+  // section-relative addend, so beyond that the objects' own sh_addr only
+  // supplies the default bases.
+  uint32_t text_address = text_base == LINK_BASE_FROM_OBJECT
+                              ? modules[0].object.sections[ELF_TEXT].address
+                              : (uint32_t)text_base;
+  uint32_t data_address = data_base == LINK_BASE_FROM_OBJECT
+                              ? modules[0].object.sections[ELF_DATA].address
+                              : (uint32_t)data_base;
+  uint32_t text_size = 0;
+  uint32_t data_size = 0;
+  for (int m = 0; m < count; m++) {
+    const elf_section_desc_t *sections = modules[m].object.sections;
+    text_size = place_section(text_address + text_size,
+                              &sections[ELF_TEXT]) - text_address;
+    modules[m].address[ELF_TEXT] = text_address + text_size;
+    modules[m].offset[ELF_TEXT] = text_size;
+    text_size += sections[ELF_TEXT].size;
+  }
+  for (int m = 0; m < count; m++) {
+    const elf_section_desc_t *sections = modules[m].object.sections;
+    data_size = place_section(data_address + data_size,
+                              &sections[ELF_DATA]) - data_address;
+    modules[m].address[ELF_DATA] = data_address + data_size;
+    modules[m].offset[ELF_DATA] = text_size + data_size;
+    data_size += sections[ELF_DATA].size;
+  }
+  // .bss follows .data but takes no room in the image
+  uint32_t bss_size = data_size;
+  for (int m = 0; m < count; m++) {
+    const elf_section_desc_t *bss = &modules[m].object.sections[ELF_BSS];
+    bss_size = place_section(data_address + bss_size, bss) - data_address;
+    modules[m].address[ELF_BSS] = data_address + bss_size;
+    bss_size += bss->size;
+  }
+
+  if (!define_globals(modules, count, &globals, options->err))
+    goto done;
+  for (int m = 0; m < count; m++) {
+    if (!resolve_symbols(&modules[m], &globals)) {
+      fprintf(options->err, "Error: Out of memory\n");
+      goto done;
+    }
+  }
+
+  size_t image_size = (size_t)text_size + data_size;
+  image = calloc(image_size ? image_size : 1, 1);
+  if (!image) {
+    fprintf(options->err, "Error: Out of memory\n");
+    goto done;
+  }
+  job.image = image;
+  threadpool_run(pool, relocate_module, &job, count);
+  if (!report_errors(modules, count, options->err))
+    goto done;
+
+  if (!write_binary_file(output_file, image, image_size)) {
+    fprintf(options->err, "Error: Failed to write output file '%s'\n",
+            output_file);
+    goto done;
+  }
+  if (options->verbose) {
+    fprintf(options->out, "Linked %d objects -> %s\n", count, output_file);
+    fprintf(options->out, "Text: 0x%08X (%u bytes), data: 0x%08X (%u bytes)\n",
+            text_address, text_size, data_address, data_size);
+  }
+  status = 0;
+
+done:
+  for (int m = 0; modules && m < count; m++) {
+    if (modules[m].data)
+      munmap(modules[m].data, modules[m].size);
+    arena_free(&modules[m].arena);
+  }
+  free(modules);
+  free(image);
+  symtab_free(&globals);
+  if (pool)
+    threadpool_destroy(pool);
+  return status;
+}
@@ -0,0 +1,19 @@
+#ifndef LINK_H
+#define LINK_H
+
+#include "libmipsasm.h"
+
+// Base address not given on the command line: take the first object's
+#define LINK_BASE_FROM_OBJECT (-1)
+
+// Link relocatable objects into a flat image, the way `mipsasm --link`
+// does: the .text of every object in order at text_base, then their .data
+// at data_base. A base of LINK_BASE_FROM_OBJECT is the sh_addr of the first
+// object's section, which mipsasm --elf sets to the address the source
+// placed it at; objects from other assemblers usually have 0 there, so
+// pass the bases explicitly for them. Returns the process exit code.
+int link_objects(const char *const *inputs, int count,
+                 const char *output_file, int64_t text_base,
+                 int64_t data_base, const mips_options_t *options);
+
+#endif // LINK_H
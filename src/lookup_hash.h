@@ -0,0 +1,31 @@
+#ifndef LOOKUP_HASH_H
+#define LOOKUP_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest mnemonic or register name held in a perfect-hash slot
+#define LOOKUP_MAX_NAME 8
+
+// Slot of a perfect-hash table generated by tools/gen_lookup.c. The full
+// hash is stored so a miss is almost always rejected without comparing
+// names.
+typedef struct {
+  char name[LOOKUP_MAX_NAME];
+  uint8_t len; // 0 marks an empty slot
+  uint8_t value;
+  uint32_t hash;
+} lookup_slot_t;
+
+// Seeded FNV-1a hash shared by the table generator and the runtime lookup
+static inline uint32_t lookup_hash(const char *str, size_t len,
+                                   uint32_t seed) {
+  uint32_t hash = 2166136261u ^ seed;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)str[i];
+    hash *= 16777619u;
+  }
+  return hash ^ (hash >> 15);
+}
+
+#endif // LOOKUP_HASH_H
@@ -1,121 +1,991 @@
+#define _XOPEN_SOURCE 700
+
+#include "build_id.h"
+#include "cache.h"
+#include "link.h"
 #include "mipsasm.h"
+#include "server.h"
+#include "threadpool.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #define VERSION "1.0.0"
 
+// Report printed by --stats after each file
+typedef enum { STATS_NONE, STATS_HUMAN, STATS_JSON } stats_format_t;
+
+static stats_format_t stats_format = STATS_NONE;
+
+// Names of the peephole rules in --stats, by MIPS_PEEPHOLE_*
+static const char *const peephole_rules[MIPS_PEEPHOLE_RULES] = {
+    "li", "la", "la_mem", "move"};
+
 void print_usage(const char *prog_name) {
   printf("MIPS Assembler v%s\n", VERSION);
   printf("Usage: %s [options] input_file [output_file]\n", prog_name);
+  printf("       %s [options] -m input_file... [@response_file...]\n",
+         prog_name);
+  printf("       %s [options] --link object_file... [-o output_file]\n",
+         prog_name);
+  printf("Use '-' as input_file to assemble from standard input in a single "
+         "pass\n");
+  printf("Use '-' as output_file to write the binary to standard output\n");
   printf("Options:\n");
+  printf("  --cache <dir>      Reuse results stored in a cache directory\n");
+  printf("  --cache-size <MiB> Size limit of the cache (default: 256)\n");
+  printf("  --connect <socket> Assemble through a running server\n");
+  printf("  --elf              Write an ELF32 big-endian relocatable "
+         "object\n");
   printf("  -h, --help         Show this help message\n");
+  printf("  -j <n>             Use n threads (default: number of CPUs)\n");
+  printf("  --link             Link --elf objects into a flat binary\n");
+  printf("  --text-base <addr> Link .text at addr (default: the first "
+         "object's)\n");
+  printf("  --data-base <addr> Link .data at addr (default: the first "
+         "object's)\n");
+  printf("  -m, --multi        Assemble every input_file to its own .bin (.o "
+         "with --elf)\n");
   printf("  -o <file>          Specify output file\n");
+  printf("  -O                 Shorten li/la/move and fold la into loads "
+         "and stores\n");
+  printf("  --schedule         Reorder basic blocks to hide load and "
+         "HI/LO latency\n");
+  printf("  --server <socket>  Serve assembly requests on a Unix socket\n");
+  printf("  --stats[=json]     Print phase times and counters of each file\n");
+  printf("  --trace <list>     Verbose output limited to some events: "
+         "labels,\n");
+  printf("                     sections, directives, symbols (implies -v)\n");
   printf("  -v, --verbose      Enable verbose output\n");
+  printf("A response file lists one 'input_file [output_file]' per line and "
+         "implies -m\n");
+  printf("MIPSASM_SERVER names a server socket to use when it is running\n");
+  printf("MIPSASM_CACHE names a cache directory to use by default\n");
 }
 
-int main(int argc, char *argv[]) {
-  char *input_file = NULL;
-  char *output_file = NULL;
-  int verbose = 0;
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
 
-  // Parse command line arguments
-  for (int i = 1; i < argc; i++) {
-    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-      print_usage(argv[0]);
-      return 0;
-    } else if (strcmp(argv[i], "-v") == 0 ||
-               strcmp(argv[i], "--verbose") == 0) {
-      verbose = 1;
-    } else if (strcmp(argv[i], "-o") == 0) {
-      if (i + 1 < argc) {
-        output_file = argv[++i];
-      } else {
-        fprintf(stderr, "Error: -o option requires an argument\n");
-        return 1;
-      }
-    } else if (input_file == NULL) {
-      input_file = argv[i];
-    } else if (output_file == NULL) {
-      output_file = argv[i];
+// Print the --stats report of one file
+static void print_stats(FILE *out, const char *input_file, double read_ms,
+                        double write_ms, const mips_stats_t *stats) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  if (stats_format == STATS_JSON) {
+    fprintf(out,
+            "{\"file\": \"%s\", \"read_ms\": %.3f, \"pass1_ms\": %.3f, "
+            "\"pass2_ms\": %.3f, \"write_ms\": %.3f, \"lines\": %llu, "
+            "\"statements\": %llu, \"instructions\": %llu, "
+            "\"pseudo_expansions\": %llu, \"pseudo_words\": %llu, "
+            "\"labels\": %llu, \"label_lookups\": %llu, "
+            "\"hash_probes\": %llu, \"text_bytes\": %llu, "
+            "\"data_bytes\": %llu, \"memory_bytes\": %llu, "
+            "\"peak_rss_kb\": %ld, \"mnemonics\": {",
+            input_file, read_ms, stats->pass1_ms, stats->pass2_ms, write_ms,
+            (unsigned long long)stats->lines,
+            (unsigned long long)stats->statements,
+            (unsigned long long)stats->instructions,
+            (unsigned long long)stats->pseudo_expansions,
+            (unsigned long long)stats->pseudo_words,
+            (unsigned long long)stats->labels,
+            (unsigned long long)stats->label_lookups,
+            (unsigned long long)stats->hash_probes,
+            (unsigned long long)stats->text_bytes,
+            (unsigned long long)stats->data_bytes,
+            (unsigned long long)stats->memory_bytes, usage.ru_maxrss);
+    for (int i = 0; i < stats->mnemonic_count; i++) {
+      fprintf(out, "%s\"%s\": %llu", i ? ", " : "",
+              stats->mnemonics[i].mnemonic,
+              (unsigned long long)stats->mnemonics[i].count);
     }
+    fprintf(out, "}, \"peephole\": {");
+    for (int r = 0; r < MIPS_PEEPHOLE_RULES; r++) {
+      fprintf(out, "%s\"%s\": %llu", r ? ", " : "", peephole_rules[r],
+              (unsigned long long)stats->peephole[r]);
+    }
+    fprintf(out,
+            "}, \"delay_slots\": %llu, \"slots_filled\": %llu, "
+            "\"stalls_before\": %llu, \"stalls_after\": %llu, "
+            "\"interlocks\": %llu, \"branches_relaxed\": %llu}\n",
+            (unsigned long long)stats->delay_slots,
+            (unsigned long long)stats->slots_filled,
+            (unsigned long long)stats->stalls_before,
+            (unsigned long long)stats->stalls_after,
+            (unsigned long long)stats->interlocks,
+            (unsigned long long)stats->branches_relaxed);
+    return;
   }
 
-  if (input_file == NULL) {
-    print_usage(argv[0]);
+  fprintf(out, "Statistics for %s:\n", input_file);
+  fprintf(out, "  Read:          %10.3f ms\n", read_ms);
+  fprintf(out, "  Pass 1:        %10.3f ms\n", stats->pass1_ms);
+  fprintf(out, "  Pass 2:        %10.3f ms\n", stats->pass2_ms);
+  fprintf(out, "  Write:         %10.3f ms\n", write_ms);
+  fprintf(out, "  Lines:         %10llu\n", (unsigned long long)stats->lines);
+  fprintf(out, "  Statements:    %10llu\n",
+          (unsigned long long)stats->statements);
+  fprintf(out, "  Instructions:  %10llu (%llu pseudo, expanded to %llu "
+               "words)\n",
+          (unsigned long long)stats->instructions,
+          (unsigned long long)stats->pseudo_expansions,
+          (unsigned long long)stats->pseudo_words);
+  fprintf(out, "  Labels:        %10llu\n", (unsigned long long)stats->labels);
+  fprintf(out, "  Label lookups: %10llu (%llu hash probes)\n",
+          (unsigned long long)stats->label_lookups,
+          (unsigned long long)stats->hash_probes);
+  fprintf(out, "  Text section:  %10llu bytes\n",
+          (unsigned long long)stats->text_bytes);
+  fprintf(out, "  Data section:  %10llu bytes\n",
+          (unsigned long long)stats->data_bytes);
+  fprintf(out, "  Heap:          %10llu bytes\n",
+          (unsigned long long)stats->memory_bytes);
+  fprintf(out, "  Peak RSS:      %10ld KiB\n", usage.ru_maxrss);
+  if (stats->delay_slots > 0) {
+    fprintf(out, "  Delay slots:   %10llu (%llu filled)\n",
+            (unsigned long long)stats->delay_slots,
+            (unsigned long long)stats->slots_filled);
+  }
+  if (stats->stalls_before > 0 || stats->interlocks > 0) {
+    fprintf(out, "  Stalls:        %10llu -> %llu (%llu interlock nops)\n",
+            (unsigned long long)stats->stalls_before,
+            (unsigned long long)stats->stalls_after,
+            (unsigned long long)stats->interlocks);
+  }
+  if (stats->branches_relaxed > 0) {
+    fprintf(out, "  Far branches:  %10llu\n",
+            (unsigned long long)stats->branches_relaxed);
+  }
+  uint64_t hits = 0;
+  for (int r = 0; r < MIPS_PEEPHOLE_RULES; r++)
+    hits += stats->peephole[r];
+  if (hits > 0) {
+    fprintf(out, "  Peephole:\n");
+    for (int r = 0; r < MIPS_PEEPHOLE_RULES; r++) {
+      fprintf(out, "    %-8s %10llu\n", peephole_rules[r],
+              (unsigned long long)stats->peephole[r]);
+    }
+  }
+  if (stats->mnemonic_count > 0) {
+    fprintf(out, "  Mnemonics:\n");
+    for (int i = 0; i < stats->mnemonic_count; i++) {
+      fprintf(out, "    %-8s %10llu\n", stats->mnemonics[i].mnemonic,
+              (unsigned long long)stats->mnemonics[i].count);
+    }
+  }
+}
+
+// Parse the comma-separated event categories of --trace; returns 0 for an
+// unknown name
+static unsigned parse_trace(const char *list) {
+  static const struct {
+    const char *name;
+    unsigned mask;
+  } categories[] = {{"labels", MIPS_TRACE_LABELS},
+                    {"sections", MIPS_TRACE_SECTIONS},
+                    {"directives", MIPS_TRACE_DIRECTIVES},
+                    {"symbols", MIPS_TRACE_SYMBOLS},
+                    {"all", MIPS_TRACE_ALL}};
+  unsigned mask = 0;
+
+  while (*list) {
+    size_t len = strcspn(list, ",");
+    size_t i = 0;
+    while (i < sizeof(categories) / sizeof(categories[0]) &&
+           (strlen(categories[i].name) != len ||
+            strncmp(categories[i].name, list, len) != 0)) {
+      i++;
+    }
+    if (i == sizeof(categories) / sizeof(categories[0]))
+      return 0;
+    mask |= categories[i].mask;
+    list += len;
+    if (*list == ',')
+      list++;
+  }
+  return mask;
+}
+
+// Parse the address of --text-base or --data-base (decimal, or hex with
+// 0x); returns -1 unless it is a word-aligned 32-bit address
+static int64_t parse_address(const char *text) {
+  char *end;
+  errno = 0;
+  unsigned long long address = strtoull(text, &end, 0);
+  if (errno != 0 || end == text || *end != '\0' || text[0] == '-' ||
+      address > UINT32_MAX || address % 4 != 0) {
+    return -1;
+  }
+  return (int64_t)address;
+}
+
+// Write the assembled image and release it; returns the process exit code
+static int write_output(const char *input_file, const char *output_file,
+                        uint8_t *output_data, size_t output_size,
+                        const mips_options_t *options) {
+  if (!write_binary_file(output_file, output_data, output_size)) {
+    fprintf(options->err, "Error: Failed to write output file '%s'\n",
+            output_file);
+    free(output_data);
     return 1;
   }
 
-  // Use default output file name if not specified
-  if (output_file == NULL) {
-    output_file = "output.bin";
+  if (options->verbose) {
+    fprintf(options->out, "Assembly complete: %s -> %s\n", input_file,
+            output_file);
+    fprintf(options->out, "Output size: %zu bytes (%zu instructions)\n",
+            output_size, output_size / 4);
   }
 
-  // Assemble source file
+  free(output_data);
+
+  return 0;
+}
+
+// Open an output file, or standard output for "-"
+static int open_output(const char *output_file) {
+  if (strcmp(output_file, "-") == 0) {
+    fflush(stdout);
+    return STDOUT_FILENO;
+  }
+  return open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
 
-  // Read input file
-  FILE *input = fopen(input_file, "r");
-  if (!input) {
-    fprintf(stderr, "Error: Failed to open input file '%s'\n", input_file);
+// Assemble a source into a relocatable object file and print the --stats
+// report when stats are collected; returns the process exit code
+static int assemble_object(const char *input_file, const char *output_file,
+                           const char *source, size_t source_len,
+                           const mips_options_t *options, double read_ms) {
+  mips_assembler_t *as = mips_assembler_create(options);
+  uint8_t *image = NULL;
+  size_t size = 0;
+
+  if (!as) {
+    fprintf(options->err, "Error: Out of memory\n");
+    return 1;
+  }
+
+  // Size the image first, then encode it into a buffer of exactly that size
+  int result = mips_assembler_assemble(as, source, source_len, NULL, 0, &size);
+  if (result == MIPS_ASM_NOSPACE) {
+    image = malloc(size ? size : 1);
+    result = image ? mips_assembler_encode(as, image, size, &size)
+                   : MIPS_ASM_ERROR;
+  }
+  if (result != MIPS_ASM_OK) {
+    fprintf(options->err, "Error: Assembly failed\n");
+    mips_assembler_destroy(as);
+    free(image);
     return 1;
   }
 
-  // Get file size
-  fseek(input, 0, SEEK_END);
-  long input_size = ftell(input);
-  fseek(input, 0, SEEK_SET);
+  double start = now_ms();
+  int fd = open_output(output_file);
+  int ok = fd >= 0 && mips_assembler_write_elf(as, image, fd);
+  if (fd > STDOUT_FILENO && close(fd) != 0)
+    ok = 0;
+  mips_assembler_destroy(as);
+  free(image);
 
-  if (input_size <= 0 || input_size > MAX_ASM_SIZE) {
-    fprintf(stderr, "Error: Input file too large or empty\n");
-    fclose(input);
+  if (!ok) {
+    fprintf(options->err, "Error: Failed to write output file '%s'\n",
+            output_file);
     return 1;
   }
 
-  // Read source code
-  char *source_code = malloc(input_size + 1);
-  if (!source_code) {
-    fprintf(stderr, "Error: Memory allocation failed\n");
-    fclose(input);
+  if (options->verbose) {
+    fprintf(options->out, "Assembly complete: %s -> %s\n", input_file,
+            output_file);
+  }
+  if (options->stats)
+    print_stats(options->err, input_file, read_ms, now_ms() - start,
+                options->stats);
+  return 0;
+}
+
+// Read a whole stream into a malloc()ed buffer
+static int read_stream(FILE *file, char **text, size_t *size) {
+  FILE *buffer = open_memstream(text, size);
+  char chunk[65536];
+  size_t got;
+
+  if (!buffer)
+    return 0;
+  while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    fwrite(chunk, 1, got, buffer);
+  if (fclose(buffer) != 0 || ferror(file)) {
+    free(*text);
+    *text = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+// Where files are assembled: through a server when one is set, otherwise
+// locally, going through the result cache when one is set
+typedef struct {
+  const char *server;   // Server socket, or NULL
+  int server_optional;  // Assemble locally when the server is unreachable
+  const cache_t *cache; // Result cache, or NULL
+} backend_t;
+
+// Assemble through a server; returns the process exit code, or -1 when the
+// server cannot be reached and the caller should assemble locally
+static int assemble_remote(const backend_t *backend, const char *input_file,
+                           const char *output_file,
+                           const mips_options_t *options) {
+  int fd = server_connect(backend->server);
+  if (fd < 0) {
+    if (backend->server_optional)
+      return -1;
+    fprintf(options->err, "Error: Cannot connect to server '%s'\n",
+            backend->server);
     return 1;
   }
 
-  size_t bytes_read = fread(source_code, 1, input_size, input);
-  fclose(input);
+  // Files are read by the server itself; standard input is sent as source
+  uint32_t flags = options->verbose ? SERVER_FLAG_VERBOSE : 0;
+  if (options->optimize)
+    flags |= SERVER_FLAG_OPTIMIZE;
+  if (options->schedule)
+    flags |= SERVER_FLAG_SCHEDULE;
+  char *payload = NULL;
+  size_t length = 0;
+  if (strcmp(input_file, "-") == 0) {
+    if (!read_stream(stdin, &payload, &length)) {
+      fprintf(options->err, "Error: Failed to read input\n");
+      close(fd);
+      return 1;
+    }
+  } else {
+    payload = realpath(input_file, NULL);
+    if (!payload) {
+      fprintf(options->err, "Error: Failed to open input file '%s'\n",
+              input_file);
+      close(fd);
+      return 1;
+    }
+    flags |= SERVER_FLAG_PATH;
+    length = strlen(payload);
+  }
+
+  server_result_t result;
+  int ok = server_call(fd, flags, payload, length, &result);
+  close(fd);
+  free(payload);
+  if (ok == SERVER_MISMATCH) {
+    if (result.version) {
+      fprintf(options->err,
+              "Error: Server '%s' speaks protocol version %u, not %u\n",
+              backend->server, result.version, SERVER_VERSION);
+    } else {
+      fprintf(options->err,
+              "Error: Server '%s' speaks another protocol version\n",
+              backend->server);
+    }
+    return 1;
+  }
+  if (!ok) {
+    fprintf(options->err, "Error: Lost connection to server '%s'\n",
+            backend->server);
+    return 1;
+  }
 
-  if (bytes_read != (size_t)input_size) {
-    fprintf(stderr, "Error: Failed to read input file\n");
-    free(source_code);
+  fwrite(result.out, 1, result.out_len, options->out);
+  fwrite(result.err, 1, result.err_len, options->err);
+  if (!result.status) {
+    server_result_free(&result);
     return 1;
   }
 
-  source_code[input_size] = '\0';
+  // write_output() takes ownership of the image
+  uint8_t *image = result.image;
+  size_t image_len = result.image_len;
+  result.image = NULL;
+  server_result_free(&result);
+  return write_output(input_file, output_file, image, image_len, options);
+}
 
-  // Assemble source code
+// Diagnostic callback: capture messages into a pair of memory streams
+static void capture_message(void *arg, mips_diag_kind_t kind,
+                            const char *message) {
+  FILE **streams = arg;
+  fprintf(streams[kind == MIPS_DIAG_INFO ? 0 : 1], "%s\n", message);
+}
+
+// Assemble a source through the result cache: a hit replays the stored
+// messages and image without assembling, a miss assembles and stores the
+// result. Returns the process exit code, or -1 if the messages could not be
+// captured and the caller should assemble without the cache.
+static int assemble_cached(const cache_t *cache, const char *input_file,
+                           const char *output_file, const char *source,
+                           size_t source_len, const mips_options_t *options) {
+  uint32_t flags = options->verbose ? 1 | options->trace << 1 : 0;
+  if (options->optimize)
+    flags |= 1u << 5; // Above the trace categories
+  if (options->schedule)
+    flags |= 1u << 6;
+  cache_key_t key = cache_key(BUILD_ID, flags, source, source_len);
+  cache_entry_t entry;
+
+  if (!cache_lookup(cache, key, &entry)) {
+    FILE *streams[2];
+    streams[0] = open_memstream(&entry.out, &entry.out_len);
+    streams[1] = open_memstream(&entry.err, &entry.err_len);
+    if (!streams[0] || !streams[1]) {
+      if (streams[0])
+        fclose(streams[0]);
+      if (streams[1])
+        fclose(streams[1]);
+      cache_entry_free(&entry);
+      return -1;
+    }
+
+    mips_options_t capture = *options;
+    capture.diag = capture_message;
+    capture.diag_arg = streams;
+    entry.status = mips_assemble(source, source_len, &entry.image,
+                                 &entry.image_len, &capture);
+    fclose(streams[0]);
+    fclose(streams[1]);
+    cache_store(cache, key, &entry);
+  }
+
+  fwrite(entry.out, 1, entry.out_len, options->out);
+  fwrite(entry.err, 1, entry.err_len, options->err);
+  if (!entry.status) {
+    fprintf(options->err, "Error: Assembly failed\n");
+    cache_entry_free(&entry);
+    return 1;
+  }
+
+  // write_output() takes ownership of the image
+  uint8_t *image = entry.image;
+  size_t image_len = entry.image_len;
+  entry.image = NULL;
+  cache_entry_free(&entry);
+  return write_output(input_file, output_file, image, image_len, options);
+}
+
+// Assemble one input file into one output file; returns the process exit
+// code
+static int assemble_file(const char *input_file, const char *output_file,
+                         const mips_options_t *options,
+                         const backend_t *backend) {
+  FILE *err = options->err;
   uint8_t *output_data;
   size_t output_size;
+  mips_stats_t stats;
+  mips_options_t local = *options;
+
+  // Statistics describe a local run, so they bypass the server and cache.
+  // Objects are written from the assembler's state, which only exists in a
+  // local run too.
+  static const backend_t local_backend = {NULL, 0, NULL};
+  if (stats_format != STATS_NONE && strcmp(input_file, "-") != 0) {
+    local.stats = &stats;
+    backend = &local_backend;
+  }
+  if (options->format == MIPS_FORMAT_ELF)
+    backend = &local_backend;
+  double start = now_ms();
+
+  // Requests carry the verbose flag but not the trace categories
+  if (backend->server && !options->trace) {
+    int status = assemble_remote(backend, input_file, output_file, options);
+    if (status >= 0)
+      return status;
+  }
+
+  if (strcmp(input_file, "-") == 0 && options->format == MIPS_FORMAT_ELF) {
+    // An object needs the whole source, so standard input is read up front
+    char *source = NULL;
+    size_t source_len = 0;
+    if (!read_stream(stdin, &source, &source_len)) {
+      fprintf(err, "Error: Failed to read input\n");
+      return 1;
+    }
+    int status = assemble_object(input_file, output_file, source, source_len,
+                                 options, 0);
+    free(source);
+    return status;
+  }
 
-  if (!mips_assemble(source_code, &output_data, &output_size, verbose)) {
-    fprintf(stderr, "Error: Assembly failed\n");
-    free(source_code);
+  if (strcmp(input_file, "-") == 0) {
+    // Streamed input: encode as lines arrive and backpatch forward references.
+    // The peephole pass and the scheduler need the whole source.
+    if (options->optimize || options->schedule) {
+      fprintf(err, "Error: %s cannot be used with streamed input\n",
+              options->optimize ? "-O" : "--schedule");
+      return 1;
+    }
+    if (!mips_assemble_stream(stdin, &output_data, &output_size, options)) {
+      fprintf(err, "Error: Assembly failed\n");
+      return 1;
+    }
+    return write_output(input_file, output_file, output_data, output_size,
+                        options);
+  }
+
+  // Map input file
+  int input_fd = open(input_file, O_RDONLY);
+  if (input_fd < 0) {
+    fprintf(err, "Error: Failed to open input file '%s'\n", input_file);
     return 1;
   }
 
-  free(source_code);
+  struct stat input_stat;
+  if (fstat(input_fd, &input_stat) != 0) {
+    fprintf(err, "Error: Failed to stat input file '%s'\n", input_file);
+    close(input_fd);
+    return 1;
+  }
 
-  // Write output to binary file
-  if (!write_binary_file(output_file, output_data, output_size)) {
-    fprintf(stderr, "Error: Failed to write output file '%s'\n", output_file);
-    free(output_data);
+  if (input_stat.st_size <= 0) {
+    fprintf(err, "Error: Input file is empty\n");
+    close(input_fd);
     return 1;
   }
 
-  if (verbose) {
-    printf("Assembly complete: %s -> %s\n", input_file, output_file);
-    printf("Output size: %zu bytes (%zu instructions)\n", output_size,
-           output_size / 4);
+  size_t input_size = (size_t)input_stat.st_size;
+  void *source_code =
+      mmap(NULL, input_size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+  close(input_fd);
+
+  if (source_code == MAP_FAILED) {
+    fprintf(err, "Error: Failed to map input file '%s'\n", input_file);
+    return 1;
   }
+  posix_madvise(source_code, input_size, POSIX_MADV_SEQUENTIAL);
 
-  free(output_data);
+  if (backend->cache) {
+    int status = assemble_cached(backend->cache, input_file, output_file,
+                                 source_code, input_size, options);
+    if (status >= 0) {
+      munmap(source_code, input_size);
+      return status;
+    }
+  }
 
-  return 0;
+  // Assemble source code
+  double read_ms = now_ms() - start;
+  if (options->format == MIPS_FORMAT_ELF) {
+    int status = assemble_object(input_file, output_file, source_code,
+                                 input_size, &local, read_ms);
+    munmap(source_code, input_size);
+    return status;
+  }
+
+  if (!mips_assemble(source_code, input_size, &output_data, &output_size,
+                     &local)) {
+    fprintf(err, "Error: Assembly failed\n");
+    munmap(source_code, input_size);
+    return 1;
+  }
+
+  munmap(source_code, input_size);
+
+  start = now_ms();
+  int status = write_output(input_file, output_file, output_data, output_size,
+                            options);
+  if (status == 0 && local.stats)
+    print_stats(err, input_file, read_ms, now_ms() - start, &stats);
+  return status;
+}
+
+// One input of a multi-file run. Output and diagnostics are captured so they
+// can be printed in input order once every job has finished.
+typedef struct {
+  const char *input_file;
+  char *output_file;
+  char *out_log;
+  size_t out_len;
+  char *err_log;
+  size_t err_len;
+  int status;
+} file_job_t;
+
+typedef struct {
+  file_job_t *jobs;
+  const mips_options_t *options;
+  const backend_t *backend;
+} file_batch_t;
+
+// Thread pool task: assemble one file with its own context and logs
+static void run_file_job(void *arg, int index) {
+  file_batch_t *batch = arg;
+  file_job_t *job = &batch->jobs[index];
+  mips_options_t options = *batch->options;
+
+  options.jobs = 1; // Parallelism comes from running files side by side
+  options.out = open_memstream(&job->out_log, &job->out_len);
+  options.err = open_memstream(&job->err_log, &job->err_len);
+  if (!options.out || !options.err) {
+    job->status = 1;
+  } else {
+    job->status = assemble_file(job->input_file, job->output_file, &options,
+                                batch->backend);
+  }
+
+  if (options.out)
+    fclose(options.out);
+  if (options.err)
+    fclose(options.err);
+}
+
+// Derive an output name by replacing the input's extension with extension
+static char *default_output_name(const char *input_file,
+                                 const char *extension) {
+  const char *slash = strrchr(input_file, '/');
+  const char *dot = strrchr(input_file, '.');
+  size_t stem = strlen(input_file);
+  if (dot && (!slash || dot > slash + 1))
+    stem = dot - input_file;
+
+  char *name = malloc(stem + strlen(extension) + 1);
+  if (name) {
+    memcpy(name, input_file, stem);
+    strcpy(name + stem, extension);
+  }
+  return name;
+}
+
+// Output extension of the selected format
+static const char *output_extension(const mips_options_t *options) {
+  return (options->format == MIPS_FORMAT_ELF) ? ".o" : ".bin";
+}
+
+// Append an input (and optional output) to the job list
+static int add_file_job(file_job_t **jobs, size_t *count, size_t *capacity,
+                        const char *input_file, const char *output_file,
+                        const char *extension) {
+  if (*count == *capacity) {
+    size_t grown = *capacity ? *capacity * 2 : 16;
+    file_job_t *resized = realloc(*jobs, grown * sizeof(**jobs));
+    if (!resized)
+      return 0;
+    *jobs = resized;
+    *capacity = grown;
+  }
+
+  file_job_t *job = &(*jobs)[(*count)++];
+  memset(job, 0, sizeof(*job));
+  job->input_file = input_file;
+  job->output_file = output_file
+                         ? strdup(output_file)
+                         : default_output_name(input_file, extension);
+  return job->output_file != NULL;
+}
+
+// Read a response file: one "input_file [output_file]" per line. Blank lines
+// and lines starting with '#' are skipped. The returned buffer owns the file
+// names and must outlive the jobs.
+static char *read_response_file(const char *path, file_job_t **jobs,
+                                size_t *count, size_t *capacity,
+                                const char *extension) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "Error: Failed to open response file '%s'\n", path);
+    return NULL;
+  }
+
+  char *text = NULL;
+  size_t size = 0;
+  int ok = read_stream(file, &text, &size);
+  fclose(file);
+  if (!ok) {
+    fprintf(stderr, "Error: Failed to read response file '%s'\n", path);
+    return NULL;
+  }
+
+  char *saveptr = NULL;
+  for (char *line = strtok_r(text, "\n", &saveptr); line;
+       line = strtok_r(NULL, "\n", &saveptr)) {
+    char *field_save = NULL;
+    char *input_file = strtok_r(line, " \t\r", &field_save);
+    if (!input_file || input_file[0] == '#')
+      continue;
+
+    char *output_file = strtok_r(NULL, " \t\r", &field_save);
+    if (!add_file_job(jobs, count, capacity, input_file, output_file,
+                      extension)) {
+      fprintf(stderr, "Error: Out of memory\n");
+      free(text);
+      return NULL;
+    }
+  }
+  return text;
+}
+
+// Assemble every job on a thread pool and print their logs in input order;
+// returns the process exit code
+static int run_file_jobs(file_job_t *jobs, size_t count,
+                         const mips_options_t *options,
+                         const backend_t *backend) {
+  int threads = options->jobs > 0 ? options->jobs
+                                  : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1)
+    threads = 1;
+  if ((size_t)threads > count)
+    threads = (int)count;
+
+  threadpool_t *pool = threadpool_create(threads);
+  if (!pool) {
+    fprintf(stderr, "Error: Failed to start worker threads\n");
+    return 1;
+  }
+
+  file_batch_t batch = {jobs, options, backend};
+  threadpool_run(pool, run_file_job, &batch, (int)count);
+  threadpool_destroy(pool);
+
+  int status = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (jobs[i].out_log)
+      fwrite(jobs[i].out_log, 1, jobs[i].out_len, stdout);
+    if (jobs[i].err_log)
+      fwrite(jobs[i].err_log, 1, jobs[i].err_len, stderr);
+    if (jobs[i].status != 0) {
+      if (!jobs[i].err_log && !jobs[i].out_log)
+        fprintf(stderr, "Error: Out of memory assembling '%s'\n",
+                jobs[i].input_file);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+int main(int argc, char *argv[]) {
+  char *input_file = NULL;
+  char *output_file = NULL;
+  mips_options_t options = {0};
+  int multi = 0;
+  int link = 0;
+  file_job_t *jobs = NULL;
+  size_t job_count = 0;
+  size_t job_capacity = 0;
+  char **responses = calloc((size_t)argc, sizeof(char *));
+  int response_count = 0;
+  const char **objects = calloc((size_t)argc, sizeof(char *));
+  int object_count = 0;
+  const char *server_socket = NULL;
+  backend_t backend = {getenv("MIPSASM_SERVER"), 1, NULL};
+  const char *cache_dir = getenv("MIPSASM_CACHE");
+  uint64_t cache_size = CACHE_DEFAULT_SIZE;
+  cache_t cache = {NULL, 0};
+  int64_t link_base[2] = {LINK_BASE_FROM_OBJECT, LINK_BASE_FROM_OBJECT};
+  int status = 1;
+
+  options.out = stdout;
+  options.err = stderr;
+  if (!responses || !objects) {
+    fprintf(stderr, "Error: Out of memory\n");
+    free(responses);
+    free(objects);
+    return 1;
+  }
+
+  // Inputs are collected in command line order, so -m may appear anywhere
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "-o") == 0 ||
+        strcmp(argv[i], "--server") == 0 ||
+        strcmp(argv[i], "--connect") == 0 ||
+        strcmp(argv[i], "--cache") == 0 ||
+        strcmp(argv[i], "--cache-size") == 0 ||
+        strcmp(argv[i], "--trace") == 0 ||
+        strcmp(argv[i], "--text-base") == 0 ||
+        strcmp(argv[i], "--data-base") == 0)
+      i++;
+    else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--multi") == 0 ||
+             (argv[i][0] == '@' && argv[i][1] != '\0'))
+      multi = 1;
+    else if (strcmp(argv[i], "--elf") == 0)
+      options.format = MIPS_FORMAT_ELF;
+    else if (strcmp(argv[i], "--link") == 0)
+      link = 1;
+  }
+
+  // Parse command line arguments
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      print_usage(argv[0]);
+      status = 0;
+      goto done;
+    } else if (strcmp(argv[i], "-v") == 0 ||
+               strcmp(argv[i], "--verbose") == 0) {
+      options.verbose = 1;
+    } else if (strcmp(argv[i], "-O") == 0) {
+      options.optimize = 1;
+    } else if (strcmp(argv[i], "--schedule") == 0) {
+      options.schedule = 1;
+    } else if (strcmp(argv[i], "-m") == 0 ||
+               strcmp(argv[i], "--multi") == 0 ||
+               strcmp(argv[i], "--elf") == 0 ||
+               strcmp(argv[i], "--link") == 0) {
+      continue;
+    } else if (strcmp(argv[i], "--trace") == 0) {
+      if (i + 1 < argc && (options.trace = parse_trace(argv[i + 1])) != 0) {
+        options.verbose = 1;
+        i++;
+      } else {
+        fprintf(stderr, "Error: --trace option requires a list of labels, "
+                        "sections, directives or symbols\n");
+        goto done;
+      }
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats_format = STATS_HUMAN;
+    } else if (strcmp(argv[i], "--stats=json") == 0) {
+      stats_format = STATS_JSON;
+    } else if (strcmp(argv[i], "-j") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        options.jobs = atoi(argv[++i]);
+      } else {
+        fprintf(stderr, "Error: -j option requires a positive thread count\n");
+        goto done;
+      }
+    } else if (strcmp(argv[i], "--cache") == 0) {
+      if (i + 1 < argc) {
+        cache_dir = argv[++i];
+      } else {
+        fprintf(stderr, "Error: --cache option requires a directory\n");
+        goto done;
+      }
+    } else if (strcmp(argv[i], "--cache-size") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        cache_size = (uint64_t)atoi(argv[++i]) * 1024 * 1024;
+      } else {
+        fprintf(stderr, "Error: --cache-size option requires a size in MiB\n");
+        goto done;
+      }
+    } else if (strcmp(argv[i], "--text-base") == 0 ||
+               strcmp(argv[i], "--data-base") == 0) {
+      int64_t *base = &link_base[argv[i][2] == 'd'];
+      if (i + 1 >= argc || (*base = parse_address(argv[i + 1])) < 0) {
+        fprintf(stderr, "Error: %s option requires a word-aligned 32-bit "
+                        "address\n", argv[i]);
+        goto done;
+      }
+      i++;
+    } else if (strcmp(argv[i], "--server") == 0 ||
+               strcmp(argv[i], "--connect") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: %s option requires a socket path\n", argv[i]);
+        goto done;
+      }
+      if (strcmp(argv[i], "--server") == 0) {
+        server_socket = argv[++i];
+      } else {
+        backend.server = argv[++i];
+        backend.server_optional = 0;
+      }
+    } else if (strcmp(argv[i], "-o") == 0) {
+      if (multi) {
+        fprintf(stderr, "Error: -o cannot be used with multiple inputs\n");
+        goto done;
+      } else if (i + 1 < argc) {
+        output_file = argv[++i];
+      } else {
+        fprintf(stderr, "Error: -o option requires an argument\n");
+        goto done;
+      }
+    } else if (link) {
+      objects[object_count++] = argv[i];
+    } else if (multi && argv[i][0] == '@' && argv[i][1] != '\0') {
+      responses[response_count] =
+          read_response_file(argv[i] + 1, &jobs, &job_count, &job_capacity,
+                             output_extension(&options));
+      if (!responses[response_count++])
+        goto done;
+    } else if (multi) {
+      if (!add_file_job(&jobs, &job_count, &job_capacity, argv[i], NULL,
+                        output_extension(&options))) {
+        fprintf(stderr, "Error: Out of memory\n");
+        goto done;
+      }
+    } else if (input_file == NULL) {
+      input_file = argv[i];
+    } else if (output_file == NULL) {
+      output_file = argv[i];
+    }
+  }
+
+  if (server_socket) {
+    // Runs until stopped by a signal
+    int threads = options.jobs > 0 ? options.jobs
+                                   : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    server_run(server_socket, threads > 0 ? threads : 1);
+    goto done;
+  }
+
+  if (cache_dir && *cache_dir) {
+    if (!cache_init(&cache, cache_dir, cache_size)) {
+      fprintf(stderr, "Error: Cannot use cache directory '%s'\n", cache_dir);
+      goto done;
+    }
+    backend.cache = &cache;
+  }
+
+  if (link) {
+    if (multi || object_count == 0) {
+      print_usage(argv[0]);
+      goto done;
+    }
+    status = link_objects(objects, object_count,
+                          output_file ? output_file : "output.bin",
+                          link_base[0], link_base[1], &options);
+    goto done;
+  }
+
+  if (multi) {
+    if (job_count == 0) {
+      print_usage(argv[0]);
+      goto done;
+    }
+    for (size_t i = 0; i < job_count; i++) {
+      if (strcmp(jobs[i].input_file, "-") == 0) {
+        fprintf(stderr, "Error: Standard input cannot be used with -m\n");
+        goto done;
+      }
+    }
+
+    status = run_file_jobs(jobs, job_count, &options, &backend);
+    goto done;
+  }
+
+  if (input_file == NULL) {
+    print_usage(argv[0]);
+    goto done;
+  }
+
+  // Use default output file name if not specified
+  if (output_file == NULL) {
+    output_file = (options.format == MIPS_FORMAT_ELF) ? "output.o"
+                                                      : "output.bin";
+  }
+
+  status = assemble_file(input_file, output_file, &options, &backend);
+
+done:
+  cache_free(&cache);
+  for (size_t i = 0; i < job_count; i++) {
+    free(jobs[i].output_file);
+    free(jobs[i].out_log);
+    free(jobs[i].err_log);
+  }
+  free(jobs);
+  for (int i = 0; i < response_count; i++)
+    free(responses[i]);
+  free(responses);
+  free(objects);
+  return status;
 }
@@ -1,145 +1,685 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "mipsasm.h"
+#include "elf.h"
+#include "lexer.h"
+#include "lookup_hash.h"
+#include "lookup_tables.h"
+#include "threadpool.h"
+#include "xxhash.h"
 #include <ctype.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Operand kinds of an instruction schema. Each names the IR field it fills.
+typedef enum {
+  OPND_NONE = 0,
+  OPND_RD,
+  OPND_RS,
+  OPND_RT,
+  OPND_IMM,          // Immediate into imm
+  OPND_SHAMT,        // Shift amount (0-31) into imm
+  OPND_MEM,          // offset(base): offset into imm, base into rs
+  OPND_LABEL,        // Label reference into symbol
+  OPND_IMM_OR_LABEL, // Immediate, or a label reference when not a number
+  OPND_OPT_RD_RA,    // Optional rd, defaults to $ra
+  OPND_OPT_CODE      // Optional break code into imm
+} operand_kind_t;
+
+// How a machine instruction is assembled from its IR fields
+typedef enum {
+  FMT_R,      // op=0 | rs | rt | rd | shamt=imm | funct
+  FMT_I,      // opcode | rs | rt | imm (upper half of a label for lui)
+  FMT_BRANCH, // opcode | rs | rt | word offset to label
+  FMT_J,      // opcode | label >> 2
+  FMT_CODE,   // op=0 | 20-bit code | funct
+  FMT_PSEUDO  // Expanded by the descriptor's hook
+} encode_format_t;
+
+// Pseudo-instruction expansion hook. Writes the machine words for ir, given
+// the address of its label (0 while pass 1 is only sizing the statement),
+// and returns how many were written.
+typedef int (*expand_fn_t)(const ir_inst_t *ir, uint32_t address,
+                           uint32_t *words);
+
+// Longest expansion: remi through a quotient and a shift-and-add product
+#define ISA_MAX_WORDS 24
+
+// Instruction descriptor, generated from isa.def
+typedef struct {
+  const char *mnemonic;
+  uint8_t operands[3]; // operand_kind_t
+  uint8_t format;      // encode_format_t
+  uint8_t opcode;
+  uint8_t funct;
+  expand_fn_t expand;
+} isa_desc_t;
+
+// li $rt, imm => ori $rt, $zero, imm / lui $rt, hi (+ ori $rt, $rt, lo). A
+// short li of a negative 16-bit immediate is addiu $rt, $zero, imm.
+static int expand_li(const ir_inst_t *ir, uint32_t address, uint32_t *words) {
+  (void)address;
+  if ((ir->flags & IR_SHORT) && ir->imm >= 0xFFFF8000) {
+    words[0] = encode_i_type(0x09, 0, ir->rt, ir->imm & 0xFFFF);
+    return 1;
+  }
+  if (ir->imm <= 0xFFFF) {
+    // Small immediate, use ori with $zero
+    words[0] = encode_i_type(0x0D, 0, ir->rt, ir->imm & 0xFFFF);
+    return 1;
+  }
 
-int is_verbose = 0;
+  // Large immediate, use lui (+ ori if the low half is set)
+  words[0] = encode_i_type(0x0F, 0, ir->rt, (ir->imm >> 16) & 0xFFFF);
+  if ((ir->imm & 0xFFFF) == 0)
+    return 1;
+  words[1] = encode_i_type(0x0D, ir->rt, ir->rt, ir->imm & 0xFFFF);
+  return 2;
+}
 
-// Parse register name and return register number
-int parse_register(const char *reg_str) {
-  if (!reg_str)
-    return -1;
+// la $rt, label => lui $rt, upper(label) + ori $rt, $rt, lower(label). It
+// always takes two words so its size does not depend on where the label
+// ends up. In a relocatable object it is lui %hi + addiu %lo instead, the
+// pair a HI16/LO16 relocation describes: addiu sign-extends the low half,
+// so the upper half is rounded to make up for it. The peephole pass makes
+// an la a single word: the lui alone when the statement after it adds the
+// %lo (plus the displacement in imm), or one instruction for an address
+// that has one.
+static int expand_la(const ir_inst_t *ir, uint32_t address, uint32_t *words) {
+  if (ir->flags & IR_HI) {
+    uint32_t hi = (address + ir->imm + 0x8000) >> 16;
+    words[0] = encode_i_type(0x0F, 0, ir->rt, hi & 0xFFFF);
+    return 1;
+  }
+  if (ir->flags & IR_SHORT) {
+    if ((address & 0xFFFF) == 0)
+      words[0] = encode_i_type(0x0F, 0, ir->rt, address >> 16);
+    else if (address <= 0xFFFF)
+      words[0] = encode_i_type(0x0D, 0, ir->rt, address & 0xFFFF);
+    else
+      words[0] = encode_i_type(0x09, 0, ir->rt, address & 0xFFFF);
+    return 1;
+  }
+
+  if (ir->flags & IR_SIGNED_LO) {
+    words[0] =
+        encode_i_type(0x0F, 0, ir->rt, ((address + 0x8000) >> 16) & 0xFFFF);
+    words[1] = encode_i_type(0x09, ir->rt, ir->rt, address & 0xFFFF);
+    return 2;
+  }
+
+  words[0] = encode_i_type(0x0F, 0, ir->rt, (address >> 16) & 0xFFFF);
+  words[1] = encode_i_type(0x0D, ir->rt, ir->rt, address & 0xFFFF);
+  return 2;
+}
+
+// Pipeline model shared by the constant multiply and divide expansions and
+// the scheduler: cycles from issue until a result can be read. A load's
+// value arrives after its delay slot, HI and LO well after mult or div;
+// everything else is ready for the next instruction.
+#define LATENCY_LOAD 2
+#define LATENCY_MULT 12
+#define LATENCY_DIV 35
+
+static uint32_t sll_word(int rd, int rt, int shift) {
+  return encode_r_type(0, 0, rt, rd, shift, 0x00);
+}
+
+static uint32_t srl_word(int rd, int rt, int shift) {
+  return encode_r_type(0, 0, rt, rd, shift, 0x02);
+}
+
+static uint32_t sra_word(int rd, int rt, int shift) {
+  return encode_r_type(0, 0, rt, rd, shift, 0x03);
+}
+
+static uint32_t addu_word(int rd, int rs, int rt) {
+  return encode_r_type(0, rs, rt, rd, 0, 0x21);
+}
+
+static uint32_t subu_word(int rd, int rs, int rt) {
+  return encode_r_type(0, rs, rt, rd, 0, 0x23);
+}
+
+// Load a constant the way li does after the peephole pass
+static int load_constant(int reg, uint32_t value, uint32_t *words) {
+  ir_inst_t li = {0};
+  li.rt = (uint8_t)reg;
+  li.imm = value;
+  li.flags = IR_SHORT;
+  return expand_li(&li, 0, words);
+}
+
+// Steps of a shift-and-add chain. Each rewrites the accumulator acc, which
+// starts out as the multiplicand x and ends in rd.
+typedef enum {
+  MUL_SHIFT,    // acc <<= k
+  MUL_ADD_X,    // acc = (acc << k) + x
+  MUL_SUB_X,    // acc = (acc << k) - x
+  MUL_ADD_SELF, // acc = (acc << k) + acc, the shifted copy in $at
+  MUL_SUB_SELF, // acc = (acc << k) - acc, likewise
+  MUL_NEG       // acc = -acc
+} mul_op_t;
+
+// Registers a chain may use besides rd
+#define MUL_USE_X 0x01  // x can be read once rd has been written
+#define MUL_USE_AT 0x02 // $at is free for a shifted copy
+
+// Every chain the search keeps costs less than the multiplier, so it never
+// has more steps than this
+#define MUL_MAX_STEPS 16
+
+typedef struct {
+  uint8_t op[MUL_MAX_STEPS]; // mul_op_t, in execution order
+  uint8_t shift[MUL_MAX_STEPS];
+  int count;
+  int cost; // Words; each issues in one cycle
+} mul_chain_t;
+
+// Slots of the memo a search keeps of the values it has met
+#define MUL_MEMO_SIZE 256
+
+// State of one search: the registers chains may use and, for each value
+// met, its cheapest chain or (when not exact) a cost no chain gets below
+typedef struct {
+  int flags;                     // MUL_USE_*
+  uint32_t value[MUL_MEMO_SIZE]; // 0 for an empty slot
+  uint8_t exact[MUL_MEMO_SIZE];
+  int bound[MUL_MEMO_SIZE];
+  mul_chain_t chain[MUL_MEMO_SIZE];
+} mul_search_t;
+
+static int mul_search(mul_search_t *search, uint32_t c, int limit,
+                      mul_chain_t *best);
+
+// Nonzero digits of the sparsest signed-digit form of c modulo 2^32: the
+// non-adjacent form of c or of c - 2^32, with any digit 2^32 dropped
+static int signed_digits(uint32_t c) {
+  uint64_t n = c, m = (1ull << 32) - c;
+  int a = __builtin_popcountll(((3 * n) ^ n) >> 1 & 0xFFFFFFFFull);
+  int b = __builtin_popcountll(((3 * m) ^ m) >> 1 & 0xFFFFFFFFull);
+  return a < b ? a : b;
+}
+
+// Least cost of any chain for c: each addition or subtraction at most
+// doubles the nonzero digits, and costs two words
+static int mul_lower_bound(uint32_t c) {
+  int digits = signed_digits(c);
+  return digits > 1 ? 2 * (32 - __builtin_clz(digits - 1)) : 0;
+}
+
+// Try reaching c as step (op, k) applied to a chain for m; on success *best
+// and *limit become the new cheapest chain and its cost
+static int mul_try(mul_search_t *search, uint32_t m, mul_op_t op, int k,
+                   int *limit, mul_chain_t *best) {
+  int cost = (op == MUL_SHIFT || op == MUL_NEG) ? 1 : 2;
+  mul_chain_t chain;
+  if (!mul_search(search, m, *limit - cost, &chain))
+    return 0;
+  chain.op[chain.count] = (uint8_t)op;
+  chain.shift[chain.count] = (uint8_t)k;
+  chain.count++;
+  chain.cost += cost;
+  *best = chain;
+  *limit = chain.cost;
+  return 1;
+}
+
+// Cheapest chain computing c * x (c nonzero) that costs less than limit,
+// found by branch and bound over the factorizations of c: an even c is an
+// odd one shifted, an odd one (m << k) + 1, (m << k) - 1 or m times
+// 2^k + 1 or 2^k - 1. Returns 0 when there is none.
+static int mul_search(mul_search_t *search, uint32_t c, int limit,
+                      mul_chain_t *best) {
+  if (c == 1) {
+    best->count = 0;
+    best->cost = 0;
+    return limit > 0;
+  }
+  if (limit <= 1 || mul_lower_bound(c) >= limit)
+    return 0;
+
+  size_t slot = (c * 0x9E3779B1u) >> 24; // Fibonacci hash to 8 bits
+  if (search->value[slot] == c) {
+    if (search->exact[slot]) {
+      *best = search->chain[slot];
+      return best->cost < limit;
+    }
+    if (limit <= search->bound[slot])
+      return 0;
+  }
+
+  int found = 0, bound = limit;
+  if (!(c & 1)) {
+    int k = __builtin_ctz(c);
+    found = mul_try(search, c >> k, MUL_SHIFT, k, &limit, best);
+  } else {
+    int flags = search->flags;
+    if (flags & MUL_USE_X) {
+      int k = __builtin_ctz(c - 1);
+      found |= mul_try(search, (c - 1) >> k, MUL_ADD_X, k, &limit, best);
+      if (c + 1 != 0) {
+        k = __builtin_ctz(c + 1);
+        found |= mul_try(search, (c + 1) >> k, MUL_SUB_X, k, &limit, best);
+      }
+    }
+    if (flags & MUL_USE_AT) {
+      for (int k = 1; k < 32 && (1u << k) - 1 <= c; k++) {
+        uint32_t d = (1u << k) + 1;
+        if (c % d == 0)
+          found |= mul_try(search, c / d, MUL_ADD_SELF, k, &limit, best);
+        d = (1u << k) - 1;
+        if (k > 1 && c % d == 0)
+          found |= mul_try(search, c / d, MUL_SUB_SELF, k, &limit, best);
+      }
+    }
+  }
+
+  // A chain found below the limit is the cheapest there is
+  search->value[slot] = c;
+  search->exact[slot] = (uint8_t)found;
+  search->bound[slot] = bound;
+  if (found)
+    search->chain[slot] = *best;
+  return found;
+}
+
+// Cost of the chain for c's signed-digit form, a bound for mul_search():
+// each odd value is reached from (c - 1) or (c + 1), whichever has more
+// trailing zeros
+static int mul_greedy_cost(uint32_t c) {
+  int cost = 0;
+  if (!(c & 1)) {
+    c >>= __builtin_ctz(c);
+    cost++;
+  }
+  while (c != 1) {
+    c = ((c & 3) == 1 || c + 1 == 0) ? c - 1 : c + 1;
+    c >>= __builtin_ctz(c);
+    cost += 2;
+  }
+  return cost;
+}
+
+// Cheapest chain for c, or for -c followed by a negation, costing less than
+// limit
+static int mul_find(uint32_t c, int limit, int flags, mul_chain_t *best) {
+  mul_search_t search;
+  search.flags = flags;
+  memset(search.value, 0, sizeof(search.value));
+
+  if (limit > MUL_MAX_STEPS)
+    limit = MUL_MAX_STEPS;
+  if ((flags & MUL_USE_X) && mul_greedy_cost(c) < limit)
+    limit = mul_greedy_cost(c) + 1;
+  int found = mul_search(&search, c, limit, best);
+  if (found)
+    limit = best->cost;
+  mul_chain_t negated;
+  if (c != 1 && mul_search(&search, -c, limit - 1, &negated)) {
+    negated.op[negated.count++] = MUL_NEG;
+    negated.cost++;
+    *best = negated;
+    found = 1;
+  }
+  return found;
+}
+
+// rd = rs * c, through $at. A shift-and-add chain is used when it issues
+// in fewer cycles than li $at, c + mult + mflo takes to have the product;
+// *cycles is set to the cost of the expansion that was picked.
+static int multiply_constant(int rd, int rs, uint32_t c, uint32_t *words,
+                             int *cycles) {
+  if (c == 0) {
+    words[0] = addu_word(rd, 0, 0);
+    *cycles = 1;
+    return 1;
+  }
+
+  int n = load_constant(REG_AT, c, words);
+  int limit = n + 1 + LATENCY_MULT;
+  mul_chain_t chain;
+  int found, x = rs;
+  if (rd != rs) {
+    found = mul_find(c, limit, MUL_USE_X | MUL_USE_AT, &chain);
+  } else {
+    // Writing rd loses x, unless a copy is kept in $at first
+    found = mul_find(c, limit, MUL_USE_AT, &chain);
+    if (found)
+      limit = chain.cost;
+    mul_chain_t copy;
+    if (mul_find(c, limit - 1, MUL_USE_X, &copy)) {
+      chain = copy;
+      chain.cost++;
+      x = REG_AT;
+      found = 1;
+    }
+  }
+
+  if (!found) {
+    words[n++] = encode_r_type(0, rs, REG_AT, 0, 0, 0x18); // mult
+    words[n++] = encode_r_type(0, 0, 0, rd, 0, 0x12);      // mflo
+    *cycles = limit;
+    return n;
+  }
+
+  n = 0;
+  if (x == REG_AT)
+    words[n++] = addu_word(REG_AT, rs, 0);
+  if (chain.count == 0)
+    words[n++] = addu_word(rd, x, 0);
+  int acc = x;
+  for (int i = 0; i < chain.count; i++) {
+    int k = chain.shift[i];
+    switch ((mul_op_t)chain.op[i]) {
+    case MUL_SHIFT:
+      words[n++] = sll_word(rd, acc, k);
+      break;
+    case MUL_ADD_X:
+      words[n++] = sll_word(rd, acc, k);
+      words[n++] = addu_word(rd, rd, x);
+      break;
+    case MUL_SUB_X:
+      words[n++] = sll_word(rd, acc, k);
+      words[n++] = subu_word(rd, rd, x);
+      break;
+    case MUL_ADD_SELF:
+      words[n++] = sll_word(REG_AT, acc, k);
+      words[n++] = addu_word(rd, REG_AT, acc);
+      break;
+    case MUL_SUB_SELF:
+      words[n++] = sll_word(REG_AT, acc, k);
+      words[n++] = subu_word(rd, REG_AT, acc);
+      break;
+    case MUL_NEG:
+      words[n++] = subu_word(rd, 0, acc);
+      break;
+    }
+    acc = rd;
+  }
+  *cycles = n;
+  return n;
+}
+
+// Magic number and shift for signed division by d, |d| >= 2 and not a power
+// of two: the quotient is the high word of m * x, plus x when d > 0 and m is
+// negative (less x when d < 0 and m is positive), shifted right by s and
+// rounded toward zero (Hacker's Delight, 10-1)
+static void signed_magic(int32_t d, int32_t *m, int *s) {
+  const uint32_t two31 = 0x80000000u;
+  uint32_t ad = d < 0 ? -(uint32_t)d : (uint32_t)d;
+  uint32_t t = two31 + ((uint32_t)d >> 31);
+  uint32_t anc = t - 1 - t % ad;
+  uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+  uint32_t q2 = two31 / ad, r2 = two31 - q2 * ad;
+  uint32_t delta;
+  int p = 31;
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+  *m = (int32_t)(d < 0 ? -(q2 + 1) : q2 + 1);
+  *s = p - 32;
+}
+
+// k with |d| == 2^k, or 0 when |d| is not a power of two above 1
+static int power_of_two(int32_t d) {
+  uint32_t ad = d < 0 ? -(uint32_t)d : (uint32_t)d;
+  return (ad > 1 && (ad & (ad - 1)) == 0) ? __builtin_ctz(ad) : 0;
+}
+
+// $at = 2^k - 1 when rs is negative, else 0: added to the dividend, it
+// makes an arithmetic shift by k round toward zero
+static int dividend_bias(int rs, int k, uint32_t *words) {
+  if (k == 1) {
+    words[0] = srl_word(REG_AT, rs, 31);
+    return 1;
+  }
+  words[0] = sra_word(REG_AT, rs, 31);
+  words[1] = srl_word(REG_AT, REG_AT, 32 - k);
+  return 2;
+}
+
+// rd = rs / d (signed, rounded toward zero) for |d| >= 2 and not a power of
+// two, through $at; rs is read before rd is written
+static int divide_magic(int rd, int rs, int32_t d, uint32_t *words) {
+  int32_t m;
+  int s;
+  signed_magic(d, &m, &s);
+  int n = load_constant(REG_AT, (uint32_t)m, words);
+  words[n++] = encode_r_type(0, rs, REG_AT, 0, 0, 0x18); // mult
+  words[n++] = encode_r_type(0, 0, 0, REG_AT, 0, 0x10);  // mfhi
+  if (d > 0 && m < 0)
+    words[n++] = addu_word(REG_AT, REG_AT, rs);
+  else if (d < 0 && m > 0)
+    words[n++] = subu_word(REG_AT, REG_AT, rs);
+  if (s > 0)
+    words[n++] = sra_word(REG_AT, REG_AT, s);
+  words[n++] = srl_word(rd, REG_AT, 31);
+  words[n++] = addu_word(rd, rd, REG_AT);
+  return n;
+}
+
+// li $at, d + div + mflo (or mfhi for the remainder), through the divider
+static int divide_hardware(int rd, int rs, int32_t d, int remainder,
+                           uint32_t *words) {
+  int n = load_constant(REG_AT, (uint32_t)d, words);
+  words[n++] = encode_r_type(0, rs, REG_AT, 0, 0, 0x1A); // div
+  words[n++] = encode_r_type(0, 0, 0, rd, 0, remainder ? 0x10 : 0x12);
+  return n;
+}
+
+// mul $rd, $rs, imm => shift-and-add chain, or li $at + mult + mflo
+static int expand_mul(const ir_inst_t *ir, uint32_t address, uint32_t *words) {
+  (void)address;
+  int cycles;
+  return multiply_constant(ir->rd, ir->rs, ir->imm, words, &cycles);
+}
+
+// divi $rd, $rs, imm => signed quotient, rounded toward zero: a move or
+// negation for 1 or -1, a biased shift for a power of two, otherwise a
+// multiply by a magic number, which beats the divider's latency
+static int expand_divi(const ir_inst_t *ir, uint32_t address,
+                       uint32_t *words) {
+  (void)address;
+  int rd = ir->rd, rs = ir->rs;
+  int32_t d = (int32_t)ir->imm;
+  if (d == 1 || d == -1) {
+    words[0] = (d == 1) ? addu_word(rd, rs, 0) : subu_word(rd, 0, rs);
+    return 1;
+  }
+
+  int k = power_of_two(d);
+  if (k == 0)
+    return divide_magic(rd, rs, d, words);
+  int n = dividend_bias(rs, k, words);
+  words[n++] = addu_word(REG_AT, rs, REG_AT);
+  words[n++] = sra_word(rd, REG_AT, k);
+  if (d < 0)
+    words[n++] = subu_word(rd, 0, rd);
+  return n;
+}
+
+// remi $rd, $rs, imm => signed remainder, with the sign of the dividend: the
+// low bits of the biased dividend for a power of two, otherwise rs less
+// divi's quotient times imm when that beats the divider, which is also
+// used when rd is rs and no register is left for the product
+static int expand_remi(const ir_inst_t *ir, uint32_t address,
+                       uint32_t *words) {
+  (void)address;
+  int rd = ir->rd, rs = ir->rs;
+  int32_t d = (int32_t)ir->imm;
+  if (d == 1 || d == -1) {
+    words[0] = addu_word(rd, 0, 0);
+    return 1;
+  }
+
+  int k = power_of_two(d);
+  if (k > 0) {
+    int n = dividend_bias(rs, k, words);
+    if (k <= 16) {
+      // ((rs + bias) & (2^k - 1)) - bias
+      words[n++] = addu_word(rd, rs, REG_AT);
+      words[n++] = encode_i_type(0x0C, rd, rd, (1u << k) - 1); // andi
+      words[n++] = subu_word(rd, rd, REG_AT);
+    } else {
+      // rs - ((rs + bias) with its low k bits cleared)
+      words[n++] = addu_word(REG_AT, rs, REG_AT);
+      words[n++] = srl_word(REG_AT, REG_AT, k);
+      words[n++] = sll_word(REG_AT, REG_AT, k);
+      words[n++] = subu_word(rd, rs, REG_AT);
+    }
+    return n;
+  }
+
+  uint32_t hardware[ISA_MAX_WORDS];
+  int count = divide_hardware(rd, rs, d, 1, hardware);
+  if (rd != rs) {
+    int n = divide_magic(rd, rs, d, words);
+    int cycles = n - 1 + LATENCY_MULT; // mfhi waits for the product
+    int product;
+    n += multiply_constant(rd, rd, (uint32_t)d, words + n, &product);
+    words[n++] = subu_word(rd, rs, rd);
+    if (cycles + product + 1 < count - 1 + LATENCY_DIV)
+      return n;
+  }
+  memcpy(words, hardware, count * sizeof(uint32_t));
+  return count;
+}
+
+// Descriptor table indexed by instruction type
+static const isa_desc_t isa_table[INST_COUNT] = {
+#define ISA_INST(id, mnemonic, op1, op2, op3, format, opcode, funct, expand) \
+  [INST_##id] = {mnemonic,     {OPND_##op1, OPND_##op2, OPND_##op3},        \
+                 FMT_##format, opcode,                                     \
+                 funct,        expand},
+#include "isa.def"
+#undef ISA_INST
+};
+
+// Look up a name in a generated perfect-hash table. Each name has exactly one
+// candidate slot; names are only compared when length and hash both match.
+static const lookup_slot_t *lookup_name(const lookup_slot_t *slots,
+                                        uint32_t mask, uint32_t seed,
+                                        const char *name, size_t len) {
+  if (len == 0 || len > LOOKUP_MAX_NAME)
+    return NULL;
+
+  uint32_t hash = lookup_hash(name, len, seed);
+  const lookup_slot_t *slot = &slots[hash & mask];
+  if (slot->len != len || slot->hash != hash ||
+      memcmp(slot->name, name, len) != 0) {
+    return NULL;
+  }
+  return slot;
+}
 
+// Parse register name of the given length and return register number
+int parse_register_n(const char *reg_str, size_t len) {
   // Handle $ prefix
-  if (reg_str[0] == '$') {
+  if (len > 0 && reg_str[0] == '$') {
     reg_str++;
+    len--;
   }
 
+  if (len == 0)
+    return -1;
+
   // Numeric register ($0-$31)
-  if (isdigit(reg_str[0])) {
-    int reg_num = atoi(reg_str);
-    if (reg_num >= 0 && reg_num <= 31) {
-      return reg_num;
+  if (isdigit((unsigned char)reg_str[0])) {
+    int reg_num = 0;
+    for (size_t i = 0; i < len; i++) {
+      if (!isdigit((unsigned char)reg_str[i]))
+        return -1;
+      reg_num = reg_num * 10 + (reg_str[i] - '0');
+      if (reg_num > 31)
+        return -1;
     }
-    return -1;
+    return reg_num;
   }
 
-  // Named registers
-  static const struct {
-    const char *name;
-    int reg_num;
-  } reg_table[] = {
-      {"zero", REG_ZERO}, {"at", REG_AT}, {"v0", REG_V0}, {"v1", REG_V1},
-      {"a0", REG_A0},     {"a1", REG_A1}, {"a2", REG_A2}, {"a3", REG_A3},
-      {"t0", REG_T0},     {"t1", REG_T1}, {"t2", REG_T2}, {"t3", REG_T3},
-      {"t4", REG_T4},     {"t5", REG_T5}, {"t6", REG_T6}, {"t7", REG_T7},
-      {"s0", REG_S0},     {"s1", REG_S1}, {"s2", REG_S2}, {"s3", REG_S3},
-      {"s4", REG_S4},     {"s5", REG_S5}, {"s6", REG_S6}, {"s7", REG_S7},
-      {"t8", REG_T8},     {"t9", REG_T9}, {"k0", REG_K0}, {"k1", REG_K1},
-      {"gp", REG_GP},     {"sp", REG_SP}, {"fp", REG_FP}, {"ra", REG_RA}};
+  const lookup_slot_t *slot = lookup_name(register_slots, REGISTER_HASH_MASK,
+                                          REGISTER_HASH_SEED, reg_str, len);
+  return slot ? slot->value : -1;
+}
 
-  for (size_t i = 0; i < sizeof(reg_table) / sizeof(reg_table[0]); i++) {
-    if (strcmp(reg_str, reg_table[i].name) == 0) {
-      return reg_table[i].reg_num;
-    }
-  }
+// Parse register name and return register number
+int parse_register(const char *reg_str) {
+  if (!reg_str)
+    return -1;
+  return parse_register_n(reg_str, strlen(reg_str));
+}
 
-  return -1;
+// Parse instruction mnemonic of the given length
+instruction_type_t parse_instruction_n(const char *mnemonic, size_t len) {
+  const lookup_slot_t *slot = lookup_name(mnemonic_slots, MNEMONIC_HASH_MASK,
+                                          MNEMONIC_HASH_SEED, mnemonic, len);
+  return slot ? (instruction_type_t)slot->value : INST_UNKNOWN;
 }
 
 // Parse instruction mnemonic
 instruction_type_t parse_instruction(const char *mnemonic) {
   if (!mnemonic)
     return INST_UNKNOWN;
-
-  static const struct {
-    const char *name;
-    instruction_type_t type;
-  } inst_table[] = {{"lui", INST_LUI},
-                    {"li", INST_LI},
-                    {"addiu", INST_ADDIU},
-                    {"addi", INST_ADDI},
-                    {"sw", INST_SW},
-                    {"lw", INST_LW},
-                    {"bnez", INST_BNEZ},
-                    {"beqz", INST_BEQZ},
-                    {"beq", INST_BEQ},
-                    {"bne", INST_BNE},
-                    {"b", INST_B},
-                    {"j", INST_J},
-                    {"jal", INST_JAL},
-                    {"nop", INST_NOP},
-                    {"andi", INST_ANDI},
-                    {"ori", INST_ORI},
-                    {"xori", INST_XORI},
-                    {"add", INST_ADD},
-                    {"sub", INST_SUB},
-                    {"and", INST_AND},
-                    {"or", INST_OR},
-                    {"xor", INST_XOR},
-                    {"sll", INST_SLL},
-                    {"srl", INST_SRL},
-                    {"sra", INST_SRA},
-                    {"sllv", INST_SLLV},
-                    {"srlv", INST_SRLV},
-                    {"srav", INST_SRAV},
-                    {"slt", INST_SLT},
-                    {"sltu", INST_SLTU},
-                    {"jr", INST_JR},
-                    {"jalr", INST_JALR},
-                    {"mfhi", INST_MFHI},
-                    {"mflo", INST_MFLO},
-                    {"mthi", INST_MTHI},
-                    {"mtlo", INST_MTLO},
-                    {"mult", INST_MULT},
-                    {"multu", INST_MULTU},
-                    {"div", INST_DIV},
-                    {"divu", INST_DIVU},
-                    {"syscall", INST_SYSCALL},
-                    {"break", INST_BREAK},
-                    {"slti", INST_SLTI},
-                    {"sltiu", INST_SLTIU},
-                    {"lb", INST_LB},
-                    {"lbu", INST_LBU},
-                    {"lh", INST_LH},
-                    {"lhu", INST_LHU},
-                    {"sb", INST_SB},
-                    {"sh", INST_SH},
-                    {"la", INST_LA},
-                    {"move", INST_MOVE}};
-
-  for (size_t i = 0; i < sizeof(inst_table) / sizeof(inst_table[0]); i++) {
-    if (strcmp(mnemonic, inst_table[i].name) == 0) {
-      return inst_table[i].type;
-    }
-  }
-
-  return INST_UNKNOWN;
+  return parse_instruction_n(mnemonic, strlen(mnemonic));
 }
 
-// Parse immediate value (hex, decimal, or label)
-int parse_immediate(const char *str, uint32_t *value) {
-  if (!str || !value)
-    return 0;
-
-  char *endptr;
+// Parse immediate value of the given length (hex or decimal). Returns 0 if
+// the text is not a number, e.g. a label.
+int parse_immediate_n(const char *str, size_t len, uint32_t *value) {
+  uint32_t result = 0;
+  size_t i = 0;
 
   // Hex value (0x...)
-  if (strncmp(str, "0x", 2) == 0 || strncmp(str, "0X", 2) == 0) {
-    *value = strtoul(str, &endptr, 16);
-    return (*endptr == '\0');
+  if (len > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+    for (i = 2; i < len; i++) {
+      int c = (unsigned char)str[i];
+      if (!isxdigit(c))
+        return 0;
+      result = (result << 4) |
+               (uint32_t)(isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+    }
+    *value = result;
+    return 1;
   }
 
   // Decimal value
-  if (isdigit(str[0]) || str[0] == '-') {
-    long long_val = strtol(str, &endptr, 10);
-    *value = (uint32_t)long_val;
-    return (*endptr == '\0');
+  int negative = (len > 0 && str[0] == '-');
+  i = negative ? 1 : 0;
+  if (i >= len)
+    return 0;
+
+  for (; i < len; i++) {
+    if (!isdigit((unsigned char)str[i]))
+      return 0;
+    result = result * 10 + (uint32_t)(str[i] - '0');
   }
 
-  // Label (will be resolved later)
-  return 0;
+  *value = negative ? (uint32_t)(0u - result) : result;
+  return 1;
+}
+
+// Parse immediate value (hex, decimal, or label)
+int parse_immediate(const char *str, uint32_t *value) {
+  if (!str || !value)
+    return 0;
+  return parse_immediate_n(str, strlen(str), value);
 }
 
 // Encode R-type instruction
@@ -160,1713 +700,3532 @@ uint32_t encode_j_type(uint8_t op, uint32_t target) {
   return ((uint32_t)op << 26) | (target & 0x3FFFFFF);
 }
 
-// Add label to context
-int add_label(assembler_ctx_t *ctx, const char *name, uint32_t address) {
-  if (ctx->label_count >= MAX_LABELS)
+// Deliver one line of output to the context's callback, or print it to the
+// matching stream. The text is prefix followed by fmt; a trailing newline in
+// fmt is optional.
+static void emit_message(const assembler_ctx_t *ctx, mips_diag_kind_t kind,
+                         const char *prefix, const char *fmt, va_list args) {
+  size_t fmt_len = strlen(fmt);
+
+  if (!ctx->diag) {
+    FILE *stream = (kind == MIPS_DIAG_INFO) ? ctx->out : ctx->err;
+    fputs(prefix, stream);
+    vfprintf(stream, fmt, args);
+    if (fmt_len == 0 || fmt[fmt_len - 1] != '\n')
+      fputc('\n', stream);
+    return;
+  }
+
+  // Messages are formatted on the stack; only unusually long ones (e.g. an
+  // echoed source line) go to the heap
+  char buffer[512];
+  char *message = buffer;
+  size_t prefix_len = strlen(prefix);
+  va_list again;
+  va_copy(again, args);
+  memcpy(buffer, prefix, prefix_len + 1);
+  int len = vsnprintf(buffer + prefix_len, sizeof(buffer) - prefix_len, fmt,
+                      args);
+  if (len > 0 && (size_t)len >= sizeof(buffer) - prefix_len) {
+    char *large = malloc(prefix_len + (size_t)len + 1);
+    if (large) {
+      memcpy(large, prefix, prefix_len);
+      vsnprintf(large + prefix_len, (size_t)len + 1, fmt, again);
+      message = large;
+    }
+  }
+  va_end(again);
+
+  size_t total = strlen(message);
+  if (total > 0 && message[total - 1] == '\n')
+    message[total - 1] = '\0';
+  ctx->diag(ctx->diag_arg, kind, message);
+
+  if (message != buffer)
+    free(message);
+}
+
+// Format the verbose events recorded so far, so that they come out before
+// the next message
+static void flush_trace(const assembler_ctx_t *ctx) {
+  if (ctx->trace)
+    trace_drain(ctx->trace);
+}
+
+// Print a diagnostic, unless the context is parsing a chunk speculatively
+static void report(const assembler_ctx_t *ctx, const char *fmt, ...) {
+  va_list args;
+
+  if (ctx->quiet)
+    return;
+  flush_trace(ctx);
+  va_start(args, fmt);
+  emit_message(ctx, MIPS_DIAG_ERROR, "", fmt, args);
+  va_end(args);
+}
+
+// Print verbose progress output
+static void info(const assembler_ctx_t *ctx, const char *fmt, ...) {
+  va_list args;
+
+  flush_trace(ctx);
+  va_start(args, fmt);
+  emit_message(ctx, MIPS_DIAG_INFO, "", fmt, args);
+  va_end(args);
+}
+
+#ifndef MIPSASM_NO_TRACE
+// Print verbose output without flushing the trace (used by its sink)
+static void trace_info(const assembler_ctx_t *ctx, const char *fmt, ...) {
+  va_list args;
+
+  va_start(args, fmt);
+  emit_message(ctx, MIPS_DIAG_INFO, "", fmt, args);
+  va_end(args);
+}
+
+static const char *section_name(int section) {
+  return (section == SECTION_TEXT) ? "TEXT" : "DATA";
+}
+
+// Trace sink: format one verbose event as a line of output
+static void format_trace_event(void *arg, const trace_event_t *event) {
+  const assembler_ctx_t *ctx = arg;
+  int len = (int)event->name_len;
+
+  switch ((trace_kind_t)event->kind) {
+  case TRACE_LABEL:
+    trace_info(ctx, "Adding label '%.*s' at address 0x%08X (section: %s)\n",
+               len, event->name, event->value, section_name(event->section));
+    break;
+  case TRACE_SECTION:
+    trace_info(ctx, "Switching to %s section\n",
+               section_name(event->section));
+    break;
+  case TRACE_DIRECTIVE:
+    trace_info(ctx, "Processing directive: .%.*s\n", len, event->name);
+    break;
+  case TRACE_ORG:
+    trace_info(ctx, "  Setting address to 0x%08X for section %s\n",
+               event->value, section_name(event->section));
+    break;
+  case TRACE_WORD_SYMBOL:
+    trace_info(ctx, "  Adding label address: %.*s = 0x%08X\n", len,
+               event->name, event->value);
+    break;
+  case TRACE_LOAD_ADDRESS:
+    trace_info(ctx, "  Loading address of label '%.*s': 0x%08X\n", len,
+               event->name, event->value);
+    break;
+  }
+}
+
+// Record a verbose event of category cat; it is formatted when the trace is
+// flushed. Builds with MIPSASM_NO_TRACE keep only the pass summaries.
+#define TRACE(ctx, cat, kind, name, len, value, section)                       \
+  do {                                                                         \
+    if ((ctx)->trace_mask & (cat))                                             \
+      trace_record((ctx)->trace, kind, name, len, value, section);             \
+  } while (0)
+#else
+#define TRACE(ctx, cat, kind, name, len, value, section) ((void)0)
+#endif
+
+// Report an error for a source line
+static int line_error(const assembler_ctx_t *ctx, uint32_t line,
+                      const char *fmt, ...) {
+  char prefix[32];
+  va_list args;
+
+  if (ctx->quiet)
     return 0;
+  flush_trace(ctx);
+  snprintf(prefix, sizeof(prefix), "Error: line %u: ", line);
+  va_start(args, fmt);
+  emit_message(ctx, MIPS_DIAG_ERROR, prefix, fmt, args);
+  va_end(args);
+  return 0;
+}
 
-  strncpy(ctx->labels[ctx->label_count].name, name,
-          sizeof(ctx->labels[ctx->label_count].name) - 1);
-  ctx->labels[ctx->label_count]
-      .name[sizeof(ctx->labels[ctx->label_count].name) - 1] = '\0';
-  ctx->labels[ctx->label_count].address = address;
-  ctx->labels[ctx->label_count].resolved = 1;
+// Grow a dynamic array so it can hold at least `needed` elements
+static int grow_array(void **array, size_t *capacity, size_t needed,
+                      size_t elem_size, size_t initial) {
+  if (needed <= *capacity)
+    return 1;
 
-  if (is_verbose) {
-    printf("Adding label '%s' at address 0x%08X (section: %s)\n", name, address,
-           (ctx->current_section == SECTION_TEXT) ? "TEXT" : "DATA");
+  size_t new_capacity = *capacity ? *capacity : initial;
+  while (new_capacity < needed) {
+    if (new_capacity > SIZE_MAX / 2 / elem_size)
+      return 0;
+    new_capacity *= 2;
   }
-  ctx->label_count++;
 
+  void *grown = realloc(*array, new_capacity * elem_size);
+  if (!grown)
+    return 0;
+
+  *array = grown;
+  *capacity = new_capacity;
   return 1;
 }
 
-// Find label by name
-int find_label(assembler_ctx_t *ctx, const char *name) {
-  for (int i = 0; i < ctx->label_count; i++) {
-    if (strcmp(ctx->labels[i].name, name) == 0) {
-      return i;
+// Define a label of the given length at address
+static int define_label(assembler_ctx_t *ctx, const char *name, size_t len,
+                        uint32_t address) {
+  int index = symtab_add(&ctx->symbols, name, len, address);
+  if (index >= 0 && (ctx->relative || ctx->incremental)) {
+    // Remember the label so its address can be made absolute, or so a
+    // session can move or drop it
+    if (!grow_array((void **)&ctx->label_defs, &ctx->label_def_capacity,
+                    ctx->label_def_count + 1, sizeof(int32_t), 256)) {
+      index = SYMTAB_NOMEM;
+    } else {
+      ctx->label_defs[ctx->label_def_count++] = index;
     }
   }
-  return -1;
+
+  if (index == SYMTAB_DUPLICATE) {
+    report(ctx, "Error: Duplicate label '%.*s'\n", (int)len, name);
+    return 0;
+  } else if (index < 0) {
+    report(ctx, "Error: Out of memory adding label '%.*s'\n", (int)len, name);
+    return 0;
+  }
+
+  ctx->symbols.entries[index].section = (uint8_t)ctx->current_section;
+  ctx->symbols.entries[index].statement = (uint32_t)ctx->ir_count;
+  TRACE(ctx, MIPS_TRACE_LABELS, TRACE_LABEL, name, len, address,
+        ctx->current_section);
+
+  return 1;
 }
 
-// Write 32-bit big-endian value to output
-void write_be32(assembler_ctx_t *ctx, uint32_t value) {
-  if (ctx->output_size + 4 <= MAX_OUTPUT_SIZE) {
-    ctx->output[ctx->output_size++] = (value >> 24) & 0xFF;
-    ctx->output[ctx->output_size++] = (value >> 16) & 0xFF;
-    ctx->output[ctx->output_size++] = (value >> 8) & 0xFF;
-    ctx->output[ctx->output_size++] = value & 0xFF;
-    ctx->current_address += 4;
+// Add label to context
+int add_label(assembler_ctx_t *ctx, const char *name, uint32_t address) {
+  return define_label(ctx, name, strlen(name), address);
+}
 
-    // Track section size
-    if (ctx->current_section == SECTION_TEXT) {
-      ctx->text_size += 4;
-    } else {
-      ctx->data_size += 4;
-    }
+// Find label by name
+int find_label(assembler_ctx_t *ctx, const char *name) {
+  if (!name)
+    return -1;
+
+  int index = symtab_find(&ctx->symbols, name, strlen(name));
+  if (index >= 0 && !ctx->symbols.entries[index].resolved)
+    return -1;
+  return index;
+}
+
+// Make room for at least `count` more bytes of output. The buffer grows
+// geometrically so appends are amortized O(1).
+static int reserve_output(assembler_ctx_t *ctx, size_t count) {
+  if (count > SIZE_MAX - ctx->output_size) {
+    report(ctx, "Error: Output image too large\n");
+    return 0;
   }
-} // Process a single line of assembly
-static int process_line(assembler_ctx_t *ctx, const char *line) {
-  char line_copy[MAX_LINE_LENGTH];
-  char *token, *saveptr;
-  uint32_t instruction = 0;
 
-  // Copy line and remove comments
-  strncpy(line_copy, line, sizeof(line_copy) - 1);
-  line_copy[sizeof(line_copy) - 1] = '\0';
+  if (!grow_array((void **)&ctx->output, &ctx->output_capacity,
+                  ctx->output_size + count, 1, OUTPUT_INITIAL_SIZE)) {
+    report(ctx, "Error: Failed to grow output buffer to %zu bytes\n",
+            ctx->output_size + count);
+    return 0;
+  }
+  return 1;
+}
 
-  char *comment = strstr(line_copy, "//");
-  if (comment)
-    *comment = '\0';
+// Account for `size` bytes appended to the current section (pass 1)
+static int advance_address(assembler_ctx_t *ctx, uint32_t size,
+                           uint32_t line) {
+  if (size > UINT32_MAX - ctx->current_address) {
+    return line_error(ctx, line,
+                      "section %s overflows the 32-bit address space",
+                      (ctx->current_section == SECTION_TEXT) ? "TEXT"
+                                                             : "DATA");
+  }
 
-  // Also handle hash comments (#)
-  comment = strchr(line_copy, '#');
-  if (comment)
-    *comment = '\0';
+  ctx->current_address += size;
 
-  // Skip empty lines and whitespace
-  char *trimmed = line_copy;
-  while (isspace(*trimmed))
-    trimmed++;
-  if (*trimmed == '\0')
-    return 1;
+  // Track section size
+  if (ctx->current_section == SECTION_TEXT) {
+    ctx->text_size += size;
+  } else {
+    ctx->data_size += size;
+  }
+  return 1;
+}
 
-  // Check for label
-  char *colon = strchr(trimmed, ':');
-  if (colon) {
-    // Store the label
-    char label_name[64];
-    strncpy(label_name, trimmed, colon - trimmed);
-    label_name[colon - trimmed] = '\0';
+// Append a statement of `size` bytes at the current address (pass 1)
+static ir_inst_t *append_ir(assembler_ctx_t *ctx, instruction_type_t type,
+                            uint32_t size, uint32_t line) {
+  if (!grow_array((void **)&ctx->ir, &ctx->ir_capacity, ctx->ir_count + 1,
+                  sizeof(ir_inst_t), 1024)) {
+    line_error(ctx, line, "out of memory");
+    return NULL;
+  }
 
-    // Remove leading/trailing whitespace from label
-    char *label_trim = label_name;
-    while (isspace(*label_trim))
-      label_trim++;
+  uint32_t address = ctx->current_address;
+  if (!advance_address(ctx, size, line))
+    return NULL;
+
+  ir_inst_t *ir = &ctx->ir[ctx->ir_count++];
+  memset(ir, 0, sizeof(*ir));
+  ir->type = type;
+  ir->section = ctx->current_section;
+  ir->address = address;
+  ir->size = size;
+  ir->symbol = -1;
+  ir->line = line;
+  return ir;
+}
 
-    // Add the label with the current address (which depends on the current
-    // section)
-    if (ctx->pass == 1) {
-      add_label(ctx, label_trim, ctx->current_address);
-    }
-    // Move past the label for instruction processing
-    trimmed = colon + 1;
-    while (isspace(*trimmed))
-      trimmed++;
-    if (*trimmed == '\0')
-      return 1;
+// Append literal data bytes, merging with the previous statement when it is
+// literal data from the same line
+static int append_data(assembler_ctx_t *ctx, const void *bytes, size_t count,
+                       uint32_t line) {
+  if (count > UINT32_MAX ||
+      !grow_array((void **)&ctx->data_pool, &ctx->data_pool_capacity,
+                  ctx->data_pool_size + count, 1, OUTPUT_INITIAL_SIZE)) {
+    return line_error(ctx, line, "out of memory");
   }
 
-  // Skip directives (starts with .)
-  if (trimmed[0] == '.') {
-    // Extract the directive name
-    char directive_copy[MAX_LINE_LENGTH];
-    strncpy(directive_copy, trimmed + 1, sizeof(directive_copy) - 1);
-    directive_copy[sizeof(directive_copy) - 1] = '\0';
-
-    // Get just the directive name without params
-    char *directive_name = strtok_r(directive_copy, " \t", &saveptr);
-    if (directive_name) {
-      // Always process section changes in both passes
-      if (strcmp(directive_name, "text") == 0) {
-        if (ctx->pass == 1) {
-          if (is_verbose) {
-            printf("Switching to TEXT section\n");
-          }
-          // In pass 1, remember where we are in each section
-          if (ctx->current_section == SECTION_DATA) {
-            ctx->data_size = ctx->current_address - ctx->data_address;
-          }
-        }
-
-        ctx->current_section = SECTION_TEXT;
-        if (ctx->pass == 1) {
-          ctx->current_address = ctx->text_address + ctx->text_size;
-        } else if (ctx->pass == 2) {
-          ctx->current_address = ctx->text_address + ctx->text_size;
-        }
-        return 1;
-      } else if (strcmp(directive_name, "data") == 0) {
-        if (ctx->pass == 1) {
-          if (is_verbose) {
-            printf("Switching to DATA section\n");
-          }
-          // In pass 1, remember where we are in each section
-          if (ctx->current_section == SECTION_TEXT) {
-            ctx->text_size = ctx->current_address - ctx->text_address;
-          }
-        }
-
-        ctx->current_section = SECTION_DATA;
-        if (ctx->pass == 1) {
-          ctx->current_address = ctx->data_address + ctx->data_size;
-        } else if (ctx->pass == 2) {
-          ctx->current_address = ctx->data_address + ctx->data_size;
-        }
-        return 1;
-      }
-    }
+  ir_inst_t *last = ctx->ir_count ? &ctx->ir[ctx->ir_count - 1] : NULL;
+  uint32_t offset = (uint32_t)ctx->data_pool_size;
 
-    if (ctx->pass == 1) {
-      // In pass 1, estimate directive sizes
-      estimate_directive_size(ctx, trimmed + 1);
-    } else {
-      // Handle directives in pass 2
-      handle_directive(ctx, trimmed + 1, &saveptr);
-    }
+  memcpy(ctx->data_pool + ctx->data_pool_size, bytes, count);
+  ctx->data_pool_size += count;
+
+  if (last && last->type == INST_DATA && last->line == line &&
+      last->imm + last->size == offset &&
+      last->address + last->size == ctx->current_address) {
+    // Fold the new bytes into the previous statement
+    if (!advance_address(ctx, (uint32_t)count, line))
+      return 0;
+    last->size += (uint32_t)count;
     return 1;
   }
 
-  // Parse instruction
-  token = strtok_r(trimmed, " \t,", &saveptr);
-  if (!token)
-    return 1;
+  ir_inst_t *ir = append_ir(ctx, INST_DATA, (uint32_t)count, line);
+  if (!ir)
+    return 0;
+  ir->imm = offset;
+  return 1;
+}
 
-  instruction_type_t inst_type = parse_instruction(token);
+// Close the current run of a chunk and start a new one at relative address 0
+// (parallel pass 1)
+static int start_anchor(assembler_ctx_t *ctx, anchor_kind_t kind,
+                        uint32_t value, uint32_t line) {
+  if (!grow_array((void **)&ctx->anchors, &ctx->anchor_capacity,
+                  ctx->anchor_count + 1, sizeof(anchor_t), 16)) {
+    return line_error(ctx, line, "out of memory");
+  }
 
-  if (ctx->pass == 2) { // Only generate code on second pass
-    switch (inst_type) {
-    case INST_NOP:
-      instruction = 0x00000000;
-      write_be32(ctx, instruction);
-      break;
+  if (ctx->anchor_count > 0)
+    ctx->anchors[ctx->anchor_count - 1].size = ctx->current_address;
 
-    case INST_LUI: {
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *imm_str = strtok_r(NULL, " \t,", &saveptr);
+  anchor_t *anchor = &ctx->anchors[ctx->anchor_count++];
+  memset(anchor, 0, sizeof(*anchor));
+  anchor->kind = kind;
+  anchor->value = value;
+  anchor->first_ir = ctx->ir_count;
+  anchor->first_label = ctx->label_def_count;
+  ctx->current_address = 0;
+  return 1;
+}
 
-      int rt = parse_register(rt_str);
-      uint32_t imm;
+// A (pointer, length) view of part of a source line
+typedef struct {
+  const char *start;
+  size_t len;
+} token_t;
 
-      if (rt < 0)
-        return 0;
+static int is_separator(char c) {
+  return c == ' ' || c == '\t' || c == ',' || c == '\r';
+}
 
-      if (parse_immediate(imm_str, &imm)) {
-        instruction = encode_i_type(0x0F, 0, rt, imm & 0xFFFF);
-      } else {
-        // Try to resolve as label
-        int label_idx = find_label(ctx, imm_str);
-        if (label_idx >= 0) {
-          uint32_t addr = ctx->labels[label_idx].address;
-          instruction = encode_i_type(0x0F, 0, rt, (addr >> 16) & 0xFFFF);
-        } else {
-          return 0;
-        }
-      }
-      write_be32(ctx, instruction);
+// Split the operand text of a line into whitespace/comma separated tokens
+static int tokenize_operands(const char *p, const char *end, token_t *tokens,
+                             int max_tokens) {
+  int count = 0;
+  while (count < max_tokens) {
+    while (p < end && is_separator(*p))
+      p++;
+    if (p == end)
       break;
-    }
 
-    case INST_LI: {
-      // li is a pseudo-instruction, expand to lui + ori if needed
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *imm_str = strtok_r(NULL, " \t,", &saveptr);
+    tokens[count].start = p;
+    while (p < end && !is_separator(*p))
+      p++;
+    tokens[count].len = p - tokens[count].start;
+    count++;
+  }
+  return count;
+}
 
-      int rt = parse_register(rt_str);
-      uint32_t imm;
+static int parse_reg_operand(const assembler_ctx_t *ctx, const token_t *tokens,
+                             int count, int index, uint8_t *reg,
+                             uint32_t line) {
+  if (index >= count)
+    return line_error(ctx, line, "missing register operand");
 
-      if (rt < 0)
-        return 0;
+  int value = parse_register_n(tokens[index].start, tokens[index].len);
+  if (value < 0) {
+    return line_error(ctx, line, "invalid register '%.*s'",
+                      (int)tokens[index].len, tokens[index].start);
+  }
 
-      if (parse_immediate(imm_str, &imm)) {
-        if (imm <= 0xFFFF) {
-          // Small immediate, use ori with $zero
-          instruction = encode_i_type(0x0D, 0, rt, imm & 0xFFFF);
-          write_be32(ctx, instruction);
-        } else {
-          // Large immediate, use lui + ori
-          instruction = encode_i_type(0x0F, 0, rt, (imm >> 16) & 0xFFFF);
-          write_be32(ctx, instruction);
-          if ((imm & 0xFFFF) != 0) {
-            instruction = encode_i_type(0x0D, rt, rt, imm & 0xFFFF);
-            write_be32(ctx, instruction);
-          }
-        }
-      } else {
-        return 0;
-      }
-      break;
+  *reg = (uint8_t)value;
+  return 1;
+}
+
+static int parse_imm_operand(const assembler_ctx_t *ctx, const token_t *tokens,
+                             int count, int index, uint32_t *value,
+                             uint32_t line) {
+  if (index >= count)
+    return line_error(ctx, line, "missing immediate operand");
+
+  if (!parse_immediate_n(tokens[index].start, tokens[index].len, value)) {
+    return line_error(ctx, line, "invalid immediate '%.*s'",
+                      (int)tokens[index].len, tokens[index].start);
+  }
+  return 1;
+}
+
+// Record a reference to the label named by a token
+static int parse_symbol_operand(assembler_ctx_t *ctx, const token_t *tokens,
+                                int count, int index, int32_t *symbol,
+                                uint32_t line) {
+  if (index >= count)
+    return line_error(ctx, line, "missing label operand");
+
+  int value = symtab_reference(&ctx->symbols, tokens[index].start,
+                               tokens[index].len);
+  if (value < 0)
+    return line_error(ctx, line, "out of memory");
+
+  *symbol = value;
+  return 1;
+}
+
+// Parse an offset(base) memory operand
+static int parse_mem_operand(const assembler_ctx_t *ctx, const token_t *tokens,
+                             int count, int index, uint32_t *offset,
+                             uint8_t *base, uint32_t line) {
+  if (index >= count)
+    return line_error(ctx, line, "missing memory operand");
+
+  const char *start = tokens[index].start;
+  const char *end = start + tokens[index].len;
+  const char *paren = memchr(start, '(', end - start);
+  if (!paren)
+    return line_error(ctx, line, "expected offset(base) operand");
+
+  const char *base_end = memchr(paren, ')', end - paren);
+  if (!base_end)
+    base_end = end;
+
+  if (!parse_immediate_n(start, paren - start, offset)) {
+    return line_error(ctx, line, "invalid offset '%.*s'", (int)(paren - start),
+                      start);
+  }
+
+  int reg = parse_register_n(paren + 1, base_end - paren - 1);
+  if (reg < 0) {
+    return line_error(ctx, line, "invalid base register '%.*s'",
+                      (int)(base_end - paren - 1), paren + 1);
+  }
+
+  *base = (uint8_t)reg;
+  return 1;
+}
+
+// Parse one operand of the given kind into the matching IR field
+static int parse_operand(assembler_ctx_t *ctx, operand_kind_t kind,
+                         const token_t *tokens, int count, int index,
+                         ir_inst_t *parsed, uint32_t line) {
+  switch (kind) {
+  case OPND_RD:
+    return parse_reg_operand(ctx, tokens, count, index, &parsed->rd, line);
+  case OPND_RS:
+    return parse_reg_operand(ctx, tokens, count, index, &parsed->rs, line);
+  case OPND_RT:
+    return parse_reg_operand(ctx, tokens, count, index, &parsed->rt, line);
+  case OPND_IMM:
+    return parse_imm_operand(ctx, tokens, count, index, &parsed->imm, line);
+  case OPND_SHAMT:
+    if (!parse_imm_operand(ctx, tokens, count, index, &parsed->imm, line))
+      return 0;
+    if (parsed->imm > 31)
+      return line_error(ctx, line, "shift amount out of range");
+    return 1;
+  case OPND_MEM:
+    return parse_mem_operand(ctx, tokens, count, index, &parsed->imm,
+                             &parsed->rs, line);
+  case OPND_LABEL:
+    return parse_symbol_operand(ctx, tokens, count, index, &parsed->symbol,
+                                line);
+  case OPND_IMM_OR_LABEL:
+    if (index < count &&
+        !parse_immediate_n(tokens[index].start, tokens[index].len,
+                           &parsed->imm)) {
+      return parse_symbol_operand(ctx, tokens, count, index, &parsed->symbol,
+                                  line);
     }
+    return parse_imm_operand(ctx, tokens, count, index, &parsed->imm, line);
+  case OPND_OPT_RD_RA:
+    parsed->rd = REG_RA;
+    return index >= count ||
+           parse_reg_operand(ctx, tokens, count, index, &parsed->rd, line);
+  case OPND_OPT_CODE:
+    return index >= count ||
+           parse_imm_operand(ctx, tokens, count, index, &parsed->imm, line);
+  case OPND_NONE:
+    break;
+  }
+  return 1;
+}
 
-    case INST_ADDIU: {
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *imm_str = strtok_r(NULL, " \t,", &saveptr);
+// Whether a statement transfers control; the statement after it runs in
+// its delay slot
+static int is_control(const ir_inst_t *ir) {
+  if (ir->type == INST_UNKNOWN || ir->type >= INST_LABEL)
+    return 0;
+  const isa_desc_t *desc = &isa_table[ir->type];
+  return desc->format == FMT_BRANCH || desc->format == FMT_J ||
+         (desc->format == FMT_R &&
+          (desc->funct == 0x08 || desc->funct == 0x09)); // jr, jalr
+}
 
-      int rt = parse_register(rt_str);
-      int rs = parse_register(rs_str);
-      uint32_t imm;
+// Parse an instruction statement into IR (pass 1). The descriptor's operand
+// schema drives parsing; its expansion hook, if any, fixes the size.
+static int parse_instruction_line(assembler_ctx_t *ctx, const char *p,
+                                  const char *end, uint32_t line) {
+  token_t tokens[5];
+  int count = tokenize_operands(p, end, tokens, 5);
+  if (count == 0)
+    return 1;
 
-      if (rt < 0 || rs < 0)
-        return 0;
+  instruction_type_t type = parse_instruction_n(tokens[0].start, tokens[0].len);
+  if (type == INST_UNKNOWN) {
+    return line_error(ctx, line, "unknown instruction '%.*s'",
+                      (int)tokens[0].len, tokens[0].start);
+  }
 
-      if (parse_immediate(imm_str, &imm)) {
-        instruction = encode_i_type(0x09, rs, rt, imm & 0xFFFF);
-        write_be32(ctx, instruction);
-      } else {
-        return 0;
-      }
-      break;
+  const isa_desc_t *desc = &isa_table[type];
+  ir_inst_t parsed = {0};
+  parsed.symbol = -1;
+
+  for (int i = 0; i < 3 && desc->operands[i] != OPND_NONE; i++) {
+    if (!parse_operand(ctx, (operand_kind_t)desc->operands[i], tokens, count,
+                       i + 1, &parsed, line)) {
+      return 0;
     }
+  }
 
-    case INST_SW: {
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *offset_base = strtok_r(NULL, " \t,", &saveptr);
+  // mul, divi and remi work through $at
+  if (desc->format == FMT_PSEUDO && desc->operands[0] == OPND_RD) {
+    if (parsed.rd == REG_AT || parsed.rs == REG_AT) {
+      return line_error(ctx, line, "'%s' uses $at as a temporary",
+                        desc->mnemonic);
+    }
+    if (type != INST_MUL && parsed.imm == 0)
+      return line_error(ctx, line, "division by zero");
+  }
 
-      int rt = parse_register(rt_str);
-      if (rt < 0)
-        return 0;
+  uint32_t size = 4;
+  if (desc->expand) {
+    uint32_t words[ISA_MAX_WORDS];
+    size = 4 * (uint32_t)desc->expand(&parsed, 0, words);
+  }
 
-      // Parse offset(base) format
-      char *paren = strchr(offset_base, '(');
-      if (paren) {
-        *paren = '\0';
-        char *base_str = paren + 1;
-        char *end_paren = strchr(base_str, ')');
-        if (end_paren)
-          *end_paren = '\0';
+  ir_inst_t *ir = append_ir(ctx, type, size, line);
+  if (!ir)
+    return 0;
 
-        int rs = parse_register(base_str);
-        uint32_t offset;
+  ir->rd = parsed.rd;
+  ir->rs = parsed.rs;
+  ir->rt = parsed.rt;
+  ir->imm = parsed.imm;
+  ir->symbol = parsed.symbol;
+  if (ctx->object && desc->format == FMT_PSEUDO)
+    ir->flags = IR_SIGNED_LO;
+
+  // Under .set reorder the delay slot is the assembler's: it starts out as a
+  // nop, which fill_delay_slots() replaces with an earlier instruction
+  if (ctx->reorder && is_control(ir)) {
+    ir = append_ir(ctx, INST_NOP, 4, line);
+    if (!ir)
+      return 0;
+    ir->flags = IR_SLOT;
+    ctx->delay_slots++;
+  }
+  return 1;
+}
 
-        if (rs < 0)
-          return 0;
+// Switch the current section (pass 1)
+static int switch_section(assembler_ctx_t *ctx, section_type_t section,
+                          uint32_t line) {
+  TRACE(ctx, MIPS_TRACE_SECTIONS, TRACE_SECTION, NULL, 0, 0, section);
 
-        if (parse_immediate(offset_base, &offset)) {
-          instruction = encode_i_type(0x2B, rs, rt, offset & 0xFFFF);
-          write_be32(ctx, instruction);
-        } else {
-          return 0;
-        }
-      } else {
-        return 0;
-      }
+  ctx->current_section = section;
+  if (ctx->relative)
+    return start_anchor(ctx, ANCHOR_SECTION, section, line);
+
+  ctx->current_address = (section == SECTION_TEXT)
+                             ? ctx->text_address + ctx->text_size
+                             : ctx->data_address + ctx->data_size;
+  return 1;
+}
+
+// Parse the comma separated values of .word/.half/.byte (pass 1)
+static int parse_data_values(assembler_ctx_t *ctx, const char *p,
+                             const char *end, int width, uint32_t line) {
+  while (p < end) {
+    while (p < end && is_separator(*p))
+      p++;
+    if (p == end)
       break;
-    }
 
-    case INST_BNEZ: {
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *label_str = strtok_r(NULL, " \t,", &saveptr);
+    const char *start = p;
+    while (p < end && !is_separator(*p))
+      p++;
 
-      int rs = parse_register(rs_str);
-      if (rs < 0)
+    uint32_t value;
+    if (parse_immediate_n(start, p - start, &value)) {
+      // Big endian: high byte first
+      uint8_t bytes[4] = {(value >> 24) & 0xFF, (value >> 16) & 0xFF,
+                          (value >> 8) & 0xFF, value & 0xFF};
+      if (!append_data(ctx, bytes + (4 - width), width, line))
         return 0;
-
-      int label_idx = find_label(ctx, label_str);
-      if (label_idx >= 0) {
-        int32_t offset = (int32_t)(ctx->labels[label_idx].address -
-                                   (ctx->current_address + 4)) /
-                         4;
-        instruction = encode_i_type(0x05, rs, 0, offset & 0xFFFF);
-        write_be32(ctx, instruction);
-      } else {
+    } else if (width == 4) {
+      // Label address, resolved in pass 2
+      int symbol = symtab_reference(&ctx->symbols, start, p - start);
+      if (symbol < 0)
+        return line_error(ctx, line, "out of memory");
+
+      ir_inst_t *ir = append_ir(ctx, INST_WORD, 4, line);
+      if (!ir)
         return 0;
-      }
-      break;
+      ir->symbol = symbol;
+    } else {
+      return line_error(ctx, line, "invalid value '%.*s'", (int)(p - start),
+                        start);
     }
+  }
+  return 1;
+}
 
-    case INST_B: {
-      char *label_str = strtok_r(NULL, " \t,", &saveptr);
+// Set binding flags on the labels named by .globl or .extern (pass 1).
+// .globl takes a list of names; .extern a name and an optional size.
+static int declare_symbols(assembler_ctx_t *ctx, const char *p,
+                           const char *end, uint8_t binding, uint32_t line) {
+  int count = 0;
+  while (p < end) {
+    while (p < end && is_separator(*p))
+      p++;
+    if (p == end)
+      break;
 
-      int label_idx = find_label(ctx, label_str);
-      if (label_idx >= 0) {
-        int32_t offset = (int32_t)(ctx->labels[label_idx].address -
-                                   (ctx->current_address + 4)) /
-                         4;
-        instruction = encode_i_type(0x04, 0, 0, offset & 0xFFFF);
-        write_be32(ctx, instruction);
-      } else {
-        return 0;
-      }
+    const char *start = p;
+    while (p < end && !is_separator(*p))
+      p++;
+
+    int symbol = symtab_reference(&ctx->symbols, start, p - start);
+    if (symbol < 0)
+      return line_error(ctx, line, "out of memory");
+    ctx->symbols.entries[symbol].binding |= binding;
+    count++;
+    if (binding == LABEL_EXTERN)
       break;
+  }
+
+  if (count == 0)
+    return line_error(ctx, line, "missing symbol name");
+  return 1;
+}
+
+// Parse an assembler directive (.word, .byte, etc.) into IR (pass 1)
+static int parse_directive(assembler_ctx_t *ctx, const char *p,
+                           const char *end, uint32_t line) {
+  const char *name = p;
+  while (p < end && !isspace((unsigned char)*p))
+    p++;
+  size_t name_len = p - name;
+  while (p < end && isspace((unsigned char)*p))
+    p++;
+
+#define DIRECTIVE_IS(str)                                                      \
+  (name_len == sizeof(str) - 1 && memcmp(name, str, name_len) == 0)
+
+  TRACE(ctx, MIPS_TRACE_DIRECTIVES, TRACE_DIRECTIVE, name, name_len, 0, 0);
+
+  if (DIRECTIVE_IS("text")) {
+    return switch_section(ctx, SECTION_TEXT, line);
+  } else if (DIRECTIVE_IS("data")) {
+    return switch_section(ctx, SECTION_DATA, line);
+  } else if (DIRECTIVE_IS("org")) {
+    // .org directive - set the section's base address (only on first use)
+    token_t token;
+    ctx->positional = 1;
+    uint32_t address;
+    if (!tokenize_operands(p, end, &token, 1) ||
+        !parse_immediate_n(token.start, token.len, &address)) {
+      return line_error(ctx, line, "invalid .org address");
     }
 
-    case INST_ANDI: {
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *imm_str = strtok_r(NULL, " \t,", &saveptr);
+    TRACE(ctx, MIPS_TRACE_SECTIONS, TRACE_ORG, NULL, 0, address,
+          ctx->current_section);
 
-      int rt = parse_register(rt_str);
-      int rs = parse_register(rs_str);
-      uint32_t imm;
+    // In a chunk the section's size is not known yet
+    if (ctx->relative)
+      return start_anchor(ctx, ANCHOR_ORG, address, line);
 
-      if (rt < 0 || rs < 0)
-        return 0;
+    if (ctx->current_section == SECTION_TEXT) {
+      if (ctx->text_size == 0)
+        ctx->text_address = address;
+      ctx->current_address = ctx->text_address + ctx->text_size;
+    } else {
+      if (ctx->data_size == 0)
+        ctx->data_address = address;
+      ctx->current_address = ctx->data_address + ctx->data_size;
+    }
+  } else if (DIRECTIVE_IS("set")) {
+    // .set reorder/noreorder; other options are ignored
+    token_t token;
+    if (tokenize_operands(p, end, &token, 1)) {
+      if (token.len == 7 && memcmp(token.start, "reorder", 7) == 0)
+        ctx->reorder = 1;
+      else if (token.len == 9 && memcmp(token.start, "noreorder", 9) == 0)
+        ctx->reorder = 0;
+    }
+  } else if (DIRECTIVE_IS("globl") || DIRECTIVE_IS("global")) {
+    return declare_symbols(ctx, p, end, LABEL_GLOBAL, line);
+  } else if (DIRECTIVE_IS("extern")) {
+    return declare_symbols(ctx, p, end, LABEL_EXTERN, line);
+  } else if (DIRECTIVE_IS("word")) {
+    return parse_data_values(ctx, p, end, 4, line);
+  } else if (DIRECTIVE_IS("half") || DIRECTIVE_IS("short")) {
+    return parse_data_values(ctx, p, end, 2, line);
+  } else if (DIRECTIVE_IS("byte")) {
+    return parse_data_values(ctx, p, end, 1, line);
+  } else if (DIRECTIVE_IS("ascii") || DIRECTIVE_IS("asciiz")) {
+    // Bytes between the quotes are copied verbatim
+    if (p == end || *p != '"')
+      return line_error(ctx, line, "expected string literal");
+
+    const char *str = p + 1;
+    const char *end_quote = memchr(str, '"', end - str);
+    if (!end_quote)
+      return line_error(ctx, line, "unterminated string literal");
+
+    if (!append_data(ctx, str, end_quote - str, line))
+      return 0;
 
-      if (parse_immediate(imm_str, &imm)) {
-        instruction = encode_i_type(0x0C, rs, rt, imm & 0xFFFF);
-        write_be32(ctx, instruction);
-      } else {
-        return 0;
-      }
-      break;
+    // .asciiz also emits the null terminator
+    if (DIRECTIVE_IS("asciiz")) {
+      uint8_t zero = 0;
+      return append_data(ctx, &zero, 1, line);
+    }
+  } else if (DIRECTIVE_IS("space") || DIRECTIVE_IS("skip") ||
+             DIRECTIVE_IS("align")) {
+    token_t token;
+    uint32_t value;
+    if (!tokenize_operands(p, end, &token, 1) ||
+        !parse_immediate_n(token.start, token.len, &value)) {
+      return line_error(ctx, line, "invalid .%.*s operand", (int)name_len,
+                        name);
     }
 
-    case INST_BEQ: {
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *label_str = strtok_r(NULL, " \t,", &saveptr);
+    if (DIRECTIVE_IS("align")) {
+      // Pad to a 2^value boundary
+      ctx->positional = 1;
+      if (value > 31)
+        return line_error(ctx, line, "alignment out of range");
 
-      int rs = parse_register(rs_str);
-      int rt = parse_register(rt_str);
+      if (value == 0)
+        return 1;
 
-      if (rs < 0 || rt < 0)
+      // In a chunk the padding depends on the absolute address; the
+      // statement is sized when the anchor is resolved
+      if (ctx->relative && !start_anchor(ctx, ANCHOR_ALIGN, value, line))
         return 0;
 
-      int label_idx = find_label(ctx, label_str);
-      if (label_idx >= 0) {
-        int32_t offset = (int32_t)(ctx->labels[label_idx].address -
-                                   (ctx->current_address + 4)) /
-                         4;
-        instruction = encode_i_type(0x04, rs, rt, offset & 0xFFFF);
-        write_be32(ctx, instruction);
-      } else {
+      // The statement is kept even when there is nothing to pad, so the
+      // padding can be worked out again if code before it shrinks
+      uint32_t mask = (1u << value) - 1;
+      uint32_t padding =
+          ctx->relative ? 0 : (0u - ctx->current_address) & mask;
+      ir_inst_t *ir = append_ir(ctx, INST_SPACE, padding, line);
+      if (!ir)
         return 0;
-      }
-      break;
+      ir->imm = value;
+      ir->flags = IR_ALIGN;
+      return 1;
     }
 
-    case INST_BNE: {
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *label_str = strtok_r(NULL, " \t,", &saveptr);
+    if (value > 0 && !append_ir(ctx, INST_SPACE, value, line))
+      return 0;
+  }
+  // Other directives are ignored
+
+#undef DIRECTIVE_IS
 
-      int rs = parse_register(rs_str);
-      int rt = parse_register(rt_str);
+  return 1;
+}
 
-      if (rs < 0 || rt < 0)
-        return 0;
+// Process the code part of one lexed source line (pass 1)
+static int process_line(assembler_ctx_t *ctx, const lex_line_t *src,
+                        uint32_t line) {
+  const char *p = src->start;
+  const char *end = src->code_end;
+  const char *colon = src->colon;
 
-      int label_idx = find_label(ctx, label_str);
-      if (label_idx >= 0) {
-        int32_t offset = (int32_t)(ctx->labels[label_idx].address -
-                                   (ctx->current_address + 4)) /
-                         4;
-        instruction = encode_i_type(0x05, rs, rt, offset & 0xFFFF);
-        write_be32(ctx, instruction);
-      } else {
-        return 0;
-      }
-      break;
-    }
+  // Skip empty lines and whitespace
+  while (p < end && isspace((unsigned char)*p))
+    p++;
 
-    case INST_BEQZ: {
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *label_str = strtok_r(NULL, " \t,", &saveptr);
+  // Labels: everything up to a ':' that comes before any string literal
+  while (colon) {
+    const char *name_end = colon;
+    while (name_end > p && isspace((unsigned char)name_end[-1]))
+      name_end--;
 
-      int rs = parse_register(rs_str);
-      if (rs < 0)
-        return 0;
+    // Add the label with the current address (which depends on the current
+    // section)
+    if (!define_label(ctx, p, name_end - p, ctx->current_address))
+      return 0;
 
-      int label_idx = find_label(ctx, label_str);
-      if (label_idx >= 0) {
-        int32_t offset = (int32_t)(ctx->labels[label_idx].address -
-                                   (ctx->current_address + 4)) /
-                         4;
-        instruction = encode_i_type(0x04, rs, 0, offset & 0xFFFF);
-        write_be32(ctx, instruction);
-      } else {
-        return 0;
-      }
-      break;
+    // Move past the label for instruction processing
+    p = colon + 1;
+    while (p < end && isspace((unsigned char)*p))
+      p++;
+
+    // Further labels on the same line
+    colon = p;
+    while (colon < end && *colon != ':' && *colon != '"')
+      colon++;
+    if (colon == end || *colon != ':')
+      colon = NULL;
+  }
+
+  if (p == end)
+    return 1;
+
+  if (*p == '.')
+    return parse_directive(ctx, p + 1, end, line);
+
+  return parse_instruction_line(ctx, p, end, line);
+}
+
+// Whether a label is left for another module to define: declared with
+// .globl or .extern but not defined here
+static int is_external(const label_t *label) {
+  return !label->resolved &&
+         (label->binding & (LABEL_GLOBAL | LABEL_EXTERN)) != 0;
+}
+
+// Resolve the label referenced by a statement (pass 2). In a relocatable
+// object an external label resolves to 0; the linker fills it in.
+static int resolve_symbol(assembler_ctx_t *ctx, const ir_inst_t *ir,
+                          uint32_t *address) {
+  const label_t *label = &ctx->symbols.entries[ir->symbol];
+  if (ctx->object && is_external(label)) {
+    *address = 0;
+    return 1;
+  }
+  if (!label->resolved)
+    return line_error(ctx, ir->line, "undefined label '%s'", label->name);
+
+  *address = label->address;
+  return 1;
+}
+
+// Offset of a label in its section. In a relocatable object this is what a
+// field with a relocation against the label's section holds: the implicit
+// addend of the REL entry. A relocation against an external label's own
+// symbol has no addend.
+static uint32_t section_offset(const assembler_ctx_t *ctx,
+                               const label_t *label) {
+  if (!label->resolved)
+    return 0;
+  uint32_t base = (label->section == SECTION_TEXT) ? ctx->text_address
+                                                   : ctx->data_address;
+  return label->address - base;
+}
+
+static void put_be32(uint8_t *out, uint32_t value) {
+  out[0] = (value >> 24) & 0xFF;
+  out[1] = (value >> 16) & 0xFF;
+  out[2] = (value >> 8) & 0xFF;
+  out[3] = value & 0xFF;
+}
+
+// Whether a branch is taken whatever its registers hold: b, or beq of a
+// register with itself
+static int is_unconditional(const ir_inst_t *ir) {
+  return isa_table[ir->type].opcode == 0x04 && ir->rs == ir->rt;
+}
+
+// Encode a branch relax_branches() lengthened into words. A conditional
+// branch becomes the inverted branch over a nop and the jump, landing on the
+// statement after it: the original delay slot, which now runs in the delay
+// slot of the jump instead. IR_JUMP jumps with j, IR_LONG with lui/ori/jr
+// $at (lui/addiu in an object, for the HI16/LO16 pair).
+static int encode_far_branch(const assembler_ctx_t *ctx, const ir_inst_t *ir,
+                             uint32_t target, uint32_t *words) {
+  int count = 0;
+  int jump_words = (ir->flags & IR_LONG) ? 3 : 1;
+  if (!is_unconditional(ir)) {
+    words[count++] = encode_i_type(isa_table[ir->type].opcode ^ 0x01, ir->rs,
+                                   ir->rt, (uint16_t)(jump_words + 1));
+    words[count++] = 0; // nop
+  }
+  if (!(ir->flags & IR_LONG)) {
+    words[count++] = encode_j_type(0x02, target >> 2);
+  } else if (ctx->object) {
+    uint32_t hi = (target + 0x8000) >> 16;
+    words[count++] = encode_i_type(0x0F, 0, REG_AT, hi & 0xFFFF);
+    words[count++] = encode_i_type(0x09, REG_AT, REG_AT, target & 0xFFFF);
+    words[count++] = encode_r_type(0, REG_AT, 0, 0, 0, 0x08); // jr $at
+  } else {
+    words[count++] = encode_i_type(0x0F, 0, REG_AT, (target >> 16) & 0xFFFF);
+    words[count++] = encode_i_type(0x0D, REG_AT, REG_AT, target & 0xFFFF);
+    words[count++] = encode_r_type(0, REG_AT, 0, 0, 0, 0x08); // jr $at
+  }
+  return count;
+}
+
+// Encode one IR statement into out, which has room for ir->size bytes
+static int encode_ir(assembler_ctx_t *ctx, const ir_inst_t *ir, uint8_t *out) {
+  uint32_t addr = 0;
+
+  // Statements the peephole pass dropped and filled delay slots emit nothing
+  if (ir->size == 0)
+    return 1;
+
+  switch (ir->type) {
+  case INST_DATA:
+    memcpy(out, ctx->data_pool + ir->imm, ir->size);
+    return 1;
+
+  case INST_SPACE:
+    memset(out, 0, ir->size);
+    return 1;
+
+  case INST_WORD:
+    if (!resolve_symbol(ctx, ir, &addr))
+      return 0;
+    TRACE(ctx, MIPS_TRACE_SYMBOLS, TRACE_WORD_SYMBOL,
+          ctx->symbols.entries[ir->symbol].name,
+          strlen(ctx->symbols.entries[ir->symbol].name), addr, 0);
+    if (ctx->object)
+      addr = section_offset(ctx, &ctx->symbols.entries[ir->symbol]);
+    put_be32(out, addr);
+    return 1;
+
+  default:
+    break;
+  }
+
+  if (ir->type == INST_UNKNOWN || ir->type >= INST_LABEL)
+    return line_error(ctx, ir->line, "cannot encode statement");
+
+  const isa_desc_t *desc = &isa_table[ir->type];
+  const label_t *label = NULL;
+  if (ir->symbol >= 0) {
+    if (!resolve_symbol(ctx, ir, &addr))
+      return 0;
+    label = &ctx->symbols.entries[ir->symbol];
+  }
+
+  // Branches stay PC-relative; every other reference gets a relocation
+  if (label && ctx->object && desc->format != FMT_BRANCH)
+    addr = section_offset(ctx, label);
+
+  uint32_t instruction = 0;
+  switch ((encode_format_t)desc->format) {
+  case FMT_R:
+    instruction = encode_r_type(0, ir->rs, ir->rt, ir->rd, ir->imm & 0x1F,
+                                desc->funct);
+    break;
+
+  case FMT_I: {
+    // lui takes a label for its upper half; a load or store that an la was
+    // folded into adds the label's lower half to its displacement
+    uint32_t imm = ir->imm;
+    if (ir->flags & IR_LO)
+      imm = addr + ir->imm;
+    else if (ir->symbol >= 0)
+      imm = addr >> 16;
+    instruction = encode_i_type(desc->opcode, ir->rs, ir->rt, imm & 0xFFFF);
+    break;
+  }
+
+  case FMT_BRANCH: {
+    if (ir->flags & (IR_JUMP | IR_LONG)) {
+      uint32_t words[5];
+      int count = encode_far_branch(
+          ctx, ir, ctx->object ? section_offset(ctx, label) : addr, words);
+      for (int i = 0; i < count; i++)
+        put_be32(out + 4 * i, words[i]);
+      return 1;
     }
+    int32_t offset = (int32_t)(addr - (ir->address + 4)) / 4;
+    // A branch into another section or module gets a PC16 relocation, whose
+    // addend is the target's offset less the 4 bytes to the delay slot
+    if (ctx->object && (!label->resolved || label->section != ir->section))
+      offset = ((int32_t)section_offset(ctx, label) - 4) / 4;
+    else if (offset < INT16_MIN || offset > INT16_MAX)
+      return line_error(ctx, ir->line, "branch to '%s' out of range",
+                        label->name);
+    instruction = encode_i_type(desc->opcode, ir->rs, ir->rt, offset & 0xFFFF);
+    break;
+  }
 
-    case INST_J: {
-      char *label_str = strtok_r(NULL, " \t,", &saveptr);
+  case FMT_J:
+    instruction = encode_j_type(desc->opcode, addr >> 2);
+    break;
+
+  case FMT_CODE:
+    instruction = encode_r_type(0, 0, 0, 0, 0, desc->funct);
+    instruction |= (ir->imm & 0xFFFFF) << 6;
+    break;
+
+  case FMT_PSEUDO: {
+    uint32_t words[ISA_MAX_WORDS];
+    int count = desc->expand(ir, addr, words);
+    if (ir->symbol >= 0) {
+      TRACE(ctx, MIPS_TRACE_SYMBOLS, TRACE_LOAD_ADDRESS,
+            ctx->symbols.entries[ir->symbol].name,
+            strlen(ctx->symbols.entries[ir->symbol].name), addr, 0);
+    }
+    for (int i = 0; i < count; i++)
+      put_be32(out + 4 * i, words[i]);
+    return 1;
+  }
+  }
 
-      int label_idx = find_label(ctx, label_str);
-      if (label_idx >= 0) {
-        uint32_t target = ctx->labels[label_idx].address >> 2;
-        instruction = encode_j_type(0x02, target);
-        write_be32(ctx, instruction);
-      } else {
-        return 0;
-      }
-      break;
+  put_be32(out, instruction);
+  return 1;
+}
+
+// Write binary file
+// Write an image to a file, or to standard output when filename is "-"
+int write_binary_file(const char *filename, const uint8_t *data, size_t size) {
+  if (strcmp(filename, "-") == 0) {
+    size_t bytes_written = fwrite(data, 1, size, stdout);
+    return (bytes_written == size) && fflush(stdout) == 0;
+  }
+
+  FILE *file = fopen(filename, "wb");
+  if (!file) {
+    return 0;
+  }
+
+  size_t bytes_written = fwrite(data, 1, size, file);
+  fclose(file);
+
+  return (bytes_written == size);
+}
+
+// Debug: print section info
+void print_section_info(assembler_ctx_t *ctx) {
+  info(ctx, "TEXT: base=0x%08X size=%u bytes\n", ctx->text_address,
+          ctx->text_size);
+  info(ctx, "DATA: base=0x%08X size=%u bytes\n", ctx->data_address,
+          ctx->data_size);
+  info(ctx, "Total output size: %zu bytes\n",
+          (size_t)ctx->text_size + ctx->data_size);
+  info(ctx, "Label count: %d\n", ctx->symbols.count);
+
+  // List some labels if any
+  if (ctx->symbols.count > 0) {
+    info(ctx, "Labels:\n");
+    for (int i = 0; i < ctx->symbols.count && i < 10; i++) {
+      info(ctx, "  %s: 0x%08X\n", ctx->symbols.entries[i].name,
+              ctx->symbols.entries[i].address);
+    }
+    if (ctx->symbols.count > 10) {
+      info(ctx, "  (and %d more...)\n", ctx->symbols.count - 10);
     }
+  }
+}
+
+// A newline-aligned slice of the source, parsed by one pass 1 task
+typedef struct pass1_chunk {
+  const char *start;
+  size_t len;
+  assembler_ctx_t ctx; // Chunk-local IR, data, labels and anchors
+  uint32_t lines;      // Number of lines in the chunk
+  int ok;
+  int32_t *remap;     // Chunk symbol index -> merged symbol index
+  size_t ir_base;     // Offset of the chunk's statements in the merged IR
+  size_t pool_base;   // Offset of the chunk's data in the merged data pool
+  uint32_t line_base; // Number of source lines before the chunk
+  int reorder;        // .set reorder state the chunk was parsed from
+} pass1_chunk_t;
+
+// Block size of the per-run scratch arena; it only holds small chunk tables
+#define SCRATCH_BLOCK_SIZE 4096
+
+// Release everything owned by the context except the output image
+static void free_context(assembler_ctx_t *ctx) {
+  trace_destroy(ctx->trace);
+  ctx->trace = NULL;
+  for (int c = 0; c < ctx->chunk_capacity; c++)
+    free_context(&ctx->chunks[c].ctx);
+  free(ctx->chunks);
+  ctx->chunks = NULL;
+  ctx->chunk_capacity = 0;
+  arena_free(&ctx->scratch);
+  symtab_free(&ctx->symbols);
+  free(ctx->ir);
+  free(ctx->data_pool);
+  free(ctx->fixups);
+  free(ctx->anchors);
+  free(ctx->label_defs);
+  ctx->ir = NULL;
+  ctx->data_pool = NULL;
+  ctx->fixups = NULL;
+  ctx->anchors = NULL;
+  ctx->label_defs = NULL;
+}
+
+// Number of worker threads to use when the caller does not say
+static int default_jobs(void) {
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  if (online < 1)
+    return 1;
+  return online > 64 ? 64 : (int)online;
+}
+
+// Forget the previous source, keeping every buffer for reuse
+static void reset_context(assembler_ctx_t *ctx) {
+  ctx->output_size = 0;
+  ctx->ir_count = 0;
+  ctx->data_pool_size = 0;
+  ctx->fixup_count = 0;
+  ctx->anchor_count = 0;
+  ctx->label_def_count = 0;
+  ctx->lines = 0;
+  ctx->pass = 0;
+  ctx->reorder = 0;
+  ctx->delay_slots = 0;
+  ctx->slots_filled = 0;
+  ctx->stalls_before = 0;
+  ctx->stalls_after = 0;
+  ctx->interlocks = 0;
+  ctx->relaxed = 0;
+  ctx->relax_passes = 0;
+  memset(ctx->peephole, 0, sizeof(ctx->peephole));
+  arena_reset(&ctx->scratch);
+  symtab_reset(&ctx->symbols);
 
-    case INST_JAL: {
-      char *label_str = strtok_r(NULL, " \t,", &saveptr);
+  // Initialize section addresses
+  // Default: text at 0x00400000 (typical MIPS program start)
+  //          data at 0x10010000 (typical MIPS data segment start)
+  ctx->text_address = 0x00400000;
+  ctx->data_address = 0x10010000;
+  ctx->text_size = 0;
+  ctx->data_size = 0;
+  ctx->current_address = ctx->text_address; // Start in text section by default
+  ctx->current_section = SECTION_TEXT;
+}
+
+// Set up an empty context with the default memory layout
+static void init_context(assembler_ctx_t *ctx, const mips_options_t *options) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->verbose = options ? options->verbose : 0;
+  ctx->out = (options && options->out) ? options->out : stdout;
+  ctx->err = (options && options->err) ? options->err : stderr;
+  ctx->diag = options ? options->diag : NULL;
+  ctx->diag_arg = options ? options->diag_arg : NULL;
+  ctx->stats = options ? options->stats : NULL;
+  ctx->object = options && options->format == MIPS_FORMAT_ELF;
+  ctx->optimize = options ? options->optimize : 0;
+  ctx->schedule = options ? options->schedule : 0;
+#ifndef MIPSASM_NO_TRACE
+  if (ctx->verbose) {
+    ctx->trace = trace_create(format_trace_event, ctx);
+    ctx->trace_mask = (options->trace) ? options->trace : MIPS_TRACE_ALL;
+    if (!ctx->trace)
+      ctx->trace_mask = 0;
+  }
+#endif
+  symtab_init(&ctx->symbols);
+  arena_init(&ctx->scratch, SCRATCH_BLOCK_SIZE);
+  reset_context(ctx);
+}
 
-      int label_idx = find_label(ctx, label_str);
-      if (label_idx >= 0) {
-        uint32_t target = ctx->labels[label_idx].address >> 2;
-        instruction = encode_j_type(0x03, target);
-        write_be32(ctx, instruction);
-      } else {
-        return 0;
-      }
-      break;
+// Serial pass 1: parse every line into IR, assigning addresses as we go
+static int parse_source(assembler_ctx_t *ctx, const char *source,
+                        size_t source_len) {
+  lexer_t lexer;
+  lex_line_t src;
+  uint32_t line = 1;
+
+  lexer_init(&lexer, source, source_len);
+  while (lexer_next_line(&lexer, &src)) {
+    if (!process_line(ctx, &src, line)) {
+      report(ctx, "Error processing line %u: %.*s\n", line,
+              (int)(src.end - src.start), src.start);
+      return 0;
     }
+    line++;
+  }
+  ctx->lines = line - 1;
+  return 1;
+}
 
-    case INST_LW: {
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *offset_base = strtok_r(NULL, " \t,", &saveptr);
+// Create the thread pool on first use
+static threadpool_t *get_pool(threadpool_t **pool, int jobs) {
+  if (!*pool)
+    *pool = threadpool_create(jobs);
+  return *pool;
+}
 
-      int rt = parse_register(rt_str);
-      if (rt < 0)
-        return 0;
+// Minimum number of source bytes per chunk before pass 1 is split across
+// threads; smaller sources are not worth the merge
+#ifndef PASS1_MIN_CHUNK
+#define PASS1_MIN_CHUNK (256 * 1024)
+#endif
+
+// Shared state of the parallel pass 1 tasks
+typedef struct {
+  assembler_ctx_t *ctx; // Merged context
+  pass1_chunk_t *chunks;
+} pass1_job_t;
+
+// Task: parse one chunk with addresses relative to its anchors
+static void pass1_parse_chunk(void *arg, int index) {
+  pass1_chunk_t *chunk = &((pass1_job_t *)arg)->chunks[index];
+  assembler_ctx_t *ctx = &chunk->ctx;
+  lexer_t lexer;
+  lex_line_t src;
+  uint32_t line = 1;
+
+  chunk->ok = start_anchor(ctx, ANCHOR_START, 0, line);
+  lexer_init(&lexer, chunk->start, chunk->len);
+  while (chunk->ok && lexer_next_line(&lexer, &src)) {
+    chunk->ok = process_line(ctx, &src, line);
+    line++;
+  }
 
-      // Parse offset(base) format
-      char *paren = strchr(offset_base, '(');
-      if (paren) {
-        *paren = '\0';
-        char *base_str = paren + 1;
-        char *end_paren = strchr(base_str, ')');
-        if (end_paren)
-          *end_paren = '\0';
-
-        int rs = parse_register(base_str);
-        if (rs < 0)
-          return 0;
+  chunk->lines = line - 1;
+  if (chunk->ok)
+    ctx->anchors[ctx->anchor_count - 1].size = ctx->current_address;
+}
 
-        uint32_t offset;
-        if (parse_immediate(offset_base, &offset)) {
-          instruction = encode_i_type(0x23, rs, rt, offset & 0xFFFF);
-          write_be32(ctx, instruction);
-        } else {
+// Walk every anchor in source order, replaying section switches, .org and
+// .align on the real section state to give each run its absolute address.
+// Only the per-run sizes are needed, so this is cheap and stays serial.
+static int pass1_resolve_anchors(assembler_ctx_t *ctx, pass1_chunk_t *chunks,
+                                 int count) {
+  for (int c = 0; c < count; c++) {
+    assembler_ctx_t *chunk_ctx = &chunks[c].ctx;
+    for (size_t i = 0; i < chunk_ctx->anchor_count; i++) {
+      anchor_t *anchor = &chunk_ctx->anchors[i];
+      if (anchor->kind == ANCHOR_SECTION)
+        ctx->current_section = (section_type_t)anchor->value;
+
+      int text = (ctx->current_section == SECTION_TEXT);
+      uint32_t *base = text ? &ctx->text_address : &ctx->data_address;
+      uint32_t *size = text ? &ctx->text_size : &ctx->data_size;
+      if (anchor->kind == ANCHOR_ORG && *size == 0)
+        *base = anchor->value;
+
+      uint32_t address = *base + *size;
+      anchor->padding = 0;
+      if (anchor->kind == ANCHOR_ALIGN) {
+        anchor->padding = (0u - address) & ((1u << anchor->value) - 1);
+        if (anchor->padding > UINT32_MAX - address)
           return 0;
-        }
-      } else {
-        return 0;
+        address += anchor->padding;
+        *size += anchor->padding;
       }
-      break;
-    }
 
-    // R-type instructions
-    case INST_ADD: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
+      // Overflow is diagnosed by the serial pass
+      if (anchor->size > UINT32_MAX - address)
+        return 0;
 
-      int rd = parse_register(rd_str);
-      int rs = parse_register(rs_str);
-      int rt = parse_register(rt_str);
+      anchor->address = address;
+      anchor->section = ctx->current_section;
+      *size += anchor->size;
+      ctx->current_address = address + anchor->size;
+    }
+  }
+  return 1;
+}
 
-      if (rd < 0 || rs < 0 || rt < 0)
-        return 0;
+// Task: turn a chunk's relative statement and label addresses into absolute
+// ones
+static void pass1_relocate_chunk(void *arg, int index) {
+  pass1_chunk_t *chunk = &((pass1_job_t *)arg)->chunks[index];
+  assembler_ctx_t *ctx = &chunk->ctx;
+
+  for (size_t a = 0; a < ctx->anchor_count; a++) {
+    const anchor_t *anchor = &ctx->anchors[a];
+    size_t ir_end = (a + 1 < ctx->anchor_count) ? anchor[1].first_ir
+                                                : ctx->ir_count;
+    size_t label_end = (a + 1 < ctx->anchor_count) ? anchor[1].first_label
+                                                   : ctx->label_def_count;
+    size_t i = anchor->first_ir;
+
+    if (anchor->kind == ANCHOR_ALIGN) {
+      // The padding statement sits in front of the aligned address
+      ctx->ir[i].address = anchor->address - anchor->padding;
+      ctx->ir[i].size = anchor->padding;
+      ctx->ir[i].section = anchor->section;
+      ctx->ir[i].line += chunk->line_base;
+      i++;
+    }
 
-      instruction = encode_r_type(0, rs, rt, rd, 0, 0x20);
-      write_be32(ctx, instruction);
-      break;
+    for (; i < ir_end; i++) {
+      ctx->ir[i].address += anchor->address;
+      ctx->ir[i].section = anchor->section;
+      ctx->ir[i].line += chunk->line_base;
     }
 
-    case INST_SUB: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
+    for (i = anchor->first_label; i < label_end; i++) {
+      label_t *label = &ctx->symbols.entries[ctx->label_defs[i]];
+      label->address += anchor->address;
+      label->section = anchor->section;
+      label->statement += (uint32_t)chunk->ir_base;
+    }
+  }
+}
 
-      int rd = parse_register(rd_str);
-      int rs = parse_register(rs_str);
-      int rt = parse_register(rt_str);
+// Task: copy a chunk's statements and data into the merged arrays, mapping
+// symbol indices and data pool offsets
+static void pass1_copy_chunk(void *arg, int index) {
+  pass1_job_t *job = arg;
+  pass1_chunk_t *chunk = &job->chunks[index];
+  const assembler_ctx_t *ctx = &chunk->ctx;
+  ir_inst_t *ir = job->ctx->ir + chunk->ir_base;
+
+  memcpy(ir, ctx->ir, ctx->ir_count * sizeof(ir_inst_t));
+  for (size_t i = 0; i < ctx->ir_count; i++) {
+    if (ir[i].symbol >= 0)
+      ir[i].symbol = chunk->remap[ir[i].symbol];
+    if (ir[i].type == INST_DATA)
+      ir[i].imm += (uint32_t)chunk->pool_base;
+  }
 
-      if (rd < 0 || rs < 0 || rt < 0)
-        return 0;
+  if (ctx->data_pool_size > 0) {
+    memcpy(job->ctx->data_pool + chunk->pool_base, ctx->data_pool,
+           ctx->data_pool_size);
+  }
+}
 
-      instruction = encode_r_type(0, rs, rt, rd, 0, 0x22);
-      write_be32(ctx, instruction);
-      break;
+// The .set reorder state a stretch of source leaves behind, from a plain
+// text search for the directive. Parallel pass 1 guesses the state each
+// chunk starts in with it; a directive it misreads (in a comment, say) only
+// costs the serial fallback, as the guesses are checked after parsing.
+static int scan_reorder(const char *p, const char *end, int reorder) {
+  while ((p = memchr(p, '.', (size_t)(end - p))) != NULL) {
+    p++;
+    if (end - p < 4 || memcmp(p, "set", 3) != 0 ||
+        !isspace((unsigned char)p[3])) {
+      continue;
     }
+    const char *option = p + 4;
+    while (option < end && (*option == ' ' || *option == '\t'))
+      option++;
+    if (end - option >= 7 && memcmp(option, "reorder", 7) == 0)
+      reorder = 1;
+    else if (end - option >= 9 && memcmp(option, "noreorder", 9) == 0)
+      reorder = 0;
+  }
+  return reorder;
+}
 
-    case INST_AND: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
+// The context's count chunks for parallel pass 1. Chunk contexts are created
+// on first use and kept, so a warm context parses without allocating.
+static pass1_chunk_t *get_chunks(assembler_ctx_t *ctx, int count) {
+  if (count > ctx->chunk_capacity) {
+    pass1_chunk_t *grown =
+        realloc(ctx->chunks, (size_t)count * sizeof(pass1_chunk_t));
+    if (!grown)
+      return NULL;
+    ctx->chunks = grown;
+    for (int c = ctx->chunk_capacity; c < count; c++) {
+      init_context(&grown[c].ctx, NULL);
+      grown[c].ctx.quiet = 1;
+      grown[c].ctx.relative = 1;
+    }
+    ctx->chunk_capacity = count;
+  }
+  return ctx->chunks;
+}
 
-      int rd = parse_register(rd_str);
-      int rs = parse_register(rs_str);
-      int rt = parse_register(rt_str);
+// Parallel pass 1. The source is split into newline-aligned chunks that are
+// parsed concurrently, each with addresses relative to anchors (chunk start,
+// section switch, .org, .align). A serial walk over the anchors then fixes
+// their absolute addresses, chunk label tables are merged, and the chunks'
+// statements are relocated and concatenated in parallel at offsets given by
+// prefix sums. Returns 0 if the source is too small to split or if any chunk
+// failed; the caller then runs the serial pass, which also produces the
+// diagnostics in source order.
+static int parse_source_parallel(assembler_ctx_t *ctx, const char *source,
+                                 size_t source_len, threadpool_t **pool,
+                                 int jobs) {
+  int count = jobs;
+  if ((size_t)count > source_len / PASS1_MIN_CHUNK)
+    count = (int)(source_len / PASS1_MIN_CHUNK);
+  if (count < 2 || !get_pool(pool, jobs))
+    return 0;
 
-      if (rd < 0 || rs < 0 || rt < 0)
-        return 0;
+  pass1_chunk_t *chunks = get_chunks(ctx, count);
+  if (!chunks)
+    return 0;
 
-      instruction = encode_r_type(0, rs, rt, rd, 0, 0x24);
-      write_be32(ctx, instruction);
-      break;
+  // Cut at the first newline after each even split point
+  const char *source_end = source + source_len;
+  const char *start = source;
+  int used = 0;
+  int reorder = ctx->reorder;
+  for (int c = 0; c < count && start < source_end; c++) {
+    const char *end = source_end;
+    if (c + 1 < count) {
+      const char *split = source + source_len / count * (c + 1);
+      if (split < start)
+        split = start;
+      end = memchr(split, '\n', source_end - split);
+      end = end ? end + 1 : source_end;
     }
 
-    case INST_OR: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
+    pass1_chunk_t *chunk = &chunks[used++];
+    chunk->start = start;
+    chunk->len = end - start;
+    chunk->ok = 0;
+    chunk->remap = NULL;
+    reset_context(&chunk->ctx);
+    chunk->ctx.object = ctx->object;
+    chunk->ctx.pass = 1;
+    chunk->reorder = reorder;
+    chunk->ctx.reorder = reorder;
+    start = end;
+    if (c + 1 < count)
+      reorder = scan_reorder(chunk->start, end, reorder);
+  }
+  count = used;
+
+  pass1_job_t job = {ctx, chunks};
+  int ok = 1;
+  threadpool_run(*pool, pass1_parse_chunk, &job, count);
+  for (int c = 0; c < count; c++)
+    ok = ok && chunks[c].ok;
+
+  // Each chunk must have started in the .set reorder state the one before
+  // it left
+  reorder = ctx->reorder;
+  for (int c = 0; ok && c < count; c++) {
+    ok = chunks[c].reorder == reorder;
+    reorder = chunks[c].ctx.reorder;
+    ctx->delay_slots += chunks[c].ctx.delay_slots;
+  }
+  ctx->reorder = reorder;
+
+  // Prefix sums over the chunks give line numbers and merged offsets
+  size_t ir_total = 0;
+  size_t pool_total = 0;
+  uint32_t lines = 0;
+  for (int c = 0; ok && c < count; c++) {
+    chunks[c].line_base = lines;
+    chunks[c].ir_base = ir_total;
+    chunks[c].pool_base = pool_total;
+    lines += chunks[c].lines;
+    ir_total += chunks[c].ctx.ir_count;
+    pool_total += chunks[c].ctx.data_pool_size;
+  }
 
-      int rd = parse_register(rd_str);
-      int rs = parse_register(rs_str);
-      int rt = parse_register(rt_str);
+  ok = ok && pool_total <= UINT32_MAX &&
+       pass1_resolve_anchors(ctx, chunks, count);
+  if (ok)
+    threadpool_run(*pool, pass1_relocate_chunk, &job, count);
+
+  // Merge the label tables in source order, so entries keep their order of
+  // first appearance
+  for (int c = 0; ok && c < count; c++) {
+    const symtab_t *symbols = &chunks[c].ctx.symbols;
+    ctx->symbols.lookups += symbols->lookups;
+    ctx->symbols.probes += symbols->probes;
+    chunks[c].remap = arena_alloc(
+        &ctx->scratch, ((size_t)symbols->count + 1) * sizeof(int32_t));
+    ok = chunks[c].remap != NULL;
+    for (int i = 0; ok && i < symbols->count; i++) {
+      int index = symtab_import(&ctx->symbols, &symbols->entries[i]);
+      chunks[c].remap[i] = index;
+      ok = index >= 0;
+    }
+  }
 
-      if (rd < 0 || rs < 0 || rt < 0)
-        return 0;
+  ok = ok &&
+       grow_array((void **)&ctx->ir, &ctx->ir_capacity, ir_total + 1,
+                  sizeof(ir_inst_t), 1024) &&
+       grow_array((void **)&ctx->data_pool, &ctx->data_pool_capacity,
+                  pool_total + 1, 1, OUTPUT_INITIAL_SIZE);
+  if (ok) {
+    threadpool_run(*pool, pass1_copy_chunk, &job, count);
+    ctx->ir_count = ir_total;
+    ctx->data_pool_size = pool_total;
+    ctx->lines = lines;
+  }
 
-      instruction = encode_r_type(0, rs, rt, rd, 0, 0x25);
-      write_be32(ctx, instruction);
-      break;
-    }
+  return ok;
+}
 
-    case INST_XOR: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
+// Whether a machine word is mult, multu, div or divu, which write HI and LO
+static int writes_hilo(uint32_t word) {
+  return (word >> 26) == 0 && (word & 0x3F) >= 0x18 && (word & 0x3F) <= 0x1B;
+}
 
-      int rd = parse_register(rd_str);
-      int rs = parse_register(rs_str);
-      int rt = parse_register(rt_str);
+// Whether a machine word is mfhi or mflo
+static int reads_hilo(uint32_t word) {
+  return (word >> 26) == 0 && ((word & 0x3F) == 0x10 || (word & 0x3F) == 0x12);
+}
 
-      if (rd < 0 || rs < 0 || rt < 0)
-        return 0;
+// Registers a statement reads and writes, as masks over $1-$31 (bit n for
+// $n) plus HI and LO. $zero is left out; it never carries a dependency.
+#define REGS_HI (1ull << 32)
+#define REGS_LO (1ull << 33)
+#define REGS_ALL 0x3FFFFFFFEull
+
+static void statement_registers(const ir_inst_t *ir, uint64_t *uses,
+                                uint64_t *defs) {
+  *uses = 0;
+  *defs = 0;
+  if (ir->type == INST_UNKNOWN || ir->type >= INST_LABEL)
+    return;
 
-      instruction = encode_r_type(0, rs, rt, rd, 0, 0x26);
-      write_be32(ctx, instruction);
+  const isa_desc_t *desc = &isa_table[ir->type];
+  uint64_t rs = 1ull << ir->rs;
+  uint64_t rt = 1ull << ir->rt;
+  uint64_t rd = 1ull << ir->rd;
+  switch ((encode_format_t)desc->format) {
+  case FMT_R:
+    switch (desc->funct) {
+    case 0x10: // mfhi
+      *uses = REGS_HI;
+      *defs = rd;
       break;
+    case 0x12: // mflo
+      *uses = REGS_LO;
+      *defs = rd;
+      break;
+    case 0x11: // mthi
+      *uses = rs;
+      *defs = REGS_HI;
+      break;
+    case 0x13: // mtlo
+      *uses = rs;
+      *defs = REGS_LO;
+      break;
+    case 0x18: // mult, multu, div, divu
+    case 0x19:
+    case 0x1A:
+    case 0x1B:
+      *uses = rs | rt;
+      *defs = REGS_HI | REGS_LO;
+      break;
+    case 0x0C: // syscall: the handler may read and write anything
+      *uses = REGS_ALL;
+      *defs = REGS_ALL;
+      break;
+    default: // Unused register fields are $zero
+      *uses = rs | rt;
+      *defs = rd;
+      break;
+    }
+    break;
+  case FMT_I:
+    if (desc->opcode == 0x0F) { // lui
+      *defs = rt;
+    } else if (desc->opcode >= 0x28) { // Stores
+      *uses = rs | rt;
+    } else {
+      *uses = rs;
+      *defs = rt;
     }
+    break;
+  case FMT_BRANCH:
+    *uses = rs | rt;
+    break;
+  case FMT_J:
+    if (desc->opcode == 0x03) // jal
+      *defs = 1ull << REG_RA;
+    break;
+  case FMT_CODE:
+    break;
+  case FMT_PSEUDO:
+    if (desc->operands[0] == OPND_RD) { // mul, divi, remi
+      uint32_t words[ISA_MAX_WORDS];
+      int count = desc->expand(ir, 0, words);
+      *uses = rs;
+      *defs = rd | (1ull << REG_AT);
+      for (int i = 0; i < count; i++) {
+        if (writes_hilo(words[i]))
+          *defs |= REGS_HI | REGS_LO;
+      }
+    } else { // li, la
+      *defs = rt;
+    }
+    break;
+  }
+  *uses &= ~1ull;
+  *defs &= ~1ull;
+}
 
-    case INST_SLL: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *sa_str = strtok_r(NULL, " \t,", &saveptr);
+// Whether a statement is a load or a store, which take offset(base)
+static int is_memory_access(const ir_inst_t *ir) {
+  return ir->type < INST_LABEL && ir->type != INST_UNKNOWN &&
+         isa_table[ir->type].operands[1] == OPND_MEM;
+}
 
-      int rd = parse_register(rd_str);
-      int rt = parse_register(rt_str);
-      uint32_t sa;
+static int compare_address(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
 
-      if (rd < 0 || rt < 0)
-        return 0;
-      if (!parse_immediate(sa_str, &sa) || sa > 31)
-        return 0;
+// Text labels by address, so the peephole pass can tell which statements
+// may be jumped to
+typedef struct {
+  uint32_t *addresses; // Sorted
+  size_t count;
+} label_index_t;
+
+static int label_index_init(assembler_ctx_t *ctx, label_index_t *index) {
+  index->count = 0;
+  index->addresses = arena_alloc(
+      &ctx->scratch, ((size_t)ctx->symbols.count + 1) * sizeof(uint32_t));
+  if (!index->addresses)
+    return 0;
+  for (int i = 0; i < ctx->symbols.count; i++) {
+    const label_t *label = &ctx->symbols.entries[i];
+    if (label->resolved && label->section == SECTION_TEXT)
+      index->addresses[index->count++] = label->address;
+  }
+  qsort(index->addresses, index->count, sizeof(uint32_t), compare_address);
+  return 1;
+}
 
-      instruction = encode_r_type(0, 0, rt, rd, sa, 0);
-      write_be32(ctx, instruction);
-      break;
-    }
+static int is_label_target(const label_index_t *index, uint32_t address) {
+  return bsearch(&address, index->addresses, index->count, sizeof(uint32_t),
+                 compare_address) != NULL;
+}
 
-    case INST_SRL: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *sa_str = strtok_r(NULL, " \t,", &saveptr);
+// is_label_target() for a walk over text statements in address order;
+// *cursor starts at 0 and only moves forward
+static int next_label_target(const label_index_t *index, size_t *cursor,
+                             uint32_t address) {
+  while (*cursor < index->count && index->addresses[*cursor] < address)
+    (*cursor)++;
+  return *cursor < index->count && index->addresses[*cursor] == address;
+}
 
-      int rd = parse_register(rd_str);
-      int rt = parse_register(rt_str);
-      uint32_t sa;
+// How many statements past a load or store the peephole pass looks for a
+// write that ends the life of the register an la was folded away from
+#define PEEPHOLE_WINDOW 8
+
+// Whether reg is written before it is read after statement first, looking
+// only at the straight-line text that follows it
+static int register_dead_after(const assembler_ctx_t *ctx,
+                               const label_index_t *labels, size_t first,
+                               int reg) {
+  uint64_t bit = 1ull << reg;
+  int seen = 0;
+  for (size_t i = first + 1; i < ctx->ir_count && seen < PEEPHOLE_WINDOW;
+       i++) {
+    const ir_inst_t *ir = &ctx->ir[i];
+    uint64_t uses, defs;
+    if (ir->section != SECTION_TEXT || (ir->flags & IR_ALIGN))
+      continue;
+    if (ir->type >= INST_LABEL || is_label_target(labels, ir->address) ||
+        is_control(ir))
+      return 0;
 
-      if (rd < 0 || rt < 0)
-        return 0;
-      if (!parse_immediate(sa_str, &sa) || sa > 31)
-        return 0;
+    statement_registers(ir, &uses, &defs);
+    if (uses & bit)
+      return 0;
+    if (defs & bit)
+      return 1;
+    seen++;
+  }
+  return 0;
+}
 
-      instruction = encode_r_type(0, 0, rt, rd, sa, 0x02);
-      write_be32(ctx, instruction);
-      break;
+// Peephole rules for one text statement that is not in a delay slot. next
+// is the statement after it when that is text too, else NULL; previous is
+// the instruction before it when that is not in a delay slot either.
+static void peephole_statement(assembler_ctx_t *ctx,
+                               const label_index_t *labels, size_t index,
+                               ir_inst_t *next, const ir_inst_t *previous) {
+  ir_inst_t *ir = &ctx->ir[index];
+
+  switch (ir->type) {
+  case INST_LI:
+    // Negative 16-bit values: addiu $rt, $zero, imm instead of lui + ori
+    if (ir->imm >= 0xFFFF8000 && ir->size > 4) {
+      ir->flags |= IR_SHORT;
+      ir->size = 4;
+      ctx->peephole[MIPS_PEEPHOLE_LI]++;
+    }
+    break;
+
+  case INST_LA: {
+    // la $r, label + lw $x, d($r) => lui $r, %hi(label+d) + lw $x,
+    // %lo(label+d)($r), when $r is not read again with the full address
+    if (next && is_memory_access(next) && next->rs == ir->rt &&
+        ir->rt != REG_ZERO && next->symbol < 0 &&
+        !is_label_target(labels, next->address)) {
+      int load = isa_table[next->type].opcode < 0x28;
+      if ((load && next->rt == ir->rt) ||
+          (next->rt != ir->rt &&
+           register_dead_after(ctx, labels, index + 1, ir->rt))) {
+        ir->flags |= IR_HI;
+        ir->imm = next->imm;
+        ir->size = 4;
+        next->flags |= IR_LO;
+        next->symbol = ir->symbol;
+        ctx->peephole[MIPS_PEEPHOLE_LA_MEM]++;
+        break;
+      }
     }
 
-    case INST_SRA: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *sa_str = strtok_r(NULL, " \t,", &saveptr);
+    // A data label whose address one instruction can load. The rules never
+    // touch the data section, so its labels are final; an object's are not.
+    const label_t *label = &ctx->symbols.entries[ir->symbol];
+    uint32_t address = label->address;
+    if (!ctx->object && label->resolved && label->section == SECTION_DATA &&
+        ((address & 0xFFFF) == 0 || address <= 0xFFFF ||
+         address >= 0xFFFF8000)) {
+      ir->flags |= IR_SHORT;
+      ir->size = 4;
+      ctx->peephole[MIPS_PEEPHOLE_LA]++;
+    }
+    break;
+  }
 
-      int rd = parse_register(rd_str);
-      int rt = parse_register(rt_str);
-      uint32_t sa;
+  case INST_MOVE:
+    // move $r, $r, a move to $zero, and move $a, $b right after move $b, $a
+    if (ir->rd == ir->rs || ir->rd == REG_ZERO ||
+        (previous && previous->type == INST_MOVE &&
+         previous->rd == ir->rs && previous->rs == ir->rd &&
+         !is_label_target(labels, ir->address))) {
+      ir->size = 0;
+      ctx->peephole[MIPS_PEEPHOLE_MOVE]++;
+    }
+    break;
 
-      if (rd < 0 || rt < 0)
-        return 0;
-      if (!parse_immediate(sa_str, &sa) || sa > 31)
-        return 0;
+  default:
+    break;
+  }
+}
 
-      instruction = encode_r_type(0, 0, rt, rd, sa, 0x03);
-      write_be32(ctx, instruction);
-      break;
-    }
+// Lay the text section out again after passes that changed statement
+// sizes: each statement follows the one before it, .align padding is worked
+// out again and text labels move with the statements after them. The data
+// section keeps its layout.
+static void relayout_text(assembler_ctx_t *ctx) {
+  uint32_t address = ctx->text_address;
+  for (size_t i = 0; i < ctx->ir_count; i++) {
+    ir_inst_t *ir = &ctx->ir[i];
+    if (ir->section != SECTION_TEXT)
+      continue;
+    ir->address = address;
+    if (ir->flags & IR_ALIGN)
+      ir->size = (0u - address) & ((1u << ir->imm) - 1);
+    address += ir->size;
+  }
 
-    case INST_JR: {
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
+  // A label sits at the end of the last statement of its section parsed
+  // before it
+  for (int l = 0; l < ctx->symbols.count; l++) {
+    label_t *label = &ctx->symbols.entries[l];
+    if (!label->resolved || label->section != SECTION_TEXT)
+      continue;
+    label->address = ctx->text_address;
+    for (size_t i = label->statement; i-- > 0;) {
+      const ir_inst_t *ir = &ctx->ir[i];
+      if (ir->section == SECTION_TEXT) {
+        label->address = ir->address + ir->size;
+        break;
+      }
+    }
+  }
+  ctx->text_size = address - ctx->text_address;
+}
 
-      int rs = parse_register(rs_str);
-      if (rs < 0)
-        return 0;
+// Peephole pass over the statements of pass 1, for mips_options_t.optimize.
+// Rules only shrink text statements, and never one in a delay slot; the text
+// section is then laid out again.
+static int peephole_pass(assembler_ctx_t *ctx) {
+  label_index_t labels;
+  if (!label_index_init(ctx, &labels)) {
+    report(ctx, "Error: Out of memory\n");
+    return 0;
+  }
 
-      instruction = encode_r_type(0, rs, 0, 0, 0, 0x08);
-      write_be32(ctx, instruction);
-      break;
+  uint64_t hits = 0;
+  for (int r = 0; r < MIPS_PEEPHOLE_RULES; r++)
+    hits += ctx->peephole[r];
+
+  const ir_inst_t *previous = NULL;
+  int previous_in_slot = 0;
+  for (size_t i = 0; i < ctx->ir_count; i++) {
+    ir_inst_t *ir = &ctx->ir[i];
+    if (ir->section != SECTION_TEXT)
+      continue;
+
+    int in_slot = previous && is_control(previous);
+    if (!in_slot) {
+      ir_inst_t *next = (i + 1 < ctx->ir_count &&
+                         ctx->ir[i + 1].section == SECTION_TEXT)
+                            ? &ctx->ir[i + 1]
+                            : NULL;
+      peephole_statement(ctx, &labels, i, next,
+                         previous_in_slot ? NULL : previous);
+    }
+    if (ir->size > 0) {
+      previous = ir;
+      previous_in_slot = in_slot;
     }
+  }
 
-    case INST_JALR: {
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
+  for (int r = 0; r < MIPS_PEEPHOLE_RULES; r++)
+    hits -= ctx->peephole[r];
+  if (hits != 0)
+    relayout_text(ctx);
+  return 1;
+}
 
-      int rs = parse_register(rs_str);
-      int rd =
-          (rd_str) ? parse_register(rd_str) : 31; // default to $ra if no rd
+static int is_load(const ir_inst_t *ir) {
+  return is_memory_access(ir) && isa_table[ir->type].opcode < 0x28;
+}
 
-      if (rs < 0 || rd < 0)
-        return 0;
+// Whether the instructions right after `ir` are restricted on MIPS I: a
+// load's register cannot be read by the next one, and HI or LO cannot be
+// written by the next two after mfhi or mflo
+static int has_hazard(const ir_inst_t *ir) {
+  return is_load(ir) || ir->type == INST_MFHI || ir->type == INST_MFLO;
+}
 
-      instruction = encode_r_type(0, rs, 0, rd, 0, 0x09);
-      write_be32(ctx, instruction);
-      break;
-    }
+// Whether the one-word instruction `ir` can move from just before `branch`
+// into its delay slot: the branch must not read what it writes, and nothing
+// it reads or writes may be written by the branch (jal and jalr set the
+// return address before the slot runs). Instructions that end the program or
+// carry half of a %hi/%lo pair stay where they are, and so do those with a
+// hazard, which the fall-through path and the target would both follow.
+static int can_fill_slot(const ir_inst_t *ir, const ir_inst_t *branch) {
+  if (ir->size != 4 || ir->type == INST_UNKNOWN || ir->type >= INST_LABEL ||
+      ir->type == INST_SYSCALL || ir->type == INST_BREAK ||
+      (ir->flags & (IR_SLOT | IR_HI | IR_LO)) || is_control(ir) ||
+      has_hazard(ir)) {
+    return 0;
+  }
 
-    case INST_SYSCALL: {
-      instruction = encode_r_type(0, 0, 0, 0, 0, 0x0C);
-      write_be32(ctx, instruction);
-      break;
-    }
+  uint64_t uses, defs, branch_uses, branch_defs;
+  statement_registers(ir, &uses, &defs);
+  statement_registers(branch, &branch_uses, &branch_defs);
+  return (branch_uses & defs) == 0 && (branch_defs & (uses | defs)) == 0;
+}
 
-    case INST_BREAK: {
-      char *code_str = strtok_r(NULL, " \t,", &saveptr);
-      uint32_t code = 0;
+// Fill the delay slots that .set reorder added: when the statement before a
+// branch is independent of it, is not in a delay slot itself and the branch
+// is not a label target, the branch moves up and that statement takes the
+// slot in place of the nop. The text section is then laid out again.
+static int fill_delay_slots(assembler_ctx_t *ctx) {
+  label_index_t labels;
+  if (!label_index_init(ctx, &labels)) {
+    report(ctx, "Error: Out of memory\n");
+    return 0;
+  }
 
-      if (code_str && !parse_immediate(code_str, &code))
-        return 0;
+  // Slots are always parsed right after their branch, in the same section
+  for (size_t i = 2; i < ctx->ir_count; i++) {
+    ir_inst_t *slot = &ctx->ir[i];
+    ir_inst_t *branch = slot - 1;
+    ir_inst_t *ir = slot - 2;
+    if (!(slot->flags & IR_SLOT) || slot->section != SECTION_TEXT ||
+        ir->section != SECTION_TEXT ||
+        is_label_target(&labels, branch->address) ||
+        !can_fill_slot(ir, branch)) {
+      continue;
+    }
 
-      instruction = encode_r_type(0, 0, 0, 0, 0, 0x0D);
-      instruction |= (code & 0xFFFFF) << 6;
-      write_be32(ctx, instruction);
-      break;
+    // The statement before must not be a branch the candidate is the slot
+    // of, nor a load or mfhi/mflo whose result the branch would then read
+    // right after it (the candidate may be the nop that keeps them apart)
+    const ir_inst_t *before = NULL;
+    for (size_t j = i - 2; j-- > 0;) {
+      if (ctx->ir[j].section == SECTION_TEXT && ctx->ir[j].size > 0) {
+        before = &ctx->ir[j];
+        break;
+      }
+    }
+    if (before && is_control(before))
+      continue;
+    if (before && has_hazard(before)) {
+      uint64_t uses, defs, branch_uses, branch_defs;
+      statement_registers(before, &uses, &defs);
+      statement_registers(branch, &branch_uses, &branch_defs);
+      if (branch_uses & defs)
+        continue;
     }
 
-    case INST_MOVE: {
-      // Pseudo-instruction: move $rd, $rs = addu $rd, $rs, $zero
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
+    ir_inst_t moved = *ir;
+    *ir = *branch;
+    *branch = moved;
+    slot->size = 0;
+    ctx->slots_filled++;
+  }
 
-      int rd = parse_register(rd_str);
-      int rs = parse_register(rs_str);
+  if (ctx->slots_filled > 0)
+    relayout_text(ctx);
+  return 1;
+}
 
-      if (rd < 0 || rs < 0)
-        return 0;
+// Most statements list-scheduled together; a longer block is cut into
+// windows of this size, so a window's dependencies fit in 64-bit masks
+#define SCHEDULE_WINDOW 64
 
-      instruction = encode_r_type(0, rs, 0, rd, 0, 0x21); // ADDU
-      write_be32(ctx, instruction);
-      break;
-    }
+// Bytes a load or store touches
+static uint32_t access_width(const ir_inst_t *ir) {
+  switch (isa_table[ir->type].opcode & 0x03) {
+  case 0x00: // lb, lbu, sb
+    return 1;
+  case 0x01: // lh, lhu, sh
+    return 2;
+  default:
+    return 4;
+  }
+}
 
-    case INST_LA: {
-      // Pseudo-instruction: la $rt, label => lui $rt, upper(label) + ori $rt,
-      // $rt, lower(label)
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *label_str = strtok_r(NULL, " \t,", &saveptr);
+// One statement of a scheduling window
+typedef struct {
+  uint64_t uses, defs; // statement_registers()
+  uint64_t preds;      // Window statements that must issue before it
+  uint64_t data_preds; // Those whose results it reads
+  uint64_t succs;      // Window statements it must issue before
+  uint32_t latency;    // Cycles from issue until its results can be read
+  uint32_t words;      // Cycles it takes to issue
+  uint32_t priority;   // Cycles from its issue to the end of the window
+  uint32_t ready;      // Earliest cycle its operands are available
+} sched_node_t;
+
+static uint32_t result_latency(const ir_inst_t *ir) {
+  if (is_load(ir))
+    return LATENCY_LOAD;
+  if (ir->type == INST_MULT || ir->type == INST_MULTU)
+    return LATENCY_MULT;
+  if (ir->type == INST_DIV || ir->type == INST_DIVU)
+    return LATENCY_DIV;
+  return ir->size / 4;
+}
 
-      int rt = parse_register(rt_str);
-      if (rt < 0)
-        return 0;
+// Whether two accesses of a window can be told apart: the same base
+// register, not written between them, and byte ranges that do not overlap.
+// A displacement with a %lo added is not known yet.
+static int accesses_disjoint(const ir_inst_t *a, const ir_inst_t *b,
+                             uint64_t written_between) {
+  if (a->rs != b->rs || (written_between & (1ull << a->rs)) ||
+      ((a->flags | b->flags) & IR_LO)) {
+    return 0;
+  }
+  int32_t x = (int16_t)a->imm;
+  int32_t y = (int16_t)b->imm;
+  return x + (int32_t)access_width(a) <= y ||
+         y + (int32_t)access_width(b) <= x;
+}
 
-      int label_idx = find_label(ctx, label_str);
-      if (label_idx >= 0) {
-        uint32_t addr = ctx->labels[label_idx].address;
-
-        if (is_verbose) {
-          printf("  Loading address of label '%s': 0x%08X\n", label_str, addr);
-        }
-        uint16_t upper = (addr >> 16) & 0xFFFF;
-        uint16_t lower = addr & 0xFFFF;
-
-        // LUI rt, upper
-        instruction = encode_i_type(0x0F, 0, rt, upper);
-        write_be32(ctx, instruction);
-
-        // ORI rt, rt, lower (only if lower != 0)
-        if (lower != 0) {
-          instruction = encode_i_type(0x0D, rt, rt, lower);
-          write_be32(ctx, instruction);
-        }
-      } else {
-        printf("  ERROR: Label '%s' not found\n", label_str);
-        return 0;
+// Build the dependency DAG of window[0..count): register flow, anti and
+// output dependencies, and memory order between a store and any other
+// access that may overlap it. sink_uses are the registers read by the
+// statement after the window, which stays in place.
+static void schedule_build(const ir_inst_t *window, int count,
+                           sched_node_t *nodes, uint64_t sink_uses) {
+  for (int i = 0; i < count; i++) {
+    sched_node_t *node = &nodes[i];
+    statement_registers(&window[i], &node->uses, &node->defs);
+    node->preds = 0;
+    node->data_preds = 0;
+    node->succs = 0;
+    node->latency = result_latency(&window[i]);
+    node->words = window[i].size / 4;
+    node->ready = 0;
+
+    uint64_t written_between = 0;
+    for (int p = i; p-- > 0;) {
+      const sched_node_t *pred = &nodes[p];
+      uint64_t bit = 1ull << p;
+      if (pred->defs & node->uses)
+        node->data_preds |= bit;
+      if ((pred->defs & (node->uses | node->defs)) ||
+          (pred->uses & node->defs)) {
+        node->preds |= bit;
+      } else if (is_memory_access(&window[i]) &&
+                 is_memory_access(&window[p]) &&
+                 (!is_load(&window[i]) || !is_load(&window[p])) &&
+                 !accesses_disjoint(&window[p], &window[i], written_between)) {
+        node->preds |= bit;
       }
-      break;
+      written_between |= pred->defs;
     }
+    node->preds |= node->data_preds;
+    for (uint64_t preds = node->preds; preds; preds &= preds - 1)
+      nodes[__builtin_ctzll(preds)].succs |= 1ull << i;
+  }
 
-    case INST_LB: {
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *offset_base = strtok_r(NULL, " \t,", &saveptr);
+  // Longest path to the end of the window, the statement after it included
+  for (int i = count; i-- > 0;) {
+    sched_node_t *node = &nodes[i];
+    node->priority = (node->defs & sink_uses) ? node->latency : node->words;
+    for (uint64_t succs = node->succs; succs; succs &= succs - 1) {
+      int s = __builtin_ctzll(succs);
+      uint32_t edge = (nodes[s].data_preds & (1ull << i)) ? node->latency
+                                                           : node->words;
+      if (edge + nodes[s].priority > node->priority)
+        node->priority = edge + nodes[s].priority;
+    }
+  }
+}
 
-      int rt = parse_register(rt_str);
-      if (rt < 0)
-        return 0;
+// Stall cycles of the window issued in `order`, one statement per cycle and
+// word in order, waiting for operands; the statement after the window waits
+// for the registers it reads
+static uint32_t schedule_stalls(const sched_node_t *nodes, const int *order,
+                                int count, uint64_t sink_uses) {
+  uint32_t issue[SCHEDULE_WINDOW];
+  uint32_t cycle = 0;
+  uint32_t stalls = 0;
+  for (int k = 0; k < count; k++) {
+    int i = order[k];
+    uint32_t ready = cycle;
+    for (uint64_t preds = nodes[i].data_preds; preds; preds &= preds - 1) {
+      int p = __builtin_ctzll(preds);
+      if (issue[p] + nodes[p].latency > ready)
+        ready = issue[p] + nodes[p].latency;
+    }
+    stalls += ready - cycle;
+    issue[i] = ready;
+    cycle = ready + nodes[i].words;
+  }
 
-      // Parse offset(base) format
-      char *paren = strchr(offset_base, '(');
-      if (paren) {
-        *paren = '\0';
-        char *base_str = paren + 1;
-        char *end_paren = strchr(base_str, ')');
-        if (end_paren)
-          *end_paren = '\0';
-
-        int rs = parse_register(base_str);
-        if (rs < 0)
-          return 0;
+  uint32_t ready = cycle;
+  for (int p = 0; p < count; p++) {
+    if ((nodes[p].defs & sink_uses) && issue[p] + nodes[p].latency > ready)
+      ready = issue[p] + nodes[p].latency;
+  }
+  return stalls + (ready - cycle);
+}
 
-        uint32_t offset;
-        if (parse_immediate(offset_base, &offset)) {
-          instruction = encode_i_type(0x20, rs, rt, offset & 0xFFFF);
-          write_be32(ctx, instruction);
-        } else {
-          return 0;
-        }
-      } else {
-        return 0;
+// List-schedule a window: each cycle, of the statements whose predecessors
+// have all issued, the one that can issue soonest, then the one with the
+// longest path to the end of the window, then the earliest in the source
+static void schedule_list(sched_node_t *nodes, int count, int *order) {
+  uint64_t done = 0;
+  uint32_t cycle = 0;
+  for (int k = 0; k < count; k++) {
+    int best = -1;
+    uint32_t best_issue = 0;
+    for (int i = 0; i < count; i++) {
+      if ((done & (1ull << i)) || (nodes[i].preds & ~done))
+        continue;
+      uint32_t issue = nodes[i].ready > cycle ? nodes[i].ready : cycle;
+      if (best < 0 || issue < best_issue ||
+          (issue == best_issue && nodes[i].priority > nodes[best].priority)) {
+        best = i;
+        best_issue = issue;
       }
-      break;
     }
 
-    case INST_LBU: {
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *offset_base = strtok_r(NULL, " \t,", &saveptr);
-
-      int rt = parse_register(rt_str);
-      if (rt < 0)
-        return 0;
-
-      // Parse offset(base) format
-      char *paren = strchr(offset_base, '(');
-      if (paren) {
-        *paren = '\0';
-        char *base_str = paren + 1;
-        char *end_paren = strchr(base_str, ')');
-        if (end_paren)
-          *end_paren = '\0';
-
-        int rs = parse_register(base_str);
-        if (rs < 0)
-          return 0;
+    order[k] = best;
+    done |= 1ull << best;
+    cycle = best_issue + nodes[best].words;
+    for (uint64_t succs = nodes[best].succs; succs; succs &= succs - 1) {
+      int s = __builtin_ctzll(succs);
+      if ((nodes[s].data_preds & (1ull << best)) &&
+          best_issue + nodes[best].latency > nodes[s].ready)
+        nodes[s].ready = best_issue + nodes[best].latency;
+    }
+  }
+}
 
-        uint32_t offset;
-        if (parse_immediate(offset_base, &offset)) {
-          instruction = encode_i_type(0x24, rs, rt, offset & 0xFFFF);
-          write_be32(ctx, instruction);
-        } else {
-          return 0;
-        }
-      } else {
-        return 0;
-      }
-      break;
+// Schedule the statements [first, first + count) of the IR, keeping the new
+// order only when the estimate says it stalls less
+static void schedule_window(assembler_ctx_t *ctx, size_t first, int count) {
+  ir_inst_t window[SCHEDULE_WINDOW];
+  sched_node_t nodes[SCHEDULE_WINDOW];
+  int order[SCHEDULE_WINDOW];
+
+  memcpy(window, &ctx->ir[first], (size_t)count * sizeof(ir_inst_t));
+  uint64_t sink_uses = 0, sink_defs;
+  size_t end = first + (size_t)count;
+  if (end < ctx->ir_count && ctx->ir[end].section == SECTION_TEXT)
+    statement_registers(&ctx->ir[end], &sink_uses, &sink_defs);
+
+  schedule_build(window, count, nodes, sink_uses);
+  for (int k = 0; k < count; k++)
+    order[k] = k;
+  uint32_t before = schedule_stalls(nodes, order, count, sink_uses);
+  uint32_t after = before;
+  if (before > 0 && count > 1) {
+    schedule_list(nodes, count, order);
+    after = schedule_stalls(nodes, order, count, sink_uses);
+    if (after < before) {
+      for (int k = 0; k < count; k++)
+        ctx->ir[first + k] = window[order[k]];
+    } else {
+      after = before;
     }
+  }
 
-    case INST_LH: {
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *offset_base = strtok_r(NULL, " \t,", &saveptr);
+  ctx->stalls_before += before;
+  ctx->stalls_after += after;
+  if (ctx->verbose && before > 0) {
+    info(ctx, "Schedule: lines %u-%u, %u -> %u stall cycles\n",
+         window[0].line, window[count - 1].line, before, after);
+  }
+}
 
-      int rt = parse_register(rt_str);
-      if (rt < 0)
-        return 0;
+// Whether the scheduler may move a text statement: an instruction that is
+// not a branch, a delay slot, a system call or half of an object's %hi/%lo
+// relocation pair
+static int is_schedulable(const assembler_ctx_t *ctx, const ir_inst_t *ir) {
+  return ir->size > 0 && ir->type != INST_UNKNOWN && ir->type < INST_LABEL &&
+         ir->type != INST_SYSCALL && ir->type != INST_BREAK &&
+         !(ir->flags & IR_SLOT) && !is_control(ir) &&
+         !(ctx->object && (ir->flags & (IR_HI | IR_LO)));
+}
 
-      // Parse offset(base) format
-      char *paren = strchr(offset_base, '(');
-      if (paren) {
-        *paren = '\0';
-        char *base_str = paren + 1;
-        char *end_paren = strchr(base_str, ')');
-        if (end_paren)
-          *end_paren = '\0';
-
-        int rs = parse_register(base_str);
-        if (rs < 0)
-          return 0;
+// Scheduling pass, for mips_options_t.schedule. Basic blocks run from a
+// label target or the statement after a branch's delay slot to the next
+// branch, label target or statement that cannot move; each is
+// list-scheduled over a dependency DAG to hide load and HI/LO latency. Text
+// statements only change places, so the layout stays as it is.
+static int schedule_pass(assembler_ctx_t *ctx) {
+  label_index_t labels;
+  if (!label_index_init(ctx, &labels)) {
+    report(ctx, "Error: Out of memory\n");
+    return 0;
+  }
 
-        uint32_t offset;
-        if (parse_immediate(offset_base, &offset)) {
-          instruction = encode_i_type(0x21, rs, rt, offset & 0xFFFF);
-          write_be32(ctx, instruction);
-        } else {
-          return 0;
-        }
-      } else {
-        return 0;
-      }
-      break;
+  size_t first = 0;
+  size_t cursor = 0;
+  int count = 0;
+  int in_slot = 0; // The statement is in the delay slot of the one before
+  for (size_t i = 0; i <= ctx->ir_count; i++) {
+    const ir_inst_t *ir = (i < ctx->ir_count) ? &ctx->ir[i] : NULL;
+    int movable = ir && ir->section == SECTION_TEXT && !in_slot &&
+                  is_schedulable(ctx, ir);
+    if (count > 0 && (!movable || count == SCHEDULE_WINDOW ||
+                      next_label_target(&labels, &cursor, ir->address))) {
+      schedule_window(ctx, first, count);
+      count = 0;
     }
+    if (movable && count++ == 0)
+      first = i;
+    if (ir && ir->section == SECTION_TEXT && ir->size > 0)
+      in_slot = is_control(ir);
+  }
+  return 1;
+}
 
-    case INST_LHU: {
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *offset_base = strtok_r(NULL, " \t,", &saveptr);
-
-      int rt = parse_register(rt_str);
-      if (rt < 0)
-        return 0;
+// Instructions a statement issues after its last mfhi or mflo; 2 (enough
+// for any HI/LO write to follow) when neither is among its last two
+static uint32_t hilo_read_tail(const ir_inst_t *ir) {
+  if (ir->type == INST_MFHI || ir->type == INST_MFLO)
+    return 0;
+  if (isa_table[ir->type].format != FMT_PSEUDO)
+    return 2;
+  uint32_t words[ISA_MAX_WORDS];
+  int count = isa_table[ir->type].expand(ir, 0, words);
+  for (int i = 0; i < 2 && i < count; i++) {
+    if (reads_hilo(words[count - 1 - i]))
+      return (uint32_t)i;
+  }
+  return 2;
+}
 
-      // Parse offset(base) format
-      char *paren = strchr(offset_base, '(');
-      if (paren) {
-        *paren = '\0';
-        char *base_str = paren + 1;
-        char *end_paren = strchr(base_str, ')');
-        if (end_paren)
-          *end_paren = '\0';
-
-        int rs = parse_register(base_str);
-        if (rs < 0)
-          return 0;
+// Insert the nops the pipeline still needs after scheduling: one between a
+// load and an instruction that reads its register, and enough after mfhi or
+// mflo that the next two instructions do not write HI or LO. The text
+// section is then laid out again.
+static int insert_interlocks(assembler_ctx_t *ctx) {
+  // before[i]: nops inserted ahead of statement i; filled in as the count
+  // after statement i - 1 first
+  uint32_t *before =
+      arena_alloc(&ctx->scratch, (ctx->ir_count + 1) * sizeof(uint32_t));
+  if (!before) {
+    report(ctx, "Error: Out of memory\n");
+    return 0;
+  }
+  memset(before, 0, (ctx->ir_count + 1) * sizeof(uint32_t));
+
+  size_t last = SIZE_MAX, second = SIZE_MAX; // Instructions before ir
+  for (size_t i = 0; i < ctx->ir_count; i++) {
+    const ir_inst_t *ir = &ctx->ir[i];
+    if (ir->section != SECTION_TEXT || ir->size == 0)
+      continue;
+    if (ir->type == INST_UNKNOWN || ir->type >= INST_LABEL) {
+      last = second = SIZE_MAX;
+      continue;
+    }
 
-        uint32_t offset;
-        if (parse_immediate(offset_base, &offset)) {
-          instruction = encode_i_type(0x25, rs, rt, offset & 0xFFFF);
-          write_be32(ctx, instruction);
-        } else {
-          return 0;
-        }
-      } else {
-        return 0;
-      }
-      break;
+    uint64_t uses, defs;
+    statement_registers(ir, &uses, &defs);
+    int hilo = (defs & (REGS_HI | REGS_LO)) != 0;
+    if (last != SIZE_MAX) {
+      const ir_inst_t *prev = &ctx->ir[last];
+      uint32_t gap = hilo ? hilo_read_tail(prev) : 2;
+      if (is_load(prev) && (uses & (1ull << prev->rt)) && !before[last + 1])
+        before[last + 1] = 1;
+      if (gap < 2 && before[last + 1] < 2 - gap)
+        before[last + 1] = 2 - gap;
     }
+    if (second != SIZE_MAX && hilo) {
+      uint32_t gap = hilo_read_tail(&ctx->ir[second]) +
+                     ctx->ir[last].size / 4 + before[second + 1] +
+                     before[last + 1];
+      if (gap < 2)
+        before[second + 1] += 2 - gap;
+    }
+    second = last;
+    last = i;
+  }
 
-    case INST_SB: {
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *offset_base = strtok_r(NULL, " \t,", &saveptr);
+  for (size_t i = 0; i < ctx->ir_count; i++)
+    before[i + 1] += before[i];
+  uint32_t total = before[ctx->ir_count];
+  ctx->interlocks += total;
+  if (total == 0)
+    return 1;
 
-      int rt = parse_register(rt_str);
-      if (rt < 0)
-        return 0;
+  if (!grow_array((void **)&ctx->ir, &ctx->ir_capacity,
+                  ctx->ir_count + total, sizeof(ir_inst_t), 1024)) {
+    report(ctx, "Error: Out of memory\n");
+    return 0;
+  }
+  for (size_t i = ctx->ir_count; i-- > 0;) {
+    size_t at = i + before[i];
+    for (uint32_t k = before[i + 1] - before[i]; k > 0; k--) {
+      ir_inst_t *nop = &ctx->ir[at + k];
+      memset(nop, 0, sizeof(*nop));
+      nop->type = INST_NOP;
+      nop->section = SECTION_TEXT;
+      nop->size = 4;
+      nop->symbol = -1;
+      nop->line = ctx->ir[i].line;
+    }
+    ctx->ir[at] = ctx->ir[i];
+  }
+  ctx->ir_count += total;
 
-      // Parse offset(base) format
-      char *paren = strchr(offset_base, '(');
-      if (paren) {
-        *paren = '\0';
-        char *base_str = paren + 1;
-        char *end_paren = strchr(base_str, ')');
-        if (end_paren)
-          *end_paren = '\0';
-
-        int rs = parse_register(base_str);
-        if (rs < 0)
-          return 0;
+  for (int l = 0; l < ctx->symbols.count; l++) {
+    label_t *label = &ctx->symbols.entries[l];
+    if (label->resolved)
+      label->statement += before[label->statement];
+  }
+  relayout_text(ctx);
+  return 1;
+}
 
-        uint32_t offset;
-        if (parse_immediate(offset_base, &offset)) {
-          instruction = encode_i_type(0x28, rs, rt, offset & 0xFFFF);
-          write_be32(ctx, instruction);
-        } else {
-          return 0;
-        }
-      } else {
-        return 0;
-      }
-      break;
-    }
+// Branch relaxation. A text branch whose target is beyond its 16-bit word
+// offset is lengthened as encode_far_branch() describes. Lengthening one
+// branch moves the statements after it, which can push other branches out
+// of range in turn, so the layout is iterated to a fixed point. Each
+// iteration works from the size changes alone: the branches and .align
+// statements, in statement order, with the running offset they add to the
+// pass 1 addresses after them. Events carry what the iterations need, so
+// they do not go back to the IR.
+typedef struct {
+  size_t target;    // Branch: number of events before its label
+  uint32_t address; // Pass 1 address
+  uint32_t to;      // Branch: pass 1 address of its label
+  uint32_t padding; // .align: pass 1 padding
+  int32_t delta;    // Bytes the statements after it have moved
+  uint8_t branch;   // Branch, or else .align
+  uint8_t power;    // .align: the power of two
+  uint8_t always;   // Branch: unconditional
+  uint8_t flags;    // Branch: 0, IR_JUMP or IR_LONG, only ever growing
+} relax_event_t;
+
+// Size of a branch with the given relaxation flags
+static uint32_t far_branch_size(int always, uint8_t flags) {
+  uint32_t jump = (flags & IR_LONG) ? 12 : 4;
+  if (!flags)
+    return 4;
+  return always ? jump : 8 + jump;
+}
 
-    case INST_SH: {
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *offset_base = strtok_r(NULL, " \t,", &saveptr);
+// Number of events before statement index, given their statements
+static size_t relax_events_before(const size_t *statements, size_t count,
+                                  size_t index) {
+  size_t low = 0, high = count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (statements[mid] < index)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
 
-      int rt = parse_register(rt_str);
-      if (rt < 0)
-        return 0;
+// A text .align, or a branch to a text label
+static int is_relax_event(const assembler_ctx_t *ctx, const ir_inst_t *ir) {
+  if (ir->section != SECTION_TEXT)
+    return 0;
+  if (ir->flags & IR_ALIGN)
+    return 1;
+  if (ir->symbol < 0 || ir->type == INST_UNKNOWN || ir->type >= INST_LABEL ||
+      isa_table[ir->type].format != FMT_BRANCH) {
+    return 0;
+  }
+  const label_t *label = &ctx->symbols.entries[ir->symbol];
+  return label->resolved && label->section == SECTION_TEXT;
+}
 
-      // Parse offset(base) format
-      char *paren = strchr(offset_base, '(');
-      if (paren) {
-        *paren = '\0';
-        char *base_str = paren + 1;
-        char *end_paren = strchr(base_str, ')');
-        if (end_paren)
-          *end_paren = '\0';
-
-        int rs = parse_register(base_str);
-        if (rs < 0)
-          return 0;
+static int relax_branches(assembler_ctx_t *ctx) {
+  // No branch is out of range in a text section this small
+  if (ctx->text_size <= 0x20000)
+    return 1;
 
-        uint32_t offset;
-        if (parse_immediate(offset_base, &offset)) {
-          instruction = encode_i_type(0x29, rs, rt, offset & 0xFFFF);
-          write_be32(ctx, instruction);
-        } else {
-          return 0;
-        }
-      } else {
-        return 0;
+  size_t count = 0;
+  for (size_t i = 0; i < ctx->ir_count; i++)
+    count += (size_t)is_relax_event(ctx, &ctx->ir[i]);
+  // The events' statements get an array of their own, so the search for
+  // where each label falls among them stays in cache
+  relax_event_t *events =
+      arena_alloc(&ctx->scratch, count * sizeof(relax_event_t));
+  size_t *statements = arena_alloc(&ctx->scratch, count * sizeof(size_t));
+  size_t *label_events = arena_alloc(
+      &ctx->scratch, ((size_t)ctx->symbols.count + 1) * sizeof(size_t));
+  if (!events || !statements || !label_events) {
+    report(ctx, "Error: Out of memory\n");
+    return 0;
+  }
+  count = 0;
+  for (size_t i = 0; i < ctx->ir_count; i++) {
+    const ir_inst_t *ir = &ctx->ir[i];
+    if (!is_relax_event(ctx, ir))
+      continue;
+    relax_event_t *event = &events[count];
+    statements[count++] = i;
+    memset(event, 0, sizeof(*event));
+    event->address = ir->address;
+    if (ir->flags & IR_ALIGN) {
+      event->padding = ir->size;
+      event->power = (uint8_t)ir->imm;
+    } else {
+      event->branch = 1;
+      event->always = (uint8_t)is_unconditional(ir);
+    }
+  }
+  for (int l = 0; l < ctx->symbols.count; l++)
+    label_events[l] = SIZE_MAX;
+  for (size_t e = 0; e < count; e++) {
+    if (events[e].branch) {
+      int symbol = ctx->ir[statements[e]].symbol;
+      const label_t *label = &ctx->symbols.entries[symbol];
+      if (label_events[symbol] == SIZE_MAX) {
+        label_events[symbol] =
+            relax_events_before(statements, count, label->statement);
       }
-      break;
+      events[e].target = label_events[symbol];
+      events[e].to = label->address;
     }
+  }
 
-    case INST_SLTI: {
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *imm_str = strtok_r(NULL, " \t,", &saveptr);
-
-      int rt = parse_register(rt_str);
-      int rs = parse_register(rs_str);
-      uint32_t imm;
-
-      if (rt < 0 || rs < 0)
-        return 0;
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    ctx->relax_passes++;
 
-      if (parse_immediate(imm_str, &imm)) {
-        instruction = encode_i_type(0x0A, rs, rt, imm & 0xFFFF);
-        write_be32(ctx, instruction);
+    int32_t delta = 0;
+    for (size_t e = 0; e < count; e++) {
+      relax_event_t *event = &events[e];
+      if (event->branch) {
+        delta += (int32_t)(far_branch_size(event->always, event->flags) - 4);
       } else {
-        return 0;
+        uint32_t mask = (1u << event->power) - 1;
+        uint32_t padding = (0u - (event->address + delta)) & mask;
+        delta += (int32_t)(padding - event->padding);
       }
-      break;
+      event->delta = delta;
     }
 
-    case INST_SLTIU: {
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *imm_str = strtok_r(NULL, " \t,", &saveptr);
+    // Branches only grow, from short to IR_JUMP to IR_LONG, so this ends
+    for (size_t e = 0; e < count; e++) {
+      relax_event_t *event = &events[e];
+      if (!event->branch || (event->flags & IR_LONG))
+        continue;
+      uint32_t from = event->address + (e > 0 ? events[e - 1].delta : 0);
+      uint32_t to =
+          event->to + (event->target > 0 ? events[event->target - 1].delta : 0);
+      int32_t offset = (int32_t)(to - (from + 4)) / 4;
+      if (offset >= INT16_MIN && offset <= INT16_MAX)
+        continue;
+
+      // j reaches the 256 MB region of the address after it
+      uint32_t jump = from + (event->always ? 0 : 8);
+      uint8_t flags =
+          (((jump + 4) ^ to) & 0xF0000000) == 0 ? IR_JUMP : IR_LONG;
+      if (flags != event->flags) {
+        event->flags = flags;
+        changed = 1;
+      }
+    }
+  }
+
+  for (size_t e = 0; e < count; e++) {
+    if (events[e].flags) {
+      ir_inst_t *ir = &ctx->ir[statements[e]];
+      ir->flags |= events[e].flags;
+      ir->size = far_branch_size(events[e].always, events[e].flags);
+      ctx->relaxed++;
+    }
+  }
+  if (ctx->relaxed > 0)
+    relayout_text(ctx);
+  return 1;
+}
 
-      int rt = parse_register(rt_str);
-      int rs = parse_register(rs_str);
-      uint32_t imm;
+// Serial pass 2: encode every statement into the output image
+static int encode_image(assembler_ctx_t *ctx) {
+  uint8_t *out = ctx->output;
+  for (size_t i = 0; i < ctx->ir_count; i++) {
+    if (!encode_ir(ctx, &ctx->ir[i], out))
+      return 0;
+    out += ctx->ir[i].size;
+  }
+  return 1;
+}
 
-      if (rt < 0 || rs < 0)
-        return 0;
+// Minimum number of statements per chunk before pass 2 is split across
+// threads
+#ifndef PASS2_MIN_CHUNK
+#define PASS2_MIN_CHUNK 16384
+#endif
+
+// A range of statements encoded by one pass 2 task
+typedef struct {
+  size_t first;    // First statement
+  size_t end;      // One past the last statement
+  size_t offset;   // Output offset of the first statement
+  size_t size;     // Bytes emitted by the range
+  size_t error_ir; // First statement that failed to encode, or SIZE_MAX
+} pass2_chunk_t;
+
+// Shared state of the parallel pass 2 tasks
+typedef struct {
+  assembler_ctx_t *ctx;
+  pass2_chunk_t *chunks;
+} pass2_job_t;
+
+// Task: add up the sizes of a range of statements
+static void pass2_size_chunk(void *arg, int index) {
+  pass2_job_t *job = arg;
+  pass2_chunk_t *chunk = &job->chunks[index];
+  const ir_inst_t *ir = job->ctx->ir;
+
+  chunk->size = 0;
+  for (size_t i = chunk->first; i < chunk->end; i++)
+    chunk->size += ir[i].size;
+}
 
-      if (parse_immediate(imm_str, &imm)) {
-        instruction = encode_i_type(0x0B, rs, rt, imm & 0xFFFF);
-        write_be32(ctx, instruction);
-      } else {
-        return 0;
-      }
-      break;
+// Task: encode a range of statements into its own region of the image.
+// Errors are recorded, not printed, so they can be reported in source order.
+static void pass2_encode_chunk(void *arg, int index) {
+  pass2_job_t *job = arg;
+  pass2_chunk_t *chunk = &job->chunks[index];
+  assembler_ctx_t local = *job->ctx;
+  uint8_t *out = local.output + chunk->offset;
+
+  local.quiet = 1;
+  chunk->error_ir = SIZE_MAX;
+  for (size_t i = chunk->first; i < chunk->end; i++) {
+    if (!encode_ir(&local, &local.ir[i], out)) {
+      chunk->error_ir = i;
+      return;
     }
+    out += local.ir[i].size;
+  }
+}
 
-    case INST_SLT: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
+// Parallel pass 2. Statements are split into equal ranges; their output
+// offsets come from a prefix sum over the range sizes, so every range is
+// encoded into a disjoint region and the image is identical to the serial
+// one. Returns -1 if the IR is too small to split.
+static int encode_image_parallel(assembler_ctx_t *ctx, threadpool_t **pool,
+                                 int jobs) {
+  int count = jobs;
+  if ((size_t)count > ctx->ir_count / PASS2_MIN_CHUNK)
+    count = (int)(ctx->ir_count / PASS2_MIN_CHUNK);
+  if (count < 2 || !get_pool(pool, jobs))
+    return -1;
 
-      int rd = parse_register(rd_str);
-      int rs = parse_register(rs_str);
-      int rt = parse_register(rt_str);
+  pass2_chunk_t *chunks =
+      arena_alloc(&ctx->scratch, (size_t)count * sizeof(*chunks));
+  if (!chunks)
+    return -1;
 
-      if (rd < 0 || rs < 0 || rt < 0)
-        return 0;
+  for (int c = 0; c < count; c++) {
+    chunks[c].first = ctx->ir_count / count * c;
+    chunks[c].end =
+        (c + 1 < count) ? ctx->ir_count / count * (c + 1) : ctx->ir_count;
+  }
 
-      instruction = encode_r_type(0, rs, rt, rd, 0, 0x2A);
-      write_be32(ctx, instruction);
-      break;
+  pass2_job_t job = {ctx, chunks};
+  threadpool_run(*pool, pass2_size_chunk, &job, count);
+  size_t offset = 0;
+  for (int c = 0; c < count; c++) {
+    chunks[c].offset = offset;
+    offset += chunks[c].size;
+  }
+  threadpool_run(*pool, pass2_encode_chunk, &job, count);
+
+  // Report the first failure in source order by encoding it again, this
+  // time with diagnostics
+  int ok = 1;
+  for (int c = 0; ok && c < count; c++) {
+    size_t i = chunks[c].error_ir;
+    if (i != SIZE_MAX) {
+      encode_ir(ctx, &ctx->ir[i], ctx->output + chunks[c].offset);
+      ok = 0;
     }
+  }
+  return ok;
+}
 
-    case INST_SLTU: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
+// Milliseconds on the monotonic clock
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
 
-      int rd = parse_register(rd_str);
-      int rs = parse_register(rs_str);
-      int rt = parse_register(rt_str);
+// Heap held by a context's buffers. They only grow, so this is also the
+// most the run needed.
+static size_t context_footprint(const assembler_ctx_t *ctx) {
+  const symtab_t *symbols = &ctx->symbols;
+  size_t total = ctx->ir_capacity * sizeof(ir_inst_t) +
+                 ctx->data_pool_capacity +
+                 ctx->fixup_capacity * sizeof(fixup_t) +
+                 ctx->anchor_capacity * sizeof(anchor_t) +
+                 ctx->label_def_capacity * sizeof(int32_t) +
+                 (size_t)symbols->capacity * sizeof(label_t) +
+                 arena_footprint(&symbols->names) +
+                 arena_footprint(&ctx->scratch) +
+                 (size_t)ctx->chunk_capacity * sizeof(pass1_chunk_t);
+  if (symbols->slots)
+    total += ((size_t)symbols->slot_mask + 1) * sizeof(symtab_slot_t);
+  for (int c = 0; c < ctx->chunk_capacity; c++)
+    total += context_footprint(&ctx->chunks[c].ctx);
+  return total;
+}
 
-      if (rd < 0 || rs < 0 || rt < 0)
-        return 0;
+// Fill in the counters of ctx->stats from the statements of pass 1
+static void collect_stats(const assembler_ctx_t *ctx, double pass1_ms) {
+  mips_stats_t *stats = ctx->stats;
+  uint64_t counts[INST_LABEL] = {0};
+
+  memset(stats, 0, sizeof(*stats));
+  stats->pass1_ms = pass1_ms;
+  stats->lines = ctx->lines;
+  stats->statements = ctx->ir_count;
+  for (size_t i = 0; i < ctx->ir_count; i++) {
+    const ir_inst_t *ir = &ctx->ir[i];
+    if (ir->type == INST_UNKNOWN || ir->type >= INST_LABEL)
+      continue;
+    counts[ir->type]++;
+    stats->instructions++;
+    if (isa_table[ir->type].expand) {
+      stats->pseudo_expansions++;
+      stats->pseudo_words += ir->size / 4;
+    }
+  }
 
-      instruction = encode_r_type(0, rs, rt, rd, 0, 0x2B);
-      write_be32(ctx, instruction);
-      break;
+  for (int type = 1; type < INST_LABEL; type++) {
+    if (counts[type] > 0 && stats->mnemonic_count < MIPS_STATS_MNEMONICS) {
+      mips_mnemonic_count_t *entry = &stats->mnemonics[stats->mnemonic_count++];
+      entry->mnemonic = isa_table[type].mnemonic;
+      entry->count = counts[type];
     }
+  }
 
-    case INST_MULT: {
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
+  for (int i = 0; i < ctx->symbols.count; i++)
+    stats->labels += ctx->symbols.entries[i].resolved != 0;
+  stats->label_lookups = ctx->symbols.lookups;
+  stats->hash_probes = ctx->symbols.probes;
+  stats->text_bytes = ctx->text_size;
+  stats->data_bytes = ctx->data_size;
+  stats->memory_bytes = context_footprint(ctx);
+  for (int r = 0; r < MIPS_PEEPHOLE_RULES; r++)
+    stats->peephole[r] = ctx->peephole[r];
+  stats->delay_slots = ctx->delay_slots;
+  stats->slots_filled = ctx->slots_filled;
+  stats->stalls_before = ctx->stalls_before;
+  stats->stalls_after = ctx->stalls_after;
+  stats->interlocks = ctx->interlocks;
+  stats->branches_relaxed = ctx->relaxed;
+}
 
-      int rs = parse_register(rs_str);
-      int rt = parse_register(rt_str);
+// Reusable assembler: a context whose buffers and thread pool outlive a run
+struct mips_assembler {
+  assembler_ctx_t ctx;
+  threadpool_t *pool; // Created on the first source large enough to split
+  int jobs;
+  int parsed;  // Pass 1 succeeded and the image has not been encoded yet
+  int encoded; // The IR describes the image encoded last
+};
+
+static void assembler_init(mips_assembler_t *as,
+                           const mips_options_t *options) {
+  init_context(&as->ctx, options);
+  as->pool = NULL;
+  as->parsed = 0;
+  as->encoded = 0;
+  as->jobs = (options && options->jobs > 0) ? options->jobs : default_jobs();
+
+  // Verbose output is only produced by the serial passes
+  if (as->ctx.verbose)
+    as->jobs = 1;
+}
 
-      if (rs < 0 || rt < 0)
-        return 0;
+static void assembler_free(mips_assembler_t *as) {
+  threadpool_destroy(as->pool);
+  free_context(&as->ctx);
+}
 
-      instruction = encode_r_type(0, rs, rt, 0, 0, 0x18);
-      write_be32(ctx, instruction);
-      break;
-    }
+// First pass: parse into IR, assign addresses and collect labels
+static int assembler_parse(mips_assembler_t *as, const char *source,
+                           size_t source_len) {
+  assembler_ctx_t *ctx = &as->ctx;
 
-    case INST_MULTU: {
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
+  reset_context(ctx);
+  as->parsed = 0;
+  as->encoded = 0;
 
-      int rs = parse_register(rs_str);
-      int rt = parse_register(rt_str);
+  double start = ctx->stats ? now_ms() : 0;
 
-      if (rs < 0 || rt < 0)
-        return 0;
+  // Debug: Print source length
+  if (ctx->verbose) {
+    info(ctx, "Source length: %zu bytes\n", source_len);
+  }
 
-      instruction = encode_r_type(0, rs, rt, 0, 0, 0x19);
-      write_be32(ctx, instruction);
-      break;
+  ctx->pass = 1;
+  if (as->jobs < 2 ||
+      !parse_source_parallel(ctx, source, source_len, &as->pool, as->jobs)) {
+    // Start over from a clean context if the parallel attempt failed
+    reset_context(ctx);
+    ctx->pass = 1;
+    if (!parse_source(ctx, source, source_len)) {
+      flush_trace(ctx);
+      return 0;
     }
+  }
 
-    case INST_DIV: {
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
+  if ((ctx->optimize && !peephole_pass(ctx)) ||
+      (ctx->schedule && !schedule_pass(ctx)) ||
+      (ctx->delay_slots > 0 && !fill_delay_slots(ctx)) ||
+      (ctx->schedule && !insert_interlocks(ctx)) || !relax_branches(ctx)) {
+    flush_trace(ctx);
+    return 0;
+  }
 
-      int rs = parse_register(rs_str);
-      int rt = parse_register(rt_str);
+  // After pass 1, save the label table
+  if (ctx->verbose) {
+    info(ctx, "\n");
+    info(ctx, "Completed pass 1:\n");
+    print_section_info(ctx);
+    if (ctx->optimize) {
+      info(ctx, "Peephole: %llu li, %llu la, %llu la+load/store, %llu move\n",
+           (unsigned long long)ctx->peephole[MIPS_PEEPHOLE_LI],
+           (unsigned long long)ctx->peephole[MIPS_PEEPHOLE_LA],
+           (unsigned long long)ctx->peephole[MIPS_PEEPHOLE_LA_MEM],
+           (unsigned long long)ctx->peephole[MIPS_PEEPHOLE_MOVE]);
+    }
+    if (ctx->schedule) {
+      info(ctx, "Schedule: %llu -> %llu stall cycles, %llu interlock nops\n",
+           (unsigned long long)ctx->stalls_before,
+           (unsigned long long)ctx->stalls_after,
+           (unsigned long long)ctx->interlocks);
+    }
+    if (ctx->delay_slots > 0) {
+      info(ctx, "Delay slots: %llu filled, %llu nop\n",
+           (unsigned long long)ctx->slots_filled,
+           (unsigned long long)(ctx->delay_slots - ctx->slots_filled));
+    }
+    if (ctx->relaxed > 0) {
+      info(ctx, "Branches: %llu relaxed in %llu passes\n",
+           (unsigned long long)ctx->relaxed,
+           (unsigned long long)ctx->relax_passes);
+    }
+  }
+  if (ctx->stats)
+    collect_stats(ctx, now_ms() - start);
+  as->parsed = 1;
+  return 1;
+}
 
-      if (rs < 0 || rt < 0)
-        return 0;
+// Size of the image described by the parsed IR
+static size_t assembler_image_size(const mips_assembler_t *as) {
+  return (size_t)as->ctx.text_size + as->ctx.data_size;
+}
 
-      instruction = encode_r_type(0, rs, rt, 0, 0, 0x1A);
-      write_be32(ctx, instruction);
-      break;
-    }
+// Second pass: encode the IR into image, which has room for exactly
+// assembler_image_size() bytes. The image stays owned by the caller.
+static int assembler_encode(mips_assembler_t *as, uint8_t *image) {
+  assembler_ctx_t *ctx = &as->ctx;
+  int ok;
 
-    case INST_DIVU: {
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
+  double start = ctx->stats ? now_ms() : 0;
+  as->parsed = 0;
+  ctx->pass = 2;
+  ctx->output = image;
+  ctx->output_size = assembler_image_size(as);
+  ctx->output_capacity = ctx->output_size;
 
-      int rs = parse_register(rs_str);
-      int rt = parse_register(rt_str);
+  ok = (as->jobs < 2) ? -1 : encode_image_parallel(ctx, &as->pool, as->jobs);
+  if (ok < 0)
+    ok = encode_image(ctx);
 
-      if (rs < 0 || rt < 0)
-        return 0;
+  // Debug info
+  if (ok && ctx->verbose) {
+    print_section_info(ctx);
+  }
+  flush_trace(ctx);
+
+  ctx->output = NULL;
+  ctx->output_capacity = 0;
+  as->encoded = ok;
+  if (ok && ctx->stats)
+    ctx->stats->pass2_ms = now_ms() - start;
+  return ok;
+}
 
-      instruction = encode_r_type(0, rs, rt, 0, 0, 0x1B);
-      write_be32(ctx, instruction);
-      break;
-    }
+// Create a reusable assembler. options may be NULL for the defaults; they
+// are copied, but the streams and callback argument must stay valid.
+mips_assembler_t *mips_assembler_create(const mips_options_t *options) {
+  mips_assembler_t *as = malloc(sizeof(*as));
+  if (as)
+    assembler_init(as, options);
+  return as;
+}
 
-    case INST_MFHI: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
+// Forget the labels and statements of the previous run, keeping the memory
+// for reuse. mips_assembler_assemble() does this itself before every run.
+void mips_assembler_reset(mips_assembler_t *as) {
+  reset_context(&as->ctx);
+  as->parsed = 0;
+  as->encoded = 0;
+}
 
-      int rd = parse_register(rd_str);
-      if (rd < 0)
-        return 0;
+// Assemble source into the caller's buffer and set *output_size to the size
+// of the image. Returns MIPS_ASM_OK, MIPS_ASM_ERROR after reporting the
+// errors, or MIPS_ASM_NOSPACE if output is NULL or smaller than the image;
+// the parsed source is kept then, and mips_assembler_encode() finishes the
+// run once a large enough buffer is available.
+int mips_assembler_assemble(mips_assembler_t *as, const char *source,
+                            size_t source_len, uint8_t *output,
+                            size_t capacity, size_t *output_size) {
+  *output_size = 0;
+  if (!assembler_parse(as, source, source_len))
+    return MIPS_ASM_ERROR;
+
+  return mips_assembler_encode(as, output, capacity, output_size);
+}
 
-      instruction = encode_r_type(0, 0, 0, rd, 0, 0x10);
-      write_be32(ctx, instruction);
-      break;
-    }
+// Encode the source parsed by the last mips_assembler_assemble() call that
+// returned MIPS_ASM_NOSPACE. Returns the same codes; MIPS_ASM_ERROR also
+// means there is no parsed source waiting.
+int mips_assembler_encode(mips_assembler_t *as, uint8_t *output,
+                          size_t capacity, size_t *output_size) {
+  if (!as->parsed)
+    return MIPS_ASM_ERROR;
 
-    case INST_MFLO: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
+  *output_size = assembler_image_size(as);
+  if (!output || capacity < *output_size)
+    return MIPS_ASM_NOSPACE;
 
-      int rd = parse_register(rd_str);
-      if (rd < 0)
-        return 0;
+  return assembler_encode(as, output) ? MIPS_ASM_OK : MIPS_ASM_ERROR;
+}
 
-      instruction = encode_r_type(0, 0, 0, rd, 0, 0x12);
-      write_be32(ctx, instruction);
-      break;
-    }
+// Release an assembler and everything it owns
+void mips_assembler_destroy(mips_assembler_t *as) {
+  if (!as)
+    return;
+  assembler_free(as);
+  free(as);
+}
 
-    case INST_MTHI: {
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
+static elf_section_t elf_section(int section) {
+  return (section == SECTION_TEXT) ? ELF_TEXT : ELF_DATA;
+}
 
-      int rs = parse_register(rs_str);
-      if (rs < 0)
-        return 0;
+// Relocation types of a statement's words in a relocatable object; returns
+// how many of its words get one, which run on from word *first
+static int statement_relocs(const assembler_ctx_t *ctx, const ir_inst_t *ir,
+                            int *first, uint8_t types[ISA_MAX_WORDS]) {
+  *first = 0;
+  if (ir->symbol < 0)
+    return 0;
+  if (ir->type == INST_WORD) {
+    types[0] = R_MIPS_32;
+    return 1;
+  }
 
-      instruction = encode_r_type(0, rs, 0, 0, 0, 0x11);
-      write_be32(ctx, instruction);
-      break;
+  switch ((encode_format_t)isa_table[ir->type].format) {
+  case FMT_J:
+    types[0] = R_MIPS_26;
+    return 1;
+  case FMT_I: // lui label, or a load/store an la was folded into
+    types[0] = (ir->flags & IR_LO) ? R_MIPS_LO16 : R_MIPS_HI16;
+    return 1;
+  case FMT_PSEUDO: // la
+    types[0] = R_MIPS_HI16;
+    if (ir->flags & IR_HI)
+      return 1;
+    types[1] = R_MIPS_LO16;
+    return 2;
+  case FMT_BRANCH: {
+    const label_t *label = &ctx->symbols.entries[ir->symbol];
+    if (ir->flags & (IR_JUMP | IR_LONG)) {
+      // The jump after the inverted branch and its nop
+      *first = is_unconditional(ir) ? 0 : 2;
+      types[0] = (ir->flags & IR_JUMP) ? R_MIPS_26 : R_MIPS_HI16;
+      types[1] = R_MIPS_LO16;
+      return (ir->flags & IR_JUMP) ? 1 : 2;
     }
+    if (label->resolved && label->section == ir->section)
+      return 0;
+    types[0] = R_MIPS_PC16;
+    return 1;
+  }
+  default:
+    return 0;
+  }
+}
 
-    case INST_MTLO: {
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
+// Write the last encoded image as a relocatable object. Each section's body
+// is gathered from the runs of the image that belong to it, so nothing is
+// copied; the run, relocation and symbol tables live in the scratch arena.
+int mips_assembler_write_elf(mips_assembler_t *as, const uint8_t *image,
+                             int fd) {
+  assembler_ctx_t *ctx = &as->ctx;
+  uint8_t types[ISA_MAX_WORDS];
+  int first;
 
-      int rs = parse_register(rs_str);
-      if (rs < 0)
-        return 0;
+  if (!as->encoded || !ctx->object)
+    return 0;
 
-      instruction = encode_r_type(0, rs, 0, 0, 0, 0x13);
-      write_be32(ctx, instruction);
-      break;
+  // Count the runs and relocations of each section
+  size_t run_count[ELF_SECTION_COUNT] = {0};
+  size_t reloc_count[ELF_SECTION_COUNT] = {0};
+  int previous = -1;
+  for (size_t i = 0; i < ctx->ir_count; i++) {
+    const ir_inst_t *ir = &ctx->ir[i];
+    elf_section_t section = elf_section(ir->section);
+    if (ir->size > 0 && (int)section != previous) {
+      run_count[section]++;
+      previous = (int)section;
     }
+    reloc_count[section] += (size_t)statement_relocs(ctx, ir, &first, types);
+  }
 
-    case INST_SLLV: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
-
-      int rd = parse_register(rd_str);
-      int rt = parse_register(rt_str);
-      int rs = parse_register(rs_str);
+  elf_object_t object;
+  struct iovec *runs[ELF_SECTION_COUNT];
+  elf_reloc_t *relocs[ELF_SECTION_COUNT];
+  memset(&object, 0, sizeof(object));
+  for (int s = 0; s < ELF_SECTION_COUNT; s++) {
+    runs[s] = arena_alloc(&ctx->scratch, run_count[s] * sizeof(struct iovec));
+    relocs[s] =
+        arena_alloc(&ctx->scratch, reloc_count[s] * sizeof(elf_reloc_t));
+    if (!runs[s] || !relocs[s])
+      return 0;
+    object.sections[s].runs = runs[s];
+    object.sections[s].relocs = relocs[s];
+  }
 
-      if (rd < 0 || rt < 0 || rs < 0)
-        return 0;
+  // Labels defined here are local symbols of their section unless .globl
+  // made them global; external labels are undefined global symbols.
+  // Locals come first, so globals go in a second round.
+  elf_symbol_t *symbols = arena_alloc(
+      &ctx->scratch, (size_t)ctx->symbols.count * sizeof(elf_symbol_t));
+  uint32_t *elf_index = arena_alloc(
+      &ctx->scratch, (size_t)ctx->symbols.count * sizeof(uint32_t));
+  if (!symbols || !elf_index)
+    return 0;
+  for (int global = 0; global <= 1; global++) {
+    for (int i = 0; i < ctx->symbols.count; i++) {
+      const label_t *label = &ctx->symbols.entries[i];
+      int is_global = is_external(label) ||
+                      (label->resolved && (label->binding & LABEL_GLOBAL));
+      if ((!label->resolved && !is_external(label)) || is_global != global)
+        continue;
+
+      elf_index[i] = ELF_FIRST_SYMBOL + (uint32_t)object.symbol_count;
+      elf_symbol_t *symbol = &symbols[object.symbol_count++];
+      symbol->name = label->name;
+      symbol->value = section_offset(ctx, label);
+      symbol->section =
+          label->resolved ? elf_section(label->section) : ELF_UNDEF;
+      symbol->global = (uint8_t)global;
+    }
+    if (!global)
+      object.local_count = object.symbol_count;
+  }
+  object.symbols = symbols;
+
+  size_t offset = 0;
+  previous = -1;
+  for (size_t i = 0; i < ctx->ir_count; i++) {
+    const ir_inst_t *ir = &ctx->ir[i];
+    elf_section_t section = elf_section(ir->section);
+    elf_section_desc_t *desc = &object.sections[section];
+    if ((ir->flags & IR_ALIGN) && (1u << ir->imm) > desc->align)
+      desc->align = 1u << ir->imm;
+    if (ir->size > 0) {
+      if ((int)section != previous) {
+        runs[section][desc->run_count++] =
+            (struct iovec){(void *)(image + offset), 0};
+        previous = (int)section;
+      }
+      runs[section][desc->run_count - 1].iov_len += ir->size;
+    }
 
-      instruction = encode_r_type(0, rs, rt, rd, 0, 0x04);
-      write_be32(ctx, instruction);
-      break;
+    int count = statement_relocs(ctx, ir, &first, types);
+    uint32_t base = (ir->section == SECTION_TEXT) ? ctx->text_address
+                                                  : ctx->data_address;
+    for (int w = 0; w < count; w++) {
+      const label_t *label = &ctx->symbols.entries[ir->symbol];
+      elf_reloc_t *reloc = &relocs[section][desc->reloc_count++];
+      reloc->offset = ir->address - base + 4 * (uint32_t)(first + w);
+      reloc->symbol = label->resolved
+                          ? ELF_SECTION_SYMBOL(elf_section(label->section))
+                          : elf_index[ir->symbol];
+      reloc->type = types[w];
     }
+    offset += ir->size;
+  }
 
-    case INST_SRLV: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
+  object.sections[ELF_TEXT].address = ctx->text_address;
+  object.sections[ELF_TEXT].size = ctx->text_size;
+  object.sections[ELF_DATA].address = ctx->data_address;
+  object.sections[ELF_DATA].size = ctx->data_size;
+  object.sections[ELF_BSS].address = ctx->data_address + ctx->data_size;
+  return elf_write(fd, &object);
+}
 
-      int rd = parse_register(rd_str);
-      int rt = parse_register(rt_str);
-      int rs = parse_register(rs_str);
+// Main assembler function. options may be NULL for the defaults.
+int mips_assemble(const char *source, size_t source_len, uint8_t **output,
+                  size_t *output_size, const mips_options_t *options) {
+  mips_assembler_t as;
+  uint8_t *image = NULL;
+  size_t image_size = 0;
+
+  assembler_init(&as, options);
+  int ok = assembler_parse(&as, source, source_len);
+  if (ok) {
+    // Second pass: encode IR into an image sized exactly by pass 1
+    image_size = assembler_image_size(&as);
+    image = malloc(image_size ? image_size : 1);
+    if (!image) {
+      report(&as.ctx, "Error: Failed to grow output buffer to %zu bytes\n",
+             image_size);
+    }
+    ok = image && assembler_encode(&as, image);
+  }
+  assembler_free(&as);
 
-      if (rd < 0 || rt < 0 || rs < 0)
-        return 0;
+  if (!ok) {
+    free(image);
+    return 0;
+  }
 
-      instruction = encode_r_type(0, rs, rt, rd, 0, 0x06);
-      write_be32(ctx, instruction);
-      break;
-    }
+  *output = image;
+  *output_size = image_size;
+  return 1;
+}
 
-    case INST_SRAV: {
-      char *rd_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rt_str = strtok_r(NULL, " \t,", &saveptr);
-      char *rs_str = strtok_r(NULL, " \t,", &saveptr);
+// Pass 1 state at the start of one source line. A session keeps one per line
+// (plus one for the end of the source) so it can resume parsing at any line.
+typedef struct {
+  uint64_t hash;      // Hash of the line's code, comments excluded
+  size_t first_ir;    // First statement parsed from the line
+  size_t first_label; // First entry of label_defs defined on the line
+  uint32_t address;
+  uint32_t text_address;
+  uint32_t data_address;
+  uint32_t text_size;
+  uint32_t data_size;
+  uint8_t section;
+  uint8_t reorder;    // .set reorder state
+  uint8_t positional; // The line holds .org or .align
+} session_line_t;
+
+// Incremental assembler: the IR, labels and image of the previous source,
+// with per-line state to splice an edited source into them
+struct mips_session {
+  mips_assembler_t as;
+  session_line_t *lines; // line_count lines, then the state at the end
+  size_t line_count;
+  size_t line_capacity;
+  uint64_t *hashes; // Line hashes of the source being assembled
+  size_t hash_capacity;
+  session_line_t *saved_lines; // Unchanged tail while the middle is parsed
+  size_t saved_line_capacity;
+  ir_inst_t *saved_ir;
+  size_t saved_ir_capacity;
+  int32_t *saved_labels;
+  size_t saved_label_capacity;
+  label_t *old_labels; // Labels before the update, to find the ones moved
+  size_t old_label_capacity;
+  uint8_t *image;
+  size_t image_size;
+  size_t image_capacity;
+  size_t pool_limit; // Start from scratch once garbage from replaced lines
+  int symbol_limit;  // pushes the data pool or symbol table past these
+  int valid;         // lines, IR and image describe the previous source
+};
+
+static void save_line_state(const assembler_ctx_t *ctx, session_line_t *line) {
+  line->first_ir = ctx->ir_count;
+  line->first_label = ctx->label_def_count;
+  line->address = ctx->current_address;
+  line->text_address = ctx->text_address;
+  line->data_address = ctx->data_address;
+  line->text_size = ctx->text_size;
+  line->data_size = ctx->data_size;
+  line->section = (uint8_t)ctx->current_section;
+  line->reorder = (uint8_t)ctx->reorder;
+}
 
-      int rd = parse_register(rd_str);
-      int rt = parse_register(rt_str);
-      int rs = parse_register(rs_str);
+static void restore_line_state(assembler_ctx_t *ctx,
+                               const session_line_t *line) {
+  ctx->ir_count = line->first_ir;
+  ctx->label_def_count = line->first_label;
+  ctx->current_address = line->address;
+  ctx->text_address = line->text_address;
+  ctx->data_address = line->data_address;
+  ctx->text_size = line->text_size;
+  ctx->data_size = line->data_size;
+  ctx->current_section = (section_type_t)line->section;
+  ctx->reorder = line->reorder;
+}
 
-      if (rd < 0 || rt < 0 || rs < 0)
-        return 0;
+// Image offset of the first byte emitted by a line: statements are laid out
+// in source order, so it is the size of both sections so far
+static size_t line_offset(const session_line_t *line) {
+  return (size_t)line->text_size + line->data_size;
+}
 
-      instruction = encode_r_type(0, rs, rt, rd, 0, 0x07);
-      write_be32(ctx, instruction);
-      break;
+// Hash every line of source into s->hashes. Sets *prefix to the number of
+// leading lines unchanged since the previous source and *middle to the start
+// of the first changed line. Returns the line count, or SIZE_MAX when out of
+// memory.
+static size_t session_hash_lines(mips_session_t *s, const char *source,
+                                 size_t source_len, size_t *prefix,
+                                 const char **middle) {
+  lexer_t lexer;
+  lex_line_t src;
+  size_t count = 0;
+  int matching = 1;
+
+  *prefix = 0;
+  *middle = source + source_len;
+  lexer_init(&lexer, source, source_len);
+  while (lexer_next_line(&lexer, &src)) {
+    if (!grow_array((void **)&s->hashes, &s->hash_capacity, count + 1,
+                    sizeof(uint64_t), 1024)) {
+      return SIZE_MAX;
     }
 
-    default:
-      // Unknown instruction, skip
-      return 1;
-    }
-  } else {
-    // First pass: just advance address counter
-    ctx->current_address += 4;
-
-    // Handle li pseudo-instruction address calculation
-    if (inst_type == INST_LI) {
-      char *imm_str = strtok_r(NULL, " \t,", &saveptr);
-      uint32_t imm;
-
-      if (parse_immediate(imm_str, &imm)) {
-        if (imm > 0xFFFF && (imm & 0xFFFF) != 0) {
-          // li expands to two instructions
-          ctx->current_address += 4;
-        }
+    uint64_t hash = xxh64(src.start, (size_t)(src.code_end - src.start), 0);
+    s->hashes[count] = hash;
+    if (matching) {
+      if (count < s->line_count && s->lines[count].hash == hash) {
+        (*prefix)++;
+      } else {
+        matching = 0;
+        *middle = src.start;
       }
     }
+    count++;
   }
-
-  return 1;
+  return count;
 }
 
-// Write binary file
-int write_binary_file(const char *filename, const uint8_t *data, size_t size) {
-  FILE *file = fopen(filename, "wb");
-  if (!file) {
+// Replace the previous source's lines [first, old_end) by the new source's
+// lines [first, new_end), which start at `middle`; the lines from old_end on
+// are unchanged and follow as new_end on. Only the replaced lines are
+// parsed: the IR and labels of the unchanged tail are moved by the change in
+// section sizes. Returns 1 on success, 0 on a parse error (reported unless
+// quiet) and -1 if the tail cannot simply be moved, i.e. it holds .org or
+// .align and its address changed, or it starts in a different section state.
+static int session_parse(mips_session_t *s, const char *middle,
+                         const char *source_end, size_t first, size_t old_end,
+                         size_t new_end, size_t new_count, int quiet) {
+  assembler_ctx_t *ctx = &s->as.ctx;
+  size_t tail = s->line_count - old_end;
+  if (!grow_array((void **)&s->lines, &s->line_capacity, new_count + 1,
+                  sizeof(session_line_t), 1024)) {
+    if (!quiet)
+      report(ctx, "Error: Out of memory\n");
     return 0;
   }
 
-  size_t bytes_written = fwrite(data, 1, size, file);
-  fclose(file);
+  // Set the unchanged tail aside
+  const session_line_t *old_tail = &s->lines[old_end];
+  size_t tail_ir = ctx->ir_count - old_tail->first_ir;
+  size_t tail_labels = ctx->label_def_count - old_tail->first_label;
+  if (!grow_array((void **)&s->saved_lines, &s->saved_line_capacity,
+                  tail + 1, sizeof(session_line_t), 1024) ||
+      !grow_array((void **)&s->saved_ir, &s->saved_ir_capacity, tail_ir,
+                  sizeof(ir_inst_t), 1024) ||
+      !grow_array((void **)&s->saved_labels, &s->saved_label_capacity,
+                  tail_labels, sizeof(int32_t), 256)) {
+    if (!quiet)
+      report(ctx, "Error: Out of memory\n");
+    return 0;
+  }
+  memcpy(s->saved_lines, old_tail, (tail + 1) * sizeof(session_line_t));
+  if (tail_ir > 0) {
+    memcpy(s->saved_ir, ctx->ir + old_tail->first_ir,
+           tail_ir * sizeof(ir_inst_t));
+  }
+  if (tail_labels > 0) {
+    memcpy(s->saved_labels, ctx->label_defs + old_tail->first_label,
+           tail_labels * sizeof(int32_t));
+  }
 
-  return (bytes_written == size);
-}
+  // Labels of the replaced lines are undefined until parsed again
+  for (size_t i = s->lines[first].first_label;
+       i < s->saved_lines[0].first_label; i++) {
+    ctx->symbols.entries[ctx->label_defs[i]].resolved = 0;
+  }
 
-// Handle assembler directives (.word, .byte, etc.)
-void handle_directive(assembler_ctx_t *ctx, const char *directive,
-                      char **saveptr) {
-  char *token;
-  char directive_copy[MAX_LINE_LENGTH];
-  char *directive_name = NULL;
+  // Parse the changed lines from the state the unchanged head left
+  lexer_t lexer;
+  lex_line_t src;
+  restore_line_state(ctx, &s->lines[first]);
+  ctx->quiet = quiet;
+  ctx->pass = 1;
+  lexer_init(&lexer, middle, (size_t)(source_end - middle));
+  for (size_t i = first; i < new_end; i++) {
+    session_line_t *line = &s->lines[i];
+    uint32_t number = (uint32_t)i + 1;
+
+    lexer_next_line(&lexer, &src);
+    save_line_state(ctx, line);
+    line->hash = s->hashes[i];
+    ctx->positional = 0;
+    if (!process_line(ctx, &src, number)) {
+      report(ctx, "Error processing line %u: %.*s\n", number,
+             (int)(src.end - src.start), src.start);
+      ctx->quiet = 0;
+      return 0;
+    }
+    line->positional = (uint8_t)ctx->positional;
+  }
+  ctx->quiet = 0;
 
-  // Extract the directive name
-  strncpy(directive_copy, directive, sizeof(directive_copy) - 1);
-  directive_copy[sizeof(directive_copy) - 1] = '\0';
+  if (tail == 0) {
+    save_line_state(ctx, &s->lines[new_end]);
+    s->line_count = new_count;
+    return 1;
+  }
 
-  directive_name = strtok_r(directive_copy, " \t", saveptr);
-  if (!directive_name)
-    return;
+  // Move the tail by the change in size of each section
+  const session_line_t *before = &s->saved_lines[0];
+  uint32_t text_delta = ctx->text_size - before->text_size;
+  uint32_t data_delta = ctx->data_size - before->data_size;
+  if (ctx->current_section != (section_type_t)before->section ||
+      ctx->reorder != before->reorder ||
+      ctx->text_address != before->text_address ||
+      ctx->data_address != before->data_address) {
+    return -1;
+  }
+  if (text_delta || data_delta) {
+    for (size_t i = 0; i < tail; i++) {
+      if (s->saved_lines[i].positional)
+        return -1;
+    }
+  }
 
-  if (is_verbose) {
-    printf("Processing directive: .%s\n", directive_name);
+  if (!grow_array((void **)&ctx->ir, &ctx->ir_capacity,
+                  ctx->ir_count + tail_ir, sizeof(ir_inst_t), 1024) ||
+      !grow_array((void **)&ctx->label_defs, &ctx->label_def_capacity,
+                  ctx->label_def_count + tail_labels, sizeof(int32_t), 256)) {
+    if (!quiet)
+      report(ctx, "Error: Out of memory\n");
+    return 0;
   }
 
-  // Handle section directives (.text, .data) - although these are now handled
-  // in process_line
-  if (strcmp(directive_name, "text") == 0 ||
-      strcmp(directive_name, "data") == 0) {
-    // Already handled
-    return;
-  } else if (strcmp(directive_name, "org") == 0) {
-    // .org directive - set the current address
-    token = strtok_r(NULL, " \t", saveptr);
-    if (token) {
-      char *comment = strchr(token, '#');
-      if (comment)
-        *comment = '\0'; // Remove any trailing comment
-
-      uint32_t address;
-      if (parse_immediate(token, &address)) {
-        if (is_verbose) {
-          printf("  Setting address to 0x%08X for section %s\n", address,
-                 ctx->current_section == SECTION_TEXT ? "TEXT" : "DATA");
-        }
-
-        // Update the section's base address (only on first use)
-        if (ctx->current_section == SECTION_TEXT) {
-          if (ctx->text_size == 0) {
-            ctx->text_address = address;
-          }
-        } else {
-          if (ctx->data_size == 0) {
-            ctx->data_address = address;
-          }
-        }
-
-        ctx->current_address = (ctx->current_section == SECTION_TEXT)
-                                   ? ctx->text_address + ctx->text_size
-                                   : ctx->data_address + ctx->data_size;
-      }
-    }
-  } else if (strcmp(directive_name, "word") == 0) {
-    // .word directive - add 32-bit words
-    char *remaining =
-        strtok_r(NULL, "\n", saveptr); // Get everything after the directive
-    if (remaining) {
-      char *comment = strchr(remaining, '#');
-      if (comment)
-        *comment = '\0'; // Remove any trailing comment
-
-      char *saveptr2;
-      token = strtok_r(remaining, ", \t", &saveptr2);
-      while (token) {
-        uint32_t value;
-        if (parse_immediate(token, &value)) {
-          if (is_verbose) {
-            printf("  Adding word: 0x%08X\n", value);
-          }
-          write_be32(ctx, value);
-        } else {
-          // Try to resolve as label
-          int label_idx = find_label(ctx, token);
-          if (label_idx >= 0) {
-            uint32_t addr = ctx->labels[label_idx].address;
-            if (is_verbose) {
-              printf("  Adding label address: %s = 0x%08X\n", token, addr);
-            }
-            write_be32(ctx, addr);
-          } else {
-            printf("  Warning: Could not resolve value: %s\n", token);
-          }
-        }
-        token = strtok_r(NULL, ", \t", &saveptr2);
-      }
-    }
-  } else if (strcmp(directive, "byte") == 0) {
-    // .byte directive - add 8-bit bytes
-    while ((token = strtok_r(NULL, ", \t", saveptr)) != NULL) {
-      uint32_t value;
-      if (parse_immediate(token, &value)) {
-        if (ctx->output_size < MAX_OUTPUT_SIZE) {
-          ctx->output[ctx->output_size++] = (uint8_t)(value & 0xFF);
-          ctx->current_address++;
-
-          // Track section size
-          if (ctx->current_section == SECTION_TEXT) {
-            ctx->text_size += 1;
-          } else {
-            ctx->data_size += 1;
-          }
-        }
-      }
-    }
-  } else if (strcmp(directive, "half") == 0 ||
-             strcmp(directive, "short") == 0) {
-    // .half/.short directive - add 16-bit halfwords
-    while ((token = strtok_r(NULL, ", \t", saveptr)) != NULL) {
-      uint32_t value;
-      if (parse_immediate(token, &value)) {
-        if (ctx->output_size + 1 < MAX_OUTPUT_SIZE) {
-          // Big endian: high byte first
-          ctx->output[ctx->output_size++] = (uint8_t)((value >> 8) & 0xFF);
-          ctx->output[ctx->output_size++] = (uint8_t)(value & 0xFF);
-          ctx->current_address += 2;
-
-          // Track section size
-          if (ctx->current_section == SECTION_TEXT) {
-            ctx->text_size += 2;
-          } else {
-            ctx->data_size += 2;
-          }
-        }
-      }
-    }
-  } else if (strcmp(directive, "align") == 0) {
-    // .align directive - align to specified boundary
-    token = strtok_r(NULL, ", \t", saveptr);
-    if (token) {
-      uint32_t alignment;
-      if (parse_immediate(token, &alignment)) {
-        uint32_t mask = (1 << alignment) - 1;
-        while (ctx->current_address & mask) {
-          if (ctx->output_size < MAX_OUTPUT_SIZE) {
-            ctx->output[ctx->output_size++] = 0;
-            ctx->current_address++;
-
-            // Track section size
-            if (ctx->current_section == SECTION_TEXT) {
-              ctx->text_size += 1;
-            } else {
-              ctx->data_size += 1;
-            }
-          }
-        }
-      }
-    }
-  } else if (strcmp(directive, "org") == 0) {
-    // .org directive - set the current address
-    token = strtok_r(NULL, ", \t", saveptr);
-    if (token) {
-      uint32_t address;
-      if (parse_immediate(token, &address)) {
-        ctx->current_address = address;
-
-        // Update the section's base address
-        if (ctx->current_section == SECTION_TEXT) {
-          ctx->text_address = address;
-        } else {
-          ctx->data_address = address;
-        }
-      }
-    }
-  } else if (strcmp(directive, "space") == 0 ||
-             strcmp(directive, "skip") == 0) {
-    // .space/.skip directive - reserve specified number of bytes
-    token = strtok_r(NULL, ", \t", saveptr);
-    if (token) {
-      uint32_t size;
-      if (parse_immediate(token, &size)) {
-        for (uint32_t i = 0; i < size && ctx->output_size < MAX_OUTPUT_SIZE;
-             i++) {
-          ctx->output[ctx->output_size++] = 0;
-          ctx->current_address++;
-
-          // Track section size
-          if (ctx->current_section == SECTION_TEXT) {
-            ctx->text_size += 1;
-          } else {
-            ctx->data_size += 1;
-          }
-        }
-      }
-    }
-  } else if (strcmp(directive_name, "ascii") == 0 ||
-             strcmp(directive_name, "asciiz") == 0) {
-    // .ascii/.asciiz directive - add ASCII string
-    // Extract the entire quoted string
-    char *remaining =
-        strstr(directive, directive_name) + strlen(directive_name);
-    while (*remaining && isspace(*remaining))
-      remaining++; // Skip whitespace
-
-    if (*remaining == '"') {
-      remaining++; // Skip opening quote
-      char *end_quote = strchr(remaining, '"');
-      if (end_quote) {
-        *end_quote = '\0'; // Terminate at closing quote
-
-        if (is_verbose) {
-          printf("  Adding string: \"%s\"\n", remaining);
-        }
-
-        for (size_t i = 0;
-             remaining[i] != '\0' && ctx->output_size < MAX_OUTPUT_SIZE; i++) {
-          ctx->output[ctx->output_size++] = remaining[i];
-          ctx->current_address++;
-
-          // Track section size
-          if (ctx->current_section == SECTION_TEXT) {
-            ctx->text_size += 1;
-          } else {
-            ctx->data_size += 1;
-          }
-        }
-
-        // Add null terminator for .asciiz
-        if (strcmp(directive_name, "asciiz") == 0 &&
-            ctx->output_size < MAX_OUTPUT_SIZE) {
-          ctx->output[ctx->output_size++] = 0;
-          ctx->current_address++;
-
-          // Track section size
-          if (ctx->current_section == SECTION_TEXT) {
-            ctx->text_size += 1;
-          } else {
-            ctx->data_size += 1;
-          }
-        }
-      }
+  uint32_t line_delta = (uint32_t)(new_end - old_end);
+  for (size_t i = 0; i < tail_ir; i++) {
+    ir_inst_t *ir = &ctx->ir[ctx->ir_count + i];
+    *ir = s->saved_ir[i];
+    ir->address += (ir->section == SECTION_TEXT) ? text_delta : data_delta;
+    ir->line += line_delta;
+  }
+
+  // A label takes the section its line starts in
+  for (size_t i = 0; i < tail; i++) {
+    const session_line_t *line = &s->saved_lines[i];
+    uint32_t delta = (line->section == SECTION_TEXT) ? text_delta : data_delta;
+    for (size_t j = line->first_label; j < line[1].first_label; j++) {
+      int32_t index = s->saved_labels[j - before->first_label];
+      ctx->symbols.entries[index].address += delta;
     }
   }
+  if (tail_labels > 0) {
+    memcpy(ctx->label_defs + ctx->label_def_count, s->saved_labels,
+           tail_labels * sizeof(int32_t));
+  }
+
+  for (size_t i = 0; i <= tail; i++) {
+    session_line_t *line = &s->lines[new_end + i];
+    *line = s->saved_lines[i];
+    line->first_ir = line->first_ir - before->first_ir + ctx->ir_count;
+    line->first_label =
+        line->first_label - before->first_label + ctx->label_def_count;
+    line->address +=
+        (line->section == SECTION_TEXT) ? text_delta : data_delta;
+    line->text_size += text_delta;
+    line->data_size += data_delta;
+  }
+  ctx->ir_count += tail_ir;
+  ctx->label_def_count += tail_labels;
+  restore_line_state(ctx, &s->lines[new_count]);
+  s->line_count = new_count;
+  return 1;
 }
 
-// Debug: print section info
-void print_section_info(assembler_ctx_t *ctx) {
-  printf("TEXT: base=0x%08X size=%u bytes\n", ctx->text_address,
-         ctx->text_size);
-  printf("DATA: base=0x%08X size=%u bytes\n", ctx->data_address,
-         ctx->data_size);
-  printf("Total output size: %zu bytes\n", ctx->output_size);
-  printf("Label count: %d\n", ctx->label_count);
+// Make room for an image of `size` bytes
+static int session_reserve_image(mips_session_t *s, size_t size) {
+  if (!grow_array((void **)&s->image, &s->image_capacity, size, 1,
+                  OUTPUT_INITIAL_SIZE)) {
+    report(&s->as.ctx, "Error: Failed to grow output buffer to %zu bytes\n",
+           size);
+    return 0;
+  }
+  return 1;
+}
 
-  // List some labels if any
-  if (ctx->label_count > 0) {
-    printf("Labels:\n");
-    for (int i = 0; i < ctx->label_count && i < 10; i++) {
-      printf("  %s: 0x%08X\n", ctx->labels[i].name, ctx->labels[i].address);
-    }
-    if (ctx->label_count > 10) {
-      printf("  (and %d more...)\n", ctx->label_count - 10);
+// Re-encode the statements [first, end), which start at image offset
+// `offset`, that refer to a label marked as moved in s->old_labels, or to
+// any label when `all` is set
+static int session_repatch(mips_session_t *s, size_t first, size_t end,
+                           size_t offset, size_t old_count, int all) {
+  assembler_ctx_t *ctx = &s->as.ctx;
+  for (size_t i = first; i < end; i++) {
+    const ir_inst_t *ir = &ctx->ir[i];
+    if (ir->symbol >= 0 &&
+        (all || ((size_t)ir->symbol < old_count &&
+                 s->old_labels[ir->symbol].resolved))) {
+      if (!encode_ir(ctx, ir, s->image + offset))
+        return 0;
     }
+    offset += ir->size;
   }
+  return 1;
 }
 
-// Estimate directive size for pass 1 address calculation
-void estimate_directive_size(assembler_ctx_t *ctx, const char *directive) {
-  char directive_copy[MAX_LINE_LENGTH];
-  char *saveptr = NULL;
-
-  // Extract the directive name
-  strncpy(directive_copy, directive, sizeof(directive_copy) - 1);
-  directive_copy[sizeof(directive_copy) - 1] = '\0';
-
-  // Remove any comments
-  char *comment = strchr(directive_copy, '#');
-  if (comment)
-    *comment = '\0';
+// Reassemble after an edit, reusing everything outside the changed lines.
+// Returns 1 on success and 0 when the source has to be assembled from
+// scratch instead, which also covers every error so it is reported exactly
+// as a full run reports it.
+static int session_update(mips_session_t *s, const char *source,
+                          size_t source_len) {
+  assembler_ctx_t *ctx = &s->as.ctx;
+  size_t prefix;
+  const char *middle;
+
+  if (ctx->data_pool_size > s->pool_limit ||
+      ctx->symbols.count > s->symbol_limit) {
+    return 0;
+  }
 
-  char *directive_name = strtok_r(directive_copy, " \t", &saveptr);
-  if (!directive_name)
-    return;
+  size_t count = session_hash_lines(s, source, source_len, &prefix, &middle);
+  if (count == SIZE_MAX)
+    return 0;
 
-  if (is_verbose) {
-    printf("Estimating directive in pass 1: .%s\n", directive_name);
+  size_t suffix = 0;
+  size_t common = (count < s->line_count ? count : s->line_count) - prefix;
+  while (suffix < common &&
+         s->lines[s->line_count - 1 - suffix].hash ==
+             s->hashes[count - 1 - suffix]) {
+    suffix++;
+  }
+  size_t old_end = s->line_count - suffix;
+  size_t new_end = count - suffix;
+
+  // Remember where every label was, to re-encode the references to the ones
+  // that move
+  size_t old_count = (size_t)ctx->symbols.count;
+  if (!grow_array((void **)&s->old_labels, &s->old_label_capacity, old_count,
+                  sizeof(label_t), 256)) {
+    return 0;
+  }
+  memcpy(s->old_labels, ctx->symbols.entries, old_count * sizeof(label_t));
+
+  size_t old_size = s->image_size;
+  size_t middle_offset = line_offset(&s->lines[prefix]);
+  size_t old_tail_offset = line_offset(&s->lines[old_end]);
+  if (session_parse(s, middle, source + source_len, prefix, old_end, new_end,
+                    count, 1) != 1 ||
+      ctx->delay_slots > 0) {
+    return 0;
   }
 
-  if (strcmp(directive_name, "word") == 0) {
-    // Count number of comma-separated values
-    char *remaining = saveptr;
-    int word_count = 0;
+  // Splice the image: keep the head, move the tail, encode the middle
+  size_t tail_offset = line_offset(&s->lines[new_end]);
+  size_t size = (size_t)ctx->text_size + ctx->data_size;
+  if (!grow_array((void **)&s->image, &s->image_capacity, size, 1,
+                  OUTPUT_INITIAL_SIZE)) {
+    return 0;
+  }
+  memmove(s->image + tail_offset, s->image + old_tail_offset,
+          old_size - old_tail_offset);
+  s->image_size = size;
+
+  ctx->pass = 2;
+  ctx->quiet = 1;
+  ctx->output = s->image;
+  int ok = 1;
+  uint8_t *out = s->image + middle_offset;
+  size_t middle_end = s->lines[new_end].first_ir;
+  for (size_t i = s->lines[prefix].first_ir; ok && i < middle_end; i++) {
+    ok = encode_ir(ctx, &ctx->ir[i], out);
+    out += ctx->ir[i].size;
+  }
 
-    // Skip leading whitespace in remaining text
-    while (*remaining && isspace(*remaining))
-      remaining++;
+  // Re-encode the references to labels that moved, and every reference in
+  // the tail if the tail itself moved (branches are PC-relative)
+  int labels_moved = 0;
+  for (size_t i = 0; i < old_count; i++) {
+    const label_t *now = &ctx->symbols.entries[i];
+    label_t *was = &s->old_labels[i];
+    was->resolved = was->resolved != now->resolved ||
+                    was->address != now->address; // Now: "moved"
+    labels_moved |= was->resolved;
+  }
+  const session_line_t *tail = &s->lines[new_end];
+  int tail_moved = tail->text_size != s->saved_lines[0].text_size ||
+                   tail->data_size != s->saved_lines[0].data_size;
+  if (ok && labels_moved)
+    ok = session_repatch(s, 0, s->lines[prefix].first_ir, 0, old_count, 0);
+  if (ok && (labels_moved || tail_moved)) {
+    ok = session_repatch(s, middle_end, ctx->ir_count, tail_offset, old_count,
+                         tail_moved);
+  }
+  ctx->quiet = 0;
+  ctx->output = NULL;
+  return ok;
+}
 
-    char *token = strtok_r(remaining, ",", &saveptr);
-    while (token) {
-      word_count++;
-      token = strtok_r(NULL, ",", &saveptr);
+// Assemble a source from scratch, recording the state of every line
+static int session_assemble(mips_session_t *s, const char *source,
+                            size_t source_len) {
+  assembler_ctx_t *ctx = &s->as.ctx;
+  size_t prefix;
+  const char *middle;
+
+  s->valid = 0;
+  s->image_size = 0;
+  if (ctx->verbose) {
+    // Verbose output is that of a full run: no line state is kept
+    if (!assembler_parse(&s->as, source, source_len) ||
+        !session_reserve_image(s, assembler_image_size(&s->as)) ||
+        !assembler_encode(&s->as, s->image)) {
+      return 0;
     }
+    s->image_size = assembler_image_size(&s->as);
+    return 1;
+  }
 
-    // Each word is 4 bytes
-    int size = word_count * 4;
+  reset_context(ctx);
+  s->line_count = 0;
+  if (!grow_array((void **)&s->lines, &s->line_capacity, 1,
+                  sizeof(session_line_t), 1024)) {
+    report(ctx, "Error: Out of memory\n");
+    return 0;
+  }
+  save_line_state(ctx, &s->lines[0]);
 
-    if (is_verbose) {
-      printf("  Estimated %d words (%d bytes)\n", word_count, size);
-    }
+  size_t count = session_hash_lines(s, source, source_len, &prefix, &middle);
+  if (count == SIZE_MAX) {
+    report(ctx, "Error: Out of memory\n");
+    return 0;
+  }
+  if (!session_parse(s, source, source + source_len, 0, 0, count, count, 0) ||
+      (ctx->delay_slots > 0 && !fill_delay_slots(ctx)) ||
+      !relax_branches(ctx)) {
+    return 0;
+  }
 
-    ctx->current_address += size;
-    if (ctx->current_section == SECTION_TEXT) {
-      ctx->text_size += size;
-    } else {
-      ctx->data_size += size;
-    }
-  } else if (strcmp(directive_name, "byte") == 0) {
-    // Count byte items
-    char *remaining = saveptr;
-    int byte_count = 0;
+  size_t size = assembler_image_size(&s->as);
+  if (!session_reserve_image(s, size) || !assembler_encode(&s->as, s->image))
+    return 0;
 
-    // Skip whitespace
-    while (*remaining && isspace(*remaining))
-      remaining++;
+  s->image_size = size;
+  s->pool_limit = 2 * ctx->data_pool_size + OUTPUT_INITIAL_SIZE;
+  s->symbol_limit = 2 * ctx->symbols.count + 256;
 
-    char *token = strtok_r(remaining, ",", &saveptr);
-    while (token) {
-      byte_count++;
-      token = strtok_r(NULL, ",", &saveptr);
-    }
+  // Filling delay slots moves statements away from the lines that gave
+  // them and relaxed branches are sized for this layout only, so the next
+  // update starts from scratch too
+  s->valid = ctx->delay_slots == 0 && ctx->relaxed == 0;
+  return 1;
+}
 
-    if (is_verbose) {
-      printf("  Estimated %d bytes\n", byte_count);
-    }
-    ctx->current_address += byte_count;
-    if (ctx->current_section == SECTION_TEXT) {
-      ctx->text_size += byte_count;
-    } else {
-      ctx->data_size += byte_count;
-    }
-  } else if (strcmp(directive_name, "half") == 0 ||
-             strcmp(directive_name, "short") == 0) {
-    // Count half-word items
-    char *remaining = saveptr;
-    int half_count = 0;
+// Create an incremental assembler. options may be NULL for the defaults;
+// they are copied, but the streams and callback argument must stay valid.
+mips_session_t *mips_session_create(const mips_options_t *options) {
+  mips_session_t *s = calloc(1, sizeof(*s));
+  if (!s)
+    return NULL;
+
+  assembler_init(&s->as, options);
+  s->as.ctx.incremental = !s->as.ctx.verbose;
+  s->as.ctx.stats = NULL; // Updates do not run whole passes to time
+  s->as.ctx.object = 0;
+  s->as.ctx.optimize = 0; // Statements must keep the sizes and places their
+  s->as.ctx.schedule = 0; // lines gave
+
+  return s;
+}
 
-    while (*remaining && isspace(*remaining))
-      remaining++;
+// Assemble the next version of a source. Lines whose code is unchanged
+// since the previous call are not parsed again, and only the statements
+// that changed or refer to moved labels are encoded; the result is
+// identical to assembling the whole source. On success *output points to
+// the image, owned by the session and valid until the next call.
+int mips_session_update(mips_session_t *s, const char *source,
+                        size_t source_len, const uint8_t **output,
+                        size_t *output_size) {
+  *output = NULL;
+  *output_size = 0;
+  if (!(s->valid && session_update(s, source, source_len)) &&
+      !session_assemble(s, source, source_len)) {
+    return 0;
+  }
 
-    char *token = strtok_r(remaining, ",", &saveptr);
-    while (token) {
-      half_count++;
-      token = strtok_r(NULL, ",", &saveptr);
-    }
+  *output = s->image;
+  *output_size = s->image_size;
+  return 1;
+}
 
-    int size = half_count * 2; // Each half-word is 2 bytes
+// Release a session and everything it owns
+void mips_session_destroy(mips_session_t *s) {
+  if (!s)
+    return;
+  assembler_free(&s->as);
+  free(s->lines);
+  free(s->hashes);
+  free(s->saved_lines);
+  free(s->saved_ir);
+  free(s->saved_labels);
+  free(s->old_labels);
+  free(s->image);
+  free(s);
+}
 
-    if (is_verbose) {
-      printf("  Estimated %d half-words (%d bytes)\n", half_count, size);
-    }
+// Encode the statements parsed from one line straight into the output.
+// Statements that reference a label not defined yet are emitted as zeros
+// and recorded as fixups.
+static int emit_stream_line(assembler_ctx_t *ctx) {
+  for (size_t i = 0; i < ctx->ir_count; i++) {
+    const ir_inst_t *ir = &ctx->ir[i];
+    if (!reserve_output(ctx, ir->size))
+      return 0;
 
-    ctx->current_address += size;
-    if (ctx->current_section == SECTION_TEXT) {
-      ctx->text_size += size;
-    } else {
-      ctx->data_size += size;
-    }
-  } else if (strcmp(directive_name, "ascii") == 0 ||
-             strcmp(directive_name, "asciiz") == 0) {
-    // Find string between quotes
-    char *str_start = strchr(directive, '"');
-    if (str_start) {
-      str_start++; // Skip opening quote
-      char *str_end = strchr(str_start, '"');
-      if (str_end) {
-        int str_len = str_end - str_start;
-        // Add null terminator for asciiz
-        if (strcmp(directive_name, "asciiz") == 0) {
-          str_len++;
-        }
-
-        if (is_verbose) {
-          printf("  Estimated string length: %d bytes\n", str_len);
-        }
-        ctx->current_address += str_len;
-        if (ctx->current_section == SECTION_TEXT) {
-          ctx->text_size += str_len;
-        } else {
-          ctx->data_size += str_len;
-        }
-      }
-    }
-  } else if (strcmp(directive_name, "space") == 0 ||
-             strcmp(directive_name, "skip") == 0) {
-    char *size_str = strtok_r(NULL, " \t", &saveptr);
-    if (size_str) {
-      uint32_t size;
-      if (parse_immediate(size_str, &size)) {
-        if (is_verbose) {
-          printf("  Estimated space: %u bytes\n", size);
-        }
-        ctx->current_address += size;
-        if (ctx->current_section == SECTION_TEXT) {
-          ctx->text_size += size;
-        } else {
-          ctx->data_size += size;
-        }
+    uint8_t *out = ctx->output + ctx->output_size;
+    if (ir->symbol >= 0 && !ctx->symbols.entries[ir->symbol].resolved) {
+      if (!grow_array((void **)&ctx->fixups, &ctx->fixup_capacity,
+                      ctx->fixup_count + 1, sizeof(fixup_t), 64)) {
+        return line_error(ctx, ir->line, "out of memory");
       }
+      fixup_t *fixup = &ctx->fixups[ctx->fixup_count++];
+      fixup->ir = *ir;
+      fixup->offset = ctx->output_size;
+      memset(out, 0, ir->size);
+    } else if (!encode_ir(ctx, ir, out)) {
+      return 0;
     }
-  }
-  // Note: align directive is not estimated here since it depends on runtime
-  // address
-}
-
-// Main assembler function
-int mips_assemble(const char *source, uint8_t **output, size_t *output_size,
-                  int verbose) {
-  assembler_ctx_t ctx = {0};
-  char line[MAX_LINE_LENGTH];
-  const char *line_start = source;
-  const char *line_end;
-
-  is_verbose = verbose;
-
-  // Debug: Print source length
-  if (is_verbose) {
-    printf("Source length: %zu bytes\n", strlen(source));
+    ctx->output_size += ir->size;
   }
 
-  // Allocate output buffer
-  ctx.output = malloc(MAX_OUTPUT_SIZE);
-  if (!ctx.output) {
-    fprintf(stderr, "Failed to allocate memory for output buffer\n");
-    return 0;
-  }
-  memset(ctx.output, 0, MAX_OUTPUT_SIZE);
-
-  // Initialize section addresses
-  // Default: text at 0x00400000 (typical MIPS program start)
-  //          data at 0x10010000 (typical MIPS data segment start)
-  ctx.text_address = 0x00400000;
-  ctx.data_address = 0x10010000;
-  ctx.text_size = 0;
-  ctx.data_size = 0;
+  // Nothing from this line is needed any more
+  ctx->ir_count = 0;
+  ctx->data_pool_size = 0;
+  return 1;
+}
 
-  // First pass: collect labels
+// Single-pass assembler for streamed input. Each line is encoded as soon as
+// it is read; forward references are backpatched once the input ends, so
+// memory use grows with the number of unresolved references rather than
+// with the size of the source.
+int mips_assemble_stream(FILE *input, uint8_t **output, size_t *output_size,
+                         const mips_options_t *options) {
+  assembler_ctx_t ctx;
+  char *buffer = NULL;
+  size_t buffer_size = 0;
+  ssize_t length;
+  uint32_t line = 1;
+
+  init_context(&ctx, options);
   ctx.pass = 1;
-  ctx.current_address = ctx.text_address; // Start in text section by default
-  ctx.current_section = SECTION_TEXT;
-  ctx.output_size = 0;
-  ctx.label_count = 0;
 
-  line_start = source;
-  while (*line_start) {
-    line_end = strchr(line_start, '\n');
-    if (!line_end)
-      line_end = line_start + strlen(line_start);
+  while ((length = getline(&buffer, &buffer_size, input)) != -1) {
+    lexer_t lexer;
+    lex_line_t src;
 
-    size_t line_len = line_end - line_start;
-    if (line_len >= sizeof(line))
-      line_len = sizeof(line) - 1;
+    // getline() hands out exactly one line, newline included
+    lexer_init(&lexer, buffer, (size_t)length);
+    lexer_next_line(&lexer, &src);
 
-    strncpy(line, line_start, line_len);
-    line[line_len] = '\0';
-
-    if (!process_line(&ctx, line)) {
+    if (!process_line(&ctx, &src, line) || !emit_stream_line(&ctx)) {
+      report(&ctx, "Error processing line %u: %.*s\n", line,
+              (int)(src.end - src.start), src.start);
+      free(buffer);
       free(ctx.output);
+      free_context(&ctx);
       return 0;
     }
-
-    if (*line_end == '\n')
-      line_end++;
-    line_start = line_end;
+    line++;
   }
+  free(buffer);
 
-  // After pass 1, save the label table
-  if (is_verbose) {
-    printf("\nCompleted pass 1:\n");
-    print_section_info(&ctx);
+  if (ferror(input)) {
+    report(&ctx, "Error: Failed to read input\n");
+    free(ctx.output);
+    free_context(&ctx);
+    return 0;
   }
 
-  // Second pass: generate code
+  // Patch forward references now that every label is known
   ctx.pass = 2;
-  ctx.current_address = ctx.text_address; // Reset to text section
-  ctx.current_section = SECTION_TEXT;
-  ctx.output_size = 0;
-  ctx.text_size = 0;
-  ctx.data_size = 0;
-
-  line_start = source;
-  while (*line_start) {
-    line_end = strchr(line_start, '\n');
-    if (!line_end)
-      line_end = line_start + strlen(line_start);
-
-    size_t line_len = line_end - line_start;
-    if (line_len >= sizeof(line))
-      line_len = sizeof(line) - 1;
-
-    strncpy(line, line_start, line_len);
-    line[line_len] = '\0';
-
-    if (!process_line(&ctx, line)) {
-      fprintf(stderr, "Error processing line (pass 2): %s\n", line);
+  for (size_t i = 0; i < ctx.fixup_count; i++) {
+    const fixup_t *fixup = &ctx.fixups[i];
+    if (!encode_ir(&ctx, &fixup->ir, ctx.output + fixup->offset)) {
       free(ctx.output);
+      free_context(&ctx);
       return 0;
     }
-
-    if (*line_end == '\n')
-      line_end++;
-    line_start = line_end;
   }
 
-  *output = ctx.output;
-  *output_size = ctx.output_size;
-
-  // Debug info
-  if (is_verbose) {
+  if (ctx.verbose) {
+    info(&ctx, "Patched %zu forward references\n", ctx.fixup_count);
     print_section_info(&ctx);
   }
+  flush_trace(&ctx);
 
+  *output = ctx.output;
+  *output_size = ctx.output_size;
+  free_context(&ctx);
   return 1;
 }
@@ -1,71 +1,30 @@
 #ifndef MIPSASM_H
 #define MIPSASM_H
 
+#include "arena.h"
+#include "libmipsasm.h"
+#include "symtab.h"
+#include "trace.h"
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
-// Maximum assembly file size
-#define MAX_ASM_SIZE 8192
-#define MAX_OUTPUT_SIZE 4096
-#define MAX_LABELS 256
-#define MAX_LINE_LENGTH 256
+// Initial capacity of the output image; it grows on demand
+#define OUTPUT_INITIAL_SIZE 4096
 
 // MIPS instruction types
 typedef enum {
   INST_UNKNOWN = 0,
-  INST_LUI,
-  INST_LI,
-  INST_ADDIU,
-  INST_SW,
-  INST_LW,
-  INST_BNEZ,
-  INST_BEQZ,
-  INST_BEQ,
-  INST_BNE,
-  INST_B,
-  INST_J,
-  INST_JAL,
-  INST_NOP,
-  INST_ANDI,
-  INST_ORI,
-  INST_XORI,
-  INST_ADDI,
-  INST_ADD,
-  INST_SUB,
-  INST_AND,
-  INST_OR,
-  INST_XOR,
-  INST_SLL,
-  INST_SRL,
-  INST_SRA,
-  INST_SLLV,
-  INST_SRLV,
-  INST_SRAV,
-  INST_SLT,
-  INST_SLTI,
-  INST_SLTU,
-  INST_SLTIU,
-  INST_JR,
-  INST_JALR,
-  INST_MFHI,
-  INST_MFLO,
-  INST_MTHI,
-  INST_MTLO,
-  INST_MULT,
-  INST_MULTU,
-  INST_DIV,
-  INST_DIVU,
-  INST_SYSCALL,
-  INST_BREAK,
-  INST_LB,
-  INST_LBU,
-  INST_LH,
-  INST_LHU,
-  INST_SB,
-  INST_SH,
-  INST_LA,
-  INST_MOVE,
+#define ISA_INST(id, mnemonic, op1, op2, op3, format, opcode, funct, expand) \
+  INST_##id,
+#include "isa.def"
+#undef ISA_INST
   INST_LABEL,
-  INST_DIRECTIVE
+  INST_DIRECTIVE,
+  INST_DATA,  // Literal bytes from .byte/.half/.word/.ascii/.asciiz
+  INST_WORD,  // .word holding a label address
+  INST_SPACE, // Zero fill from .space/.align
+  INST_COUNT
 } instruction_type_t;
 
 // MIPS register mapping
@@ -104,47 +63,139 @@ typedef enum {
   REG_RA = 31
 } mips_register_t;
 
-// Label structure
-typedef struct {
-  char name[64];
-  uint32_t address;
-  int resolved;
-} label_t;
-
 // Section types
 typedef enum { SECTION_TEXT, SECTION_DATA } section_type_t;
 
-// Assembler context
+// One statement of intermediate representation. Pass 1 parses every source
+// line into these records, fixing each statement's size and address; pass 2
+// only resolves symbols and encodes.
 typedef struct {
+  uint32_t address; // Address of the first emitted byte
+  uint32_t size;    // Number of bytes emitted
+  uint32_t imm;     // Immediate, shift amount, data pool offset or fill size
+  int32_t symbol;   // Referenced label index, or -1
+  uint32_t line;    // Source line number (1-based)
+  uint8_t type;     // instruction_type_t
+  uint8_t section;  // section_type_t
+  uint8_t rd, rs, rt;
+  uint8_t flags;    // IR_*
+} ir_inst_t;
+
+// ir_inst_t.flags
+#define IR_SIGNED_LO 0x01 // la: %hi/%lo split for an addiu of the low half
+#define IR_ALIGN 0x02     // .align padding; imm holds the power of two
+#define IR_SHORT 0x04     // li/la: one word, set by the peephole pass
+#define IR_HI 0x08 // la: only the lui of %hi, the next statement adds %lo
+#define IR_LO 0x10 // Load/store: the displacement adds %lo of symbol
+#define IR_SLOT 0x20 // nop in a delay slot added under .set reorder
+#define IR_JUMP 0x40 // Branch out of 16-bit range: inverted branch over j
+#define IR_LONG 0x80 // Branch out of j range: inverted branch over jr $at
+
+// Forward reference recorded by streaming assembly: the statement is kept
+// so it can be re-encoded into the output once its label is defined
+typedef struct {
+  ir_inst_t ir;
+  size_t offset; // Output offset of the statement's first byte
+} fixup_t;
+
+// Kinds of anchor_t
+typedef enum {
+  ANCHOR_START,   // Start of a chunk: section and address inherited
+  ANCHOR_SECTION, // .text/.data
+  ANCHOR_ORG,     // .org
+  ANCHOR_ALIGN    // .align; the run starts with its padding statement
+} anchor_kind_t;
+
+// Start of a run of statements whose absolute address is only known once
+// everything before it has been sized. A chunk parsed in parallel pass 1
+// records statement and label addresses relative to their anchor.
+typedef struct {
+  size_t first_ir;    // First statement of the run
+  size_t first_label; // First entry of label_defs defined in the run
+  uint32_t size;      // Bytes in the run, excluding alignment padding
+  uint32_t value;     // Section, .org address or .align power
+  uint32_t address;   // Resolved absolute address (after any padding)
+  uint32_t padding;   // Resolved .align padding
+  uint8_t kind;       // anchor_kind_t
+  uint8_t section;    // Resolved section_type_t
+} anchor_t;
+
+// Slice of the source parsed by one task of parallel pass 1
+struct pass1_chunk;
+
+// Assembler context
+typedef struct assembler_ctx {
   uint8_t *output;
   size_t output_size;
+  size_t output_capacity;
   uint32_t current_address;
   uint32_t text_address; // Starting address of text section
   uint32_t data_address; // Starting address of data section
   uint32_t text_size;    // Size of text section
   uint32_t data_size;    // Size of data section
   section_type_t current_section;
-  label_t labels[MAX_LABELS];
-  int label_count;
+  symtab_t symbols; // Labels, hash-indexed by name
+  ir_inst_t *ir;    // Statements parsed in pass 1, in source order
+  size_t ir_count;
+  size_t ir_capacity;
+  uint8_t *data_pool; // Literal directive payloads referenced by INST_DATA
+  size_t data_pool_size;
+  size_t data_pool_capacity;
+  fixup_t *fixups; // Pending forward references (streaming mode only)
+  size_t fixup_count;
+  size_t fixup_capacity;
+  int verbose;
+  unsigned trace_mask; // Verbose event categories recorded (MIPS_TRACE_*)
+  trace_t *trace;      // Verbose events not formatted yet, or NULL
+  FILE *out;           // Verbose output
+  FILE *err;           // Diagnostics
+  mips_diag_fn_t diag; // Message callback, replaces out/err when set
+  void *diag_arg;      // Passed to diag
+  mips_stats_t *stats; // Filled in after each run when set
+  uint32_t lines;      // Source lines seen by pass 1
+  int quiet;           // Suppress diagnostics (speculative chunk parsing)
+  int relative;        // Addresses are relative to anchors (chunk parsing)
+  int incremental;     // Record label_defs for a session (see mips_session)
+  int object;          // Encode for a relocatable object: fields that get a
+                       // relocation hold section-relative addends
+  int positional;      // Set by .org/.align, whose effect depends on the
+                       // address they are parsed at
+  int optimize;        // Run the peephole pass after pass 1
+  uint64_t peephole[MIPS_PEEPHOLE_RULES]; // Hits of each peephole rule
+  int schedule;           // Run the scheduler after the peephole pass
+  uint64_t stalls_before; // Estimated stall cycles of the scheduled blocks
+  uint64_t stalls_after;  // before and after scheduling
+  uint64_t interlocks;    // nops the scheduler inserted for hazards
+  int reorder;            // .set reorder: the assembler fills delay slots
+  uint64_t delay_slots;   // Delay slots added under .set reorder
+  uint64_t slots_filled;  // Of those, filled by fill_delay_slots()
+  uint64_t relaxed;       // Branches relax_branches() lengthened
+  uint64_t relax_passes;  // Layout iterations it took to settle
+  anchor_t *anchors;   // Runs of a chunk, in source order
+  size_t anchor_count;
+  size_t anchor_capacity;
+  int32_t *label_defs; // Labels defined by a chunk or session, in order
+  size_t label_def_count;
+  size_t label_def_capacity;
+  struct pass1_chunk *chunks; // Chunk contexts of parallel pass 1, kept
+  int chunk_capacity;         // between runs so their buffers are reused
+  arena_t scratch;            // Per-run temporary arrays; reset each run
   int pass; // 1 for first pass (collect labels), 2 for second pass (resolve)
 } assembler_ctx_t;
 
 // Function prototypes
-int mips_assemble(const char *source, uint8_t **output, size_t *output_size,
-                  int verbose);
 int parse_register(const char *reg_str);
 uint32_t encode_r_type(uint8_t op, uint8_t rs, uint8_t rt, uint8_t rd,
                        uint8_t shamt, uint8_t func);
 uint32_t encode_i_type(uint8_t op, uint8_t rs, uint8_t rt, uint16_t imm);
 uint32_t encode_j_type(uint8_t op, uint32_t target);
 instruction_type_t parse_instruction(const char *mnemonic);
+int parse_register_n(const char *reg_str, size_t len);
+instruction_type_t parse_instruction_n(const char *mnemonic, size_t len);
+int parse_immediate_n(const char *str, size_t len, uint32_t *value);
 int add_label(assembler_ctx_t *ctx, const char *name, uint32_t address);
 int find_label(assembler_ctx_t *ctx, const char *name);
 int parse_immediate(const char *str, uint32_t *value);
-void handle_directive(assembler_ctx_t *ctx, const char *directive,
-                      char **saveptr);
-void estimate_directive_size(assembler_ctx_t *ctx, const char *directive);
-void write_be32(assembler_ctx_t *ctx, uint32_t value);
 int write_binary_file(const char *filename, const uint8_t *data, size_t size);
 
 #endif // MIPSASM_H
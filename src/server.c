@@ -0,0 +1,438 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "server.h"
+#include "libmipsasm.h"
+#include "threadpool.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Growable text buffer for the messages of one request
+typedef struct {
+  char *data;
+  size_t len;
+  size_t capacity;
+} text_buffer_t;
+
+// State of one server thread. Assemblers and buffers are kept across
+// requests, so a warm worker does not allocate for requests no larger than
+// the ones it has already served.
+typedef struct {
+  mips_assembler_t *assemblers[SERVER_OPTION_FLAGS + 1]; // By option flags
+  char *payload;
+  size_t payload_capacity;
+  uint8_t *image;
+  size_t image_capacity;
+  text_buffer_t out;
+  text_buffer_t err;
+} server_worker_t;
+
+// Shared state of the server threads
+typedef struct {
+  int listen_fd;
+  server_worker_t *workers;
+} server_t;
+
+// Socket removed when the server is stopped by a signal
+static const char *server_socket_path;
+
+// Grow a buffer so it holds at least `needed` bytes
+static int reserve(void **buffer, size_t *capacity, size_t needed) {
+  if (needed <= *capacity)
+    return 1;
+
+  size_t grown = *capacity ? *capacity : 4096;
+  while (grown < needed)
+    grown *= 2;
+
+  void *resized = realloc(*buffer, grown);
+  if (!resized)
+    return 0;
+  *buffer = resized;
+  *capacity = grown;
+  return 1;
+}
+
+// Append a formatted line to a text buffer
+static void text_printf(text_buffer_t *text, const char *fmt, ...) {
+  va_list args;
+
+  va_start(args, fmt);
+  int len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  if (len < 0 ||
+      !reserve((void **)&text->data, &text->capacity, text->len + len + 1))
+    return;
+
+  va_start(args, fmt);
+  vsnprintf(text->data + text->len, (size_t)len + 1, fmt, args);
+  va_end(args);
+  text->len += (size_t)len;
+}
+
+// Diagnostic callback: collect the assembler's messages for the reply
+static void collect_message(void *arg, mips_diag_kind_t kind,
+                            const char *message) {
+  server_worker_t *worker = arg;
+  text_printf(kind == MIPS_DIAG_INFO ? &worker->out : &worker->err, "%s\n",
+              message);
+}
+
+// Read exactly len bytes; returns 0 on error or end of stream
+static int read_full(int fd, void *buffer, size_t len) {
+  uint8_t *p = buffer;
+  while (len > 0) {
+    ssize_t got = read(fd, p, len);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return 0;
+    p += got;
+    len -= (size_t)got;
+  }
+  return 1;
+}
+
+// Write exactly len bytes without raising SIGPIPE if the peer went away
+static int write_full(int fd, const void *buffer, size_t len) {
+  const uint8_t *p = buffer;
+  while (len > 0) {
+    ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return 0;
+    p += sent;
+    len -= (size_t)sent;
+  }
+  return 1;
+}
+
+// Assemble source with the worker's assembler into its image buffer.
+// Returns 1 and sets *image_len on success.
+static int assemble_request(server_worker_t *worker, uint32_t flags,
+                            const char *source, size_t source_len,
+                            size_t *image_len) {
+  mips_assembler_t **as = &worker->assemblers[flags & SERVER_OPTION_FLAGS];
+  if (!*as) {
+    mips_options_t options = {0};
+    options.verbose = (flags & SERVER_FLAG_VERBOSE) != 0;
+    options.optimize = (flags & SERVER_FLAG_OPTIMIZE) != 0;
+    options.schedule = (flags & SERVER_FLAG_SCHEDULE) != 0;
+    options.jobs = 1; // Requests, not passes, are spread over the cores
+    options.diag = collect_message;
+    options.diag_arg = worker;
+    *as = mips_assembler_create(&options);
+    if (!*as) {
+      text_printf(&worker->err, "Error: Out of memory\n");
+      return 0;
+    }
+  }
+
+  int status = mips_assembler_assemble(*as, source, source_len, worker->image,
+                                       worker->image_capacity, image_len);
+  if (status == MIPS_ASM_NOSPACE) {
+    // First image of this size: grow the buffer and finish the run
+    if (!reserve((void **)&worker->image, &worker->image_capacity,
+                 *image_len ? *image_len : 1)) {
+      text_printf(&worker->err, "Error: Out of memory\n");
+      return 0;
+    }
+    status = mips_assembler_encode(*as, worker->image, worker->image_capacity,
+                                   image_len);
+  }
+
+  if (status != MIPS_ASM_OK) {
+    text_printf(&worker->err, "Error: Assembly failed\n");
+    return 0;
+  }
+  return 1;
+}
+
+// Assemble the file named by a request, with the same diagnostics as the
+// command line
+static int assemble_path(server_worker_t *worker, uint32_t flags,
+                         const char *path, size_t *image_len) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    text_printf(&worker->err, "Error: Failed to open input file '%s'\n",
+                path);
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    text_printf(&worker->err, "Error: Failed to stat input file '%s'\n",
+                path);
+    close(fd);
+    return 0;
+  }
+
+  if (st.st_size <= 0) {
+    text_printf(&worker->err, "Error: Input file is empty\n");
+    close(fd);
+    return 0;
+  }
+
+  size_t size = (size_t)st.st_size;
+  void *source = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (source == MAP_FAILED) {
+    text_printf(&worker->err, "Error: Failed to map input file '%s'\n",
+                path);
+    return 0;
+  }
+
+  int ok = assemble_request(worker, flags, source, size, image_len);
+  munmap(source, size);
+  return ok;
+}
+
+// Serve requests on one connection until the client hangs up
+static void serve_client(server_worker_t *worker, int fd) {
+  server_request_t request;
+
+  while (read_full(fd, &request, sizeof(request))) {
+    // A client of another version gets this server's version back
+    if (request.magic != SERVER_MAGIC) {
+      server_reply_t reply = {SERVER_MAGIC, SERVER_VERSION, 0, 0, 0, 0, 0};
+      write_full(fd, &reply, sizeof(reply));
+      return;
+    }
+    if (request.length > SERVER_MAX_REQUEST)
+      return;
+
+    // Paths are NUL-terminated in the payload buffer
+    size_t length = (size_t)request.length;
+    if (!reserve((void **)&worker->payload, &worker->payload_capacity,
+                 length + 1) ||
+        !read_full(fd, worker->payload, length)) {
+      return;
+    }
+    worker->payload[length] = '\0';
+
+    size_t image_len = 0;
+    worker->out.len = 0;
+    worker->err.len = 0;
+
+    int ok;
+    if (request.flags & SERVER_FLAG_PATH) {
+      ok = assemble_path(worker, request.flags, worker->payload, &image_len);
+    } else {
+      ok = assemble_request(worker, request.flags, worker->payload, length,
+                            &image_len);
+    }
+    if (!ok)
+      image_len = 0;
+    if (worker->out.len > SERVER_MAX_REPLY ||
+        worker->err.len > SERVER_MAX_REPLY || image_len > SERVER_MAX_REPLY) {
+      ok = 0;
+      image_len = 0;
+      worker->out.len = 0;
+      worker->err.len = 0;
+      text_printf(&worker->err,
+                  "Error: Result too large for the server; assemble "
+                  "without --connect\n");
+    }
+
+    server_reply_t reply = {SERVER_MAGIC,    SERVER_VERSION, (uint32_t)ok, 0,
+                            worker->out.len, worker->err.len, image_len};
+    if (!write_full(fd, &reply, sizeof(reply)) ||
+        !write_full(fd, worker->out.data, worker->out.len) ||
+        !write_full(fd, worker->err.data, worker->err.len) ||
+        !write_full(fd, worker->image, image_len)) {
+      return;
+    }
+  }
+}
+
+// Task: accept and serve connections until the listening socket fails
+static void serve_connections(void *arg, int index) {
+  server_t *server = arg;
+  server_worker_t *worker = &server->workers[index];
+
+  for (;;) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("Error: accept");
+      return;
+    }
+    serve_client(worker, fd);
+    close(fd);
+  }
+}
+
+// Remove the socket and exit on SIGINT/SIGTERM
+static void stop_server(int signal_number) {
+  (void)signal_number;
+  unlink(server_socket_path);
+  _exit(0);
+}
+
+// Bind a listening socket at path, replacing a stale socket left behind by
+// a server that is no longer running
+static int listen_at(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Error: Socket path '%s' is too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("Error: socket");
+    return -1;
+  }
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    int in_use = (errno == EADDRINUSE);
+    int live = in_use ? server_connect(path) : -1;
+    if (!in_use || live >= 0) {
+      fprintf(stderr, "Error: Cannot listen on '%s'%s\n", path,
+              live >= 0 ? ": a server is already running" : "");
+      if (live >= 0)
+        close(live);
+      close(fd);
+      return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+      perror("Error: bind");
+      close(fd);
+      return -1;
+    }
+  }
+
+  if (listen(fd, SOMAXCONN) != 0) {
+    perror("Error: listen");
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  return fd;
+}
+
+// Run the assembler daemon on socket_path with one worker per thread. Only
+// returns on failure.
+int server_run(const char *socket_path, int threads) {
+  server_t server;
+
+  server.listen_fd = listen_at(socket_path);
+  if (server.listen_fd < 0)
+    return 0;
+
+  server_socket_path = socket_path;
+  signal(SIGINT, stop_server);
+  signal(SIGTERM, stop_server);
+
+  server.workers = calloc((size_t)threads, sizeof(server_worker_t));
+  threadpool_t *pool = server.workers ? threadpool_create(threads) : NULL;
+  if (pool) {
+    threadpool_run(pool, serve_connections, &server, threads);
+    threadpool_destroy(pool);
+  } else {
+    fprintf(stderr, "Error: Failed to start worker threads\n");
+  }
+
+  for (int i = 0; server.workers && i < threads; i++) {
+    server_worker_t *worker = &server.workers[i];
+    for (size_t a = 0; a <= SERVER_OPTION_FLAGS; a++)
+      mips_assembler_destroy(worker->assemblers[a]);
+    free(worker->payload);
+    free(worker->image);
+    free(worker->out.data);
+    free(worker->err.data);
+  }
+  free(server.workers);
+  close(server.listen_fd);
+  unlink(socket_path);
+  return 0;
+}
+
+// Connect to a server; returns the socket or -1
+int server_connect(const char *socket_path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path))
+    return -1;
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+  return fd;
+}
+
+// Read `len` bytes of a reply into a new buffer
+static int read_part(int fd, uint64_t len, void **part) {
+  *part = malloc(len ? (size_t)len : 1);
+  return *part && read_full(fd, *part, (size_t)len);
+}
+
+// Send one request and wait for its reply. Returns 0 if the exchange
+// failed, and SERVER_MISMATCH with result->version set when the server
+// speaks another protocol version; the assembly's own result is in
+// result->status.
+int server_call(int fd, uint32_t flags, const void *payload, size_t length,
+                server_result_t *result) {
+  server_request_t request = {SERVER_MAGIC, flags, length};
+  server_reply_t reply;
+
+  memset(result, 0, sizeof(*result));
+  if (!write_full(fd, &request, sizeof(request)) ||
+      !write_full(fd, payload, length) ||
+      !read_full(fd, &reply, sizeof(reply))) {
+    return 0;
+  }
+  if (reply.magic != SERVER_MAGIC || reply.version != SERVER_VERSION) {
+    result->version = reply.magic == SERVER_MAGIC ? reply.version : 0;
+    return SERVER_MISMATCH;
+  }
+
+  // Never trust a length enough to allocate more than a reply may hold
+  if (reply.out_len > SERVER_MAX_REPLY || reply.err_len > SERVER_MAX_REPLY ||
+      reply.image_len > SERVER_MAX_REPLY) {
+    return 0;
+  }
+
+  result->status = (int)reply.status;
+  result->out_len = (size_t)reply.out_len;
+  result->err_len = (size_t)reply.err_len;
+  result->image_len = (size_t)reply.image_len;
+  if (!read_part(fd, reply.out_len, (void **)&result->out) ||
+      !read_part(fd, reply.err_len, (void **)&result->err) ||
+      !read_part(fd, reply.image_len, (void **)&result->image)) {
+    server_result_free(result);
+    return 0;
+  }
+  return 1;
+}
+
+// Release the buffers of a reply
+void server_result_free(server_result_t *result) {
+  free(result->out);
+  free(result->err);
+  free(result->image);
+  memset(result, 0, sizeof(*result));
+}
@@ -0,0 +1,74 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Request protocol of `mipsasm --server`, spoken over a local Unix stream
+// socket in native byte order. A connection carries any number of
+// request/reply exchanges:
+//
+//   request: server_request_t, then `length` bytes of source (or of a file
+//            path when SERVER_FLAG_PATH is set)
+//   reply:   server_reply_t, then out_len bytes of verbose output, err_len
+//            bytes of diagnostics and image_len bytes of image
+//
+// Byte order and layout are those of the build, so the magic carries the
+// protocol version: a server from another version, or of the other byte
+// order, rejects the request. A reply starts with the magic and the
+// server's version in every version, so a client can report a mismatch
+// before it reads anything else.
+#define SERVER_VERSION 3u
+#define SERVER_MAGIC (0x3053414Du + (SERVER_VERSION << 24)) // "MAS3"
+
+#define SERVER_FLAG_VERBOSE 0x1u
+#define SERVER_FLAG_PATH 0x2u     // Payload is a path the server reads itself
+#define SERVER_FLAG_OPTIMIZE 0x4u // -O
+#define SERVER_FLAG_SCHEDULE 0x8u // --schedule
+
+// Flags that select the assembler options of a request
+#define SERVER_OPTION_FLAGS                                                    \
+  (SERVER_FLAG_VERBOSE | SERVER_FLAG_OPTIMIZE | SERVER_FLAG_SCHEDULE)
+
+// Longest accepted payload, and longest part of a reply
+#define SERVER_MAX_REQUEST (1u << 30)
+#define SERVER_MAX_REPLY (1u << 30)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t flags;
+  uint64_t length;
+} server_request_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;  // SERVER_VERSION of the server
+  uint32_t status;   // 1 when the image was assembled, 0 on error
+  uint32_t reserved; // 0
+  uint64_t out_len;
+  uint64_t err_len;
+  uint64_t image_len;
+} server_reply_t;
+
+// server_call() result for a server of another protocol version
+#define SERVER_MISMATCH (-1)
+
+// Reply of server_call(); every buffer is malloc()ed
+typedef struct {
+  int status;
+  uint32_t version; // Server's version after SERVER_MISMATCH, 0 if unknown
+  char *out;
+  size_t out_len;
+  char *err;
+  size_t err_len;
+  uint8_t *image;
+  size_t image_len;
+} server_result_t;
+
+int server_run(const char *socket_path, int threads);
+int server_connect(const char *socket_path);
+int server_call(int fd, uint32_t flags, const void *payload, size_t length,
+                server_result_t *result);
+void server_result_free(server_result_t *result);
+
+#endif // SERVER_H
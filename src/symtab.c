@@ -0,0 +1,189 @@
+#include "symtab.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SYMTAB_INITIAL_SLOTS 64
+
+// Initialize an empty symbol table
+void symtab_init(symtab_t *st) {
+  st->entries = NULL;
+  st->count = 0;
+  st->capacity = 0;
+  st->slots = NULL;
+  st->slot_mask = 0;
+  st->lookups = 0;
+  st->probes = 0;
+  arena_init(&st->names, 0);
+}
+
+// Release all memory owned by the symbol table
+void symtab_free(symtab_t *st) {
+  free(st->entries);
+  free(st->slots);
+  arena_free(&st->names);
+  symtab_init(st);
+}
+
+// Remove every label, keeping the memory for the next use of the table
+void symtab_reset(symtab_t *st) {
+  st->count = 0;
+  st->lookups = 0;
+  st->probes = 0;
+  if (st->slots) {
+    for (uint32_t i = 0; i <= st->slot_mask; i++)
+      st->slots[i].index = -1;
+  }
+  arena_reset(&st->names);
+}
+
+// FNV-1a hash of a label name
+uint32_t symtab_hash(const char *name, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Find the slot holding name, or the empty slot where it would be inserted
+static uint32_t symtab_probe(symtab_t *st, const char *name, size_t len,
+                             uint32_t hash) {
+  uint32_t slot = hash & st->slot_mask;
+  st->lookups++;
+  st->probes++;
+  while (st->slots[slot].index >= 0) {
+    if (st->slots[slot].hash == hash) {
+      const char *candidate = st->entries[st->slots[slot].index].name;
+      if (strncmp(candidate, name, len) == 0 && candidate[len] == '\0')
+        break;
+    }
+    slot = (slot + 1) & st->slot_mask;
+    st->probes++;
+  }
+  return slot;
+}
+
+// Double the slot array and rehash every entry, keeping the load factor <= 1/2
+static int symtab_grow_slots(symtab_t *st) {
+  uint32_t slot_count = st->slots ? (st->slot_mask + 1) * 2
+                                  : SYMTAB_INITIAL_SLOTS;
+  symtab_slot_t *slots = malloc(slot_count * sizeof(*slots));
+  if (!slots)
+    return 0;
+
+  for (uint32_t i = 0; i < slot_count; i++)
+    slots[i].index = -1;
+  free(st->slots);
+  st->slots = slots;
+  st->slot_mask = slot_count - 1;
+
+  for (int i = 0; i < st->count; i++) {
+    uint32_t slot = st->entries[i].hash & st->slot_mask;
+    while (st->slots[slot].index >= 0)
+      slot = (slot + 1) & st->slot_mask;
+    st->slots[slot].hash = st->entries[i].hash;
+    st->slots[slot].index = i;
+  }
+  return 1;
+}
+
+// Append a new entry for name in the given slot
+static int symtab_insert(symtab_t *st, uint32_t slot, const char *name,
+                         size_t len, uint32_t hash) {
+  if (st->count == st->capacity) {
+    int capacity = st->capacity ? st->capacity * 2 : SYMTAB_INITIAL_SLOTS / 2;
+    label_t *entries = realloc(st->entries, capacity * sizeof(*entries));
+    if (!entries)
+      return SYMTAB_NOMEM;
+    st->entries = entries;
+    st->capacity = capacity;
+  }
+
+  const char *interned = arena_strndup(&st->names, name, len);
+  if (!interned)
+    return SYMTAB_NOMEM;
+
+  label_t *label = &st->entries[st->count];
+  label->name = interned;
+  label->address = 0;
+  label->hash = hash;
+  label->resolved = 0;
+  label->section = 0;
+  label->binding = 0;
+  label->statement = 0;
+
+  st->slots[slot].hash = hash;
+  st->slots[slot].index = st->count;
+  return st->count++;
+}
+
+// Look up a name with a known hash, creating an unresolved entry if it is not
+// present yet. Returns the entry index or SYMTAB_NOMEM.
+static int symtab_reference_hashed(symtab_t *st, const char *name, size_t len,
+                                   uint32_t hash) {
+  if (!st->slots || (uint32_t)(st->count + 1) * 2 > st->slot_mask + 1) {
+    if (!symtab_grow_slots(st))
+      return SYMTAB_NOMEM;
+  }
+
+  uint32_t slot = symtab_probe(st, name, len, hash);
+  if (st->slots[slot].index >= 0)
+    return st->slots[slot].index;
+
+  return symtab_insert(st, slot, name, len, hash);
+}
+
+// Look up name, creating an unresolved entry if it is not present yet.
+// Returns the entry index or SYMTAB_NOMEM.
+int symtab_reference(symtab_t *st, const char *name, size_t len) {
+  return symtab_reference_hashed(st, name, len, symtab_hash(name, len));
+}
+
+// Define a label; returns its index, SYMTAB_DUPLICATE or SYMTAB_NOMEM.
+// Defining a label that was previously only referenced resolves it.
+int symtab_add(symtab_t *st, const char *name, size_t len, uint32_t address) {
+  int index = symtab_reference(st, name, len);
+  if (index < 0)
+    return index;
+
+  label_t *label = &st->entries[index];
+  if (label->resolved)
+    return SYMTAB_DUPLICATE;
+
+  label->address = address;
+  label->resolved = 1;
+  return index;
+}
+
+// Copy an entry of another table into this one, reusing its cached hash. A
+// defined entry is defined here too, and binding flags add up. Returns the
+// index in this table, SYMTAB_DUPLICATE or SYMTAB_NOMEM.
+int symtab_import(symtab_t *st, const label_t *label) {
+  size_t len = strlen(label->name);
+  int index = symtab_reference_hashed(st, label->name, len, label->hash);
+  if (index < 0)
+    return index;
+
+  label_t *entry = &st->entries[index];
+  entry->binding |= label->binding;
+  if (!label->resolved)
+    return index;
+  if (entry->resolved)
+    return SYMTAB_DUPLICATE;
+
+  entry->address = label->address;
+  entry->section = label->section;
+  entry->statement = label->statement;
+  entry->resolved = 1;
+  return index;
+}
+
+// Find a label by name; returns its index or -1
+int symtab_find(symtab_t *st, const char *name, size_t len) {
+  if (!st->slots)
+    return -1;
+
+  uint32_t slot = symtab_probe(st, name, len, symtab_hash(name, len));
+  return st->slots[slot].index;
+}
@@ -0,0 +1,56 @@
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+#include "arena.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Return codes for symtab_add() and symtab_import()
+#define SYMTAB_DUPLICATE (-1)
+#define SYMTAB_NOMEM (-2)
+
+// label_t.binding flags
+#define LABEL_GLOBAL 0x01 // .globl: visible to other modules
+#define LABEL_EXTERN 0x02 // .extern: may be defined by another module
+
+// Label structure
+typedef struct {
+  const char *name; // Interned in the symbol table's string arena
+  uint32_t address;
+  uint32_t hash;
+  int resolved;    // Zero while the label has only been referenced
+  uint8_t section; // Section the label is defined in (section_type_t)
+  uint8_t binding; // LABEL_* flags
+  uint32_t statement; // Number of statements parsed before the definition
+} label_t;
+
+// Hash table slot. The hash is cached next to the entry index so probing
+// past other names does not touch the entry array.
+typedef struct {
+  uint32_t hash;
+  int32_t index; // -1 marks an empty slot
+} symtab_slot_t;
+
+// Growable symbol table. Labels are kept in definition order in `entries`,
+// indexed by an open-addressed (linear probing) hash table of entry indices.
+typedef struct {
+  label_t *entries;
+  int count;
+  int capacity;
+  symtab_slot_t *slots;
+  uint32_t slot_mask; // Slot count minus one (slot count is a power of two)
+  arena_t names;
+  uint64_t lookups; // Lookups since the last reset (statistics)
+  uint64_t probes;  // Slots they visited
+} symtab_t;
+
+void symtab_init(symtab_t *st);
+void symtab_free(symtab_t *st);
+void symtab_reset(symtab_t *st);
+uint32_t symtab_hash(const char *name, size_t len);
+int symtab_reference(symtab_t *st, const char *name, size_t len);
+int symtab_add(symtab_t *st, const char *name, size_t len, uint32_t address);
+int symtab_import(symtab_t *st, const label_t *label);
+int symtab_find(symtab_t *st, const char *name, size_t len);
+
+#endif // SYMTAB_H
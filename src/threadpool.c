@@ -0,0 +1,199 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "threadpool.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+// Per-thread share of a batch. The owner takes indices from the front;
+// idle threads steal from the back.
+typedef struct {
+  pthread_mutex_t lock;
+  int next; // Next index for the owner
+  int end;  // One past the last unclaimed index
+  threadpool_fn_t fn;
+  void *arg;
+} task_queue_t;
+
+// Fixed-size pool of worker threads running parallel-for batches with work
+// stealing. The calling thread takes part in every batch as thread 0, so a
+// pool of N threads starts N - 1 workers.
+struct threadpool {
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready; // Signalled when a batch starts or on shutdown
+  pthread_cond_t work_done;  // Signalled when the last task of a batch ends
+  pthread_t *workers;
+  int worker_count;
+  task_queue_t *queues; // One per requested thread, caller first
+  int queue_count;
+
+  // Protected by lock
+  int remaining;  // Tasks of the current batch not finished yet
+  unsigned batch; // Incremented for every batch so workers notice new work
+  int shutdown;
+};
+
+// Worker thread start argument
+typedef struct {
+  threadpool_t *pool;
+  int self;
+} worker_arg_t;
+
+// Claim an index from a queue, from the front for its owner or the back
+// for a thief. Returns 0 if the queue is empty.
+static int claim_task(task_queue_t *queue, int steal, int *index,
+                      threadpool_fn_t *fn, void **arg) {
+  int found = 0;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->next < queue->end) {
+    *index = steal ? --queue->end : queue->next++;
+    *fn = queue->fn;
+    *arg = queue->arg;
+    found = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+// Run tasks from our own queue, then steal from the others until every
+// queue is empty
+static void run_tasks(threadpool_t *pool, int self) {
+  int threads = pool->worker_count + 1;
+  int victim = self;
+  threadpool_fn_t fn;
+  void *arg;
+  int index;
+
+  for (int tries = 0; tries < threads;) {
+    if (!claim_task(&pool->queues[victim], victim != self, &index, &fn,
+                    &arg)) {
+      victim = (victim + 1) % threads;
+      tries++;
+      continue;
+    }
+
+    fn(arg, index);
+    tries = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->remaining == 0)
+      pthread_cond_broadcast(&pool->work_done);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static void *worker_main(void *data) {
+  worker_arg_t *worker = data;
+  threadpool_t *pool = worker->pool;
+  int self = worker->self;
+  unsigned seen = 0;
+
+  free(worker);
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->shutdown && pool->batch == seen)
+      pthread_cond_wait(&pool->work_ready, &pool->lock);
+    if (pool->shutdown)
+      break;
+
+    seen = pool->batch;
+    pthread_mutex_unlock(&pool->lock);
+    run_tasks(pool, self);
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+// Create a pool that runs batches on `threads` threads (including the
+// caller). Returns NULL on failure.
+threadpool_t *threadpool_create(int threads) {
+  threadpool_t *pool = calloc(1, sizeof(*pool));
+  if (!pool)
+    return NULL;
+
+  if (threads < 1)
+    threads = 1;
+  pool->workers = malloc((size_t)threads * sizeof(pthread_t));
+  pool->queues = calloc((size_t)threads, sizeof(task_queue_t));
+  if (!pool->workers || !pool->queues) {
+    free(pool->workers);
+    free(pool->queues);
+    free(pool);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->work_done, NULL);
+  for (int i = 0; i < threads; i++)
+    pthread_mutex_init(&pool->queues[i].lock, NULL);
+  pool->queue_count = threads;
+
+  for (int i = 0; i < threads - 1; i++) {
+    worker_arg_t *worker = malloc(sizeof(*worker));
+    if (!worker)
+      break;
+    worker->pool = pool;
+    worker->self = i + 1;
+    if (pthread_create(&pool->workers[i], NULL, worker_main, worker) != 0) {
+      free(worker);
+      break; // Run with the workers we have
+    }
+    pool->worker_count++;
+  }
+  return pool;
+}
+
+// Run fn(arg, i) for every i in [0, count) and wait until all have returned.
+// Indices are dealt out to the threads in contiguous blocks; threads that run
+// out of work steal from the end of another thread's block.
+void threadpool_run(threadpool_t *pool, threadpool_fn_t fn, void *arg,
+                    int count) {
+  int threads = pool->worker_count + 1;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->remaining = count;
+  for (int t = 0; t < threads; t++) {
+    task_queue_t *queue = &pool->queues[t];
+    pthread_mutex_lock(&queue->lock);
+    queue->next = (int)((long long)count * t / threads);
+    queue->end = (int)((long long)count * (t + 1) / threads);
+    queue->fn = fn;
+    queue->arg = arg;
+    pthread_mutex_unlock(&queue->lock);
+  }
+  pool->batch++;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  run_tasks(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->remaining > 0)
+    pthread_cond_wait(&pool->work_done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Stop all workers and free the pool
+void threadpool_destroy(threadpool_t *pool) {
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->worker_count; i++)
+    pthread_join(pool->workers[i], NULL);
+
+  for (int i = 0; i < pool->queue_count; i++)
+    pthread_mutex_destroy(&pool->queues[i].lock);
+  pthread_cond_destroy(&pool->work_done);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->queues);
+  free(pool->workers);
+  free(pool);
+}
@@ -0,0 +1,14 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// Task run by threadpool_run(): called once for every index in [0, count)
+typedef void (*threadpool_fn_t)(void *arg, int index);
+
+typedef struct threadpool threadpool_t;
+
+threadpool_t *threadpool_create(int threads);
+void threadpool_run(threadpool_t *pool, threadpool_fn_t fn, void *arg,
+                    int count);
+void threadpool_destroy(threadpool_t *pool);
+
+#endif // THREADPOOL_H
@@ -0,0 +1,46 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+
+trace_t *trace_create(trace_sink_t sink, void *sink_arg) {
+  trace_t *trace = malloc(sizeof(*trace));
+  if (trace) {
+    trace->count = 0;
+    trace->text_used = 0;
+    trace->sink = sink;
+    trace->sink_arg = sink_arg;
+  }
+  return trace;
+}
+
+void trace_destroy(trace_t *trace) { free(trace); }
+
+// Record one event. The name is copied, so it may point into a line buffer
+// that is reused before the event is formatted.
+void trace_record(trace_t *trace, trace_kind_t kind, const char *name,
+                  size_t name_len, uint32_t value, int section) {
+  if (name_len > TRACE_TEXT_SIZE)
+    name_len = TRACE_TEXT_SIZE;
+  if (trace->count == TRACE_CAPACITY ||
+      trace->text_used + name_len > TRACE_TEXT_SIZE) {
+    trace_drain(trace);
+  }
+
+  trace_event_t *event = &trace->events[trace->count++];
+  event->name = trace->text + trace->text_used;
+  event->name_len = (uint32_t)name_len;
+  event->value = value;
+  event->kind = (uint8_t)kind;
+  event->section = (uint8_t)section;
+  if (name_len > 0)
+    memcpy(trace->text + trace->text_used, name, name_len);
+  trace->text_used += name_len;
+}
+
+// Format every recorded event through the sink and empty the buffer
+void trace_drain(trace_t *trace) {
+  for (size_t i = 0; i < trace->count; i++)
+    trace->sink(trace->sink_arg, &trace->events[i]);
+  trace->count = 0;
+  trace->text_used = 0;
+}
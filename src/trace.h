@@ -0,0 +1,54 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Events held before the buffer is drained
+#define TRACE_CAPACITY 1024
+
+// Bytes of names copied out of the source before the buffer is drained
+#define TRACE_TEXT_SIZE 16384
+
+// Kinds of trace_event_t
+typedef enum {
+  TRACE_LABEL,        // Label defined: name, value = address, section
+  TRACE_SECTION,      // .text/.data: section
+  TRACE_DIRECTIVE,    // Directive processed: name
+  TRACE_ORG,          // .org: value = address, section
+  TRACE_WORD_SYMBOL,  // .word label resolved: name, value = address
+  TRACE_LOAD_ADDRESS, // la/li label resolved: name, value = address
+} trace_kind_t;
+
+// One verbose event, recorded in binary form and formatted when the buffer
+// is drained. name points into the buffer's own text.
+typedef struct {
+  const char *name;
+  uint32_t name_len;
+  uint32_t value;
+  uint8_t kind;    // trace_kind_t
+  uint8_t section; // section_type_t
+} trace_event_t;
+
+// Receives the events of trace_drain() in the order they were recorded
+typedef void (*trace_sink_t)(void *arg, const trace_event_t *event);
+
+// Event buffer of one assembler context. A context is only used by one
+// thread at a time, so recording takes no lock; a full buffer is drained
+// into its sink.
+typedef struct {
+  trace_event_t events[TRACE_CAPACITY];
+  size_t count;
+  char text[TRACE_TEXT_SIZE];
+  size_t text_used;
+  trace_sink_t sink;
+  void *sink_arg;
+} trace_t;
+
+trace_t *trace_create(trace_sink_t sink, void *sink_arg);
+void trace_destroy(trace_t *trace);
+void trace_record(trace_t *trace, trace_kind_t kind, const char *name,
+                  size_t name_len, uint32_t value, int section);
+void trace_drain(trace_t *trace);
+
+#endif // TRACE_H
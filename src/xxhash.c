@@ -0,0 +1,89 @@
+// XXH64, the 64-bit variant of Yann Collet's xxHash. Fast non-cryptographic
+// hash used to key cached results.
+
+#include "xxhash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ull
+#define PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define PRIME64_3 0x165667B19E3779F9ull
+#define PRIME64_4 0x85EBCA77C2B2AE63ull
+#define PRIME64_5 0x27D4EB2F165667C5ull
+
+static uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+// Unaligned little-endian loads
+static uint32_t read32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read64(const uint8_t *p) {
+  return (uint64_t)read32(p) | ((uint64_t)read32(p + 4) << 32);
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t value) {
+  acc ^= round64(0, value);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+// Hash len bytes of data
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+  const uint8_t *p = data;
+  const uint8_t *end = p + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    // Four interleaved lanes over 32-byte stripes
+    uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+    uint64_t v2 = seed + PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME64_1;
+    const uint8_t *limit = end - 32;
+    do {
+      v1 = round64(v1, read64(p));
+      v2 = round64(v2, read64(p + 8));
+      v3 = round64(v3, read64(p + 16));
+      v4 = round64(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = merge_round(h, v1);
+    h = merge_round(h, v2);
+    h = merge_round(h, v3);
+    h = merge_round(h, v4);
+  } else {
+    h = seed + PRIME64_5;
+  }
+
+  h += (uint64_t)len;
+
+  // Tail: 8, 4 and 1 byte steps
+  for (; p + 8 <= end; p += 8) {
+    h ^= round64(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t)read32(p) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= (uint64_t)*p * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+  }
+
+  // Avalanche
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
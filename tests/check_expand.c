@@ -0,0 +1,260 @@
+// Check of the mul, divi and remi by-constant expansions.
+//
+// Assembles each pseudo-instruction for every constant in [-70000, 70000],
+// for +/-(2^k + {-3..3}) and for random constants, both with rd != rs and
+// with rd == rs. The words it emits run on a small MIPS I interpreter for
+// boundary, random and near-overflow dividends, and every result is compared
+// with C's *, / and %.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/libmipsasm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest expansion, in words
+#define MAX_WORDS 64
+
+// Random constants checked per pseudo-instruction
+#define RANDOM_CONSTANTS 150000
+
+// Failures reported before the rest are only counted
+#define MAX_REPORTS 20
+
+typedef enum { KIND_MUL, KIND_DIVI, KIND_REMI, KIND_COUNT } kind_t;
+
+static const char *const names[KIND_COUNT] = {"mul", "divi", "remi"};
+
+// Registers of the expansion under test
+#define REG_RD 8
+#define REG_RS 9
+
+typedef struct {
+  uint32_t words[MAX_WORDS];
+  int count;
+} program_t;
+
+static mips_assembler_t *assembler;
+static unsigned long long checked;
+static unsigned long long failures;
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+// xorshift64
+static uint32_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (uint32_t)rng_state;
+}
+
+static int assemble(const char *source, program_t *program) {
+  uint8_t image[MAX_WORDS * 4];
+  size_t size;
+  if (!mips_assembler_assemble(assembler, source, strlen(source), image,
+                               sizeof(image), &size)) {
+    return 0;
+  }
+  program->count = (int)(size / 4);
+  for (int i = 0; i < program->count; i++) {
+    const uint8_t *p = image + 4 * i;
+    program->words[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+                        (uint32_t)p[2] << 8 | p[3];
+  }
+  return 1;
+}
+
+// Run a program with every register but $zero set to a distinct value and
+// rs to x. Returns 0 on an instruction the expansions should not emit, or a
+// division that would trap.
+static int run(const program_t *program, int rd, int rs, uint32_t x,
+               uint32_t *result) {
+  uint32_t r[32];
+  uint32_t hi = 0xDEADBEEF;
+  uint32_t lo = 0xBEEFDEAD;
+  r[0] = 0;
+  for (int i = 1; i < 32; i++)
+    r[i] = 0x1000u * (uint32_t)i + 7;
+  r[rs] = x;
+
+  for (int i = 0; i < program->count; i++) {
+    uint32_t word = program->words[i];
+    int op = (int)(word >> 26);
+    int s = (int)(word >> 21) & 31;
+    int t = (int)(word >> 16) & 31;
+    int d = (int)(word >> 11) & 31;
+    int shift = (int)(word >> 6) & 31;
+    uint32_t imm = word & 0xFFFF;
+
+    if (op == 0x00) {
+      switch (word & 63) {
+      case 0x00: // sll
+        r[d] = r[t] << shift;
+        break;
+      case 0x02: // srl
+        r[d] = r[t] >> shift;
+        break;
+      case 0x03: // sra
+        r[d] = (uint32_t)((int32_t)r[t] >> shift);
+        break;
+      case 0x21: // addu
+        r[d] = r[s] + r[t];
+        break;
+      case 0x23: // subu
+        r[d] = r[s] - r[t];
+        break;
+      case 0x18: { // mult
+        int64_t product = (int64_t)(int32_t)r[s] * (int32_t)r[t];
+        hi = (uint32_t)((uint64_t)product >> 32);
+        lo = (uint32_t)product;
+        break;
+      }
+      case 0x1A: { // div
+        int32_t a = (int32_t)r[s];
+        int32_t b = (int32_t)r[t];
+        if (b == 0 || (a == INT32_MIN && b == -1))
+          return 0;
+        lo = (uint32_t)(a / b);
+        hi = (uint32_t)(a % b);
+        break;
+      }
+      case 0x10: // mfhi
+        r[d] = hi;
+        break;
+      case 0x12: // mflo
+        r[d] = lo;
+        break;
+      default:
+        return 0;
+      }
+    } else if (op == 0x09) { // addiu
+      r[t] = r[s] + (uint32_t)(int32_t)(int16_t)imm;
+    } else if (op == 0x0C) { // andi
+      r[t] = r[s] & imm;
+    } else if (op == 0x0D) { // ori
+      r[t] = r[s] | imm;
+    } else if (op == 0x0F) { // lui
+      r[t] = imm << 16;
+    } else {
+      return 0;
+    }
+    r[0] = 0;
+  }
+  *result = r[rd];
+  return 1;
+}
+
+// What C makes of x op c; -1 is special-cased only where C would overflow
+static uint32_t reference(kind_t kind, uint32_t x, uint32_t c) {
+  int32_t a = (int32_t)x;
+  int32_t b = (int32_t)c;
+  if (kind == KIND_MUL)
+    return x * c;
+  if (b == -1)
+    return kind == KIND_DIVI ? 0u - x : 0;
+  return kind == KIND_DIVI ? (uint32_t)(a / b) : (uint32_t)(a % b);
+}
+
+// A dividend: boundary values first, then random ones, then for divi and
+// remi ones next to the largest multiples of the divisor, of either sign
+static uint32_t dividend(kind_t kind, uint32_t c, int i) {
+  static const uint32_t boundary[] = {
+      0,          1,          2,          3,          7,
+      0xFFFFFFFF, 0xFFFFFFFE, 0x80000000, 0x80000001, 0x7FFFFFFF,
+      0x7FFFFFFE, 12345,      0u - 12345, 1000000,    0u - 1000000};
+  int count = (int)(sizeof(boundary) / sizeof(boundary[0]));
+  if (i < count)
+    return boundary[i];
+  if (kind == KIND_MUL || i < count + 20)
+    return rng();
+
+  uint32_t divisor = (int32_t)c < 0 ? 0u - c : c;
+  uint32_t x = (rng() % 5 + 0x7FFFFFFDu / divisor) * divisor -
+               (uint32_t)(i & 1);
+  return i >= count + 30 ? 0u - x : x;
+}
+
+#define DIVIDENDS 55
+
+static void check(kind_t kind, uint32_t c) {
+  if (kind != KIND_MUL && c == 0)
+    return;
+
+  for (int same = 0; same < 2; same++) {
+    int rs = same ? REG_RD : REG_RS;
+    char source[64];
+    program_t program;
+    snprintf(source, sizeof(source), "%s $%d, $%d, %d\n", names[kind], REG_RD,
+             rs, (int)(int32_t)c);
+    if (!assemble(source, &program)) {
+      if (failures++ < MAX_REPORTS)
+        fprintf(stderr, "Expansion check: cannot assemble %s", source);
+      continue;
+    }
+
+    for (int i = 0; i < DIVIDENDS; i++) {
+      uint32_t x = dividend(kind, c, i);
+      uint32_t want = reference(kind, x, c);
+      uint32_t got = 0;
+      checked++;
+      if (!run(&program, REG_RD, rs, x, &got)) {
+        if (failures++ < MAX_REPORTS) {
+          fprintf(stderr,
+                  "Expansion check failed: %.*s emits an unexpected "
+                  "instruction or divides by zero\n",
+                  (int)strlen(source) - 1, source);
+        }
+        break;
+      }
+      if (got != want) {
+        if (failures++ < MAX_REPORTS) {
+          fprintf(stderr,
+                  "Expansion check failed: %.*s with rs = %d gives %d, "
+                  "not %d\n",
+                  (int)strlen(source) - 1, source, (int)(int32_t)x,
+                  (int)(int32_t)got, (int)(int32_t)want);
+        }
+        break;
+      }
+    }
+  }
+}
+
+int main(void) {
+  mips_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.jobs = 1;
+  options.err = stderr;
+
+  assembler = mips_assembler_create(&options);
+  if (!assembler) {
+    fprintf(stderr, "Expansion check: failed to create an assembler\n");
+    return 1;
+  }
+
+  for (int kind = 0; kind < KIND_COUNT; kind++) {
+    for (int32_t c = -70000; c <= 70000; c++)
+      check((kind_t)kind, (uint32_t)c);
+    for (int k = 0; k < 32; k++) {
+      for (int e = -3; e <= 3; e++) {
+        uint32_t c = (1u << k) + (uint32_t)e;
+        check((kind_t)kind, c);
+        check((kind_t)kind, 0u - c);
+      }
+    }
+    // Small constants are the common case, so shift half of them down
+    for (int i = 0; i < RANDOM_CONSTANTS; i++) {
+      uint32_t c = rng();
+      check((kind_t)kind, i % 2 ? c : c >> (rng() & 31));
+    }
+  }
+  mips_assembler_destroy(assembler);
+
+  if (failures > 0) {
+    fprintf(stderr, "Expansion check: %llu failures\n", failures);
+    return 1;
+  }
+  printf("Expansion check passed: %llu results of mul, divi and remi\n",
+         checked);
+  return 0;
+}
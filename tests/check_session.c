@@ -0,0 +1,264 @@
+// Incremental assembly check for libmipsasm.
+//
+// Applies a series of edits to a source, feeds every version to one
+// mips_session_t and compares each image with what mips_assemble() makes of
+// the same source from scratch. The edits move labels, change the layout
+// with .align and .org, and switch .set reorder on and off, which makes the
+// session fall back to full runs and then return to incremental updates.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/libmipsasm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Filler statements around the edited lines, so that updates have a long
+// unchanged head and tail to reuse
+#define FILLER_LINES 1000
+
+#define MAX_LINES (4 * FILLER_LINES + 64)
+
+typedef enum {
+  EDIT_INSERT,  // Insert text before the line `at`, or append when NULL
+  EDIT_DELETE,  // Remove the line `at`
+  EDIT_REPLACE, // Replace the line `at` with text
+  EDIT_MOVE,    // Move the line `at` before the line text
+} edit_op_t;
+
+typedef struct {
+  const char *name;
+  edit_op_t op;
+  const char *at;
+  const char *text;
+  int fails; // The edited source does not assemble
+} edit_t;
+
+// Source lines; filler lines are marked by a NULL entry in `lines` and
+// formatted from their index
+static const char *lines[MAX_LINES];
+static int filler[MAX_LINES];
+static size_t line_count;
+
+static const edit_t edits[] = {
+    {"insert a line before a label", EDIT_INSERT, "loop:",
+     "  addiu $t2, $t2, 1", 0},
+    {"insert two lines at the top", EDIT_INSERT, "main:", "  nop\n  nop", 0},
+    {"delete a line", EDIT_DELETE, "  lw $t0, 0($a0)", NULL, 0},
+    {"move a label", EDIT_MOVE, "done:", "  jr $ra", 0},
+    {"change a data .align", EDIT_REPLACE, "  .align 2", "  .align 4", 0},
+    {"change a data .org", EDIT_REPLACE, "  .org 0x10010100",
+     "  .org 0x10010180", 0},
+    {"add a text .align", EDIT_INSERT, "func:", "  .align 4", 0},
+    {"change a text .org", EDIT_REPLACE, "  .org 0x00402000",
+     "  .org 0x00403000", 0},
+    {"append data", EDIT_INSERT, NULL, "  .word done", 0},
+    {"turn on .set reorder", EDIT_INSERT, "main:", ".set reorder", 0},
+    {"edit under .set reorder", EDIT_INSERT, "loop:", "  addiu $t3, $t3, 1", 0},
+    {"turn off .set reorder", EDIT_DELETE, ".set reorder", NULL, 0},
+    {"edit after .set reorder", EDIT_DELETE, "  addiu $t3, $t3, 1", NULL, 0},
+    {"break a reference", EDIT_REPLACE, "  jal func", "  jal nowhere", 1},
+    {"fix the reference", EDIT_REPLACE, "  jal nowhere", "  jal func", 0},
+    {"remove the text .org", EDIT_DELETE, "  .org 0x00403000", NULL, 0},
+    {"remove the text .align", EDIT_DELETE, "  .align 4", NULL, 0},
+    {"remove the data .org", EDIT_DELETE, "  .org 0x10010180", NULL, 0},
+    {"remove the data .align", EDIT_DELETE, "  .align 4", NULL, 0},
+    // Without .org and .align, the tail moves with the edits
+    {"insert a line before a label again", EDIT_INSERT, "loop:",
+     "  addiu $t4, $t4, 1", 0},
+    {"delete a line again", EDIT_DELETE, "  addiu $t2, $t2, 1", NULL, 0},
+    {"move a label back", EDIT_MOVE, "done:", "  li $v0, 10", 0},
+    {"grow the data", EDIT_INSERT, "table:", "  .word 9", 0},
+    {"shrink the text at the top", EDIT_REPLACE, "  nop\n  nop", "  nop", 0},
+};
+
+#define EDIT_COUNT (sizeof(edits) / sizeof(edits[0]))
+
+static void add_line(const char *line) {
+  filler[line_count] = 0;
+  lines[line_count++] = line;
+}
+
+static void add_filler(size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    filler[line_count] = 1;
+    lines[line_count++] = NULL;
+  }
+}
+
+// Starting source: branches, jumps and la across the filler, data that
+// refers to text labels, and .align and .org in both sections
+static void build_source(void) {
+  add_line(".text");
+  add_line("main:");
+  add_line("  la $a0, table");
+  add_line("  lw $t0, 0($a0)");
+  add_line("  jal func");
+  add_line("  beq $t0, $zero, done");
+  add_filler(FILLER_LINES);
+  add_line("loop:");
+  add_line("  addiu $t0, $t0, -1");
+  add_line("  bne $t0, $zero, loop");
+  add_filler(FILLER_LINES);
+  add_line("  .org 0x00402000");
+  add_line("func:");
+  add_line("  la $t1, count");
+  add_line("  lw $t1, 0($t1)");
+  add_line("  jr $ra");
+  add_filler(FILLER_LINES);
+  add_line("done:");
+  add_line("  li $v0, 10");
+  add_line("  syscall");
+  add_line(".data");
+  add_line("  .byte 1");
+  add_line("  .align 2");
+  add_line("table:");
+  add_line("  .word main, loop, func, done");
+  add_line("count:");
+  add_line("  .word 3");
+  add_line("  .org 0x10010100");
+  add_line("tail:");
+  add_line("  .word table");
+}
+
+static size_t find_line(const char *text) {
+  for (size_t i = 0; i < line_count; i++) {
+    if (lines[i] && strcmp(lines[i], text) == 0)
+      return i;
+  }
+  return SIZE_MAX;
+}
+
+static void insert_line(size_t at, const char *text) {
+  memmove(&lines[at + 1], &lines[at], (line_count - at) * sizeof(*lines));
+  memmove(&filler[at + 1], &filler[at], (line_count - at) * sizeof(*filler));
+  lines[at] = text;
+  filler[at] = 0;
+  line_count++;
+}
+
+static void delete_line(size_t at) {
+  line_count--;
+  memmove(&lines[at], &lines[at + 1], (line_count - at) * sizeof(*lines));
+  memmove(&filler[at], &filler[at + 1], (line_count - at) * sizeof(*filler));
+}
+
+static int apply_edit(const edit_t *edit) {
+  size_t at = edit->at ? find_line(edit->at) : line_count;
+  if (at == SIZE_MAX || line_count == MAX_LINES)
+    return 0;
+
+  switch (edit->op) {
+  case EDIT_INSERT:
+    insert_line(at, edit->text);
+    break;
+  case EDIT_DELETE:
+    delete_line(at);
+    break;
+  case EDIT_REPLACE:
+    lines[at] = edit->text;
+    break;
+  case EDIT_MOVE: {
+    const char *line = lines[at];
+    delete_line(at);
+    size_t to = find_line(edit->text);
+    if (to == SIZE_MAX)
+      return 0;
+    insert_line(to, line);
+    break;
+  }
+  }
+  return 1;
+}
+
+// Join the lines into a malloc()ed source
+static char *render(size_t *len) {
+  size_t size = 1;
+  for (size_t i = 0; i < line_count; i++)
+    size += filler[i] ? 32 : strlen(lines[i]) + 1;
+
+  char *source = malloc(size);
+  if (!source)
+    return NULL;
+  char *p = source;
+  for (size_t i = 0; i < line_count; i++) {
+    if (filler[i])
+      p += sprintf(p, "  addiu $s%zu, $s%zu, %zu\n", i % 8, i % 8, i % 13);
+    else
+      p += sprintf(p, "%s\n", lines[i]);
+  }
+  *len = (size_t)(p - source);
+  return source;
+}
+
+static void discard_message(void *arg, mips_diag_kind_t kind,
+                            const char *message) {
+  (void)arg;
+  (void)kind;
+  (void)message;
+}
+
+// Feed the current source to the session and compare with a full run
+static int check_version(mips_session_t *session, const mips_options_t *options,
+                         const char *name, int fails) {
+  size_t len;
+  char *source = render(&len);
+  if (!source) {
+    fprintf(stderr, "Session check: out of memory\n");
+    return 0;
+  }
+
+  const uint8_t *image;
+  size_t image_size;
+  uint8_t *expected = NULL;
+  size_t expected_size = 0;
+  int session_ok =
+      mips_session_update(session, source, len, &image, &image_size);
+  int full_ok = mips_assemble(source, len, &expected, &expected_size, options);
+  free(source);
+
+  int same = session_ok == full_ok && full_ok == !fails &&
+             (!full_ok || (image_size == expected_size &&
+                           memcmp(image, expected, expected_size) == 0));
+  free(expected);
+  if (!same) {
+    fprintf(stderr, "Session check failed after '%s': ", name);
+    if (session_ok != full_ok || full_ok == fails)
+      fprintf(stderr, "session %s, full run %s\n",
+              session_ok ? "succeeded" : "failed",
+              full_ok ? "succeeded" : "failed");
+    else
+      fprintf(stderr, "images differ\n");
+  }
+  return same;
+}
+
+int main(void) {
+  mips_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.jobs = 1;
+  options.diag = discard_message;
+
+  mips_session_t *session = mips_session_create(&options);
+  if (!session) {
+    fprintf(stderr, "Session check: failed to create a session\n");
+    return 1;
+  }
+
+  build_source();
+  int ok = check_version(session, &options, "the first version", 0);
+  for (size_t i = 0; ok && i < EDIT_COUNT; i++) {
+    if (!apply_edit(&edits[i])) {
+      fprintf(stderr, "Session check: cannot apply '%s'\n", edits[i].name);
+      ok = 0;
+    } else {
+      ok = check_version(session, &options, edits[i].name, edits[i].fails);
+    }
+  }
+  mips_session_destroy(session);
+
+  if (!ok)
+    return 1;
+  printf("Session check passed: %zu edits\n", EDIT_COUNT);
+  return 0;
+}
@@ -0,0 +1,13 @@
+# Branches are only lengthened into jumps in the text section, so a branch
+# in the data section more than 32768 words ahead of its target is an error
+.text
+main:
+    li $v0, 10
+    syscall
+
+.data
+    beq $t0, $zero, ahead
+    nop
+    .space 0x20000
+ahead:
+    .word 1
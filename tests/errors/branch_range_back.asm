@@ -0,0 +1,13 @@
+# The same for a branch in the data section more than 32768 words behind
+# its target
+.text
+main:
+    li $v0, 10
+    syscall
+
+.data
+back:
+    .word 1
+    .space 0x20000
+    bne $t0, $zero, back
+    nop
@@ -0,0 +1,36 @@
+# Second module of the link test; see main.asm
+.text
+.globl square
+.globl finish
+.globl twice
+
+square:
+    mult $a0, $a0
+    mflo $v0
+    jr $ra
+    nop
+
+finish:
+    li $v0, 10
+    syscall
+
+    .align 4                # Raises .text's sh_addralign to 16
+twice:
+    add $v0, $a0, $a0
+    jr $ra
+    nop
+
+.data
+.globl table
+.globl counter
+.globl aligned
+
+    .byte 1
+    .align 4                # Raises .data's sh_addralign to 16
+aligned:
+    .word 40
+table:
+    .word 10, 20, 30
+    .space 0x8000
+counter:
+    .word 0
@@ -0,0 +1,37 @@
+# Linked with lib.asm by make test: calls, branches, la and .word that
+# refer to the other module
+.text
+.globl main
+.extern square
+.extern finish
+.extern table
+.extern counter
+.extern twice
+.extern aligned
+
+main:
+    li $a0, 7
+    jal square              # R_MIPS_26 into lib.o's .text
+    nop
+    move $s0, $v0
+    la $t0, table           # HI16/LO16 pair into lib.o's .data
+    lw $s1, 8($t0)
+    la $t1, counter         # Low half above 0x7fff, so %hi rounds up
+    sw $s0, 0($t1)
+    lw $s2, 0($t1)
+    la $t2, pointers
+    lw $t3, 4($t2)
+    lw $s3, 0($t2)
+    lw $s3, 0($s3)
+    jal twice               # 16-byte aligned in lib.o's .text
+    nop
+    move $s4, $v0
+    la $t4, aligned         # 16-byte aligned in lib.o's .data
+    lw $s5, 0($t4)
+    lw $s6, 4($t4)          # table follows aligned
+    beq $zero, $zero, finish # R_MIPS_PC16 into lib.o's .text
+    nop
+
+.data
+pointers:
+    .word table, finish     # R_MIPS_32 against both sections of lib.o
@@ -0,0 +1,26 @@
+# Data Directive Test
+# This test covers the data directives and their sizing in both passes
+
+.data
+bytes:      .byte   1, 2, 3             # Three bytes, leaves data unaligned
+            .align  2                   # Pad to a word boundary
+halves:     .half   0x1234, -2          # Two half-words
+            .short  7
+words:      .word   0xDEADBEEF, bytes, words
+gap:        .space  6                   # Reserved bytes
+hash_str:   .ascii  "no # comment // here"
+            .align  2
+after:      .asciiz "end"
+
+.text
+main:
+    la      $t0, bytes
+    lb      $t1, 2($t0)
+    la      $t0, words
+    lw      $t2, 4($t0)                 # Address of bytes
+    la      $t3, after
+    bne     $t2, $t0, done
+    nop
+done:
+    li      $v0, 10
+    syscall
@@ -0,0 +1,27 @@
+# Multiply and Divide by Constant Test
+# mul, divi and remi expand to shift/add chains, magic-number multiplies or
+# the hardware multiplier and divider, depending on the constant
+
+.text
+main:
+    li      $t0, 1000
+    li      $t1, -1000
+    mul     $s0, $t0, 10        # Shift-and-add chain
+    mul     $s1, $t1, -7        # Negated chain
+    mul     $s2, $t0, 0x12345   # Long chain or mult
+    mul     $t2, $t2, 0         # Zero
+    divi    $s3, $t0, 8         # Power of two: biased shift
+    divi    $s4, $t1, 8         # ...rounding toward zero
+    divi    $s5, $t0, 7         # Magic number
+    divi    $s6, $t1, -3        # Negative divisor
+    remi    $s7, $t0, 7
+    remi    $t3, $t1, 16
+    remi    $t4, $t1, -7
+    move    $t5, $t0
+    divi    $t5, $t5, 10        # rd == rs
+    move    $t6, $t1
+    remi    $t6, $t6, 9         # rd == rs
+    mul     $t7, $t0, 1         # Plain move
+    divi    $t8, $t0, -1        # Negation
+    li      $v0, 10
+    syscall
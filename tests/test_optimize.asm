@@ -0,0 +1,49 @@
+# Peephole Pass Test
+# Every -O rule, and branches whose offsets change as the statements
+# between them shrink
+# mipsasm flags: -O
+
+.text
+main:
+    li      $t0, -1             # addiu instead of lui + ori
+    li      $t1, 0x8000         # Already one ori
+    li      $t2, 0x12345678     # Needs lui + ori
+    la      $s0, value          # Data label at a 64 KiB boundary: one lui
+    la      $s1, buffer         # Keeps lui + ori
+    la      $t3, value
+    lw      $s2, 0($t3)         # Folded: lui $t3 + lw %lo(value)($t3)
+    li      $t3, 0              # ...as $t3 is overwritten here
+    la      $t4, buffer
+    lw      $s3, 4($t4)         # Not folded: $t4 is read again below
+    add     $s3, $s3, $t4
+    move    $t5, $t5            # Dropped
+    move    $a0, $t2
+    move    $t2, $a0            # Dropped: undoes the move above
+    beq     $t0, $zero, skip    # Not taken, over shrunk statements
+    li      $t6, -2             # Delay slot: left alone
+    li      $t7, -3
+    la      $t8, value
+    sw      $t7, 8($t8)         # Folded into a store
+    li      $t8, 1
+skip:
+    li      $t9, -4             # Shrinks; skip moves with it
+    bne     $t0, $zero, over    # Taken, over shrunk statements
+    nop
+    li      $s5, -6
+    la      $s5, value
+over:
+    li      $s4, 3
+loop:
+    li      $v1, -5             # Likewise for loop
+    la      $a1, value
+    lw      $a2, 0($a1)         # Folded
+    li      $a1, 0
+    addiu   $s4, $s4, -1
+    bne     $s4, $zero, loop    # Backward over shrunk statements
+    nop
+    li      $v0, 10
+    syscall
+
+.data
+value:  .word 42
+buffer: .word 1, 2, 3, 4
@@ -0,0 +1,30 @@
+# Branch Relaxation Test
+# .space puts branch targets beyond the 16-bit offset's 128 KiB reach, so
+# the branches become jumps; the .align padding changes as they grow
+
+.text
+main:
+    li      $t0, 1
+    beq     $t0, $zero, fail    # Not taken: bne over a j
+    nop
+    beqz    $t0, fail           # Likewise
+    nop
+    bnez    $t0, forward        # Taken: beq over a j
+    addi    $s0, $s0, 1         # Delay slot: runs on both paths
+    li      $s7, 99             # Skipped
+back:
+    addi    $s2, $s2, 1
+    b       done                # A j alone
+    addi    $s4, $s4, 1
+    .align  4
+    .space  0x20000
+
+forward:
+    addi    $s1, $s1, 1
+    bne     $t0, $zero, back    # Backward and taken
+    addi    $s3, $s3, 1
+fail:
+    li      $s7, 1
+done:
+    li      $v0, 10
+    syscall
@@ -0,0 +1,19 @@
+# Branch Relaxation Test: 256 MB regions
+# The target lies in the next 256 MB region, where a j cannot reach, so the
+# branch becomes an inverted branch over lui/ori/jr $at
+
+.text
+    .org    0x0FFF8000
+main:
+    li      $t0, 1
+    bnez    $t0, far            # Taken
+    addi    $s0, $s0, 1         # Delay slot: runs on both paths
+    li      $s7, 99             # Skipped
+    .space  0x20000
+
+far:
+    addi    $s1, $s1, 1
+    beq     $t0, $zero, main    # Not taken, back across the boundary
+    nop
+    li      $v0, 10
+    syscall
@@ -0,0 +1,58 @@
+# Delay Slot Filling Test
+# Under .set reorder the assembler adds the slot after each branch and
+# fills it with the instruction before the branch when it can
+
+.text
+main:
+    .set    reorder
+    li      $t0, 3
+    li      $s0, 0
+loop:
+    addi    $t0, $t0, -1
+    addi    $s0, $s0, 5         # Filled: the branch does not use $s0
+    bne     $t0, $zero, loop
+    li      $t1, 7
+    beq     $t1, $zero, fail    # nop: the branch reads $t1
+    addi    $s1, $s1, 1         # Filled
+    beq     $t1, $zero, fail
+    bne     $t1, $zero, next    # nop: the addi before it is in a slot
+    li      $s1, 99
+next:
+    addi    $s2, $s2, 2
+target:
+    beq     $t1, $zero, target  # nop: the branch is a label target
+    move    $s3, $ra
+    jal     func                # nop: jal writes the $ra the move reads
+    .set    noreorder
+    beq     $zero, $zero, tail
+    addi    $s5, $s5, 6         # Slot written by the source
+    li      $s5, 99
+tail:
+    .set    reorder
+    la      $a0, value
+    lw      $t2, 0($a0)
+    nop                         # Kept: the branch reads the loaded $t2
+    beq     $t2, $zero, fail
+    lw      $t3, 0($a0)
+    beq     $t1, $zero, fail    # nop: a load in the slot is a hazard
+    add     $s6, $t3, $t3
+    mult    $t1, $t1
+    mflo    $t4
+    bne     $t1, $zero, done    # nop: so is mflo before the mult there
+done:
+    mult    $t4, $t4
+    li      $v0, 10
+    syscall
+
+func:
+    addi    $s4, $s4, 4         # Filled: jr only reads $ra
+    jr      $ra
+
+fail:
+    li      $s7, 1
+    li      $v0, 10
+    syscall
+
+.data
+value:
+    .word   5
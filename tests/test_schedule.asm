@@ -0,0 +1,49 @@
+# Instruction Scheduling Test
+# --schedule reorders each basic block to hide load and HI/LO latency, and
+# keeps the source order when that does not remove a stall
+# mipsasm flags: --schedule
+
+.text
+main:
+    la      $s0, values
+    la      $s1, results
+    li      $t4, 6
+    li      $t5, 7
+
+load_use:
+    lw      $t0, 0($s0)         # The independent statements below move
+    add     $t1, $t0, $t0       # between each load and its use
+    lw      $t2, 4($s0)
+    add     $t3, $t2, $t2
+    addi    $a1, $zero, 1
+    addi    $a2, $zero, 2
+
+hi_lo:
+    mult    $t0, $t2
+    mflo    $t6                 # Waits for the mult
+    mult    $t4, $t5            # Writes LO: stays after the mflo above
+    mflo    $t7
+    addi    $a3, $zero, 3       # Fills the wait instead
+    sll     $v1, $a3, 2
+
+memory:
+    sw      $t1, 0($s1)
+    lw      $t8, 0($s0)         # Another base: stays after the store
+    sw      $t3, 4($s1)
+    lw      $t9, 12($s1)        # Same base, other bytes: may pass it
+    add     $s2, $t8, $t9
+    add     $s3, $t1, $t3
+    sw      $t6, 8($s1)
+
+in_order:
+    lw      $s4, 8($s0)         # Nothing to move between the load and its
+    add     $s5, $s4, $s4       # use: the order stays and a nop goes in
+    sw      $s5, 12($s1)
+
+done:
+    li      $v0, 10
+    syscall
+
+.data
+values:     .word 3, 5, 9
+results:    .word 0, 0, 0, 100
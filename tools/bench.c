@@ -0,0 +1,533 @@
+// Throughput benchmark for libmipsasm.
+//
+// Generates synthetic sources of a given size and statement mix, assembles
+// each one in-process several times and prints the best timings as JSON on
+// stdout. With --baseline, the results are compared against an earlier run
+// and any workload whose throughput dropped by more than the tolerance makes
+// the benchmark fail.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/libmipsasm.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Share of each statement kind in a workload, in percent
+typedef struct {
+  const char *name;
+  int instructions; // Arithmetic, logic, loads and stores
+  int labels;       // Label definitions (with an instruction)
+  int branches;     // Branches, jumps and la to labels
+  int data;         // .word/.half/.byte/.asciiz in the data section
+} workload_t;
+
+static const workload_t workloads[] = {
+    {"instructions", 100, 0, 0, 0},
+    {"labels", 20, 60, 20, 0},
+    {"branches", 30, 10, 60, 0},
+    {"data", 10, 5, 5, 80},
+    {"mixed", 55, 10, 20, 15},
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+// Result of one workload
+typedef struct {
+  const char *name;
+  size_t lines;
+  size_t source_bytes;
+  size_t image_bytes;
+  double pass1_ms;
+  double pass2_ms;
+  double total_ms;
+  long peak_rss_kb;
+} result_t;
+
+// Growable text buffer for the generated source
+typedef struct {
+  char *data;
+  size_t len;
+  size_t capacity;
+} text_t;
+
+static void append(text_t *text, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+
+  if (text->len + (size_t)len + 1 > text->capacity) {
+    size_t capacity = text->capacity ? text->capacity : 1 << 16;
+    while (text->len + (size_t)len + 1 > capacity)
+      capacity *= 2;
+    text->data = realloc(text->data, capacity);
+    if (!text->data) {
+      fprintf(stderr, "Error: Out of memory\n");
+      exit(1);
+    }
+    text->capacity = capacity;
+  }
+
+  va_start(args, fmt);
+  vsnprintf(text->data + text->len, (size_t)len + 1, fmt, args);
+  va_end(args);
+  text->len += (size_t)len;
+}
+
+// xorshift64*: fixed seed, so every run generates the same source
+static uint64_t rng_state;
+
+static uint32_t rng(uint32_t bound) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (uint32_t)((rng_state * 2685821657736338717ull) >> 32) % bound;
+}
+
+static const char *const regs[] = {"$t0", "$t1", "$t2", "$t3", "$t4", "$t5",
+                                   "$t6", "$t7", "$s0", "$s1", "$s2", "$s3",
+                                   "$a0", "$a1", "$v0", "$v1"};
+
+#define REG() regs[rng(16)]
+
+static void emit_instruction(text_t *text) {
+  switch (rng(10)) {
+  case 0:
+    append(text, "  add %s, %s, %s\n", REG(), REG(), REG());
+    break;
+  case 1:
+    append(text, "  addiu %s, %s, %u\n", REG(), REG(), rng(1000));
+    break;
+  case 2:
+    append(text, "  lw %s, %u(%s)\n", REG(), 4 * rng(64), REG());
+    break;
+  case 3:
+    append(text, "  sw %s, %u(%s)\n", REG(), 4 * rng(64), REG());
+    break;
+  case 4:
+    append(text, "  sll %s, %s, %u\n", REG(), REG(), rng(32));
+    break;
+  case 5:
+    append(text, "  and %s, %s, %s\n", REG(), REG(), REG());
+    break;
+  case 6:
+    append(text, "  ori %s, %s, 0x%x\n", REG(), REG(), rng(0x10000));
+    break;
+  case 7:
+    append(text, "  li %s, 0x%x\n", REG(), rng(0x7FFFFFFF));
+    break;
+  case 8:
+    append(text, "  slt %s, %s, %s    # compare\n", REG(), REG(), REG());
+    break;
+  default:
+    append(text, "  move %s, %s\n", REG(), REG());
+    break;
+  }
+}
+
+// Label targets are drawn from every label in the source; branches stay
+// close to their own position so the offsets fit in 16 bits
+static void emit_branch(text_t *text, uint32_t defined, uint32_t total) {
+  uint32_t near = defined + rng(64);
+  near = (near > 32) ? near - 32 : 0;
+  if (near >= total)
+    near = total - 1;
+
+  switch (rng(5)) {
+  case 0:
+    append(text, "  beq %s, %s, L%u\n", REG(), REG(), near);
+    break;
+  case 1:
+    append(text, "  bne %s, %s, L%u\n", REG(), REG(), near);
+    break;
+  case 2:
+    append(text, "  j L%u\n", rng(total));
+    break;
+  case 3:
+    append(text, "  jal L%u\n", rng(total));
+    break;
+  default:
+    append(text, "  la %s, L%u\n", REG(), rng(total));
+    break;
+  }
+}
+
+static void emit_data(text_t *text, uint32_t total) {
+  switch (rng(4)) {
+  case 0:
+    append(text, "  .word L%u, %u\n", rng(total), rng(100000));
+    break;
+  case 1:
+    append(text, "  .half %u, %u, %u\n", rng(65536), rng(65536), rng(65536));
+    break;
+  case 2:
+    append(text, "  .byte %u, %u, %u, %u\n", rng(256), rng(256), rng(256),
+           rng(256));
+    break;
+  default:
+    append(text, "  .asciiz \"message %u: the quick brown fox\"\n",
+           rng(100000));
+    break;
+  }
+}
+
+// Generate `lines` statements with the workload's mix. Text statements come
+// first, then the data section. With layout, the sections start at .org
+// addresses, data statements stay where they were drawn, switching sections
+// back and forth, .align statements are scattered through both and text
+// switches between .set reorder and noreorder; this is what the parallel
+// passes find hardest to split.
+static void generate(const workload_t *workload, size_t lines, int layout,
+                     text_t *text) {
+  enum { KIND_INSTRUCTION, KIND_LABEL, KIND_BRANCH, KIND_DATA };
+  unsigned char *kinds = malloc(lines ? lines : 1);
+  uint32_t label_total = 1; // L0 is always defined
+  size_t data_lines = 0;
+
+  if (!kinds) {
+    fprintf(stderr, "Error: Out of memory\n");
+    exit(1);
+  }
+
+  rng_state = 0x9E3779B97F4A7C15ull;
+  for (size_t i = 0; i < lines; i++) {
+    int pick = (int)rng(100);
+    if ((pick -= workload->instructions) < 0)
+      kinds[i] = KIND_INSTRUCTION;
+    else if ((pick -= workload->labels) < 0)
+      kinds[i] = KIND_LABEL;
+    else if ((pick -= workload->branches) < 0)
+      kinds[i] = KIND_BRANCH;
+    else
+      kinds[i] = KIND_DATA;
+    label_total += kinds[i] == KIND_LABEL;
+    data_lines += kinds[i] == KIND_DATA;
+  }
+
+  text->len = 0;
+  append(text, "# %s workload, %zu statements\n", workload->name, lines);
+  if (layout)
+    append(text, ".data\n.org 0x10020000\n.text\n.org 0x00500000\n");
+  append(text, ".text\nL0:\n");
+  uint32_t defined = 1;
+  int in_data = 0;
+  int reorder = 0;
+  for (size_t i = 0; i < lines; i++) {
+    if (layout && (kinds[i] == KIND_DATA) != in_data) {
+      in_data = !in_data;
+      append(text, in_data ? ".data\n" : ".text\n");
+    }
+    if (layout && rng(64) == 0)
+      append(text, "  .align %u\n", 2 + rng(3));
+    if (layout && rng(512) == 0) {
+      reorder = !reorder;
+      append(text, "  .set %s\n", reorder ? "reorder" : "noreorder");
+    }
+
+    if (kinds[i] == KIND_LABEL) {
+      append(text, "L%u:", defined++);
+      emit_instruction(text);
+    } else if (kinds[i] == KIND_BRANCH) {
+      emit_branch(text, defined, label_total);
+    } else if (kinds[i] == KIND_INSTRUCTION) {
+      emit_instruction(text);
+    } else if (layout) {
+      emit_data(text, label_total);
+    }
+  }
+
+  if (data_lines > 0 && !layout) {
+    append(text, ".data\n");
+    for (size_t i = 0; i < data_lines; i++)
+      emit_data(text, label_total);
+  }
+  free(kinds);
+}
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static long peak_rss_kb(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// Assemble the source `runs` times, after one untimed warm-up run, and keep
+// the best time of each phase.
+// Totals come from mips_assemble(); the split into passes from an
+// assembler context, which stops after pass 1 when given no buffer.
+static int measure(const text_t *text, int runs, const mips_options_t *options,
+                   result_t *result) {
+  mips_assembler_t *as = mips_assembler_create(options);
+  uint8_t *buffer = NULL;
+  size_t size = 0;
+
+  if (!as)
+    return 0;
+
+  result->total_ms = result->pass1_ms = result->pass2_ms = 1e300;
+  for (int run = -1; run < runs; run++) {
+    uint8_t *image;
+    double start = now_ms();
+    if (!mips_assemble(text->data, text->len, &image, &size, options))
+      break;
+    double total = now_ms() - start;
+    free(image);
+
+    start = now_ms();
+    int status =
+        mips_assembler_assemble(as, text->data, text->len, NULL, 0, &size);
+    double pass1 = now_ms() - start;
+    if (status != MIPS_ASM_NOSPACE)
+      break;
+    if (!buffer && !(buffer = malloc(size ? size : 1)))
+      break;
+
+    start = now_ms();
+    if (mips_assembler_encode(as, buffer, size, &size) != MIPS_ASM_OK)
+      break;
+    double pass2 = now_ms() - start;
+
+    if (run < 0)
+      continue;
+    if (total < result->total_ms)
+      result->total_ms = total;
+    if (pass1 < result->pass1_ms)
+      result->pass1_ms = pass1;
+    if (pass2 < result->pass2_ms)
+      result->pass2_ms = pass2;
+    result->image_bytes = size;
+    if (run + 1 == runs) {
+      free(buffer);
+      mips_assembler_destroy(as);
+      return 1;
+    }
+  }
+
+  free(buffer);
+  mips_assembler_destroy(as);
+  return 0;
+}
+
+static double per_second(double count, double ms) {
+  return ms > 0 ? count * 1e3 / ms : 0;
+}
+
+static void print_json(FILE *out, const result_t *results, size_t count,
+                       size_t lines, int runs, int jobs) {
+  fprintf(out, "{\n  \"lines\": %zu,\n  \"runs\": %d,\n  \"jobs\": %d,\n",
+          lines, runs, jobs);
+  fprintf(out, "  \"workloads\": [\n");
+  for (size_t i = 0; i < count; i++) {
+    const result_t *r = &results[i];
+    fprintf(out,
+            "    {\"name\": \"%s\", \"lines\": %zu, \"source_bytes\": %zu, "
+            "\"image_bytes\": %zu, \"pass1_ms\": %.3f, \"pass2_ms\": %.3f, "
+            "\"total_ms\": %.3f, \"lines_per_sec\": %.0f, "
+            "\"bytes_per_sec\": %.0f, \"peak_rss_kb\": %ld}%s\n",
+            r->name, r->lines, r->source_bytes, r->image_bytes, r->pass1_ms,
+            r->pass2_ms, r->total_ms, per_second((double)r->lines, r->total_ms),
+            per_second((double)r->source_bytes, r->total_ms), r->peak_rss_kb,
+            (i + 1 < count) ? "," : "");
+  }
+  fprintf(out, "  ],\n  \"peak_rss_kb\": %ld\n}\n", peak_rss_kb());
+}
+
+// Find `"key": ` in a baseline line and parse the number after it
+static int json_number(const char *line, const char *key, double *value) {
+  char pattern[64];
+  snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+  const char *p = strstr(line, pattern);
+  if (!p)
+    return 0;
+  *value = strtod(p + strlen(pattern), NULL);
+  return 1;
+}
+
+// Compare against a baseline written by an earlier run (one workload per
+// line, as print_json() writes it). Returns 0 if a workload regressed by
+// more than tolerance percent.
+static int compare_baseline(const char *path, const result_t *results,
+                            size_t count, double tolerance) {
+  FILE *file = fopen(path, "r");
+  char line[1024];
+  int ok = 1;
+
+  if (!file) {
+    fprintf(stderr, "Error: Cannot open baseline '%s'\n", path);
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), file)) {
+    char name[64];
+    double lines, rate;
+    const char *p = strstr(line, "\"name\": \"");
+    if (!p || sscanf(p, "\"name\": \"%63[^\"]\"", name) != 1 ||
+        !json_number(line, "lines", &lines) ||
+        !json_number(line, "lines_per_sec", &rate)) {
+      continue;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      const result_t *r = &results[i];
+      if (strcmp(r->name, name) != 0)
+        continue;
+      if ((size_t)lines != r->lines) {
+        fprintf(stderr, "%-12s  baseline has %.0f lines, skipped\n", name,
+                lines);
+        break;
+      }
+
+      double current = per_second((double)r->lines, r->total_ms);
+      double change = rate > 0 ? (current - rate) * 100 / rate : 0;
+      int regressed = change < -tolerance;
+      fprintf(stderr, "%-12s %12.0f lines/s  baseline %12.0f  %+6.1f%%%s\n",
+              name, current, rate, change, regressed ? "  REGRESSION" : "");
+      if (regressed)
+        ok = 0;
+      break;
+    }
+  }
+  fclose(file);
+  return ok;
+}
+
+static void print_usage(const char *program) {
+  printf("Usage: %s [options]\n", program);
+  printf("Options:\n");
+  printf("  --lines <n>        Statements per workload (default: 200000)\n");
+  printf("  --runs <n>         Runs per workload; the best is kept "
+         "(default: 10)\n");
+  printf("  -j <n>             Assembler threads (default: 1)\n");
+  printf("  --workload <name>  Only run one workload\n");
+  printf("  --mix <i,l,b,d>    Run a custom mix of instruction, label, "
+         "branch and data\n");
+  printf("                     statements, in percent\n");
+  printf("  --emit             Print the generated sources instead of "
+         "assembling them\n");
+  printf("  --layout           Start sections at .org, interleave data with "
+         "text and\n");
+  printf("                     scatter .align and .set reorder/noreorder\n");
+  printf("  --baseline <file>  Compare throughput against an earlier run\n");
+  printf("  --tolerance <pct>  Allowed slowdown against the baseline "
+         "(default: 10)\n");
+  printf("Workloads:");
+  for (size_t i = 0; i < WORKLOAD_COUNT; i++)
+    printf(" %s", workloads[i].name);
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  size_t lines = 200000;
+  int runs = 10;
+  int jobs = 1;
+  int emit = 0;
+  int layout = 0;
+  double tolerance = 10;
+  const char *only = NULL;
+  const char *baseline = NULL;
+  workload_t custom = {"custom", 0, 0, 0, 0};
+  int use_custom = 0;
+
+  for (int i = 1; i < argc; i++) {
+    const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      print_usage(argv[0]);
+      return 0;
+    } else if (strcmp(argv[i], "--emit") == 0) {
+      emit = 1;
+    } else if (strcmp(argv[i], "--layout") == 0) {
+      layout = 1;
+    } else if (!value) {
+      fprintf(stderr, "Error: %s option requires a value\n", argv[i]);
+      return 1;
+    } else if (strcmp(argv[i], "--lines") == 0) {
+      lines = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--runs") == 0) {
+      runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-j") == 0) {
+      jobs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--workload") == 0) {
+      only = argv[++i];
+    } else if (strcmp(argv[i], "--baseline") == 0) {
+      baseline = argv[++i];
+    } else if (strcmp(argv[i], "--tolerance") == 0) {
+      tolerance = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--mix") == 0) {
+      if (sscanf(argv[++i], "%d,%d,%d,%d", &custom.instructions,
+                 &custom.labels, &custom.branches, &custom.data) != 4 ||
+          custom.instructions < 0 || custom.labels < 0 ||
+          custom.branches < 0 || custom.data < 0 ||
+          custom.instructions + custom.labels + custom.branches +
+                  custom.data !=
+              100) {
+        fprintf(stderr, "Error: --mix takes four percentages adding up to "
+                        "100\n");
+        return 1;
+      }
+      use_custom = 1;
+    } else {
+      fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (runs < 1 || jobs < 0) {
+    fprintf(stderr, "Error: --runs and -j take positive counts\n");
+    return 1;
+  }
+
+  const workload_t *selected[WORKLOAD_COUNT + 1];
+  size_t count = 0;
+  if (use_custom)
+    selected[count++] = &custom;
+  for (size_t i = 0; i < WORKLOAD_COUNT && !use_custom; i++) {
+    if (!only || strcmp(only, workloads[i].name) == 0)
+      selected[count++] = &workloads[i];
+  }
+  if (count == 0) {
+    fprintf(stderr, "Error: Unknown workload '%s'\n", only);
+    return 1;
+  }
+
+  mips_options_t options = {0};
+  options.jobs = jobs;
+  result_t results[WORKLOAD_COUNT + 1];
+  text_t text = {NULL, 0, 0};
+
+  for (size_t i = 0; i < count; i++) {
+    generate(selected[i], lines, layout, &text);
+    if (emit) {
+      fwrite(text.data, 1, text.len, stdout);
+      continue;
+    }
+
+    result_t *r = &results[i];
+    r->name = selected[i]->name;
+    r->lines = lines;
+    r->source_bytes = text.len;
+    if (!measure(&text, runs, &options, r)) {
+      fprintf(stderr, "Error: The %s workload failed to assemble\n",
+              r->name);
+      free(text.data);
+      return 1;
+    }
+    r->peak_rss_kb = peak_rss_kb();
+  }
+  free(text.data);
+  if (emit)
+    return 0;
+
+  print_json(stdout, results, count, lines, runs, jobs);
+  if (baseline && !compare_baseline(baseline, results, count, tolerance))
+    return 1;
+  return 0;
+}
@@ -0,0 +1,113 @@
+// Build-time generator for the mnemonic and register lookup tables.
+//
+// Reads the instruction set from src/isa.def and the register names from
+// src/registers.def, searches for a hash seed that maps every name to a
+// distinct slot, and writes the resulting perfect-hash tables to stdout as a
+// C header.
+
+#include "../src/lookup_hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  const char *name;
+  const char *value; // C expression for the slot value
+} name_key_t;
+
+static const name_key_t mnemonics[] = {
+#define ISA_INST(id, mnemonic, op1, op2, op3, format, opcode, funct, expand) \
+  {mnemonic, "INST_" #id},
+#include "../src/isa.def"
+#undef ISA_INST
+};
+
+static const name_key_t registers[] = {
+#define REGISTER(name, number) {#name, #number},
+#include "../src/registers.def"
+#undef REGISTER
+};
+
+// Try to place every key into a table of `size` slots with the given seed.
+// Returns 1 and fills `owner` (key index per slot, -1 when empty) when no
+// two keys share a slot.
+static int try_seed(const name_key_t *keys, size_t count, uint32_t size,
+                    uint32_t seed, int *owner) {
+  for (uint32_t i = 0; i < size; i++)
+    owner[i] = -1;
+
+  for (size_t i = 0; i < count; i++) {
+    uint32_t slot =
+        lookup_hash(keys[i].name, strlen(keys[i].name), seed) & (size - 1);
+    if (owner[slot] >= 0)
+      return 0;
+    owner[slot] = (int)i;
+  }
+  return 1;
+}
+
+// Emit a perfect-hash table for keys as <array>_slots plus <prefix>_HASH_*
+// macros
+static int emit_table(const char *prefix, const char *array,
+                      const name_key_t *keys, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (strlen(keys[i].name) > LOOKUP_MAX_NAME) {
+      fprintf(stderr, "gen_lookup: name '%s' is too long\n", keys[i].name);
+      return 0;
+    }
+  }
+
+  // Start at a load factor of at most 1/2 and grow until a seed is found
+  uint32_t size = 1;
+  while (size < count * 2)
+    size *= 2;
+
+  for (; size <= 4096; size *= 2) {
+    int *owner = malloc(size * sizeof(int));
+    if (!owner) {
+      fprintf(stderr, "gen_lookup: out of memory\n");
+      return 0;
+    }
+
+    for (uint32_t seed = 0; seed < 1000000; seed++) {
+      if (!try_seed(keys, count, size, seed, owner))
+        continue;
+
+      printf("#define %s_HASH_SEED 0x%08Xu\n", prefix, seed);
+      printf("#define %s_HASH_MASK 0x%Xu\n\n", prefix, size - 1);
+      printf("static const lookup_slot_t %s_slots[%u] = {\n", array, size);
+      for (uint32_t slot = 0; slot < size; slot++) {
+        if (owner[slot] < 0)
+          continue;
+        const name_key_t *key = &keys[owner[slot]];
+        size_t len = strlen(key->name);
+        printf("    [%u] = {\"%s\", %zu, %s, 0x%08Xu},\n", slot, key->name,
+               len, key->value, lookup_hash(key->name, len, seed));
+      }
+      printf("};\n\n");
+
+      free(owner);
+      return 1;
+    }
+
+    free(owner);
+  }
+
+  fprintf(stderr, "gen_lookup: no perfect hash found for %s\n", prefix);
+  return 0;
+}
+
+int main(void) {
+  printf("// Generated by tools/gen_lookup.c - do not edit\n\n");
+  printf("#ifndef LOOKUP_TABLES_H\n#define LOOKUP_TABLES_H\n\n");
+
+  if (!emit_table("MNEMONIC", "mnemonic", mnemonics,
+                  sizeof(mnemonics) / sizeof(mnemonics[0])) ||
+      !emit_table("REGISTER", "register", registers,
+                  sizeof(registers) / sizeof(registers[0]))) {
+    return 1;
+  }
+
+  printf("#endif // LOOKUP_TABLES_H\n");
+  return 0;
+}